@@ -104,7 +104,7 @@ void drawGround(mat4 mvpMatrix)
 	glUniformMatrix4fv(mvploc, 1, false, &mvpMatrix[0].x);
 	int mloc = glGetUniformLocation(shaderProgram, "modelMatrix");
 	glUniformMatrix4fv(mloc, 1, false, &mm[0].x);
-	render(groundModel);
+	render(groundModel, mvpMatrix);
 }
 
 
@@ -168,7 +168,7 @@ void display()
 	mat4 modelViewProjectionMatrix = projectionMatrix * viewMatrix * cityModelMatrix;
 	glUniformMatrix4fv(mvploc, 1, false, &modelViewProjectionMatrix[0].x);
 	glUniformMatrix4fv(mloc, 1, false, &cityModelMatrix[0].x);
-	render(cityModel);
+	render(cityModel, modelViewProjectionMatrix);
 
 	// Ground
 	// Task 5: Uncomment this
@@ -178,7 +178,7 @@ void display()
 	modelViewProjectionMatrix = projectionMatrix * viewMatrix * carModelMatrix;
 	glUniformMatrix4fv(mvploc, 1, false, &modelViewProjectionMatrix[0].x);
 	glUniformMatrix4fv(mloc, 1, false, &carModelMatrix[0].x);
-	render(carModel);
+	render(carModel, modelViewProjectionMatrix);
 
 	// donut car
 	mat4 donutCarModelMatrix = translate(vec3(20, 0, 0))             // Move to the center of the roundabout
@@ -187,7 +187,7 @@ void display()
 	modelViewProjectionMatrix = projectionMatrix * viewMatrix * donutCarModelMatrix;
 	glUniformMatrix4fv(mvploc, 1, false, &modelViewProjectionMatrix[0].x);
 	glUniformMatrix4fv(mloc, 1, false, &donutCarModelMatrix[0].x);
-	render(carModel);
+	render(carModel, modelViewProjectionMatrix);
 
 	glUseProgram(0);
 }
@@ -334,6 +334,8 @@ void gui()
 	}
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
 	            ImGui::GetIO().Framerate);
+	ImGui::Text("Meshes: %d drawn, %d outside the view", int(labhelper::render_statistics.meshes),
+	            int(labhelper::render_statistics.culled_meshes));
 	// ----------------------------------------------------------
 }
 
@@ -361,6 +363,7 @@ int main(int argc, char* argv[])
 		stopRendering = handleEvents();
 
 		// render to window
+		labhelper::render_statistics = labhelper::RenderStatistics();
 		display();
 
 		// Render overlay GUI.
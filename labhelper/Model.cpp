@@ -1,5 +1,10 @@
 #include "Model.h"
 #include "labhelper.h"
+#include "texture_compression.h"
+#include "mesh_optimization.h"
+#include "frustum.h"
+#include "uniforms.h"
+#include "trace.h"
 #include <iostream>
 #define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
 #include <tiny_obj_loader.h>
@@ -7,54 +12,208 @@
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
+#include <fstream>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <GL/glew.h>
 #include <stb_image.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace labhelper
 {
-void Texture::free()
+///////////////////////////////////////////////////////////////////////////
+// Texture cache
+//
+// Materials, also in different models, often use the same image. Each
+// image is decoded and uploaded once per path and number of components,
+// and shared by all textures that use it. read() adds a reference and
+// free() removes one; the image and GL texture go with the last one.
+// read() may run on several threads at once, see labhelper::assets.
+//
+// If the driver supports it, images are block compressed (see
+// texture_compression.h) and the result is stored next to the image as
+// <image>.<format>.dds. Later runs read that instead of decoding the image.
+///////////////////////////////////////////////////////////////////////////
+namespace
 {
-	if(data)
+	struct CachedImage
+	{
+		uint8_t* data;
+		int width, height;
+		uint32_t gl_id;
+		int references;
+		std::shared_ptr<const CompressedImage> compressed;
+	};
+	std::mutex texture_cache_mutex;
+	std::map<std::string, CachedImage> texture_cache;
+
+	std::string textureCacheKey(const Texture& texture)
+	{
+		return texture.directory + texture.filename + "#" + std::to_string(texture.n_components);
+	}
+
+	struct FileStamp
 	{
-		stbi_image_free(data);
-		data = nullptr;
+		int64_t size;
+		int64_t modified;
+	};
+
+	bool getFileStamp(const std::string& path, FileStamp& stamp)
+	{
+		struct stat st;
+		if(stat(path.c_str(), &st) != 0)
+		{
+			return false;
+		}
+		stamp.size = int64_t(st.st_size);
+		stamp.modified = int64_t(st.st_mtime);
+		return true;
 	}
-	if(gl_id_internal)
+} // namespace
+
+void Texture::free()
+{
+	std::lock_guard<std::mutex> lock(texture_cache_mutex);
+	auto cached = texture_cache.find(textureCacheKey(*this));
+	if(cached != texture_cache.end() && --cached->second.references == 0)
 	{
-		glDeleteTextures(1, &gl_id_internal);
-		gl_id_internal = 0;
+		stbi_image_free(cached->second.data);
+		if(cached->second.gl_id)
+		{
+			glDeleteTextures(1, &cached->second.gl_id);
+		}
+		texture_cache.erase(cached);
 	}
+	data = nullptr;
+	gl_id_internal = 0;
 }
 
 bool Texture::load(const std::string& _directory, const std::string& _filename, int _components)
+{
+	read(_directory, _filename, _components);
+	upload();
+	return true;
+}
+
+bool Texture::read(const std::string& _directory, const std::string& _filename, int _components)
 {
 	filename = file::normalise(_filename);
 	directory = file::normalise(_directory);
 	valid = true;
-	int components;
-	data = stbi_load((directory + filename).c_str(), &width, &height, &components, _components);
-	if(data == nullptr)
+	n_components = _components;
+	const std::string key = textureCacheKey(*this);
 	{
-		std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in " << directory
-		          << "\n";
-		exit(1);
+		std::lock_guard<std::mutex> lock(texture_cache_mutex);
+		auto cached = texture_cache.find(key);
+		if(cached != texture_cache.end())
+		{
+			cached->second.references++;
+			data = cached->second.data;
+			compressed = cached->second.compressed;
+			width = cached->second.width;
+			height = cached->second.height;
+			return true;
+		}
+	}
+
+	const std::string path = directory + filename;
+	trace::Scope scope("Read texture", path);
+	const char* format_names[] = { "bc4", "bc5", "bc1", "bc3" };
+	const std::string compressed_path = path + "." + format_names[_components - 1] + ".dds";
+	std::shared_ptr<CompressedImage> compressed_image;
+	FileStamp stamp;
+	if(compressionSupported() && getFileStamp(path, stamp))
+	{
+		compressed_image = std::make_shared<CompressedImage>();
 	}
-	glGenTextures(1, &gl_id_internal);
+
+	int decoded_width, decoded_height, components;
+	uint8_t* decoded = nullptr;
+	if(compressed_image && readDDS(compressed_path, stamp.size, stamp.modified, *compressed_image))
+	{
+		decoded_width = compressed_image->levels[0].width;
+		decoded_height = compressed_image->levels[0].height;
+	}
+	else
+	{
+		trace::begin("Decode image");
+		decoded = stbi_load(path.c_str(), &decoded_width, &decoded_height, &components, _components);
+		trace::end();
+		if(decoded == nullptr)
+		{
+			std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in "
+			          << directory << "\n";
+			exit(1);
+		}
+		if(compressed_image)
+		{
+			trace::Scope compress_scope("Compress image");
+			compressImage(decoded, decoded_width, decoded_height, _components, *compressed_image);
+			writeDDS(compressed_path, *compressed_image, stamp.size, stamp.modified);
+			stbi_image_free(decoded);
+			decoded = nullptr;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(texture_cache_mutex);
+	// Another thread may have loaded the same image in the meantime
+	CachedImage loaded_image = { decoded, decoded_width, decoded_height, 0, 0, compressed_image };
+	auto inserted = texture_cache.insert({ key, loaded_image });
+	if(!inserted.second)
+	{
+		stbi_image_free(decoded);
+	}
+	CachedImage& image = inserted.first->second;
+	image.references++;
+	data = image.data;
+	compressed = image.compressed;
+	width = image.width;
+	height = image.height;
+	return true;
+}
+
+bool Texture::createTexture()
+{
+	std::lock_guard<std::mutex> lock(texture_cache_mutex);
+	CachedImage& image = texture_cache.at(textureCacheKey(*this));
+	bool created = false;
+	if(image.gl_id == 0)
+	{
+		glGenTextures(1, &image.gl_id);
+		created = true;
+	}
+	gl_id_internal = image.gl_id;
 	gl_id = gl_id_internal;
-	glBindTexture(GL_TEXTURE_2D, gl_id_internal);
-	GLenum format, internal_format;
-	n_components = _components;
-	if(_components == 1)
+	return created;
+}
+
+void Texture::getFormat(uint32_t& internal_format, uint32_t& format) const
+{
+	if(n_components == 1)
 	{
-		format = GL_R;
+		format = GL_RED;
 		internal_format = GL_R8;
 	}
-	else if(_components == 3)
+	else if(n_components == 3)
 	{
 		format = GL_RGB;
 		internal_format = GL_RGB;
 	}
-	else if(_components == 4)
+	else if(n_components == 4)
 	{
 		format = GL_RGBA;
 		internal_format = GL_RGBA;
@@ -64,16 +223,54 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 		std::cout << "Texture loading not implemented for this number of compenents.\n";
 		exit(1);
 	}
-	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
+}
 
+void Texture::upload()
+{
+	if(!createTexture())
+	{
+		// Already uploaded for another texture with the same image
+		return;
+	}
+	trace::Scope scope("Upload texture", directory + filename);
+	glBindTexture(GL_TEXTURE_2D, gl_id_internal);
+	if(compressed)
+	{
+		// All levels were computed offline
+		for(size_t i = 0; i < compressed->levels.size(); i++)
+		{
+			const CompressedImage::Level& level = compressed->levels[i];
+			glCompressedTexImage2D(GL_TEXTURE_2D, GLint(i), compressed->internal_format, level.width,
+			                       level.height, 0, GLsizei(level.size), &compressed->blocks[level.offset]);
+		}
+	}
+	else
+	{
+		uint32_t format, internal_format;
+		getFormat(internal_format, format);
+		glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+	setSamplerState();
 	glBindTexture(GL_TEXTURE_2D, 0);
-	return true;
+}
+
+namespace
+{
+	// Also for the texture arrays of models
+	void setSamplerState(GLenum target)
+	{
+		glTexParameterf(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameterf(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameterf(target, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
+	}
+} // namespace
+
+void Texture::setSamplerState() const
+{
+	labhelper::setSamplerState(GL_TEXTURE_2D);
 }
 
 glm::vec4 Texture::sample(glm::vec2 uv) const
@@ -116,10 +313,1071 @@ Model::~Model()
 	glDeleteBuffers(1, &m_positions_bo);
 	glDeleteBuffers(1, &m_normals_bo);
 	glDeleteBuffers(1, &m_texture_coordinates_bo);
+	glDeleteBuffers(1, &m_indices_bo);
+	glDeleteBuffers(1, &m_material_uniforms_bo);
+	glDeleteBuffers(1, &m_materials_storage_bo);
+	glDeleteBuffers(1, &m_material_indices_bo);
+	glDeleteBuffers(1, &m_draw_commands_bo);
+	for(uint64_t handle : m_texture_array_handles)
+	{
+		if(handle != 0)
+		{
+			glMakeTextureHandleNonResidentARB(handle);
+		}
+	}
+	glDeleteTextures(GLsizei(m_texture_arrays.size()), m_texture_arrays.data());
 }
 
 
-Model* loadModelFromOBJ(std::string path)
+///////////////////////////////////////////////////////////////////////////
+// Binary model cache
+//
+// Parsing the OBJ is by far the slowest part of loading a model, so the
+// result of loadModelFromOBJ() is stored next to the OBJ as
+// <name>.objcache and memory mapped the next time the model is loaded.
+// Vertex data is stored in exactly the layout of the GL buffers. The cache
+// records the size and modification time of the OBJ and its MTL files and
+// is rebuilt whenever any of them change.
+///////////////////////////////////////////////////////////////////////////
+namespace
+{
+	const char cache_magic[8] = { 'L', 'H', 'M', 'O', 'D', 'E', 'L', '\0' };
+	// Bump whenever the cache layout or the contents of Model change
+	const uint32_t cache_version = 4;
+	const size_t cache_alignment = 16;
+
+	uint64_t alignOffset(uint64_t offset)
+	{
+		return (offset + cache_alignment - 1) / cache_alignment * cache_alignment;
+	}
+
+	struct CacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t number_of_dependencies;
+		uint32_t number_of_materials;
+		uint32_t number_of_meshes;
+		uint64_t number_of_vertices;
+		uint64_t number_of_indices;
+		// Offsets of the vertex and index arrays from the start of the file
+		uint64_t positions_offset;
+		uint64_t normals_offset;
+		uint64_t texture_coordinates_offset;
+		uint64_t indices_offset;
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// A read only view of a whole file
+	///////////////////////////////////////////////////////////////////////
+	class MappedFile
+	{
+	public:
+		~MappedFile()
+		{
+			close();
+		}
+		bool open(const std::string& path);
+		void close();
+		const uint8_t* data() const
+		{
+			return m_data;
+		}
+		size_t size() const
+		{
+			return m_size;
+		}
+
+	private:
+		const uint8_t* m_data = nullptr;
+		size_t m_size = 0;
+#ifdef _WIN32
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = nullptr;
+#endif
+	};
+
+#ifdef _WIN32
+	bool MappedFile::open(const std::string& path)
+	{
+		m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		                     FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER size;
+		if(m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+		m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if(m_mapping != nullptr)
+		{
+			m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		}
+		if(m_data == nullptr)
+		{
+			close();
+			return false;
+		}
+		m_size = size_t(size.QuadPart);
+		return true;
+	}
+
+	void MappedFile::close()
+	{
+		if(m_data != nullptr)
+			UnmapViewOfFile(m_data);
+		if(m_mapping != nullptr)
+			CloseHandle(m_mapping);
+		if(m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+		m_data = nullptr;
+		m_mapping = nullptr;
+		m_file = INVALID_HANDLE_VALUE;
+		m_size = 0;
+	}
+#else
+	bool MappedFile::open(const std::string& path)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0)
+		{
+			return false;
+		}
+		struct stat st;
+		void* data = MAP_FAILED;
+		if(fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		::close(fd);
+		if(data == MAP_FAILED)
+		{
+			return false;
+		}
+		m_data = static_cast<const uint8_t*>(data);
+		m_size = size_t(st.st_size);
+		return true;
+	}
+
+	void MappedFile::close()
+	{
+		if(m_data != nullptr)
+		{
+			munmap(const_cast<uint8_t*>(m_data), m_size);
+		}
+		m_data = nullptr;
+		m_size = 0;
+	}
+#endif
+
+	///////////////////////////////////////////////////////////////////////
+	// Helpers for the variable length part of the cache. Strings are
+	// prefixed by their length.
+	///////////////////////////////////////////////////////////////////////
+	class CacheWriter
+	{
+	public:
+		std::vector<char> buffer;
+		template<typename T>
+		void write(const T& value)
+		{
+			const char* bytes = reinterpret_cast<const char*>(&value);
+			buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+		}
+		void write(const std::string& s)
+		{
+			write(uint32_t(s.size()));
+			buffer.insert(buffer.end(), s.begin(), s.end());
+		}
+		void align()
+		{
+			buffer.resize(size_t(alignOffset(buffer.size())), 0);
+		}
+	};
+
+	class CacheReader
+	{
+	public:
+		CacheReader(const uint8_t* begin, const uint8_t* end) : m_current(begin), m_end(end)
+		{
+		}
+		bool ok = true;
+		template<typename T>
+		T read()
+		{
+			T value = T();
+			if(size_t(m_end - m_current) < sizeof(T))
+			{
+				ok = false;
+				return value;
+			}
+			memcpy(&value, m_current, sizeof(T));
+			m_current += sizeof(T);
+			return value;
+		}
+		std::string readString()
+		{
+			uint32_t size = read<uint32_t>();
+			if(!ok || size_t(m_end - m_current) < size)
+			{
+				ok = false;
+				return std::string();
+			}
+			std::string s(reinterpret_cast<const char*>(m_current), size);
+			m_current += size;
+			return s;
+		}
+
+	private:
+		const uint8_t* m_current;
+		const uint8_t* m_end;
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// tinyobj does not tell us which MTL files it read, so look for the
+	// mtllib statements ourselves. Only done when the cache is rebuilt.
+	///////////////////////////////////////////////////////////////////////
+	std::vector<std::string> findMaterialLibraries(const std::string& obj_path)
+	{
+		std::vector<std::string> libraries;
+		std::ifstream obj_file(obj_path);
+		std::string line;
+		while(std::getline(obj_file, line))
+		{
+			std::istringstream tokens(line);
+			std::string keyword, library;
+			tokens >> keyword;
+			if(keyword != "mtllib")
+				continue;
+			while(tokens >> library)
+			{
+				libraries.push_back(library);
+			}
+		}
+		return libraries;
+	}
+
+	void writeModelCache(const std::string& cache_path,
+	                     const std::string& directory,
+	                     const std::string& obj_filename,
+	                     const Model* model)
+	{
+		std::vector<std::string> dependencies = findMaterialLibraries(directory + obj_filename);
+		dependencies.insert(dependencies.begin(), obj_filename);
+
+		CacheWriter records;
+		for(const auto& dependency : dependencies)
+		{
+			FileStamp stamp = { -1, -1 };
+			getFileStamp(directory + dependency, stamp);
+			records.write(dependency);
+			records.write(stamp);
+		}
+		for(const auto& material : model->m_materials)
+		{
+			records.write(material.m_name);
+			records.write(material.m_color);
+			records.write(material.m_shininess);
+			records.write(material.m_metalness);
+			records.write(material.m_fresnel);
+			records.write(material.m_emission);
+			records.write(material.m_transparency);
+			records.write(material.m_ior);
+			const Texture* textures[] = { &material.m_color_texture, &material.m_shininess_texture,
+				                          &material.m_metalness_texture, &material.m_fresnel_texture,
+				                          &material.m_emission_texture };
+			for(const Texture* texture : textures)
+			{
+				records.write(texture->valid ? texture->filename : std::string());
+			}
+		}
+		for(const auto& mesh : model->m_meshes)
+		{
+			records.write(mesh.m_name);
+			records.write(mesh.m_material_idx);
+			records.write(mesh.m_start_index);
+			records.write(mesh.m_number_of_indices);
+			records.write(mesh.m_base_vertex);
+			records.write(mesh.m_number_of_vertices);
+			records.write(mesh.m_aabb_min);
+			records.write(mesh.m_aabb_max);
+			records.write(mesh.m_bounding_sphere_center);
+			records.write(mesh.m_bounding_sphere_radius);
+			records.write(uint32_t(mesh.m_lods.size()));
+			for(const auto& lod : mesh.m_lods)
+			{
+				records.write(lod);
+			}
+		}
+
+		const uint64_t number_of_vertices = model->m_positions.size();
+		const uint64_t number_of_indices = model->m_indices.size();
+		CacheHeader header;
+		memcpy(header.magic, cache_magic, sizeof(cache_magic));
+		header.version = cache_version;
+		header.number_of_dependencies = uint32_t(dependencies.size());
+		header.number_of_materials = uint32_t(model->m_materials.size());
+		header.number_of_meshes = uint32_t(model->m_meshes.size());
+		header.number_of_vertices = number_of_vertices;
+		header.number_of_indices = number_of_indices;
+
+		CacheWriter file;
+		file.write(header);
+		file.buffer.insert(file.buffer.end(), records.buffer.begin(), records.buffer.end());
+		file.align();
+		header.positions_offset = file.buffer.size();
+		header.normals_offset = alignOffset(header.positions_offset + number_of_vertices * sizeof(glm::vec3));
+		header.texture_coordinates_offset =
+		    alignOffset(header.normals_offset + number_of_vertices * sizeof(glm::vec3));
+		header.indices_offset =
+		    alignOffset(header.texture_coordinates_offset + number_of_vertices * sizeof(glm::vec2));
+		memcpy(file.buffer.data(), &header, sizeof(header));
+
+		// Write to a temporary file and rename it, so that a program loading
+		// the same model never sees half a cache
+		const std::string tmp_path = cache_path + ".tmp";
+		{
+			std::ofstream f(tmp_path, std::ios::binary);
+			f.write(file.buffer.data(), file.buffer.size());
+			f.seekp(std::streamoff(header.positions_offset));
+			f.write(reinterpret_cast<const char*>(model->m_positions.data()),
+			        number_of_vertices * sizeof(glm::vec3));
+			f.seekp(std::streamoff(header.normals_offset));
+			f.write(reinterpret_cast<const char*>(model->m_normals.data()),
+			        number_of_vertices * sizeof(glm::vec3));
+			f.seekp(std::streamoff(header.texture_coordinates_offset));
+			f.write(reinterpret_cast<const char*>(model->m_texture_coordinates.data()),
+			        number_of_vertices * sizeof(glm::vec2));
+			f.seekp(std::streamoff(header.indices_offset));
+			f.write(reinterpret_cast<const char*>(model->m_indices.data()),
+			        number_of_indices * sizeof(uint32_t));
+			if(!f.good())
+			{
+				std::cout << "(could not write " << cache_path << ")" << std::flush;
+				f.close();
+				remove(tmp_path.c_str());
+				return;
+			}
+		}
+		file::replace(tmp_path, cache_path);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Fill in the model from a valid, up to date cache. Returns false,
+	// without touching the model, if the cache has to be rebuilt.
+	///////////////////////////////////////////////////////////////////////
+	bool readModelCache(const MappedFile& cache, const std::string& directory, Model* model)
+	{
+		if(cache.size() < sizeof(CacheHeader))
+		{
+			return false;
+		}
+		CacheHeader header;
+		memcpy(&header, cache.data(), sizeof(header));
+		if(memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != cache_version)
+		{
+			return false;
+		}
+		const uint64_t n = header.number_of_vertices;
+		const uint64_t number_of_indices = header.number_of_indices;
+		if(header.positions_offset + n * sizeof(glm::vec3) > cache.size()
+		   || header.normals_offset + n * sizeof(glm::vec3) > cache.size()
+		   || header.texture_coordinates_offset + n * sizeof(glm::vec2) > cache.size()
+		   || header.indices_offset + number_of_indices * sizeof(uint32_t) > cache.size())
+		{
+			return false;
+		}
+
+		CacheReader reader(cache.data() + sizeof(CacheHeader), cache.data() + header.positions_offset);
+		for(uint32_t i = 0; i < header.number_of_dependencies; i++)
+		{
+			std::string dependency = reader.readString();
+			FileStamp cached = reader.read<FileStamp>();
+			FileStamp current;
+			if(!reader.ok || !getFileStamp(directory + dependency, current) || current.size != cached.size
+			   || current.modified != cached.modified)
+			{
+				return false;
+			}
+		}
+		std::vector<Material> materials(header.number_of_materials);
+		std::vector<std::string> texture_filenames;
+		for(auto& material : materials)
+		{
+			material.m_name = reader.readString();
+			material.m_color = reader.read<glm::vec3>();
+			material.m_shininess = reader.read<float>();
+			material.m_metalness = reader.read<float>();
+			material.m_fresnel = reader.read<float>();
+			material.m_emission = reader.read<glm::vec3>();
+			material.m_transparency = reader.read<float>();
+			material.m_ior = reader.read<float>();
+			for(int i = 0; i < 5; i++)
+			{
+				texture_filenames.push_back(reader.readString());
+			}
+		}
+		std::vector<Mesh> meshes(header.number_of_meshes);
+		for(auto& mesh : meshes)
+		{
+			mesh.m_name = reader.readString();
+			mesh.m_material_idx = reader.read<uint32_t>();
+			mesh.m_start_index = reader.read<uint32_t>();
+			mesh.m_number_of_indices = reader.read<uint32_t>();
+			mesh.m_base_vertex = reader.read<uint32_t>();
+			mesh.m_number_of_vertices = reader.read<uint32_t>();
+			mesh.m_aabb_min = reader.read<glm::vec3>();
+			mesh.m_aabb_max = reader.read<glm::vec3>();
+			mesh.m_bounding_sphere_center = reader.read<glm::vec3>();
+			mesh.m_bounding_sphere_radius = reader.read<float>();
+			if(uint64_t(mesh.m_start_index) + mesh.m_number_of_indices > number_of_indices
+			   || uint64_t(mesh.m_base_vertex) + mesh.m_number_of_vertices > n)
+			{
+				return false;
+			}
+			uint32_t number_of_lods = reader.read<uint32_t>();
+			for(uint32_t i = 0; i < number_of_lods && reader.ok; i++)
+			{
+				Mesh::Lod lod = reader.read<Mesh::Lod>();
+				if(uint64_t(lod.m_start_index) + lod.m_number_of_indices > number_of_indices)
+				{
+					return false;
+				}
+				mesh.m_lods.push_back(lod);
+			}
+		}
+		if(!reader.ok)
+		{
+			return false;
+		}
+
+		///////////////////////////////////////////////////////////////////
+		// The cache is valid, load the textures and copy the vertex data
+		///////////////////////////////////////////////////////////////////
+		for(size_t i = 0; i < materials.size(); i++)
+		{
+			Material& material = materials[i];
+			Texture* textures[] = { &material.m_color_texture, &material.m_shininess_texture,
+				                    &material.m_metalness_texture, &material.m_fresnel_texture,
+				                    &material.m_emission_texture };
+			const int components[] = { 4, 1, 1, 1, 4 };
+			for(int t = 0; t < 5; t++)
+			{
+				if(!texture_filenames[i * 5 + t].empty())
+				{
+					textures[t]->read(directory, texture_filenames[i * 5 + t], components[t]);
+				}
+			}
+		}
+		model->m_materials = materials;
+		model->m_meshes = meshes;
+		const uint8_t* base = cache.data();
+		const glm::vec3* positions = reinterpret_cast<const glm::vec3*>(base + header.positions_offset);
+		const glm::vec3* normals = reinterpret_cast<const glm::vec3*>(base + header.normals_offset);
+		const glm::vec2* texture_coordinates =
+		    reinterpret_cast<const glm::vec2*>(base + header.texture_coordinates_offset);
+		model->m_positions.assign(positions, positions + n);
+		model->m_normals.assign(normals, normals + n);
+		model->m_texture_coordinates.assign(texture_coordinates, texture_coordinates + n);
+		const uint32_t* indices = reinterpret_cast<const uint32_t*>(base + header.indices_offset);
+		model->m_indices.assign(indices, indices + number_of_indices);
+		return true;
+	}
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////
+// Parallel OBJ parser
+//
+// Gives the same shapes and attributes as tinyobj::LoadObj() with
+// triangulation. The file is split into one chunk of whole lines per
+// thread, and the chunks are parsed at the same time. Statements that
+// change the parser state (o, g, usemtl and mtllib) are recorded with
+// their position and replayed in file order once all chunks are done.
+///////////////////////////////////////////////////////////////////////////
+namespace
+{
+	// Smallest part of a file that is worth parsing on its own thread
+	const size_t min_chunk_size = 64 * 1024;
+	// Marks a texture coordinate or normal that was not given for a corner
+	const int missing_index = std::numeric_limits<int>::min();
+
+	enum ObjStatementType
+	{
+		OBJ_USEMTL,
+		OBJ_MTLLIB,
+		OBJ_GROUP,
+		OBJ_OBJECT
+	};
+
+	struct ObjStatement
+	{
+		ObjStatementType type;
+		// Number of faces in the chunk before this statement
+		size_t face;
+		std::string argument;
+	};
+
+	struct ObjFace
+	{
+		uint32_t first_corner;
+		uint32_t number_of_corners;
+		// Attributes parsed in this chunk before the face, to resolve
+		// relative indices
+		int number_of_vertices, number_of_normals, number_of_texcoords;
+	};
+
+	struct ObjChunk
+	{
+		char* begin;
+		char* end;
+		std::vector<float> vertices, normals, texcoords;
+		// Indices as written in the file until the chunk is resolved
+		std::vector<tinyobj::index_t> corners;
+		std::vector<ObjFace> faces;
+		std::vector<ObjStatement> statements;
+	};
+
+	struct ObjTriangle
+	{
+		tinyobj::index_t corners[3];
+		int material_id;
+	};
+
+	struct ObjShape
+	{
+		std::string name;
+		size_t first_triangle;
+		size_t number_of_triangles;
+	};
+
+	struct ObjData
+	{
+		std::vector<float> vertices, normals, texcoords;
+		std::vector<tinyobj::material_t> materials;
+		std::vector<ObjShape> shapes;
+		// The triangles of all shapes, in shape order
+		std::vector<ObjTriangle> triangles;
+	};
+
+	// The first word, like sscanf(s, "%s")
+	std::string firstWord(const char* s)
+	{
+		s += strspn(s, " \t\v\f");
+		return std::string(s, strcspn(s, " \t\v\f"));
+	}
+
+	// Like tinyobj::parseTriple(), but keeps the indices as they are written
+	tinyobj::index_t parseCorner(const char** token)
+	{
+		tinyobj::index_t corner;
+		corner.vertex_index = atoi(*token);
+		corner.normal_index = missing_index;
+		corner.texcoord_index = missing_index;
+		(*token) += strcspn(*token, "/ \t\r");
+		if((*token)[0] != '/')
+			return corner;
+		(*token)++;
+		if((*token)[0] == '/')
+		{
+			(*token)++;
+			corner.normal_index = atoi(*token);
+			(*token) += strcspn(*token, "/ \t\r");
+			return corner;
+		}
+		corner.texcoord_index = atoi(*token);
+		(*token) += strcspn(*token, "/ \t\r");
+		if((*token)[0] != '/')
+			return corner;
+		(*token)++;
+		corner.normal_index = atoi(*token);
+		(*token) += strcspn(*token, "/ \t\r");
+		return corner;
+	}
+
+	void parseChunk(ObjChunk& chunk)
+	{
+		// Every line becomes a C string, as tinyobj's parsing helpers expect
+		for(char* c = chunk.begin; c != chunk.end; c++)
+		{
+			if(*c == '\n' || *c == '\r')
+				*c = '\0';
+		}
+		for(const char* line = chunk.begin; line < chunk.end; line += strlen(line) + 1)
+		{
+			const char* token = line + strspn(line, " \t");
+			if(token[0] == '\0' || token[0] == '#')
+			{
+				continue;
+			}
+			if(token[0] == 'v' && IS_SPACE(token[1]))
+			{
+				token += 2;
+				float x, y, z;
+				tinyobj::parseReal3(&x, &y, &z, &token);
+				chunk.vertices.push_back(x);
+				chunk.vertices.push_back(y);
+				chunk.vertices.push_back(z);
+			}
+			else if(token[0] == 'v' && token[1] == 'n' && IS_SPACE(token[2]))
+			{
+				token += 3;
+				float x, y, z;
+				tinyobj::parseReal3(&x, &y, &z, &token);
+				chunk.normals.push_back(x);
+				chunk.normals.push_back(y);
+				chunk.normals.push_back(z);
+			}
+			else if(token[0] == 'v' && token[1] == 't' && IS_SPACE(token[2]))
+			{
+				token += 3;
+				float x, y;
+				tinyobj::parseReal2(&x, &y, &token);
+				chunk.texcoords.push_back(x);
+				chunk.texcoords.push_back(y);
+			}
+			else if(token[0] == 'f' && IS_SPACE(token[1]))
+			{
+				token += 2;
+				token += strspn(token, " \t");
+				ObjFace face;
+				face.first_corner = uint32_t(chunk.corners.size());
+				face.number_of_vertices = int(chunk.vertices.size() / 3);
+				face.number_of_normals = int(chunk.normals.size() / 3);
+				face.number_of_texcoords = int(chunk.texcoords.size() / 2);
+				while(!IS_NEW_LINE(token[0]))
+				{
+					chunk.corners.push_back(parseCorner(&token));
+					token += strspn(token, " \t\r");
+				}
+				face.number_of_corners = uint32_t(chunk.corners.size()) - face.first_corner;
+				chunk.faces.push_back(face);
+			}
+			else if(strncmp(token, "usemtl", 6) == 0 && IS_SPACE(token[6]))
+			{
+				chunk.statements.push_back({ OBJ_USEMTL, chunk.faces.size(), firstWord(token + 7) });
+			}
+			else if(strncmp(token, "mtllib", 6) == 0 && IS_SPACE(token[6]))
+			{
+				chunk.statements.push_back({ OBJ_MTLLIB, chunk.faces.size(), std::string(token + 7) });
+			}
+			else if(token[0] == 'g' && IS_SPACE(token[1]))
+			{
+				// The group name is the first name after 'g'
+				std::vector<std::string> names;
+				while(!IS_NEW_LINE(token[0]))
+				{
+					names.push_back(tinyobj::parseString(&token));
+					token += strspn(token, " \t\r");
+				}
+				std::string name = names.size() > 1 ? names[1] : "";
+				chunk.statements.push_back({ OBJ_GROUP, chunk.faces.size(), name });
+			}
+			else if(token[0] == 'o' && IS_SPACE(token[1]))
+			{
+				chunk.statements.push_back({ OBJ_OBJECT, chunk.faces.size(), firstWord(token + 2) });
+			}
+		}
+	}
+
+	// Make the indices of a chunk zero based and absolute
+	void resolveChunk(ObjChunk& chunk, int vertices_before, int normals_before, int texcoords_before)
+	{
+		for(const ObjFace& face : chunk.faces)
+		{
+			for(uint32_t c = face.first_corner; c < face.first_corner + face.number_of_corners; c++)
+			{
+				tinyobj::index_t& corner = chunk.corners[c];
+				corner.vertex_index =
+				    tinyobj::fixIndex(corner.vertex_index, vertices_before + face.number_of_vertices);
+				corner.normal_index = corner.normal_index == missing_index ?
+				                          -1 :
+				                          tinyobj::fixIndex(corner.normal_index,
+				                                            normals_before + face.number_of_normals);
+				corner.texcoord_index = corner.texcoord_index == missing_index ?
+				                            -1 :
+				                            tinyobj::fixIndex(corner.texcoord_index,
+				                                              texcoords_before + face.number_of_texcoords);
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Build the shapes from the parsed chunks by replaying the statements
+	// exactly as tinyobj::LoadObj() handles them
+	///////////////////////////////////////////////////////////////////////
+	class ObjShapeBuilder
+	{
+	public:
+		ObjShapeBuilder(ObjData& obj, const std::vector<ObjChunk>& chunks, const std::string& directory)
+		    : m_obj(obj), m_chunks(chunks), m_material_reader(directory)
+		{
+		}
+
+		void run(std::string& err)
+		{
+			for(size_t c = 0; c < m_chunks.size(); c++)
+			{
+				const ObjChunk& chunk = m_chunks[c];
+				size_t s = 0;
+				for(size_t f = 0; f < chunk.faces.size(); f++)
+				{
+					for(; s < chunk.statements.size() && chunk.statements[s].face == f; s++)
+					{
+						apply(chunk.statements[s], err);
+					}
+					m_face_group.push_back(&chunk.faces[f]);
+					m_face_group_chunks.push_back(&chunk);
+				}
+				for(; s < chunk.statements.size(); s++)
+				{
+					apply(chunk.statements[s], err);
+				}
+			}
+			if(exportFaceGroup() || m_obj.triangles.size() > m_shape.first_triangle)
+			{
+				pushShape();
+			}
+		}
+
+	private:
+		void apply(const ObjStatement& statement, std::string& err)
+		{
+			if(statement.type == OBJ_USEMTL)
+			{
+				auto material = m_material_map.find(statement.argument);
+				int material_id = material != m_material_map.end() ? material->second : -1;
+				if(material_id != m_material_id)
+				{
+					exportFaceGroup();
+					m_material_id = material_id;
+				}
+			}
+			else if(statement.type == OBJ_MTLLIB)
+			{
+				std::vector<std::string> filenames;
+				tinyobj::SplitString(statement.argument, ' ', filenames);
+				if(filenames.empty())
+				{
+					err += "WARN: Looks like empty filename for mtllib. Use default material. \n";
+					return;
+				}
+				bool found = false;
+				for(size_t i = 0; i < filenames.size() && !found; i++)
+				{
+					std::string err_mtl;
+					found = m_material_reader(filenames[i], &m_obj.materials, &m_material_map, &err_mtl);
+					err += err_mtl;
+				}
+				if(!found)
+				{
+					err += "WARN: Failed to load material file(s). Use default material.\n";
+				}
+			}
+			else
+			{
+				// A new group or object starts a new shape. Like tinyobj, a
+				// shape whose faces were all exported by usemtl is dropped.
+				if(exportFaceGroup())
+				{
+					pushShape();
+				}
+				else
+				{
+					m_obj.triangles.resize(m_shape.first_triangle);
+				}
+				m_shape.name = "";
+				m_shape.first_triangle = m_obj.triangles.size();
+				m_name = statement.argument;
+			}
+		}
+
+		// Triangulate the faces since the last state change into the shape
+		bool exportFaceGroup()
+		{
+			if(m_face_group.empty())
+			{
+				return false;
+			}
+			for(size_t f = 0; f < m_face_group.size(); f++)
+			{
+				const ObjFace& face = *m_face_group[f];
+				const tinyobj::index_t* corners = &m_face_group_chunks[f]->corners[face.first_corner];
+				for(uint32_t k = 2; k < face.number_of_corners; k++)
+				{
+					ObjTriangle triangle = { { corners[0], corners[k - 1], corners[k] }, m_material_id };
+					m_obj.triangles.push_back(triangle);
+				}
+			}
+			m_face_group.clear();
+			m_face_group_chunks.clear();
+			m_shape.name = m_name;
+			return true;
+		}
+
+		void pushShape()
+		{
+			m_shape.number_of_triangles = m_obj.triangles.size() - m_shape.first_triangle;
+			m_obj.shapes.push_back(m_shape);
+		}
+
+		ObjData& m_obj;
+		const std::vector<ObjChunk>& m_chunks;
+		tinyobj::MaterialFileReader m_material_reader;
+		std::map<std::string, int> m_material_map;
+		int m_material_id = -1;
+		std::string m_name;
+		ObjShape m_shape = { "", 0, 0 };
+		std::vector<const ObjFace*> m_face_group;
+		std::vector<const ObjChunk*> m_face_group_chunks;
+	};
+
+	bool parseOBJ(const std::string& path, const std::string& mtl_directory, ObjData& obj, std::string& err)
+	{
+		std::ifstream file(path, std::ios::binary);
+		if(!file)
+		{
+			err = "Cannot open file [" + path + "]\n";
+			return false;
+		}
+		file.seekg(0, std::ios::end);
+		const size_t size = size_t(file.tellg());
+		file.seekg(0, std::ios::beg);
+		// Keep a terminating zero after the last line
+		std::vector<char> buffer(size + 1, '\0');
+		file.read(buffer.data(), size);
+
+		///////////////////////////////////////////////////////////////////
+		// Split the file on line endings and parse the chunks
+		///////////////////////////////////////////////////////////////////
+		size_t number_of_chunks = std::max(1u, std::thread::hardware_concurrency());
+		number_of_chunks = std::max<size_t>(1, std::min(number_of_chunks, size / min_chunk_size));
+		std::vector<ObjChunk> chunks(number_of_chunks);
+		size_t chunk_begin = 0;
+		for(size_t c = 0; c < number_of_chunks; c++)
+		{
+			size_t chunk_end = std::max(chunk_begin, size * (c + 1) / number_of_chunks);
+			while(chunk_end < size && buffer[chunk_end - 1] != '\n' && buffer[chunk_end - 1] != '\r')
+			{
+				chunk_end++;
+			}
+			chunks[c].begin = buffer.data() + chunk_begin;
+			chunks[c].end = buffer.data() + chunk_end;
+			chunk_begin = chunk_end;
+		}
+		parallelFor(chunks.size(), 1, [&chunks](size_t begin, size_t end) {
+			for(size_t c = begin; c < end; c++)
+				parseChunk(chunks[c]);
+		});
+
+		///////////////////////////////////////////////////////////////////
+		// Resolve relative indices and gather the attributes
+		///////////////////////////////////////////////////////////////////
+		std::vector<size_t> vertices_before(number_of_chunks + 1, 0);
+		std::vector<size_t> normals_before(number_of_chunks + 1, 0);
+		std::vector<size_t> texcoords_before(number_of_chunks + 1, 0);
+		for(size_t c = 0; c < number_of_chunks; c++)
+		{
+			vertices_before[c + 1] = vertices_before[c] + chunks[c].vertices.size();
+			normals_before[c + 1] = normals_before[c] + chunks[c].normals.size();
+			texcoords_before[c + 1] = texcoords_before[c] + chunks[c].texcoords.size();
+		}
+		obj.vertices.resize(vertices_before.back());
+		obj.normals.resize(normals_before.back());
+		obj.texcoords.resize(texcoords_before.back());
+		parallelFor(chunks.size(), 1, [&](size_t begin, size_t end) {
+			for(size_t c = begin; c < end; c++)
+			{
+				ObjChunk& chunk = chunks[c];
+				resolveChunk(chunk, int(vertices_before[c] / 3), int(normals_before[c] / 3),
+				             int(texcoords_before[c] / 2));
+				auto vertices = obj.vertices.begin() + vertices_before[c];
+				auto normals = obj.normals.begin() + normals_before[c];
+				auto texcoords = obj.texcoords.begin() + texcoords_before[c];
+				std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices);
+				std::copy(chunk.normals.begin(), chunk.normals.end(), normals);
+				std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), texcoords);
+			}
+		});
+
+		ObjShapeBuilder(obj, chunks, mtl_directory).run(err);
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Indexed meshes
+	///////////////////////////////////////////////////////////////////////
+	struct Vertex
+	{
+		glm::vec3 position;
+		glm::vec3 normal;
+		glm::vec2 texture_coordinate;
+		bool operator==(const Vertex& other) const
+		{
+			return memcmp(this, &other, sizeof(Vertex)) == 0;
+		}
+	};
+
+	struct VertexHash
+	{
+		size_t operator()(const Vertex& vertex) const
+		{
+			// FNV-1a
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&vertex);
+			uint64_t hash = 14695981039346656037ull;
+			for(size_t i = 0; i < sizeof(Vertex); i++)
+			{
+				hash = (hash ^ bytes[i]) * 1099511628211ull;
+			}
+			return size_t(hash);
+		}
+	};
+
+	struct IndexedMesh
+	{
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+		std::vector<SimplifiedMesh> lods;
+	};
+
+	// Triangles in each level of detail, relative to the full mesh
+	const float lod_triangle_ratios[] = { 0.5f, 0.25f, 0.125f };
+
+	///////////////////////////////////////////////////////////////////////
+	// Turn the vertex stream of each mesh, given by m_start_index and
+	// m_number_of_vertices, into unique vertices and indices, and
+	// optimize their order. Simplify the meshes for the levels of detail.
+	///////////////////////////////////////////////////////////////////////
+	void indexMeshes(Model* model)
+	{
+		std::vector<IndexedMesh> indexed(model->m_meshes.size());
+		parallelFor(model->m_meshes.size(), 1, [&](size_t begin, size_t end) {
+			for(size_t m = begin; m < end; m++)
+			{
+				const Mesh& mesh = model->m_meshes[m];
+				IndexedMesh& result = indexed[m];
+				std::unordered_map<Vertex, uint32_t, VertexHash> welded;
+				welded.reserve(mesh.m_number_of_vertices);
+				result.indices.resize(mesh.m_number_of_vertices);
+				for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+				{
+					const uint32_t v = mesh.m_start_index + i;
+					Vertex vertex = { model->m_positions[v], model->m_normals[v],
+						              model->m_texture_coordinates[v] };
+					auto inserted = welded.insert({ vertex, uint32_t(result.vertices.size()) });
+					if(inserted.second)
+					{
+						result.vertices.push_back(vertex);
+					}
+					result.indices[i] = inserted.first->second;
+				}
+				const size_t number_of_vertices = result.vertices.size();
+				std::vector<glm::vec3> positions(number_of_vertices);
+				for(size_t v = 0; v < number_of_vertices; v++)
+				{
+					positions[v] = result.vertices[v].position;
+				}
+				std::vector<uint32_t> clusters = optimizeVertexCache(result.indices, number_of_vertices);
+				optimizeOverdraw(result.indices, clusters, positions.data());
+				std::vector<uint32_t> remap;
+				optimizeVertexFetch(result.indices, number_of_vertices, remap);
+				std::vector<Vertex> reordered(number_of_vertices);
+				for(size_t v = 0; v < number_of_vertices; v++)
+				{
+					reordered[remap[v]] = result.vertices[v];
+					positions[remap[v]] = result.vertices[v].position;
+				}
+				result.vertices.swap(reordered);
+
+				// The levels of detail are only drawn from afar, so their
+				// overdraw matters less than their vertex cache misses
+				std::vector<size_t> targets;
+				for(float ratio : lod_triangle_ratios)
+				{
+					targets.push_back(size_t(ratio * float(result.indices.size() / 3)));
+				}
+				result.lods = simplifyMesh(result.indices, positions.data(), number_of_vertices, targets);
+				for(SimplifiedMesh& lod : result.lods)
+				{
+					optimizeVertexCache(lod.indices, number_of_vertices);
+				}
+			}
+		});
+
+		model->m_positions.clear();
+		model->m_normals.clear();
+		model->m_texture_coordinates.clear();
+		model->m_indices.clear();
+		for(size_t m = 0; m < model->m_meshes.size(); m++)
+		{
+			Mesh& mesh = model->m_meshes[m];
+			const IndexedMesh& result = indexed[m];
+			mesh.m_start_index = uint32_t(model->m_indices.size());
+			mesh.m_number_of_indices = uint32_t(result.indices.size());
+			mesh.m_base_vertex = uint32_t(model->m_positions.size());
+			mesh.m_number_of_vertices = uint32_t(result.vertices.size());
+			glm::vec3 min_corner(std::numeric_limits<float>::max());
+			glm::vec3 max_corner(-std::numeric_limits<float>::max());
+			for(const Vertex& vertex : result.vertices)
+			{
+				model->m_positions.push_back(vertex.position);
+				model->m_normals.push_back(vertex.normal);
+				model->m_texture_coordinates.push_back(vertex.texture_coordinate);
+				min_corner = glm::min(min_corner, vertex.position);
+				max_corner = glm::max(max_corner, vertex.position);
+			}
+			if(result.vertices.empty())
+			{
+				min_corner = max_corner = glm::vec3(0.0f);
+			}
+			mesh.m_aabb_min = min_corner;
+			mesh.m_aabb_max = max_corner;
+			mesh.m_bounding_sphere_center = 0.5f * (min_corner + max_corner);
+			mesh.m_bounding_sphere_radius = 0.0f;
+			for(const Vertex& vertex : result.vertices)
+			{
+				float distance = glm::length(vertex.position - mesh.m_bounding_sphere_center);
+				mesh.m_bounding_sphere_radius = std::max(mesh.m_bounding_sphere_radius, distance);
+			}
+			model->m_indices.insert(model->m_indices.end(), result.indices.begin(), result.indices.end());
+			mesh.m_lods.clear();
+			for(const SimplifiedMesh& lod : result.lods)
+			{
+				Mesh::Lod mesh_lod = { uint32_t(model->m_indices.size()), uint32_t(lod.indices.size()),
+					                   lod.error };
+				mesh.m_lods.push_back(mesh_lod);
+				model->m_indices.insert(model->m_indices.end(), lod.indices.begin(), lod.indices.end());
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Bounds of the whole model from those of its meshes
+	///////////////////////////////////////////////////////////////////////
+	void computeModelBounds(Model* model)
+	{
+		model->m_aabb_min = glm::vec3(std::numeric_limits<float>::max());
+		model->m_aabb_max = glm::vec3(-std::numeric_limits<float>::max());
+		for(const Mesh& mesh : model->m_meshes)
+		{
+			model->m_aabb_min = glm::min(model->m_aabb_min, mesh.m_aabb_min);
+			model->m_aabb_max = glm::max(model->m_aabb_max, mesh.m_aabb_max);
+		}
+		if(model->m_meshes.empty())
+		{
+			model->m_aabb_min = model->m_aabb_max = glm::vec3(0.0f);
+		}
+		model->m_bounding_sphere_center = 0.5f * (model->m_aabb_min + model->m_aabb_max);
+		model->m_bounding_sphere_radius = 0.0f;
+		for(const Mesh& mesh : model->m_meshes)
+		{
+			float distance = glm::length(mesh.m_bounding_sphere_center - model->m_bounding_sphere_center);
+			model->m_bounding_sphere_radius =
+			    std::max(model->m_bounding_sphere_radius, distance + mesh.m_bounding_sphere_radius);
+		}
+	}
+} // namespace
+
+Model* readModelFromOBJ(std::string path)
 {
 	std::string filename, extension, directory;
 
@@ -134,17 +1392,37 @@ Model* loadModelFromOBJ(std::string path)
 		exit(1);
 	}
 
+	std::cout << "Loading " << path << "..." << std::flush;
+	trace::Scope scope("Read model", path);
+	Model* model = new Model;
+	model->m_name = filename;
+	model->m_filename = path;
+
 	///////////////////////////////////////////////////////////////////////
-	// Parse the OBJ file using tinyobj
+	// Use the binary cache if it is up to date
 	///////////////////////////////////////////////////////////////////////
-	std::cout << "Loading " << path << "..." << std::flush;
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
+	const std::string cache_path = directory + filename + ".objcache";
+	{
+		trace::begin("Read model cache");
+		MappedFile cache;
+		bool cached = cache.open(cache_path) && readModelCache(cache, directory, model);
+		trace::end();
+		if(cached)
+		{
+			computeModelBounds(model);
+			std::cout << "done (cached).\n";
+			return model;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Parse the OBJ file, expecting the '.mtl' file in the same directory
+	///////////////////////////////////////////////////////////////////////
+	ObjData obj;
 	std::string err;
-	// Expect '.mtl' file in the same directory and triangulate meshes
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err,
-	                            (directory + filename + extension).c_str(), directory.c_str(), true);
+	trace::begin("Parse OBJ");
+	bool ret = parseOBJ(directory + filename + extension, directory, obj, err);
+	trace::end();
 	if(!err.empty())
 	{ // `err` may contain warning message.
 		std::cerr << err << std::endl;
@@ -153,41 +1431,39 @@ Model* loadModelFromOBJ(std::string path)
 	{
 		exit(1);
 	}
-	Model* model = new Model;
-	model->m_name = filename;
-	model->m_filename = path;
+	const std::vector<ObjTriangle>& triangles = obj.triangles;
 
 	///////////////////////////////////////////////////////////////////////
 	// Transform all materials into our datastructure
 	///////////////////////////////////////////////////////////////////////
-	for(const auto& m : materials)
+	for(const auto& m : obj.materials)
 	{
 		Material material;
 		material.m_name = m.name;
 		material.m_color = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
 		if(m.diffuse_texname != "")
 		{
-			material.m_color_texture.load(directory, m.diffuse_texname, 4);
+			material.m_color_texture.read(directory, m.diffuse_texname, 4);
 		}
 		material.m_metalness = m.metallic;
 		if(m.metallic_texname != "")
 		{
-			material.m_metalness_texture.load(directory, m.metallic_texname, 1);
+			material.m_metalness_texture.read(directory, m.metallic_texname, 1);
 		}
 		material.m_fresnel = m.specular[0];
 		if(m.specular_texname != "")
 		{
-			material.m_fresnel_texture.load(directory, m.specular_texname, 1);
+			material.m_fresnel_texture.read(directory, m.specular_texname, 1);
 		}
 		material.m_shininess = m.roughness;
 		if(m.roughness_texname != "")
 		{
-			material.m_shininess_texture.load(directory, m.roughness_texname, 1);
+			material.m_shininess_texture.read(directory, m.roughness_texname, 1);
 		}
 		material.m_emission = glm::vec3(m.emission[0], m.emission[1], m.emission[2]);
 		if(m.emissive_texname != "")
 		{
-			material.m_emission_texture.load(directory, m.emissive_texname, 4);
+			material.m_emission_texture.read(directory, m.emissive_texname, 4);
 		}
 		material.m_transparency = m.transmittance[0];
 		material.m_ior = m.ior;
@@ -196,180 +1472,552 @@ Model* loadModelFromOBJ(std::string path)
 
 	///////////////////////////////////////////////////////////////////////
 	// A vertex in the OBJ file may have different indices for position,
-	// normal and texture coordinate. We will not even attempt to use
-	// indexed lookups, but will store a simple vertex stream per mesh.
+	// normal and texture coordinate. Start with a simple vertex stream per
+	// mesh, which indexMeshes() welds into unique vertices at the end.
 	///////////////////////////////////////////////////////////////////////
-	uint64_t number_of_vertices = 0;
-	for(const auto& shape : shapes)
-	{
-		number_of_vertices += shape.mesh.indices.size();
-	}
+	uint64_t number_of_vertices = triangles.size() * 3;
 	model->m_positions.resize(number_of_vertices);
 	model->m_normals.resize(number_of_vertices);
 	model->m_texture_coordinates.resize(number_of_vertices);
 
 	///////////////////////////////////////////////////////////////////////
 	// For each vertex _position_ auto generate a normal that will be used
-	// if no normal is supplied.
+	// if no normal is supplied. A counting sort lists the faces around
+	// each position in face order, with each thread counting and placing
+	// the corners of its own range of faces, and then each thread sums the
+	// face normals of its own range of positions. All of it is linear in
+	// the number of faces and positions, and the sums are made in face
+	// order, so the result does not depend on the number of threads.
 	///////////////////////////////////////////////////////////////////////
-	std::vector<glm::vec4> auto_normals(attrib.vertices.size() / 3);
-	for(const auto& shape : shapes)
-	{
-		for(int face = 0; face < int(shape.mesh.indices.size()) / 3; face++)
+	const glm::vec3* obj_vertices = reinterpret_cast<const glm::vec3*>(obj.vertices.data());
+	std::vector<glm::vec3> face_normals(triangles.size());
+	parallelFor(triangles.size(), 4096, [&](size_t begin, size_t end) {
+		for(size_t face = begin; face < end; face++)
 		{
-			glm::vec3 v0 = glm::vec3(attrib.vertices[shape.mesh.indices[face * 3 + 0].vertex_index * 3 + 0],
-			                         attrib.vertices[shape.mesh.indices[face * 3 + 0].vertex_index * 3 + 1],
-			                         attrib.vertices[shape.mesh.indices[face * 3 + 0].vertex_index * 3 + 2]);
-			glm::vec3 v1 = glm::vec3(attrib.vertices[shape.mesh.indices[face * 3 + 1].vertex_index * 3 + 0],
-			                         attrib.vertices[shape.mesh.indices[face * 3 + 1].vertex_index * 3 + 1],
-			                         attrib.vertices[shape.mesh.indices[face * 3 + 1].vertex_index * 3 + 2]);
-			glm::vec3 v2 = glm::vec3(attrib.vertices[shape.mesh.indices[face * 3 + 2].vertex_index * 3 + 0],
-			                         attrib.vertices[shape.mesh.indices[face * 3 + 2].vertex_index * 3 + 1],
-			                         attrib.vertices[shape.mesh.indices[face * 3 + 2].vertex_index * 3 + 2]);
+			glm::vec3 v0 = obj_vertices[triangles[face].corners[0].vertex_index];
+			glm::vec3 v1 = obj_vertices[triangles[face].corners[1].vertex_index];
+			glm::vec3 v2 = obj_vertices[triangles[face].corners[2].vertex_index];
 
 			glm::vec3 e0 = glm::normalize(v1 - v0);
 			glm::vec3 e1 = glm::normalize(v2 - v0);
-			glm::vec3 face_normal = cross(e0, e1);
+			face_normals[face] = cross(e0, e1);
+		}
+	});
+	const size_t number_of_positions = obj.vertices.size() / 3;
+	const size_t number_of_face_ranges = std::max<size_t>(
+	    1, std::min<size_t>(std::thread::hardware_concurrency(), triangles.size() / 65536));
+	auto faceRangeBegin = [&](size_t range) {
+		return triangles.size() * range / number_of_face_ranges;
+	};
+	// Corners of each position per range of faces, and then where the
+	// range places the first of them in vertex_faces
+	std::vector<uint32_t> range_offsets(number_of_face_ranges * number_of_positions, 0);
+	parallelFor(number_of_face_ranges, 1, [&](size_t begin, size_t end) {
+		for(size_t range = begin; range < end; range++)
+		{
+			uint32_t* counts = &range_offsets[range * number_of_positions];
+			for(size_t face = faceRangeBegin(range); face < faceRangeBegin(range + 1); face++)
+			{
+				for(int j = 0; j < 3; j++)
+				{
+					counts[triangles[face].corners[j].vertex_index] += 1;
+				}
+			}
+		}
+	});
+	// The faces of position v are vertex_faces[first_vertex_face[v]] up to
+	// vertex_faces[first_vertex_face[v + 1]]
+	std::vector<uint32_t> first_vertex_face(number_of_positions + 1, 0);
+	parallelFor(number_of_positions, 4096, [&](size_t begin, size_t end) {
+		for(size_t v = begin; v < end; v++)
+		{
+			for(size_t range = 0; range < number_of_face_ranges; range++)
+			{
+				first_vertex_face[v + 1] += range_offsets[range * number_of_positions + v];
+			}
+		}
+	});
+	for(size_t v = 0; v < number_of_positions; v++)
+	{
+		first_vertex_face[v + 1] += first_vertex_face[v];
+	}
+	parallelFor(number_of_positions, 4096, [&](size_t begin, size_t end) {
+		for(size_t v = begin; v < end; v++)
+		{
+			uint32_t offset = first_vertex_face[v];
+			for(size_t range = 0; range < number_of_face_ranges; range++)
+			{
+				uint32_t& range_offset = range_offsets[range * number_of_positions + v];
+				const uint32_t count = range_offset;
+				range_offset = offset;
+				offset += count;
+			}
+		}
+	});
+	std::vector<uint32_t> vertex_faces(first_vertex_face.back());
+	parallelFor(number_of_face_ranges, 1, [&](size_t begin, size_t end) {
+		for(size_t range = begin; range < end; range++)
+		{
+			uint32_t* offsets = &range_offsets[range * number_of_positions];
+			for(size_t face = faceRangeBegin(range); face < faceRangeBegin(range + 1); face++)
+			{
+				for(int j = 0; j < 3; j++)
+				{
+					vertex_faces[offsets[triangles[face].corners[j].vertex_index]++] = uint32_t(face);
+				}
+			}
+		}
+	});
+	std::vector<glm::vec4> auto_normals(number_of_positions);
+	parallelFor(number_of_positions, 4096, [&](size_t begin, size_t end) {
+		for(size_t v = begin; v < end; v++)
+		{
+			glm::vec4 sum(0.0f);
+			for(uint32_t i = first_vertex_face[v]; i < first_vertex_face[v + 1]; i++)
+			{
+				sum += glm::vec4(face_normals[vertex_faces[i]], 1.0f);
+			}
+			auto_normals[v] = (1.0f / sum.w) * sum;
+		}
+	});
 
-			auto_normals[shape.mesh.indices[face * 3 + 0].vertex_index] += glm::vec4(face_normal, 1.0f);
-			auto_normals[shape.mesh.indices[face * 3 + 1].vertex_index] += glm::vec4(face_normal, 1.0f);
-			auto_normals[shape.mesh.indices[face * 3 + 2].vertex_index] += glm::vec4(face_normal, 1.0f);
+	///////////////////////////////////////////////////////////////////////
+	// Now we will turn all shapes into Meshes. A shape that has several
+	// materials will be split into several meshes with unique names, in
+	// the order the materials are first used in the shape. Faces without
+	// a material are skipped, as are shapes that start without one.
+	///////////////////////////////////////////////////////////////////////
+	// For each triangle in the vertex stream, the triangle it comes from
+	std::vector<uint32_t> source_triangles;
+	source_triangles.reserve(triangles.size());
+	std::vector<int> bucket_of_material(obj.materials.size(), -1);
+	std::vector<std::vector<uint32_t>> buckets;
+	std::vector<int> bucket_materials;
+	for(const ObjShape& shape : obj.shapes)
+	{
+		if(shape.number_of_triangles == 0 || triangles[shape.first_triangle].material_id == -1)
+		{
+			continue;
+		}
+		for(size_t t = shape.first_triangle; t < shape.first_triangle + shape.number_of_triangles; t++)
+		{
+			int material = triangles[t].material_id;
+			if(material == -1)
+			{
+				continue;
+			}
+			if(bucket_of_material[material] == -1)
+			{
+				bucket_of_material[material] = int(bucket_materials.size());
+				bucket_materials.push_back(material);
+				if(buckets.size() < bucket_materials.size())
+					buckets.resize(bucket_materials.size());
+			}
+			buckets[bucket_of_material[material]].push_back(uint32_t(t));
 		}
+		for(size_t b = 0; b < bucket_materials.size(); b++)
+		{
+			Mesh mesh;
+			mesh.m_name = shape.name;
+			if(bucket_materials.size() > 1)
+			{
+				mesh.m_name += "_" + obj.materials[bucket_materials[b]].name;
+			}
+			mesh.m_material_idx = bucket_materials[b];
+			mesh.m_start_index = uint32_t(source_triangles.size() * 3);
+			mesh.m_number_of_vertices = uint32_t(buckets[b].size() * 3);
+			model->m_meshes.push_back(mesh);
+			source_triangles.insert(source_triangles.end(), buckets[b].begin(), buckets[b].end());
+			bucket_of_material[bucket_materials[b]] = -1;
+			buckets[b].clear();
+		}
+		bucket_materials.clear();
 	}
-	for(auto& normal : auto_normals)
+
+	///////////////////////////////////////////////////////////////////////
+	// Now we generate the vertices
+	///////////////////////////////////////////////////////////////////////
+	parallelFor(source_triangles.size(), 4096, [&](size_t begin, size_t end) {
+		for(size_t i = begin; i < end; i++)
+		{
+			const ObjTriangle& triangle = triangles[source_triangles[i]];
+			for(int j = 0; j < 3; j++)
+			{
+				const tinyobj::index_t& corner = triangle.corners[j];
+				model->m_positions[i * 3 + j] = obj_vertices[corner.vertex_index];
+				if(corner.normal_index == -1)
+				{
+					// No normal, use the autogenerated
+					model->m_normals[i * 3 + j] = glm::vec3(auto_normals[corner.vertex_index]);
+				}
+				else
+				{
+					const float* normal = &obj.normals[corner.normal_index * 3];
+					model->m_normals[i * 3 + j] = glm::vec3(normal[0], normal[1], normal[2]);
+				}
+				if(corner.texcoord_index == -1)
+				{
+					// No UV coordinates. Use null.
+					model->m_texture_coordinates[i * 3 + j] = glm::vec2(0.0f);
+				}
+				else
+				{
+					const float* texcoord = &obj.texcoords[corner.texcoord_index * 2];
+					model->m_texture_coordinates[i * 3 + j] = glm::vec2(texcoord[0], texcoord[1]);
+				}
+			}
+		}
+	});
+
+	std::sort(model->m_meshes.begin(), model->m_meshes.end(),
+	          [](const Mesh& a, const Mesh& b) { return a.m_name < b.m_name; });
+
+	trace::begin("Index meshes");
+	indexMeshes(model);
+	trace::end();
+	computeModelBounds(model);
+
+	writeModelCache(cache_path, directory, filename + extension, model);
+
+	std::cout << "done.\n";
+	return model;
+}
+
+namespace
+{
+	///////////////////////////////////////////////////////////////////////
+	// Once all layers of an array are in: fill in the mipmaps unless they
+	// were copied too, and make a bindless handle for it if the model has
+	// them, after which the texture can not be changed.
+	///////////////////////////////////////////////////////////////////////
+	void finishTextureArray(Model* model, const TextureArrayLayer& layer)
 	{
-		normal = (1.0f / normal.w) * normal;
+		if(layer.texture->compressed == nullptr)
+		{
+			glBindTexture(GL_TEXTURE_2D_ARRAY, model->m_texture_arrays[layer.array]);
+			glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		}
+		if(!model->m_texture_array_handles.empty())
+		{
+			GLuint64 handle = glGetTextureHandleARB(model->m_texture_arrays[layer.array]);
+			glMakeTextureHandleResidentARB(handle);
+			model->m_texture_array_handles[layer.array] = handle;
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////
-	// Now we will turn all shapes into Meshes. A shape that has several
-	// materials will be split into several meshes with unique names
+	// Copy the color and emission textures of the materials into arrays of
+	// textures with the same size, format and number of mipmaps. They are
+	// copied from the pixels or compressed blocks kept on the CPU, so it
+	// does not matter whether the textures have been uploaded yet.
 	///////////////////////////////////////////////////////////////////////
-	int vertices_so_far = 0;
-	for(int s = 0; s < shapes.size(); ++s)
+	void createTextureArrays(Model* model, bool bindless, std::vector<TextureArrayLayer>* deferred_layers)
 	{
-		const auto& shape = shapes[s];
-		///////////////////////////////////////////////////////////////////
-		// The shapes in an OBJ file may several different materials.
-		// If so, we will split the shape into one Mesh per Material
-		///////////////////////////////////////////////////////////////////
-		int next_material_index = shape.mesh.material_ids[0];
-		int next_material_starting_face = 0;
-		std::vector<bool> finished_materials(materials.size(), false);
-		int number_of_materials_in_shape = 0;
-		while(next_material_index != -1)
-		{
-			int current_material_index = next_material_index;
-			int current_material_starting_face = next_material_starting_face;
-			next_material_index = -1;
-			next_material_starting_face = -1;
-			// Process a new Mesh with a unique material
-			Mesh mesh;
-			mesh.m_name = shape.name + "_" + materials[current_material_index].name;
-			mesh.m_material_idx = current_material_index;
-			mesh.m_start_index = vertices_so_far;
-			number_of_materials_in_shape += 1;
-
-			uint64_t number_of_faces = shape.mesh.indices.size() / 3;
-			for(int i = current_material_starting_face; i < number_of_faces; i++)
-			{
-				if(shape.mesh.material_ids[i] != current_material_index)
-				{
-					if(next_material_index >= 0)
-						continue;
-					else if(finished_materials[shape.mesh.material_ids[i]])
-						continue;
-					else
-					{ // Found a new material that we have not processed.
-						next_material_index = shape.mesh.material_ids[i];
-						next_material_starting_face = i;
-					}
+		struct TextureArray
+		{
+			GLenum internal_format;
+			int width, height, levels;
+			std::vector<const Texture*> layers;
+		};
+		std::vector<TextureArray> arrays;
+		// Array and layer of each image, which textures may share
+		std::map<const void*, std::pair<int32_t, int32_t>> images;
+		GLint max_layers = 256;
+		glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+
+		auto addTexture = [&](const Texture& texture, int32_t& array, int32_t& layer) {
+			array = -1;
+			layer = 0;
+			if(!texture.valid)
+			{
+				return;
+			}
+			const void* image = texture.compressed ? (const void*)texture.compressed.get() : texture.data;
+			auto found = images.find(image);
+			if(found != images.end())
+			{
+				array = found->second.first;
+				layer = found->second.second;
+				return;
+			}
+			TextureArray key;
+			key.width = texture.width;
+			key.height = texture.height;
+			if(texture.compressed)
+			{
+				key.internal_format = texture.compressed->internal_format;
+				key.levels = int(texture.compressed->levels.size());
+			}
+			else
+			{
+				// Texture storage must have a sized format
+				const GLenum sized_formats[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+				key.internal_format = sized_formats[texture.n_components - 1];
+				key.levels = 1;
+				while(std::max(texture.width, texture.height) >> key.levels)
+				{
+					key.levels++;
 				}
-				else
+			}
+			for(array = 0; array < int32_t(arrays.size()); array++)
+			{
+				const TextureArray& other = arrays[array];
+				if(other.internal_format == key.internal_format && other.width == key.width
+				   && other.height == key.height && other.levels == key.levels
+				   && int(other.layers.size()) < max_layers)
+				{
+					break;
+				}
+			}
+			if(array == int32_t(arrays.size()))
+			{
+				arrays.push_back(key);
+			}
+			layer = int32_t(arrays[array].layers.size());
+			arrays[array].layers.push_back(&texture);
+			images[image] = std::make_pair(array, layer);
+		};
+		model->m_material_texture_layers.resize(model->m_materials.size());
+		for(size_t i = 0; i < model->m_materials.size(); i++)
+		{
+			const Material& material = model->m_materials[i];
+			Model::MaterialTextureLayers& layers = model->m_material_texture_layers[i];
+			addTexture(material.m_color_texture, layers.m_color_array, layers.m_color_layer);
+			addTexture(material.m_emission_texture, layers.m_emission_array, layers.m_emission_layer);
+		}
+
+		for(const TextureArray& array : arrays)
+		{
+			GLuint texture;
+			glGenTextures(1, &texture);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+			glTexStorage3D(GL_TEXTURE_2D_ARRAY, array.levels, array.internal_format, array.width,
+			               array.height, GLsizei(array.layers.size()));
+			setSamplerState(GL_TEXTURE_2D_ARRAY);
+			model->m_texture_arrays.push_back(texture);
+			model->m_texture_array_pending_layers.push_back(int32_t(array.layers.size()));
+		}
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		if(bindless)
+		{
+			model->m_texture_array_handles.assign(arrays.size(), 0);
+		}
+
+		GLint alignment;
+		glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for(size_t a = 0; a < arrays.size(); a++)
+		{
+			for(size_t i = 0; i < arrays[a].layers.size(); i++)
+			{
+				TextureArrayLayer layer = { int32_t(a), int32_t(i), arrays[a].layers[i] };
+				if(deferred_layers != nullptr)
+				{
+					deferred_layers->push_back(layer);
+					continue;
+				}
+				const Texture& source = *layer.texture;
+				glBindTexture(GL_TEXTURE_2D_ARRAY, model->m_texture_arrays[a]);
+				if(source.compressed)
 				{
-					///////////////////////////////////////////////////////
-					// Now we generate the vertices
-					///////////////////////////////////////////////////////
-					for(int j = 0; j < 3; j++)
+					const CompressedImage& image = *source.compressed;
+					for(size_t l = 0; l < image.levels.size(); l++)
 					{
-						int v = shape.mesh.indices[i * 3 + j].vertex_index;
-						model->m_positions[vertices_so_far + j] =
-						    glm::vec3(attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 0],
-						              attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 1],
-						              attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 2]);
-						if(shape.mesh.indices[i * 3 + j].normal_index == -1)
-						{
-							// No normal, use the autogenerated
-							model->m_normals[vertices_so_far + j] = glm::vec3(
-							    auto_normals[shape.mesh.indices[i * 3 + j].vertex_index]);
-						}
-						else
-						{
-							model->m_normals[vertices_so_far + j] =
-							    glm::vec3(attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 0],
-							              attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 1],
-							              attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 2]);
-						}
-						if(shape.mesh.indices[i * 3 + j].texcoord_index == -1)
-						{
-							// No UV coordinates. Use null.
-							model->m_texture_coordinates[vertices_so_far + j] = glm::vec2(0.0f);
-						}
-						else
-						{
-							model->m_texture_coordinates[vertices_so_far + j] = glm::vec2(
-							    attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 0],
-							    attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 1]);
-						}
+						const CompressedImage::Level& level = image.levels[l];
+						glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, GLint(l), 0, 0, layer.layer,
+						                          level.width, level.height, 1, image.internal_format,
+						                          GLsizei(level.size), &image.blocks[level.offset]);
 					}
-					vertices_so_far += 3;
+				}
+				else
+				{
+					uint32_t internal_format, format;
+					source.getFormat(internal_format, format);
+					glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer.layer, source.width, source.height, 1,
+					                format, GL_UNSIGNED_BYTE, source.data);
+				}
+				glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+				if(--model->m_texture_array_pending_layers[a] == 0)
+				{
+					finishTextureArray(model, layer);
 				}
 			}
-			///////////////////////////////////////////////////////////////
-			// Finalize and push this mesh to the list
-			///////////////////////////////////////////////////////////////
-			mesh.m_number_of_vertices = vertices_so_far - mesh.m_start_index;
-			model->m_meshes.push_back(mesh);
-			finished_materials[current_material_index] = true;
 		}
-		if(number_of_materials_in_shape == 1)
+		glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+	}
+} // namespace
+
+void uploadModel(Model* model, std::vector<TextureArrayLayer>* deferred_layers)
+{
+	trace::Scope scope("Upload model", model->m_filename);
+	///////////////////////////////////////////////////////////////////////
+	// Textures that have not been uploaded yet
+	///////////////////////////////////////////////////////////////////////
+	for(auto& material : model->m_materials)
+	{
+		Texture* textures[] = { &material.m_color_texture, &material.m_shininess_texture,
+			                    &material.m_metalness_texture, &material.m_fresnel_texture,
+			                    &material.m_emission_texture };
+		for(Texture* texture : textures)
 		{
-			// If there's only one material, we don't need the material name in the mesh name
-			model->m_meshes.back().m_name = shape.name;
+			if(texture->valid && texture->gl_id == 0)
+			{
+				texture->upload();
+			}
 		}
 	}
 
-	std::sort(model->m_meshes.begin(), model->m_meshes.end(),
-	          [](const Mesh& a, const Mesh& b) { return a.m_name < b.m_name; });
-
 	///////////////////////////////////////////////////////////////////////
-	// Upload to GPU
+	// Vertex array object and buffers
 	///////////////////////////////////////////////////////////////////////
+	const size_t number_of_vertices = model->m_positions.size();
 	glGenVertexArrays(1, &model->m_vaob);
 	glBindVertexArray(model->m_vaob);
 	glGenBuffers(1, &model->m_positions_bo);
 	glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
-	glBufferData(GL_ARRAY_BUFFER, model->m_positions.size() * sizeof(glm::vec3), &model->m_positions[0].x,
+	glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(glm::vec3), model->m_positions.data(),
 	             GL_STATIC_DRAW);
 	glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
 	glEnableVertexAttribArray(0);
 	glGenBuffers(1, &model->m_normals_bo);
 	glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
-	glBufferData(GL_ARRAY_BUFFER, model->m_normals.size() * sizeof(glm::vec3), &model->m_normals[0].x,
+	glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(glm::vec3), model->m_normals.data(),
 	             GL_STATIC_DRAW);
 	glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
 	glEnableVertexAttribArray(1);
 	glGenBuffers(1, &model->m_texture_coordinates_bo);
 	glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
-	glBufferData(GL_ARRAY_BUFFER, model->m_texture_coordinates.size() * sizeof(glm::vec2),
-	             &model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(glm::vec2), model->m_texture_coordinates.data(),
+	             GL_STATIC_DRAW);
 	glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
 	glEnableVertexAttribArray(2);
+	glGenBuffers(1, &model->m_indices_bo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, model->m_indices.size() * sizeof(uint32_t), model->m_indices.data(),
+	             GL_STATIC_DRAW);
+	if(multiDrawSupported())
+	{
+		// Attribute 3 is the index of the material, which render() passes as
+		// the base instance of each draw
+		std::vector<uint32_t> material_indices(std::max(model->m_materials.size(), size_t(1)));
+		for(size_t i = 0; i < material_indices.size(); i++)
+		{
+			material_indices[i] = uint32_t(i);
+		}
+		glGenBuffers(1, &model->m_material_indices_bo);
+		glBindBuffer(GL_ARRAY_BUFFER, model->m_material_indices_bo);
+		glBufferData(GL_ARRAY_BUFFER, material_indices.size() * sizeof(uint32_t), material_indices.data(),
+		             GL_STATIC_DRAW);
+		glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, 0, 0);
+		glVertexAttribDivisor(3, 1);
+		glEnableVertexAttribArray(3);
+		glGenBuffers(1, &model->m_draw_commands_bo);
+	}
 
+	// The vertex array object keeps the element array buffer binding
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-	std::cout << "done.\n";
+	if(materialTextureMode() != separate_textures)
+	{
+		createTextureArrays(model, materialTextureMode() == bindless_texture_arrays, deferred_layers);
+	}
+	updateMaterialUniforms(model);
+}
+
+void textureArrayLayerUploaded(Model* model, const TextureArrayLayer& layer)
+{
+	if(--model->m_texture_array_pending_layers[layer.array] == 0)
+	{
+		finishTextureArray(model, layer);
+		updateMaterialUniforms(model);
+	}
+}
+
+void updateMaterialUniforms(Model* model)
+{
+	std::vector<MaterialStorage> materials(std::max(model->m_materials.size(), size_t(1)));
+	for(size_t i = 0; i < model->m_materials.size(); i++)
+	{
+		const Material& material = model->m_materials[i];
+		MaterialUniforms& block = materials[i].uniforms;
+		block.color = material.m_color;
+		block.metalness = material.m_metalness;
+		block.emission = material.m_emission;
+		block.fresnel = material.m_fresnel;
+		block.shininess = material.m_shininess;
+		block.has_color_texture = material.m_color_texture.valid;
+		block.has_emission_texture = material.m_emission_texture.valid;
+		// render() does not bind shininess textures
+		block.has_shininess_texture = 0;
+		if(i < model->m_material_texture_layers.size())
+		{
+			const Model::MaterialTextureLayers& layers = model->m_material_texture_layers[i];
+			materials[i].color_layer = layers.m_color_layer;
+			materials[i].emission_layer = layers.m_emission_layer;
+			if(!model->m_texture_array_handles.empty() && layers.m_color_array >= 0)
+			{
+				materials[i].color_texture_array = model->m_texture_array_handles[layers.m_color_array];
+			}
+			if(!model->m_texture_array_handles.empty() && layers.m_emission_array >= 0)
+			{
+				materials[i].emission_texture_array = model->m_texture_array_handles[layers.m_emission_array];
+			}
+		}
+	}
+
+	// Each block must start at a multiple of the alignment to be bound
+	GLint alignment = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	alignment = std::max(alignment, 1);
+	const size_t stride = (sizeof(MaterialUniforms) + alignment - 1) / alignment * alignment;
+	model->m_material_uniforms_stride = uint32_t(stride);
+	std::vector<uint8_t> blocks(materials.size() * stride);
+	for(size_t i = 0; i < materials.size(); i++)
+	{
+		memcpy(&blocks[i * stride], &materials[i].uniforms, sizeof(MaterialUniforms));
+	}
+	if(model->m_material_uniforms_bo == 0)
+	{
+		glGenBuffers(1, &model->m_material_uniforms_bo);
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, model->m_material_uniforms_bo);
+	glBufferData(GL_UNIFORM_BUFFER, blocks.size(), blocks.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	if(!multiDrawSupported())
+	{
+		return;
+	}
+	// Only the storage block uses the texture arrays
+	for(size_t i = 0; i < model->m_material_texture_layers.size(); i++)
+	{
+		const Model::MaterialTextureLayers& layers = model->m_material_texture_layers[i];
+		if(layers.m_color_array >= 0 && model->m_texture_array_pending_layers[layers.m_color_array] > 0)
+		{
+			materials[i].uniforms.has_color_texture = 0;
+		}
+		if(layers.m_emission_array >= 0 && model->m_texture_array_pending_layers[layers.m_emission_array] > 0)
+		{
+			materials[i].uniforms.has_emission_texture = 0;
+		}
+	}
+	if(model->m_materials_storage_bo == 0)
+	{
+		glGenBuffers(1, &model->m_materials_storage_bo);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, model->m_materials_storage_bo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, materials.size() * sizeof(MaterialStorage), materials.data(),
+	             GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+Model* loadModelFromOBJ(std::string path)
+{
+	Model* model = readModelFromOBJ(path);
+	uploadModel(model);
 	return model;
 }
 
@@ -443,29 +2091,32 @@ void saveModelToOBJ(Model* model, std::string filename)
 		obj_file << "o " << mesh.m_name << "\n";
 		obj_file << "g " << mesh.m_name << "\n";
 		obj_file << "usemtl " << model->m_materials[mesh.m_material_idx].m_name << "\n";
-		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+		for(uint32_t i = mesh.m_base_vertex; i < mesh.m_base_vertex + mesh.m_number_of_vertices; i++)
 		{
 			obj_file << "v " << model->m_positions[i].x << " " << model->m_positions[i].y << " "
 			         << model->m_positions[i].z << "\n";
 		}
-		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+		for(uint32_t i = mesh.m_base_vertex; i < mesh.m_base_vertex + mesh.m_number_of_vertices; i++)
 		{
 			obj_file << "vn " << model->m_normals[i].x << " " << model->m_normals[i].y << " "
 			         << model->m_normals[i].z << "\n";
 		}
-		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+		for(uint32_t i = mesh.m_base_vertex; i < mesh.m_base_vertex + mesh.m_number_of_vertices; i++)
 		{
 			obj_file << "vt " << model->m_texture_coordinates[i].x << " " << model->m_texture_coordinates[i].y
 			         << "\n";
 		}
-		int number_of_faces = mesh.m_number_of_vertices / 3;
-		for(int i = 0; i < number_of_faces; i++)
+		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_indices; i += 3)
 		{
-			obj_file << "f " << vertex_counter << "/" << vertex_counter << "/" << vertex_counter << " "
-			         << vertex_counter + 1 << "/" << vertex_counter + 1 << "/" << vertex_counter + 1 << " "
-			         << vertex_counter + 2 << "/" << vertex_counter + 2 << "/" << vertex_counter + 2 << "\n";
-			vertex_counter += 3;
+			obj_file << "f";
+			for(uint32_t j = 0; j < 3; j++)
+			{
+				int index = vertex_counter + int(model->m_indices[i + j]);
+				obj_file << " " << index << "/" << index << "/" << index;
+			}
+			obj_file << "\n";
 		}
+		vertex_counter += int(mesh.m_number_of_vertices);
 	}
 }
 
@@ -478,76 +2129,449 @@ void freeModel(Model* model)
 		delete model;
 }
 
+LodSettings lod_settings;
+MultiDrawSettings multi_draw_settings;
+MaterialTextureSettings material_texture_settings;
+RenderStatistics render_statistics;
+
+bool multiDrawSupported()
+{
+	return GLEW_VERSION_4_3
+	       || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance && GLEW_ARB_shader_storage_buffer_object
+	           && GLEW_ARB_program_interface_query);
+}
+
+MaterialTextureMode materialTextureMode()
+{
+	// The arrays are allocated with glTexStorage3D
+	if(!multiDrawSupported() || !(GLEW_VERSION_4_2 || GLEW_ARB_texture_storage))
+	{
+		return separate_textures;
+	}
+	if(material_texture_settings.mode == bindless_texture_arrays && !GLEW_ARB_bindless_texture)
+	{
+		return texture_arrays;
+	}
+	return material_texture_settings.mode;
+}
+
+namespace
+{
+	///////////////////////////////////////////////////////////////////////
+	// Picks the levels of detail to draw. An error of one unit in model
+	// space, at a view depth of one, covers m_pixels_per_unit pixels.
+	///////////////////////////////////////////////////////////////////////
+	class LodSelector
+	{
+	public:
+		LodSelector(const glm::mat4& modelViewMatrix, const glm::mat4& projectionMatrix)
+		    : m_model_view_matrix(modelViewMatrix)
+		    , m_perspective(projectionMatrix[2][3] != 0.0f)
+		{
+			GLint viewport[4];
+			glGetIntegerv(GL_VIEWPORT, viewport);
+			m_scale = std::max(glm::length(glm::vec3(modelViewMatrix[0])),
+			                   std::max(glm::length(glm::vec3(modelViewMatrix[1])),
+			                            glm::length(glm::vec3(modelViewMatrix[2]))));
+			m_pixels_per_unit = m_scale * projectionMatrix[1][1] * 0.5f * float(viewport[3]);
+		}
+		// The level of detail to draw, or nullptr for the full mesh
+		const Mesh::Lod* select(const Mesh& mesh) const
+		{
+			float depth = 1.0f;
+			if(m_perspective)
+			{
+				glm::vec4 center = m_model_view_matrix * glm::vec4(mesh.m_bounding_sphere_center, 1.0f);
+				// The nearest point of the bounding sphere, the camera may be inside it
+				depth = -center.z - m_scale * mesh.m_bounding_sphere_radius;
+				if(depth <= 0.0f)
+				{
+					return nullptr;
+				}
+			}
+			const Mesh::Lod* selected = nullptr;
+			for(const Mesh::Lod& lod : mesh.m_lods)
+			{
+				if(lod.m_error * m_pixels_per_unit > lod_settings.error_threshold * depth)
+				{
+					break;
+				}
+				selected = &lod;
+			}
+			return selected;
+		}
+
+	private:
+		glm::mat4 m_model_view_matrix;
+		bool m_perspective;
+		float m_scale;
+		float m_pixels_per_unit;
+	};
+
+	// Where to draw a mesh from, or false if it is outside the view frustum
+	bool selectIndices(const Mesh& mesh,
+	                   const Frustum* frustum,
+	                   const LodSelector* lod_selector,
+	                   uint32_t& start_index,
+	                   uint32_t& number_of_indices)
+	{
+		if(frustum != nullptr && !frustum->intersectsBox(mesh.m_aabb_min, mesh.m_aabb_max))
+		{
+			render_statistics.culled_meshes++;
+			return false;
+		}
+		start_index = mesh.m_start_index;
+		number_of_indices = mesh.m_number_of_indices;
+		const Mesh::Lod* lod = lod_selector != nullptr ? lod_selector->select(mesh) : nullptr;
+		if(lod != nullptr)
+		{
+			start_index = lod->m_start_index;
+			number_of_indices = lod->m_number_of_indices;
+		}
+		render_statistics.meshes++;
+		render_statistics.triangles += number_of_indices / 3;
+		return true;
+	}
+
+	// Whether any mesh of the model may be in the view frustum
+	bool modelInView(const Model* model, const Frustum* frustum)
+	{
+		if(frustum != nullptr && !frustum->intersectsSphere(model->m_bounding_sphere_center,
+		                                                    model->m_bounding_sphere_radius))
+		{
+			render_statistics.culled_meshes += model->m_meshes.size();
+			return false;
+		}
+		return true;
+	}
+} // namespace
+
+MaterialSource materialSource(const Model* model, uint32_t program, const bool submitMaterials)
+{
+	if(!submitMaterials)
+	{
+		return no_materials;
+	}
+	if(model->m_materials_storage_bo != 0 && hasStorageBlock(program, "Materials"))
+	{
+		return materials_from_storage;
+	}
+	if(hasUniformBlock(program, "MaterialUniforms"))
+	{
+		return materials_from_block;
+	}
+	return materials_from_uniforms;
+}
+
+void bindMaterials(const Model* model, uint32_t program, MaterialSource source)
+{
+	if(source == no_materials)
+	{
+		return;
+	}
+	setUniform(program, "color_texture", 0);
+	setUniform(program, "emission_texture", 5);
+	if(source == materials_from_storage)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, materials_storage_binding, model->m_materials_storage_bo);
+	}
+}
+
+void bindMaterial(const Model* model, uint32_t material_idx, uint32_t program, MaterialSource source)
+{
+	if(source == materials_from_block)
+	{
+		glBindBufferRange(GL_UNIFORM_BUFFER, material_uniforms_binding, model->m_material_uniforms_bo,
+		                  GLintptr(material_idx) * model->m_material_uniforms_stride,
+		                  sizeof(MaterialUniforms));
+	}
+	else if(source == materials_from_uniforms)
+	{
+		const Material& material = model->m_materials[material_idx];
+		setUniform(program, "has_color_texture", material.m_color_texture.valid);
+		setUniform(program, "has_emission_texture", material.m_emission_texture.valid);
+
+		setUniform(program, "material_color", material.m_color);
+		setUniform(program, "material_metalness", material.m_metalness);
+		setUniform(program, "material_fresnel", material.m_fresnel);
+		setUniform(program, "material_shininess", material.m_shininess);
+		setUniform(program, "material_emission", material.m_emission);
+
+		// Actually unused in the labs
+		/*
+		setUniform(program, "has_metalness_texture", material.m_metalness_texture.valid);
+		setUniform(program, "has_fresnel_texture", material.m_fresnel_texture.valid);
+		setUniform(program, "has_shininess_texture", material.m_shininess_texture.valid);
+		*/
+	}
+	else
+	{
+		// The storage block is indexed by the base instance of the draw
+		return;
+	}
+	render_statistics.material_changes++;
+}
+
 ///////////////////////////////////////////////////////////////////////
-// Loop through all Meshes in the Model and render them
+// Bind the textures of a material. With the Materials storage block,
+// these are the texture arrays the model may have, or nothing when the
+// arrays are bindless.
 ///////////////////////////////////////////////////////////////////////
-void render(const Model* model, const bool submitMaterials)
+void bindMaterialTextures(const Model* model, uint32_t material_idx, MaterialSource source)
+{
+	if(source == materials_from_storage && !model->m_material_texture_layers.empty())
+	{
+		const Model::MaterialTextureLayers& layers = model->m_material_texture_layers[material_idx];
+		if(model->m_texture_array_handles.empty() && layers.m_color_array >= 0)
+		{
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, model->m_texture_arrays[layers.m_color_array]);
+			render_statistics.texture_binds++;
+		}
+		if(model->m_texture_array_handles.empty() && layers.m_emission_array >= 0)
+		{
+			glActiveTexture(GL_TEXTURE5);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, model->m_texture_arrays[layers.m_emission_array]);
+			render_statistics.texture_binds++;
+		}
+		glActiveTexture(GL_TEXTURE0);
+		return;
+	}
+	const Material& material = model->m_materials[material_idx];
+	if(material.m_color_texture.valid)
+	{
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, material.m_color_texture.gl_id);
+		render_statistics.texture_binds++;
+	}
+	// Actually unused in the labs
+	/*
+	if ( material.m_metalness_texture.valid )
+	{
+		glActiveTexture( GL_TEXTURE2 );
+		glBindTexture( GL_TEXTURE_2D, material.m_metalness_texture.gl_id );
+	}
+	if ( material.m_fresnel_texture.valid )
+	{
+		glActiveTexture( GL_TEXTURE3 );
+		glBindTexture( GL_TEXTURE_2D, material.m_fresnel_texture.gl_id );
+	}
+	if ( material.m_shininess_texture.valid )
+	{
+		glActiveTexture( GL_TEXTURE4 );
+		glBindTexture( GL_TEXTURE_2D, material.m_shininess_texture.gl_id );
+	}
+	*/
+	if(material.m_emission_texture.valid)
+	{
+		glActiveTexture(GL_TEXTURE5);
+		glBindTexture(GL_TEXTURE_2D, material.m_emission_texture.gl_id);
+		render_statistics.texture_binds++;
+	}
+	glActiveTexture(GL_TEXTURE0);
+}
+
+uint64_t materialTexturesKey(const Model* model, uint32_t material_idx, MaterialSource source)
 {
-	GLint current_program = 0;
-	glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
+	uint64_t color = 0, emission = 0;
+	if(source == materials_from_storage && !model->m_material_texture_layers.empty())
+	{
+		const Model::MaterialTextureLayers& layers = model->m_material_texture_layers[material_idx];
+		if(model->m_texture_array_handles.empty() && layers.m_color_array >= 0)
+		{
+			color = model->m_texture_arrays[layers.m_color_array];
+		}
+		if(model->m_texture_array_handles.empty() && layers.m_emission_array >= 0)
+		{
+			emission = model->m_texture_arrays[layers.m_emission_array];
+		}
+	}
+	else if(source != no_materials)
+	{
+		const Material& material = model->m_materials[material_idx];
+		color = material.m_color_texture.valid ? material.m_color_texture.gl_id : 0;
+		emission = material.m_emission_texture.valid ? material.m_emission_texture.gl_id : 0;
+	}
+	return color << 32 | emission;
+}
 
-	glBindVertexArray(model->m_vaob);
-	for(auto& mesh : model->m_meshes)
+void selectMeshes(const Model* model,
+                  const glm::mat4& modelViewMatrix,
+                  const glm::mat4& projectionMatrix,
+                  std::vector<MeshDraw>& draws)
+{
+	Frustum frustum(projectionMatrix * modelViewMatrix);
+	if(!modelInView(model, &frustum))
+	{
+		return;
+	}
+	LodSelector lod_selector(modelViewMatrix, projectionMatrix);
+	for(uint32_t i = 0; i < uint32_t(model->m_meshes.size()); i++)
+	{
+		MeshDraw draw;
+		draw.mesh = i;
+		if(selectIndices(model->m_meshes[i], &frustum, lod_settings.enabled ? &lod_selector : nullptr,
+		                 draw.start_index, draw.number_of_indices))
+		{
+			draws.push_back(draw);
+		}
+	}
+}
+
+namespace
+{
+	///////////////////////////////////////////////////////////////////////
+	// Draw the meshes with one glMultiDrawElementsIndirect() for each set
+	// of textures. The base instance of each draw is the index of the
+	// material, which the shader looks up in the Materials storage block.
+	///////////////////////////////////////////////////////////////////////
+	void multiDrawMeshes(const Model* model,
+	                     MaterialSource source,
+	                     const Frustum* frustum,
+	                     const LodSelector* lod_selector)
 	{
-		if(submitMaterials)
+		struct Draw
+		{
+			// As glMultiDrawElementsIndirect() reads it
+			GLuint count;
+			GLuint instance_count;
+			GLuint first_index;
+			GLint base_vertex;
+			GLuint base_instance;
+			// See materialTexturesKey()
+			uint64_t textures;
+		};
+		// Only used on the thread with the GL context
+		static std::vector<Draw> draws;
+		draws.clear();
+		for(const Mesh& mesh : model->m_meshes)
+		{
+			Draw draw;
+			if(!selectIndices(mesh, frustum, lod_selector, draw.first_index, draw.count))
+			{
+				continue;
+			}
+			draw.instance_count = 1;
+			draw.base_vertex = GLint(mesh.m_base_vertex);
+			draw.base_instance = mesh.m_material_idx;
+			draw.textures = materialTexturesKey(model, mesh.m_material_idx, source);
+			draws.push_back(draw);
+		}
+		if(draws.empty())
 		{
-			const Material& material = model->m_materials[mesh.m_material_idx];
+			return;
+		}
+		std::stable_sort(draws.begin(), draws.end(),
+		                 [](const Draw& a, const Draw& b) { return a.textures < b.textures; });
 
-			bool has_color_texture = material.m_color_texture.valid;
-			bool has_metalness_texture = material.m_metalness_texture.valid;
-			bool has_fresnel_texture = material.m_fresnel_texture.valid;
-			bool has_shininess_texture = material.m_shininess_texture.valid;
-			bool has_emission_texture = material.m_emission_texture.valid;
-			if(has_color_texture)
+		// The commands are read in place, skipping the textures
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, model->m_draw_commands_bo);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, draws.size() * sizeof(Draw), draws.data(), GL_STREAM_DRAW);
+		glBindVertexArray(model->m_vaob);
+		render_statistics.vertex_array_binds++;
+		for(size_t first = 0; first < draws.size();)
+		{
+			size_t end = first + 1;
+			while(end < draws.size() && draws[end].textures == draws[first].textures)
 			{
-				glActiveTexture(GL_TEXTURE0);
-				glBindTexture(GL_TEXTURE_2D, material.m_color_texture.gl_id);
-				setUniformSlow(current_program, "color_texture", 0);
+				end++;
 			}
-			// Actually unused in the labs
-			/*
-			if ( has_metalness_texture )
+			if(source != no_materials)
 			{
-				glActiveTexture( GL_TEXTURE2 );
-				glBindTexture( GL_TEXTURE_2D, material.m_metalness_texture.gl_id );
+				bindMaterialTextures(model, draws[first].base_instance, source);
 			}
-			if ( has_fresnel_texture )
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(first * sizeof(Draw)),
+			                            GLsizei(end - first), sizeof(Draw));
+			render_statistics.draw_calls++;
+			first = end;
+		}
+		glBindVertexArray(0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+
+	void renderMeshes(const Model* model,
+	                  const bool submitMaterials,
+	                  const Frustum* frustum,
+	                  const LodSelector* lod_selector)
+	{
+		if(!modelInView(model, frustum))
+		{
+			return;
+		}
+
+		GLint current_program = 0;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
+		const MaterialSource source = materialSource(model, GLuint(current_program), submitMaterials);
+		bindMaterials(model, GLuint(current_program), source);
+
+		if(multi_draw_settings.enabled && model->m_draw_commands_bo != 0
+		   && (source == no_materials || source == materials_from_storage))
+		{
+			multiDrawMeshes(model, source, frustum, lod_selector);
+			return;
+		}
+
+		glBindVertexArray(model->m_vaob);
+		render_statistics.vertex_array_binds++;
+		uint32_t current_material = UINT32_MAX;
+		for(auto& mesh : model->m_meshes)
+		{
+			uint32_t start_index, number_of_indices;
+			if(!selectIndices(mesh, frustum, lod_selector, start_index, number_of_indices))
 			{
-				glActiveTexture( GL_TEXTURE3 );
-				glBindTexture( GL_TEXTURE_2D, material.m_fresnel_texture.gl_id );
+				continue;
 			}
-			if ( has_shininess_texture )
+			if(source != no_materials && mesh.m_material_idx != current_material)
 			{
-				glActiveTexture( GL_TEXTURE4 );
-				glBindTexture( GL_TEXTURE_2D, material.m_shininess_texture.gl_id );
+				current_material = mesh.m_material_idx;
+				bindMaterialTextures(model, mesh.m_material_idx, source);
+				bindMaterial(model, mesh.m_material_idx, GLuint(current_program), source);
 			}
-			*/
-			if(has_emission_texture)
+			if(source == materials_from_storage)
 			{
-				glActiveTexture(GL_TEXTURE5);
-				glBindTexture(GL_TEXTURE_2D, material.m_emission_texture.gl_id);
-				setUniformSlow(current_program, "emission_texture", 5);
+				// The base instance is the index of the material, as in multiDrawMeshes()
+				glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, GLsizei(number_of_indices),
+				                                              GL_UNSIGNED_INT,
+				                                              (void*)(start_index * sizeof(uint32_t)), 1,
+				                                              GLint(mesh.m_base_vertex), mesh.m_material_idx);
 			}
-			glActiveTexture(GL_TEXTURE0);
+			else
+			{
+				glDrawElementsBaseVertex(GL_TRIANGLES, GLsizei(number_of_indices), GL_UNSIGNED_INT,
+				                         (void*)(start_index * sizeof(uint32_t)), GLint(mesh.m_base_vertex));
+			}
+			render_statistics.draw_calls++;
+		}
+		glBindVertexArray(0);
+	}
+} // namespace
 
-			setUniformSlow(current_program, "has_color_texture", has_color_texture);
-			setUniformSlow(current_program, "has_emission_texture", has_emission_texture);
+///////////////////////////////////////////////////////////////////////
+// Loop through all Meshes in the Model and render them
+///////////////////////////////////////////////////////////////////////
+void render(const Model* model, const bool submitMaterials)
+{
+	renderMeshes(model, submitMaterials, nullptr, nullptr);
+}
 
-			setUniformSlow(current_program, "material_color", material.m_color);
-			setUniformSlow(current_program, "material_metalness", material.m_metalness);
-			setUniformSlow(current_program, "material_fresnel", material.m_fresnel);
-			setUniformSlow(current_program, "material_shininess", material.m_shininess);
-			setUniformSlow(current_program, "material_emission", material.m_emission);
+void render(const Model* model, const glm::mat4& modelViewProjectionMatrix, const bool submitMaterials)
+{
+	Frustum frustum(modelViewProjectionMatrix);
+	renderMeshes(model, submitMaterials, &frustum, nullptr);
+}
 
-			// Actually unused in the labs
-			/*
-			setUniformSlow( current_program, "has_metalness_texture", has_metalness_texture );
-			setUniformSlow( current_program, "has_fresnel_texture", has_fresnel_texture );
-			setUniformSlow( current_program, "has_shininess_texture", has_shininess_texture );
-			*/
-		}
-		glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
+void render(const Model* model,
+            const glm::mat4& modelViewMatrix,
+            const glm::mat4& projectionMatrix,
+            const bool submitMaterials)
+{
+	Frustum frustum(projectionMatrix * modelViewMatrix);
+	if(!lod_settings.enabled)
+	{
+		renderMeshes(model, submitMaterials, &frustum, nullptr);
+		return;
 	}
-	glBindVertexArray(0);
+	LodSelector lod_selector(modelViewMatrix, projectionMatrix);
+	renderMeshes(model, submitMaterials, &frustum, &lod_selector);
 }
 } // namespace labhelper
@@ -7,6 +7,8 @@
 
 namespace labhelper
 {
+struct CompressedImage;
+
 struct Texture
 {
 	bool valid = false;
@@ -15,10 +17,24 @@ struct Texture
 	std::string filename;
 	std::string directory;
 	int width, height;
-	uint8_t* data;
+	// Decoded pixels, or null if the texture is block compressed
+	uint8_t* data = nullptr;
+	std::shared_ptr<const CompressedImage> compressed;
 	uint8_t n_components = 4;
 
 	bool load(const std::string& directory, const std::string& filename, int nof_components);
+	// load() in two steps. read() decodes the image and does not need a GL
+	// context, upload() creates the GL texture from `data` or `compressed`.
+	// Textures with the same image share the pixels and the GL texture.
+	bool read(const std::string& directory, const std::string& filename, int nof_components);
+	void upload();
+	// Set gl_id to the GL texture of the image, creating it if this is the
+	// first texture to use it. Returns true if the image must be uploaded.
+	bool createTexture();
+	// GL formats and sampler state used by upload()
+	void getFormat(uint32_t& internal_format, uint32_t& format) const;
+	void setSamplerState() const;
+	// Only for textures that are not compressed
 	glm::vec4 sample(glm::vec2 uv) const;
 	void free();
 };
@@ -51,9 +67,27 @@ struct Mesh
 {
 	std::string m_name;
 	uint32_t m_material_idx;
-	// Where this Mesh's vertices start
+	// Where this Mesh's indices start
 	uint32_t m_start_index;
+	uint32_t m_number_of_indices;
+	// Where this Mesh's vertices start. Indices are relative to this.
+	uint32_t m_base_vertex;
 	uint32_t m_number_of_vertices;
+	// Bounds of the vertices, in model space
+	glm::vec3 m_aabb_min;
+	glm::vec3 m_aabb_max;
+	glm::vec3 m_bounding_sphere_center;
+	float m_bounding_sphere_radius;
+	// Simplified versions of the mesh, each with about half the triangles
+	// of the one before. They index the same vertices as the mesh. m_error
+	// is how far, roughly, the simplified surface is from the original.
+	struct Lod
+	{
+		uint32_t m_start_index;
+		uint32_t m_number_of_indices;
+		float m_error;
+	};
+	std::vector<Lod> m_lods;
 };
 
 class Model
@@ -68,21 +102,202 @@ public:
 	std::vector<Material> m_materials;
 	// A model will contain one or more "Meshes"
 	std::vector<Mesh> m_meshes;
+	// Bounds of all meshes, in model space
+	glm::vec3 m_aabb_min = glm::vec3(0.0f);
+	glm::vec3 m_aabb_max = glm::vec3(0.0f);
+	glm::vec3 m_bounding_sphere_center = glm::vec3(0.0f);
+	float m_bounding_sphere_radius = 0.0f;
 	// Buffers on CPU
 	std::vector<glm::vec3> m_positions;
 	std::vector<glm::vec3> m_normals;
 	std::vector<glm::vec2> m_texture_coordinates;
+	// Three per triangle. Each mesh's vertices are welded and its triangles
+	// ordered for the vertex cache and overdraw (see mesh_optimization.h).
+	// The levels of detail follow the triangles of their mesh.
+	std::vector<uint32_t> m_indices;
 	// Buffers on GPU
-	uint32_t m_positions_bo;
-	uint32_t m_normals_bo;
-	uint32_t m_texture_coordinates_bo;
+	uint32_t m_positions_bo = 0;
+	uint32_t m_normals_bo = 0;
+	uint32_t m_texture_coordinates_bo = 0;
+	uint32_t m_indices_bo = 0;
+	// A MaterialUniforms block (see uniforms.h) for each material, in order,
+	// m_material_uniforms_stride bytes apart
+	uint32_t m_material_uniforms_bo = 0;
+	uint32_t m_material_uniforms_stride = 0;
+	// Only with multiDrawSupported(): the same blocks without gaps, for the
+	// Materials storage block, the index of each material as an instanced
+	// attribute, and the commands of the last multi-draw
+	uint32_t m_materials_storage_bo = 0;
+	uint32_t m_material_indices_bo = 0;
+	uint32_t m_draw_commands_bo = 0;
+	// Unless materialTextureMode() is separate_textures when the model is
+	// uploaded: the color and emission textures of the materials as layers
+	// of arrays of textures with the same size and format, and with
+	// bindless_texture_arrays the resident handles of the arrays
+	std::vector<uint32_t> m_texture_arrays;
+	std::vector<uint64_t> m_texture_array_handles;
+	// Layers of each array not copied into it yet. Materials are drawn
+	// without the textures of an array, and its handle is 0, until all
+	// of them are in, see uploadModel().
+	std::vector<int32_t> m_texture_array_pending_layers;
+	struct MaterialTextureLayers
+	{
+		// Index into m_texture_arrays, or -1 without a texture
+		int32_t m_color_array;
+		int32_t m_color_layer;
+		int32_t m_emission_array;
+		int32_t m_emission_layer;
+	};
+	// One for each material
+	std::vector<MaterialTextureLayers> m_material_texture_layers;
 	// Vertex Array Object
-	uint32_t m_vaob;
+	uint32_t m_vaob = 0;
 };
 
 Model* loadModelFromOBJ(std::string filename);
+// loadModelFromOBJ() in two steps. readModelFromOBJ() parses the model and
+// decodes its textures without using GL, so it can run on any thread.
+// uploadModel() creates the GL buffers and any textures not yet uploaded.
+Model* readModelFromOBJ(std::string filename);
+// A layer of one of the texture arrays of a model, and the texture to copy into it
+struct TextureArrayLayer
+{
+	// Index into Model::m_texture_arrays
+	int32_t array;
+	int32_t layer;
+	const Texture* texture;
+};
+// uploadModel() copies the textures into the texture arrays of the model
+// right away, unless given deferred_layers. It then leaves the arrays
+// empty and lists their layers there, for the caller to copy when it
+// suits it, and to pass to textureArrayLayerUploaded() once copied.
+void uploadModel(Model* model, std::vector<TextureArrayLayer>* deferred_layers = nullptr);
+void textureArrayLayerUploaded(Model* model, const TextureArrayLayer& layer);
+// Copy the materials to the uniform buffer that render() binds for programs
+// with a MaterialUniforms block. Call after changing m_materials.
+void updateMaterialUniforms(Model* model);
 void saveModelToOBJ(Model* model, std::string filename);
 void saveModelMaterialsToMTL(Model* model, std::string filename);
 void freeModel(Model* model);
+// Materials are set with the Materials storage block if the current program
+// has one, else with the MaterialUniforms block if it has that, and with
+// separate uniforms (material_color etc.) otherwise. See uniforms.h.
 void render(const Model* model, const bool submitMaterials = true);
+// Skip the meshes that are outside the view frustum
+void render(const Model* model,
+            const glm::mat4& modelViewProjectionMatrix,
+            const bool submitMaterials = true);
+// Skip the meshes that are outside the view frustum, and draw the others
+// at the coarsest level of detail whose error is at most
+// lod_settings.error_threshold pixels on screen. Uses the current viewport.
+void render(const Model* model,
+            const glm::mat4& modelViewMatrix,
+            const glm::mat4& projectionMatrix,
+            const bool submitMaterials = true);
+
+struct LodSettings
+{
+	// When disabled, render() always draws the full meshes
+	bool enabled = true;
+	// In pixels
+	float error_threshold = 1.0f;
+};
+extern LodSettings lod_settings;
+
+// With GL 4.3, render() draws all meshes with the same textures with one
+// glMultiDrawElementsIndirect(), when the program reads the materials from
+// the Materials storage block (or materials are not submitted). The index
+// of the material is the base instance of the draw, and vertex attribute 3.
+bool multiDrawSupported();
+
+struct MultiDrawSettings
+{
+	// When disabled, or not supported, render() draws each mesh on its own
+	bool enabled = true;
+};
+extern MultiDrawSettings multi_draw_settings;
+
+// How shaders with the Materials storage block find the textures of the
+// materials. With texture arrays, meshes whose textures are in the same
+// arrays can share a multi-draw although their textures differ. With
+// bindless handles, no textures are bound and all meshes of a model share
+// one multi-draw. Each texture array is an extra copy of the textures.
+enum MaterialTextureMode
+{
+	// color_texture and emission_texture are sampler2D
+	separate_textures,
+	// color_texture and emission_texture are sampler2DArray, the layers are
+	// in the storage block
+	texture_arrays,
+	// The storage block has handles of sampler2DArray (ARB_bindless_texture)
+	bindless_texture_arrays,
+};
+struct MaterialTextureSettings
+{
+	// Used for models uploaded after it is set, so set it before loading
+	// models, and load shaders to match materialTextureMode()
+	MaterialTextureMode mode = separate_textures;
+};
+extern MaterialTextureSettings material_texture_settings;
+// The mode that is used: falls back to texture_arrays without bindless
+// textures, and to separate_textures without multiDrawSupported() or
+// texture storage (GL 4.2)
+MaterialTextureMode materialTextureMode();
+
+// What render() has drawn. Reset once per frame to count per frame.
+struct RenderStatistics
+{
+	// A multi-draw counts as one draw call
+	size_t draw_calls = 0;
+	size_t meshes = 0;
+	size_t triangles = 0;
+	// Meshes not drawn because they are outside the view frustum
+	size_t culled_meshes = 0;
+	// State set between draws. Programs are only changed by RenderQueue.
+	size_t program_changes = 0;
+	size_t vertex_array_binds = 0;
+	size_t material_changes = 0;
+	size_t texture_binds = 0;
+};
+extern RenderStatistics render_statistics;
+
+///////////////////////////////////////////////////////////////////////////////
+// The steps of render(), for drawing meshes in another order (see
+// render_queue.h). All count what they do in render_statistics.
+///////////////////////////////////////////////////////////////////////////////
+enum MaterialSource
+{
+	// Materials are not submitted
+	no_materials,
+	// The Materials storage block, indexed by the base instance of the draw
+	materials_from_storage,
+	// The MaterialUniforms block
+	materials_from_block,
+	// Separate uniforms, material_color etc.
+	materials_from_uniforms,
+};
+// How render() would give the materials of the model to the program
+MaterialSource materialSource(const Model* model, uint32_t program, const bool submitMaterials);
+// Set the samplers of the current program, and bind the storage block of
+// the model. Once for each model and program, before the materials.
+void bindMaterials(const Model* model, uint32_t program, MaterialSource source);
+// Set a material, except for its textures
+void bindMaterial(const Model* model, uint32_t material_idx, uint32_t program, MaterialSource source);
+void bindMaterialTextures(const Model* model, uint32_t material_idx, MaterialSource source);
+// Materials with the same key bind the same textures
+uint64_t materialTexturesKey(const Model* model, uint32_t material_idx, MaterialSource source);
+
+struct MeshDraw
+{
+	uint32_t mesh;
+	// The indices of the level of detail
+	uint32_t start_index;
+	uint32_t number_of_indices;
+};
+// Append the meshes that render(model, modelViewMatrix, projectionMatrix)
+// would draw to draws
+void selectMeshes(const Model* model,
+                  const glm::mat4& modelViewMatrix,
+                  const glm::mat4& projectionMatrix,
+                  std::vector<MeshDraw>& draws);
 } // namespace labhelper
\ No newline at end of file
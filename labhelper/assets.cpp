@@ -0,0 +1,499 @@
+#include "assets.h"
+#include "Model.h"
+#include "texture_compression.h"
+#include "labhelper.h"
+#include "trace.h"
+#include <stb_image.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace labhelper
+{
+namespace assets
+{
+	namespace
+	{
+		///////////////////////////////////////////////////////////////////////
+		// A texture waiting to be uploaded. Each level holds on to its
+		// decoded pixels until the upload is done.
+		///////////////////////////////////////////////////////////////////////
+		struct Level
+		{
+			GLint level;
+			int width, height;
+			std::shared_ptr<void> pixels;
+			size_t size;
+		};
+
+		struct Upload
+		{
+			GLuint texture;
+			GLenum internal_format, format, type;
+			// Levels are blocks of `internal_format` rather than pixels
+			bool compressed = false;
+			std::vector<Level> levels;
+			// glGenerateMipmap() is called after uploading this level, if any
+			int generate_mipmaps_after;
+			// Or into a layer of the storage of a texture array
+			GLenum target = GL_TEXTURE_2D;
+			GLint layer = 0;
+			// Called once all levels are uploaded, if set
+			std::function<void()> done;
+		};
+
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable job_added;
+		bool stopping = false;
+		// Run on the workers
+		std::deque<std::function<void()>> jobs;
+		// Run on the GL thread by update()
+		std::deque<std::function<void()>> finished;
+		// Only used on the GL thread
+		std::deque<Upload> uploads;
+		GLuint pixel_buffer = 0;
+		std::atomic<int> number_pending(0);
+
+		void workerLoop()
+		{
+			trace::setThreadName("Asset worker");
+			for(;;)
+			{
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					job_added.wait(lock, [] { return stopping || !jobs.empty(); });
+					if(stopping)
+					{
+						return;
+					}
+					job = std::move(jobs.front());
+					jobs.pop_front();
+				}
+				job();
+			}
+		}
+
+		void addJob(const std::function<void()>& job)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(workers.empty())
+			{
+				// Leave one core for the GL thread
+				unsigned number_of_threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+				stopping = false;
+				for(unsigned i = 0; i < number_of_threads; i++)
+				{
+					workers.push_back(std::thread(workerLoop));
+				}
+			}
+			jobs.push_back(job);
+			job_added.notify_one();
+		}
+
+		void addFinished(const std::function<void()>& task)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finished.push_back(task);
+		}
+
+		std::shared_ptr<void> decode(const std::string& filename,
+		                             int nof_components,
+		                             bool floating_point,
+		                             int& width,
+		                             int& height)
+		{
+			trace::Scope scope("Decode image", filename);
+			int components;
+			void* data = floating_point ?
+			                 static_cast<void*>(stbi_loadf(filename.c_str(), &width, &height, &components,
+			                                               nof_components)) :
+			                 static_cast<void*>(stbi_load(filename.c_str(), &width, &height, &components,
+			                                              nof_components));
+			if(data == nullptr)
+			{
+				std::cout << "Failed to load image: " << filename << ".\n";
+				return nullptr;
+			}
+			return std::shared_ptr<void>(data, stbi_image_free);
+		}
+
+		void getFormat(int nof_components, bool floating_point, GLenum& internal_format, GLenum& format)
+		{
+			const GLenum formats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+			const GLenum byte_formats[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+			const GLenum float_formats[] = { GL_R32F, GL_RG32F, GL_RGB32F, GL_RGBA32F };
+			int i = glm::clamp(nof_components, 1, 4) - 1;
+			format = formats[i];
+			internal_format = floating_point ? float_formats[i] : byte_formats[i];
+		}
+
+		// Give the texture a single texel until the image is loaded
+		void setPlaceholder(GLuint texture, GLenum internal_format, GLenum format, bool floating_point)
+		{
+			const uint8_t grey[4] = { 128, 128, 128, 255 };
+			const float black[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+			glBindTexture(GL_TEXTURE_2D, texture);
+			if(floating_point)
+				glTexImage2D(GL_TEXTURE_2D, 0, internal_format, 1, 1, 0, format, GL_FLOAT, black);
+			else
+				glTexImage2D(GL_TEXTURE_2D, 0, internal_format, 1, 1, 0, format, GL_UNSIGNED_BYTE, grey);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Copy the pixels into the pixel buffer and let the driver transfer
+		// them to the texture without stalling this thread. Returns the
+		// number of bytes uploaded.
+		///////////////////////////////////////////////////////////////////////
+		size_t uploadTexture(const Upload& upload)
+		{
+			GLint alignment;
+			glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glBindTexture(upload.target, upload.texture);
+			size_t bytes = 0;
+			for(size_t i = 0; i < upload.levels.size(); i++)
+			{
+				const Level& level = upload.levels[i];
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffer);
+				// Orphan the previous contents, which may still be in flight
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, level.size, nullptr, GL_STREAM_DRAW);
+				void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, level.size,
+				                                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+				const void* pixels = nullptr;
+				if(mapped != nullptr)
+				{
+					memcpy(mapped, level.pixels.get(), level.size);
+					glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				}
+				else
+				{
+					// Could not map the buffer, upload from client memory
+					glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+					pixels = level.pixels.get();
+				}
+				if(upload.target == GL_TEXTURE_2D_ARRAY && upload.compressed)
+				{
+					glCompressedTexSubImage3D(upload.target, level.level, 0, 0, upload.layer, level.width,
+					                          level.height, 1, upload.internal_format, GLsizei(level.size),
+					                          pixels);
+				}
+				else if(upload.target == GL_TEXTURE_2D_ARRAY)
+				{
+					glTexSubImage3D(upload.target, level.level, 0, 0, upload.layer, level.width, level.height,
+					                1, upload.format, upload.type, pixels);
+				}
+				else if(upload.compressed)
+				{
+					glCompressedTexImage2D(GL_TEXTURE_2D, level.level, upload.internal_format, level.width,
+					                       level.height, 0, GLsizei(level.size), pixels);
+				}
+				else
+				{
+					glTexImage2D(GL_TEXTURE_2D, level.level, upload.internal_format, level.width,
+					             level.height, 0, upload.format, upload.type, pixels);
+				}
+				if(int(i) == upload.generate_mipmaps_after)
+				{
+					glGenerateMipmap(upload.target);
+				}
+				bytes += level.size;
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glBindTexture(upload.target, 0);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+			if(upload.done)
+			{
+				upload.done();
+			}
+			return bytes;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// The format and levels of a texture of a model, from the pixels or
+		// compressed blocks that it keeps on the CPU
+		///////////////////////////////////////////////////////////////////////
+		void addTextureLevels(const Texture& texture, Upload& upload)
+		{
+			texture.getFormat(upload.internal_format, upload.format);
+			upload.type = GL_UNSIGNED_BYTE;
+			if(texture.compressed)
+			{
+				// Keep the compressed image alive until all levels are uploaded
+				const CompressedImage& image = *texture.compressed;
+				upload.internal_format = image.internal_format;
+				upload.compressed = true;
+				for(size_t i = 0; i < image.levels.size(); i++)
+				{
+					const CompressedImage::Level& level = image.levels[i];
+					std::shared_ptr<void> blocks(texture.compressed,
+					                             const_cast<uint8_t*>(&image.blocks[level.offset]));
+					upload.levels.push_back({ GLint(i), level.width, level.height, blocks, level.size });
+				}
+				upload.generate_mipmaps_after = -1;
+			}
+			else
+			{
+				// The pixels belong to the texture, which keeps them for sampling
+				std::shared_ptr<void> pixels(texture.data, [](void*) {});
+				size_t size = size_t(texture.width) * texture.height * texture.n_components;
+				upload.levels.push_back({ 0, texture.width, texture.height, pixels, size });
+				upload.generate_mipmaps_after = 0;
+			}
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Move a model read on a worker into the placeholder handed out by
+		// loadModelFromOBJ(), and queue its textures for upload
+		///////////////////////////////////////////////////////////////////////
+		void finishModel(Model* model, Model* loaded)
+		{
+			model->m_materials.swap(loaded->m_materials);
+			model->m_meshes.swap(loaded->m_meshes);
+			model->m_positions.swap(loaded->m_positions);
+			model->m_normals.swap(loaded->m_normals);
+			model->m_texture_coordinates.swap(loaded->m_texture_coordinates);
+			model->m_indices.swap(loaded->m_indices);
+			// For culling whole models, see computeModelBounds()
+			model->m_aabb_min = loaded->m_aabb_min;
+			model->m_aabb_max = loaded->m_aabb_max;
+			model->m_bounding_sphere_center = loaded->m_bounding_sphere_center;
+			model->m_bounding_sphere_radius = loaded->m_bounding_sphere_radius;
+			delete loaded;
+
+			for(auto& material : model->m_materials)
+			{
+				Texture* textures[] = { &material.m_color_texture, &material.m_shininess_texture,
+					                    &material.m_metalness_texture, &material.m_fresnel_texture,
+					                    &material.m_emission_texture };
+				for(Texture* texture : textures)
+				{
+					// Images shared with a texture loaded earlier are only uploaded once
+					if(!texture->valid || !texture->createTexture())
+					{
+						continue;
+					}
+					uint32_t internal_format, format;
+					texture->getFormat(internal_format, format);
+					setPlaceholder(texture->gl_id, internal_format, format, false);
+					glBindTexture(GL_TEXTURE_2D, texture->gl_id);
+					texture->setSamplerState();
+					glBindTexture(GL_TEXTURE_2D, 0);
+
+					Upload upload;
+					upload.texture = texture->gl_id;
+					addTextureLevels(*texture, upload);
+					uploads.push_back(upload);
+					number_pending++;
+				}
+			}
+
+			// The texture arrays are filled a layer at a time, like the textures
+			std::vector<TextureArrayLayer> layers;
+			uploadModel(model, &layers);
+			for(const TextureArrayLayer& layer : layers)
+			{
+				Upload upload;
+				upload.texture = model->m_texture_arrays[layer.array];
+				upload.target = GL_TEXTURE_2D_ARRAY;
+				upload.layer = layer.layer;
+				addTextureLevels(*layer.texture, upload);
+				// Left to textureArrayLayerUploaded() once the array is complete
+				upload.generate_mipmaps_after = -1;
+				upload.done = [model, layer]() { textureArrayLayerUploaded(model, layer); };
+				uploads.push_back(upload);
+				number_pending++;
+			}
+		}
+	} // namespace
+
+	Model* loadModelFromOBJ(const std::string& filename)
+	{
+		Model* model = new Model;
+		model->m_name = file::file_stem(filename);
+		model->m_filename = filename;
+		number_pending++;
+		addJob([model, filename]() {
+			Model* loaded = readModelFromOBJ(filename);
+			addFinished([model, loaded]() {
+				finishModel(model, loaded);
+				number_pending--;
+			});
+		});
+		return model;
+	}
+
+	void loadTexture(GLuint texture,
+	                 const std::string& filename,
+	                 int nof_components,
+	                 bool floating_point,
+	                 bool mipmaps)
+	{
+		GLenum internal_format, format;
+		getFormat(nof_components, floating_point, internal_format, format);
+		setPlaceholder(texture, internal_format, format, floating_point);
+		number_pending++;
+		addJob([=]() {
+			int width, height;
+			std::shared_ptr<void> pixels = decode(filename, nof_components, floating_point, width, height);
+			addFinished([=]() {
+				if(!pixels)
+				{
+					number_pending--;
+					return;
+				}
+				size_t size = size_t(width) * height * nof_components * (floating_point ? sizeof(float) : 1);
+				Upload upload;
+				upload.texture = texture;
+				upload.internal_format = internal_format;
+				upload.format = format;
+				upload.type = floating_point ? GL_FLOAT : GL_UNSIGNED_BYTE;
+				upload.levels.push_back({ 0, width, height, pixels, size });
+				upload.generate_mipmaps_after = mipmaps ? 0 : -1;
+				uploads.push_back(upload);
+			});
+		});
+	}
+
+	GLuint loadHdrTexture(const std::string& filename)
+	{
+		GLuint texId;
+		glGenTextures(1, &texId);
+		glBindTexture(GL_TEXTURE_2D, texId);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		loadTexture(texId, filename, 3, true, false);
+		return texId;
+	}
+
+	GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames)
+	{
+		GLuint texId;
+		glGenTextures(1, &texId);
+		glBindTexture(GL_TEXTURE_2D, texId);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		setPlaceholder(texId, GL_RGB32F, GL_RGB, true);
+
+		///////////////////////////////////////////////////////////////////////
+		// Decode the levels in parallel. The last one to finish queues the
+		// upload of all of them.
+		///////////////////////////////////////////////////////////////////////
+		struct Levels
+		{
+			std::vector<Level> levels;
+			std::atomic<int> remaining;
+		};
+		std::shared_ptr<Levels> levels = std::make_shared<Levels>();
+		levels->levels.resize(filenames.size());
+		levels->remaining = int(filenames.size());
+		number_pending++;
+		for(size_t i = 0; i < filenames.size(); i++)
+		{
+			std::string filename = filenames[i];
+			addJob([texId, levels, i, filename]() {
+				Level& level = levels->levels[i];
+				level.level = GLint(i);
+				level.pixels = decode(filename, 3, true, level.width, level.height);
+				level.size = level.pixels ? size_t(level.width) * level.height * 3 * sizeof(float) : 0;
+				if(--levels->remaining > 0)
+				{
+					return;
+				}
+				addFinished([texId, levels]() {
+					for(const Level& level : levels->levels)
+					{
+						if(!level.pixels)
+						{
+							number_pending--;
+							return;
+						}
+					}
+					Upload upload;
+					upload.texture = texId;
+					upload.internal_format = GL_RGB32F;
+					upload.format = GL_RGB;
+					upload.type = GL_FLOAT;
+					// Level 0 is uploaded again after glGenerateMipmap(), see
+					// labhelper::loadHdrMipmapTexture()
+					upload.levels.push_back(levels->levels[0]);
+					upload.levels.insert(upload.levels.end(), levels->levels.begin(), levels->levels.end());
+					upload.generate_mipmaps_after = 0;
+					uploads.push_back(upload);
+				});
+			});
+		}
+		return texId;
+	}
+
+	void update(size_t max_upload_bytes)
+	{
+		std::deque<std::function<void()>> tasks;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.swap(finished);
+		}
+		for(auto& task : tasks)
+		{
+			trace::Scope scope("Finish asset");
+			task();
+		}
+
+		if(!uploads.empty() && pixel_buffer == 0)
+		{
+			glGenBuffers(1, &pixel_buffer);
+		}
+		size_t uploaded_bytes = 0;
+		while(!uploads.empty() && (uploaded_bytes == 0 || uploaded_bytes < max_upload_bytes))
+		{
+			trace::Scope scope("Upload texture");
+			uploaded_bytes += uploadTexture(uploads.front());
+			uploads.pop_front();
+			number_pending--;
+		}
+	}
+
+	int pending()
+	{
+		return number_pending;
+	}
+
+	void shutDown()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			jobs.clear();
+		}
+		job_added.notify_all();
+		for(auto& worker : workers)
+		{
+			worker.join();
+		}
+		workers.clear();
+		finished.clear();
+		uploads.clear();
+		if(pixel_buffer != 0)
+		{
+			glDeleteBuffers(1, &pixel_buffer);
+			pixel_buffer = 0;
+		}
+		number_pending = 0;
+	}
+} // namespace assets
+} // namespace labhelper
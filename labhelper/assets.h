@@ -0,0 +1,65 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Background loading of models and textures.
+//
+// The functions below return right away with a placeholder: an empty Model
+// or a texture holding a single texel. Files are decoded on a pool of
+// worker threads, and update() then uploads the results through pixel
+// buffer objects, a few megabytes per frame, so the application can start
+// rendering immediately and the scene streams in.
+//
+// A loaded object keeps its GL name, so sampler state set on a placeholder
+// texture stays. Models and textures must not be freed while they are
+// still loading, see pending().
+///////////////////////////////////////////////////////////////////////////////
+namespace labhelper
+{
+class Model;
+
+namespace assets
+{
+	///////////////////////////////////////////////////////////////////////////
+	/// Like labhelper::loadModelFromOBJ(). The model has no meshes until it
+	/// is loaded, and its textures are placeholders until they are uploaded.
+	///////////////////////////////////////////////////////////////////////////
+	Model* loadModelFromOBJ(const std::string& filename);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Like labhelper::loadHdrTexture() and loadHdrMipmapTexture()
+	///////////////////////////////////////////////////////////////////////////
+	GLuint loadHdrTexture(const std::string& filename);
+	GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Load an image into an existing texture. Pixels are 8 bit normalized,
+	/// or 32 bit float if `floating_point` is set. Sampler state is left
+	/// to the caller.
+	///////////////////////////////////////////////////////////////////////////
+	void loadTexture(GLuint texture,
+	                 const std::string& filename,
+	                 int nof_components,
+	                 bool floating_point,
+	                 bool mipmaps);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Call once per frame on the GL thread. Finishes loaded models and
+	/// uploads textures until `max_upload_bytes` have been copied, but
+	/// always at least one texture.
+	///////////////////////////////////////////////////////////////////////////
+	void update(size_t max_upload_bytes = 16 * 1024 * 1024);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Number of models and textures that are not completely loaded yet
+	///////////////////////////////////////////////////////////////////////////
+	int pending();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Stop the worker threads. Anything not loaded yet is dropped.
+	///////////////////////////////////////////////////////////////////////////
+	void shutDown();
+} // namespace assets
+} // namespace labhelper
@@ -0,0 +1,438 @@
+#include "capture.h"
+#include "trace.h"
+#include <SDL.h>
+#include <imgui.h>
+#include <stb_image_write.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace labhelper
+{
+namespace capture
+{
+	namespace
+	{
+		struct Image
+		{
+			std::string filename;
+			int width, height;
+			// RGB floats, written as .hdr and a tone mapped .png, rather
+			// than RGB bytes written as .png
+			bool hdr;
+		};
+
+		struct PixelBuffer
+		{
+			enum State
+			{
+				unused,
+				// Until the fence signals
+				reading,
+				// Mapped, until a worker has written the file
+				writing
+			};
+			State state = unused;
+			GLuint buffer = 0;
+			size_t capacity = 0;
+			GLsync fence = nullptr;
+			Image image;
+			const void* pixels = nullptr;
+			// The oldest buffer is waited for when all are in use
+			uint64_t order = 0;
+			// Set by the worker, guarded by the mutex
+			bool written = false;
+		};
+
+		// A deque, so that the workers can hold on to buffers while more are added
+		std::deque<PixelBuffer> buffers;
+		uint64_t number_of_reads = 0;
+		std::vector<std::string> screenshots;
+		bool sequence_running = false;
+		std::string sequence_prefix;
+		int sequence_frame = 0;
+		int stalls = 0;
+		std::atomic<int> number_pending(0);
+
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable job_added;
+		std::condition_variable image_written;
+		bool stopping = false;
+		std::deque<std::function<void()>> jobs;
+
+		void workerLoop()
+		{
+			trace::setThreadName("Capture worker");
+			for(;;)
+			{
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					job_added.wait(lock, [] { return stopping || !jobs.empty(); });
+					// Jobs still queued when stopping are finished first
+					if(jobs.empty())
+					{
+						return;
+					}
+					job = std::move(jobs.front());
+					jobs.pop_front();
+				}
+				job();
+			}
+		}
+
+		void addJob(const std::function<void()>& job)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(workers.empty())
+			{
+				// PNG encoding is slow, a sequence needs a few threads to keep up
+				unsigned number_of_threads =
+				    std::min(4u, std::max(2u, std::thread::hardware_concurrency()) - 1);
+				stopping = false;
+				for(unsigned i = 0; i < number_of_threads; i++)
+				{
+					workers.push_back(std::thread(workerLoop));
+				}
+			}
+			jobs.push_back(job);
+			job_added.notify_one();
+		}
+
+		std::string timestamp()
+		{
+			std::time_t tt = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+			std::stringstream name;
+			name << std::put_time(std::localtime(&tt), "%Y-%m-%d_%H-%M-%S");
+			return name.str();
+		}
+
+		size_t imageSize(const Image& image)
+		{
+			return size_t(image.width) * image.height * 3 * (image.hdr ? sizeof(float) : 1);
+		}
+
+		// On a worker. The rows of the pixels are bottom up, as read by GL.
+		void writeImage(const Image& image, const void* pixels)
+		{
+			trace::Scope scope("Write image", image.filename);
+			bool written;
+			if(!image.hdr)
+			{
+				// A negative stride flips the rows without copying them
+				int row = image.width * 3;
+				const uint8_t* last_row =
+				    static_cast<const uint8_t*>(pixels) + size_t(row) * (image.height - 1);
+				written =
+				    stbi_write_png(image.filename.c_str(), image.width, image.height, 3, last_row, -row) != 0;
+			}
+			else
+			{
+				const float* data = static_cast<const float*>(pixels);
+				size_t row = size_t(image.width) * 3;
+				std::vector<float> flipped(row * image.height);
+				for(int r = 0; r < image.height; r++)
+				{
+					memcpy(&flipped[r * row], &data[(image.height - 1 - r) * row], row * sizeof(float));
+				}
+				std::vector<uint8_t> png(flipped.size());
+				for(size_t i = 0; i < flipped.size(); i++)
+				{
+					png[i] = uint8_t(255 * (flipped[i] / (1 + flipped[i])));
+				}
+				written = stbi_write_hdr((image.filename + ".hdr").c_str(), image.width, image.height, 3,
+				                         flipped.data())
+				          && stbi_write_png((image.filename + ".png").c_str(), image.width, image.height, 3,
+				                            png.data(), 0);
+			}
+			if(!written)
+			{
+				std::cout << "Failed to write " << image.filename << std::endl;
+			}
+		}
+
+		// Map a buffer whose read is done and hand it to a worker
+		void startWriting(PixelBuffer& buffer)
+		{
+			glDeleteSync(buffer.fence);
+			buffer.fence = nullptr;
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.buffer);
+			buffer.pixels =
+			    glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, imageSize(buffer.image), GL_MAP_READ_BIT);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			buffer.state = PixelBuffer::writing;
+			if(buffer.pixels == nullptr)
+			{
+				std::cout << "Failed to map the pixels of " << buffer.image.filename << std::endl;
+				buffer.written = true;
+				number_pending--;
+				return;
+			}
+			PixelBuffer* pixel_buffer = &buffer;
+			addJob([pixel_buffer]() {
+				writeImage(pixel_buffer->image, pixel_buffer->pixels);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					pixel_buffer->written = true;
+				}
+				image_written.notify_all();
+				number_pending--;
+			});
+		}
+
+		bool isWritten(const PixelBuffer& buffer)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return buffer.written;
+		}
+
+		void finishWriting(PixelBuffer& buffer)
+		{
+			if(buffer.pixels != nullptr)
+			{
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.buffer);
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+				buffer.pixels = nullptr;
+			}
+			buffer.written = false;
+			buffer.state = PixelBuffer::unused;
+		}
+
+		// Move buffers along without waiting
+		void poll()
+		{
+			for(PixelBuffer& buffer : buffers)
+			{
+				if(buffer.state == PixelBuffer::reading)
+				{
+					GLenum status = glClientWaitSync(buffer.fence, 0, 0);
+					if(status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+					{
+						startWriting(buffer);
+					}
+				}
+				if(buffer.state == PixelBuffer::writing && isWritten(buffer))
+				{
+					finishWriting(buffer);
+				}
+			}
+		}
+
+		void waitFor(PixelBuffer& buffer)
+		{
+			trace::Scope scope("Wait for capture", buffer.image.filename);
+			if(buffer.state == PixelBuffer::reading)
+			{
+				const GLuint64 one_second = 1000000000;
+				GLenum status;
+				do
+				{
+					status = glClientWaitSync(buffer.fence, GL_SYNC_FLUSH_COMMANDS_BIT, one_second);
+				} while(status == GL_TIMEOUT_EXPIRED);
+				startWriting(buffer);
+			}
+			if(buffer.state == PixelBuffer::writing)
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				image_written.wait(lock, [&buffer] { return buffer.written; });
+				lock.unlock();
+				finishWriting(buffer);
+			}
+		}
+
+		// An unused buffer with room for `size` bytes, bound to GL_PIXEL_PACK_BUFFER
+		PixelBuffer& acquire(size_t size)
+		{
+			poll();
+			PixelBuffer* found = nullptr;
+			for(PixelBuffer& buffer : buffers)
+			{
+				if(buffer.state == PixelBuffer::unused)
+				{
+					found = &buffer;
+					break;
+				}
+			}
+			if(found == nullptr && buffers.size() < size_t(max_pixel_buffers))
+			{
+				buffers.emplace_back();
+				found = &buffers.back();
+				glGenBuffers(1, &found->buffer);
+			}
+			if(found == nullptr)
+			{
+				stalls++;
+				found = &*std::min_element(buffers.begin(), buffers.end(),
+				                           [](const PixelBuffer& a, const PixelBuffer& b) {
+					                           return a.order < b.order;
+				                           });
+				waitFor(*found);
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, found->buffer);
+			if(found->capacity < size)
+			{
+				glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+				found->capacity = size;
+			}
+			return *found;
+		}
+
+		// Fence the read into the buffer, which is then unbound
+		void startReading(PixelBuffer& buffer, const Image& image)
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			buffer.image = image;
+			buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			buffer.order = number_of_reads++;
+			buffer.state = PixelBuffer::reading;
+			number_pending++;
+		}
+
+		void readFramebuffer(const std::string& filename)
+		{
+			trace::Scope scope("Read framebuffer", filename);
+			Image image;
+			image.filename = filename;
+			image.hdr = false;
+			SDL_GL_GetDrawableSize(SDL_GL_GetCurrentWindow(), &image.width, &image.height);
+			PixelBuffer& buffer = acquire(imageSize(image));
+
+			GLint alignment;
+			glGetIntegerv(GL_PACK_ALIGNMENT, &alignment);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+			glReadPixels(0, 0, image.width, image.height, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+			glPixelStorei(GL_PACK_ALIGNMENT, alignment);
+			startReading(buffer, image);
+		}
+	} // namespace
+
+	std::string saveScreenshot()
+	{
+		std::string filename = timestamp() + ".png";
+		screenshots.push_back(filename);
+		return filename;
+	}
+
+	void saveHdrTexture(const std::string& filename, GLuint texture)
+	{
+		trace::Scope scope("Read texture", filename);
+		Image image;
+		image.filename = filename;
+		image.hdr = true;
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &image.width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &image.height);
+		PixelBuffer& buffer = acquire(imageSize(image));
+
+		GLint alignment;
+		glGetIntegerv(GL_PACK_ALIGNMENT, &alignment);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, nullptr);
+		glPixelStorei(GL_PACK_ALIGNMENT, alignment);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		startReading(buffer, image);
+	}
+
+	void startSequence(const std::string& prefix)
+	{
+		sequence_prefix = prefix.empty() ? timestamp() : prefix;
+		sequence_frame = 0;
+		sequence_running = true;
+	}
+
+	void stopSequence()
+	{
+		sequence_running = false;
+	}
+
+	bool sequenceRunning()
+	{
+		return sequence_running;
+	}
+
+	void update()
+	{
+		poll();
+		for(const std::string& filename : screenshots)
+		{
+			readFramebuffer(filename);
+		}
+		screenshots.clear();
+		if(sequence_running)
+		{
+			char number[16];
+			snprintf(number, sizeof(number), "_%05d.png", sequence_frame++);
+			readFramebuffer(sequence_prefix + number);
+		}
+	}
+
+	int pending()
+	{
+		return number_pending;
+	}
+
+	void gui()
+	{
+		if(!ImGui::CollapsingHeader("Capture"))
+		{
+			return;
+		}
+		if(ImGui::Button("Screenshot"))
+		{
+			saveScreenshot();
+		}
+		ImGui::SameLine();
+		bool running = sequence_running;
+		if(ImGui::Checkbox("Record frames", &running))
+		{
+			if(running)
+			{
+				startSequence();
+			}
+			else
+			{
+				stopSequence();
+			}
+		}
+		ImGui::Text("%d frames recorded, %d images to write, %d stalls", sequence_frame, pending(), stalls);
+	}
+
+	void shutDown()
+	{
+		sequence_running = false;
+		screenshots.clear();
+		for(PixelBuffer& buffer : buffers)
+		{
+			waitFor(buffer);
+			glDeleteBuffers(1, &buffer.buffer);
+		}
+		buffers.clear();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		job_added.notify_all();
+		for(std::thread& worker : workers)
+		{
+			worker.join();
+		}
+		workers.clear();
+	}
+} // namespace capture
+} // namespace labhelper
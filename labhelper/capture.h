@@ -0,0 +1,69 @@
+#pragma once
+#include <string>
+#include <GL/glew.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Screenshots and frame sequences that do not stall the GL thread.
+//
+// labhelper::saveScreenshot() reads the pixels back with glReadPixels(),
+// which waits for the GPU to finish the frame, and then encodes the PNG
+// before it returns. Here the pixels are instead read into a pixel buffer
+// object, with a fence after the read. update() maps the buffers whose
+// fences have signaled, a few frames later, and hands them to worker
+// threads that flip the rows and write the files straight from the mapped
+// memory. The buffers are reused in the order they were read, and more are
+// added, up to max_pixel_buffers, while the workers are behind. Only when
+// all of them are in use does a read wait for the oldest one, which is
+// counted as a stall.
+//
+// Only for the thread with the GL context.
+///////////////////////////////////////////////////////////////////////////////
+namespace labhelper
+{
+namespace capture
+{
+	const int max_pixel_buffers = 16;
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Save the default framebuffer as it is at the next update(), that is
+	/// the frame being drawn. Returns the name of the file, which is written
+	/// a few frames later.
+	///////////////////////////////////////////////////////////////////////////
+	std::string saveScreenshot();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Like labhelper::saveHdrTexture(): level 0 of the texture is saved to
+	/// filename.hdr, and tone mapped to filename.png
+	///////////////////////////////////////////////////////////////////////////
+	void saveHdrTexture(const std::string& filename, GLuint texture);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Save every frame, at update(), to prefix_00000.png, prefix_00001.png
+	/// and so on. The prefix is the date and time if empty.
+	///////////////////////////////////////////////////////////////////////////
+	void startSequence(const std::string& prefix = "");
+	void stopSequence();
+	bool sequenceRunning();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Call once per frame when it is drawn, before the buffers are swapped
+	///////////////////////////////////////////////////////////////////////////
+	void update();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Number of images that are not written yet
+	///////////////////////////////////////////////////////////////////////////
+	int pending();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// A screenshot button and a frame sequence checkbox, in the current
+	/// ImGui window
+	///////////////////////////////////////////////////////////////////////////
+	void gui();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Write what is pending, stop the worker threads and delete the buffers
+	///////////////////////////////////////////////////////////////////////////
+	void shutDown();
+} // namespace capture
+} // namespace labhelper
@@ -0,0 +1,103 @@
+#include "frustum.h"
+#include <cmath>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LABHELPER_FRUSTUM_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace labhelper
+{
+Frustum::Frustum(const glm::mat4& matrix)
+{
+	// glm matrices are column major, matrix[c][r]
+	for(int p = 0; p < 6; p++)
+	{
+		const int row = p / 2;
+		const float sign = p % 2 == 0 ? 1.0f : -1.0f;
+		glm::vec4 plane;
+		for(int c = 0; c < 4; c++)
+		{
+			plane[c] = matrix[c][3] + sign * matrix[c][row];
+		}
+		const float length = glm::length(glm::vec3(plane));
+		if(length > 0.0f)
+		{
+			plane /= length;
+		}
+		m_x[p] = plane.x;
+		m_y[p] = plane.y;
+		m_z[p] = plane.z;
+		m_w[p] = plane.w;
+	}
+	for(int p = 6; p < 8; p++)
+	{
+		m_x[p] = m_y[p] = m_z[p] = 0.0f;
+		m_w[p] = 1.0f;
+	}
+}
+
+bool Frustum::intersectsBox(const glm::vec3& aabb_min, const glm::vec3& aabb_max) const
+{
+	// The box is outside a plane if its center is further outside than the
+	// box extends along the normal
+	const glm::vec3 center = 0.5f * (aabb_min + aabb_max);
+	const glm::vec3 extent = 0.5f * (aabb_max - aabb_min);
+#ifdef LABHELPER_FRUSTUM_SSE
+	const __m128 sign_bit = _mm_set1_ps(-0.0f);
+	const __m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+	const __m128 ex = _mm_set1_ps(extent.x), ey = _mm_set1_ps(extent.y), ez = _mm_set1_ps(extent.z);
+	for(int p = 0; p < 8; p += 4)
+	{
+		const __m128 x = _mm_load_ps(m_x + p), y = _mm_load_ps(m_y + p), z = _mm_load_ps(m_z + p);
+		__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, cx), _mm_mul_ps(y, cy)),
+		                             _mm_add_ps(_mm_mul_ps(z, cz), _mm_load_ps(m_w + p)));
+		__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign_bit, x), ex),
+		                                      _mm_mul_ps(_mm_andnot_ps(sign_bit, y), ey)),
+		                           _mm_mul_ps(_mm_andnot_ps(sign_bit, z), ez));
+		if(_mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps())) != 0)
+		{
+			return false;
+		}
+	}
+#else
+	for(int p = 0; p < 6; p++)
+	{
+		float distance = m_x[p] * center.x + m_y[p] * center.y + m_z[p] * center.z + m_w[p];
+		float radius =
+		    std::abs(m_x[p]) * extent.x + std::abs(m_y[p]) * extent.y + std::abs(m_z[p]) * extent.z;
+		if(distance + radius < 0.0f)
+		{
+			return false;
+		}
+	}
+#endif
+	return true;
+}
+
+bool Frustum::intersectsSphere(const glm::vec3& center, float radius) const
+{
+#ifdef LABHELPER_FRUSTUM_SSE
+	const __m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+	const __m128 r = _mm_set1_ps(radius);
+	for(int p = 0; p < 8; p += 4)
+	{
+		__m128 distance =
+		    _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(m_x + p), cx), _mm_mul_ps(_mm_load_ps(m_y + p), cy)),
+		               _mm_add_ps(_mm_mul_ps(_mm_load_ps(m_z + p), cz), _mm_load_ps(m_w + p)));
+		if(_mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(distance, r), _mm_setzero_ps())) != 0)
+		{
+			return false;
+		}
+	}
+#else
+	for(int p = 0; p < 6; p++)
+	{
+		if(m_x[p] * center.x + m_y[p] * center.y + m_z[p] * center.z + m_w[p] + radius < 0.0f)
+		{
+			return false;
+		}
+	}
+#endif
+	return true;
+}
+} // namespace labhelper
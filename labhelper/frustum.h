@@ -0,0 +1,34 @@
+#pragma once
+#include <glm/glm.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// View frustum culling.
+//
+// The six planes are extracted from a (model-)view-projection matrix as in
+// "Fast Extraction of Viewing Frustum Planes from the World-View-Projection
+// Matrix" (Gribb and Hartmann, 2001), so they are in the space the matrix
+// transforms from and no bounding volume has to be transformed. The tests
+// are conservative: volumes near the edges or corners of the frustum may
+// pass although they are outside, but no volume inside is rejected.
+///////////////////////////////////////////////////////////////////////////////
+namespace labhelper
+{
+class Frustum
+{
+public:
+	explicit Frustum(const glm::mat4& matrix);
+	// Whether the axis aligned box may be inside
+	bool intersectsBox(const glm::vec3& aabb_min, const glm::vec3& aabb_max) const;
+	// Whether the sphere may be inside
+	bool intersectsSphere(const glm::vec3& center, float radius) const;
+
+private:
+	// Plane i is (m_x[i], m_y[i], m_z[i], m_w[i]), with a unit normal that
+	// points into the frustum. The last two planes are padding that keeps
+	// everything inside, so that the planes can be tested four at a time.
+	alignas(16) float m_x[8];
+	alignas(16) float m_y[8];
+	alignas(16) float m_z[8];
+	alignas(16) float m_w[8];
+};
+} // namespace labhelper
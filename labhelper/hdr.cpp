@@ -1,4 +1,5 @@
 #include "hdr.h"
+#include "trace.h"
 #include <iostream>
 #include <stb_image.h>
 #include <stb_image_write.h>
@@ -12,6 +13,7 @@ struct HDRImage
 	// Constructor
 	HDRImage(const std::string& filename)
 	{
+		trace::Scope scope("Decode HDR image", filename);
 		stbi_set_flip_vertically_on_load(true);
 		data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
 		if(data == nullptr)
@@ -29,6 +31,7 @@ struct HDRImage
 
 GLuint loadHdrTexture(const std::string& filename)
 {
+	trace::Scope scope("Load HDR texture", filename);
 	GLuint texId;
 	glGenTextures(1, &texId);
 	glBindTexture(GL_TEXTURE_2D, texId);
@@ -46,6 +49,7 @@ GLuint loadHdrTexture(const std::string& filename)
 
 GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames)
 {
+	trace::Scope scope("Load HDR mipmap texture", filenames[0]);
 	GLuint texId;
 	glGenTextures(1, &texId);
 	glBindTexture(GL_TEXTURE_2D, texId);
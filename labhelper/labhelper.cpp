@@ -20,8 +20,11 @@
 #include <stb_image_write.h>
 
 #include "labhelper.h"
+#include "trace.h"
 
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <chrono>
@@ -513,69 +516,420 @@ std::string GetShaderProgramInfoLog(GLuint obj)
 }
 
 
-GLuint loadShaderProgram(const std::string& vertexShader, const std::string& fragmentShader, bool allow_errors)
+///////////////////////////////////////////////////////////////////////////
+// Program binaries
+//
+// A linked program is saved with glGetProgramBinary() next to its vertex
+// shader, as <vertex stem>.<fragment stem>.programcache, and loaded with
+// glProgramBinary() the next time the same sources are loaded. The cache
+// records a hash of the sources, with the defines inserted, and of the
+// vendor, renderer and version strings of the driver, and is rebuilt when
+// either changes. A binary the driver rejects anyway is compiled from
+// source and saved again. Programs with defines get a hash of them in the
+// file name, so that each set of defines has its own cache.
+///////////////////////////////////////////////////////////////////////////
+namespace
 {
-	GLuint vShader = glCreateShader(GL_VERTEX_SHADER);
-	GLuint fShader = glCreateShader(GL_FRAGMENT_SHADER);
+	const char program_cache_magic[8] = { 'L', 'H', 'P', 'R', 'O', 'G', '\0', '\0' };
+	const uint32_t program_cache_version = 1;
 
-	std::ifstream vs_file(vertexShader);
-	std::string vs_src((std::istreambuf_iterator<char>(vs_file)), std::istreambuf_iterator<char>());
+	struct ProgramCacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t format;
+		uint64_t source_hash;
+		uint64_t driver_hash;
+		uint64_t length;
+	};
 
-	std::ifstream fs_file(fragmentShader);
-	std::string fs_src((std::istreambuf_iterator<char>(fs_file)), std::istreambuf_iterator<char>());
+	uint64_t hashString(const std::string& string, uint64_t hash = 14695981039346656037ull)
+	{
+		// FNV-1a
+		for(char c : string)
+		{
+			hash ^= uint8_t(c);
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
 
-	const char* vs = vs_src.c_str();
-	const char* fs = fs_src.c_str();
+	bool programBinariesSupported()
+	{
+		// Core profiles on macOS have the functions but no binary formats
+		static const bool supported = [] {
+			GLint formats = 0;
+			if(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+			{
+				glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			}
+			return formats > 0;
+		}();
+		return supported;
+	}
 
-	glShaderSource(vShader, 1, &vs, nullptr);
-	glShaderSource(fShader, 1, &fs, nullptr);
-	// text data is not needed beyond this point
+	bool parallelShaderCompileSupported()
+	{
+		return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+	}
 
-	glCompileShader(vShader);
-	int compileOk = 0;
-	glGetShaderiv(vShader, GL_COMPILE_STATUS, &compileOk);
-	if(!compileOk)
+	uint64_t driverHash()
 	{
-		std::string err = GetShaderInfoLog(vShader);
-		if(allow_errors)
+		uint64_t hash = hashString("");
+		for(GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
 		{
-			non_fatal_error(err, vertexShader);
+			const char* string = reinterpret_cast<const char*>(glGetString(name));
+			hash = hashString(string != nullptr ? string : "", hash);
 		}
-		else
+		return hash;
+	}
+
+	std::string programCachePath(const std::vector<std::string>& filenames, const std::string& defines)
+	{
+		std::string path = file::parent_path(filenames[0]) + file::file_stem(filenames[0]);
+		for(size_t i = 1; i < filenames.size(); i++)
 		{
-			fatal_error(err, vertexShader);
+			path += "." + file::file_stem(filenames[i]);
 		}
-		return 0;
+		if(!defines.empty())
+		{
+			char hash[16];
+			snprintf(hash, sizeof(hash), ".%08x", uint32_t(hashString(defines)));
+			path += hash;
+		}
+		return path + ".programcache";
 	}
 
-	glCompileShader(fShader);
-	glGetShaderiv(fShader, GL_COMPILE_STATUS, &compileOk);
-	if(!compileOk)
+	// A linked program, or 0 if there is no cache or it is out of date
+	GLuint readProgramCache(const std::string& path, uint64_t source_hash)
 	{
-		std::string err = GetShaderInfoLog(fShader);
-		if(allow_errors)
+		std::ifstream file(path, std::ios::binary);
+		ProgramCacheHeader header;
+		if(!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+		   || memcmp(header.magic, program_cache_magic, sizeof(program_cache_magic)) != 0
+		   || header.version != program_cache_version || header.source_hash != source_hash
+		   || header.driver_hash != driverHash())
+		{
+			return 0;
+		}
+		std::vector<char> binary(size_t(header.length));
+		if(!file.read(binary.data(), binary.size()))
+		{
+			return 0;
+		}
+		GLuint program = glCreateProgram();
+		glProgramBinary(program, header.format, binary.data(), GLsizei(binary.size()));
+		GLint linkOk = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
+		if(!linkOk)
+		{
+			glDeleteProgram(program);
+			return 0;
+		}
+		return program;
+	}
+
+	void writeProgramCache(const std::string& path, uint64_t source_hash, GLuint program)
+	{
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if(length <= 0)
+		{
+			return;
+		}
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+		ProgramCacheHeader header;
+		memcpy(header.magic, program_cache_magic, sizeof(program_cache_magic));
+		header.version = program_cache_version;
+		header.format = format;
+		header.source_hash = source_hash;
+		header.driver_hash = driverHash();
+		header.length = uint64_t(length);
+
+		// Write to a temporary file and rename it, like the model cache
+		const std::string tmp_path = path + ".tmp";
+		{
+			std::ofstream file(tmp_path, std::ios::binary);
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			file.write(binary.data(), binary.size());
+			if(!file.good())
+			{
+				std::cout << "Could not write " << path << std::endl;
+				file.close();
+				remove(tmp_path.c_str());
+				return;
+			}
+		}
+		file::replace(tmp_path, path);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// A program being loaded. With GL_KHR_parallel_shader_compile the
+	// driver compiles and links it on its own threads, and ready() tells
+	// when finishing it no longer waits.
+	///////////////////////////////////////////////////////////////////////
+	struct ProgramLoad
+	{
+		GLuint program;
+		// Empty when loaded from the cache
+		std::vector<GLuint> shaders;
+		std::vector<std::string> filenames;
+		bool allow_errors;
+		std::string cache_path;
+		uint64_t source_hash;
+		std::function<void(GLuint)> done;
+
+		bool ready() const
+		{
+			if(shaders.empty() || !parallelShaderCompileSupported())
+			{
+				return true;
+			}
+			GLint completed = GL_TRUE;
+			glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &completed);
+			return completed != GL_FALSE;
+		}
+
+		std::string name() const
 		{
-			non_fatal_error(err, fragmentShader);
+			std::string name = filenames[0];
+			for(size_t i = 1; i < filenames.size(); i++)
+			{
+				name += ", " + filenames[i];
+			}
+			return name;
+		}
+	};
+
+	std::vector<ProgramLoad> program_loads;
+
+	std::string insertDefines(const std::string& source, const std::string& defines)
+	{
+		if(defines.empty())
+		{
+			return source;
+		}
+		// The #version line must come first, and errors should still be reported
+		// at the lines of the file
+		size_t version_end = source.find('\n');
+		if(version_end == std::string::npos)
+		{
+			version_end = source.size();
+		}
+		return source.substr(0, version_end) + "\n" + defines + "\n#line 2\n"
+		       + source.substr(std::min(version_end + 1, source.size()));
+	}
+
+	void reportError(const ProgramLoad& load, const std::string& error, const std::string& title)
+	{
+		if(load.allow_errors)
+		{
+			non_fatal_error(error, title);
 		}
 		else
 		{
-			fatal_error(err, fragmentShader);
+			fatal_error(error, title);
 		}
-		return 0;
 	}
 
-	GLuint shaderProgram = glCreateProgram();
-	glAttachShader(shaderProgram, fShader);
-	glDeleteShader(fShader);
-	glAttachShader(shaderProgram, vShader);
-	glDeleteShader(vShader);
-	if(!allow_errors)
-		CHECK_GL_ERROR();
+	ProgramLoad startProgramLoad(const std::vector<GLenum>& types,
+	                             const std::vector<std::string>& filenames,
+	                             bool allow_errors,
+	                             const std::string& defines)
+	{
+		ProgramLoad load;
+		load.filenames = filenames;
+		load.allow_errors = allow_errors;
+		trace::Scope scope("Load shader program", load.name());
+
+		std::vector<std::string> sources(filenames.size());
+		load.source_hash = hashString("");
+		for(size_t i = 0; i < filenames.size(); i++)
+		{
+			std::ifstream file(filenames[i]);
+			sources[i] = std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			sources[i] = insertDefines(sources[i], defines);
+			// The stage is hashed too, so that sources cannot move between stages
+			load.source_hash = hashString(sources[i], load.source_hash ^ types[i]);
+		}
+		load.cache_path = programCachePath(filenames, defines);
+
+		load.program = programBinariesSupported() ? readProgramCache(load.cache_path, load.source_hash) : 0;
+		if(load.program != 0)
+		{
+			return load;
+		}
+
+		static bool threads_set = false;
+		if(!threads_set && parallelShaderCompileSupported())
+		{
+			// Let the driver use as many threads as it likes
+			if(GLEW_KHR_parallel_shader_compile)
+				glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+			else
+				glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+			threads_set = true;
+		}
+
+		// Nothing below waits for the compiler, errors are only checked when
+		// the program is finished
+		load.program = glCreateProgram();
+		for(size_t i = 0; i < filenames.size(); i++)
+		{
+			const char* source = sources[i].c_str();
+			load.shaders.push_back(glCreateShader(types[i]));
+			glShaderSource(load.shaders[i], 1, &source, nullptr);
+			glCompileShader(load.shaders[i]);
+			glAttachShader(load.program, load.shaders[i]);
+		}
+		if(programBinariesSupported())
+		{
+			glProgramParameteri(load.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
+		glLinkProgram(load.program);
+		return load;
+	}
+
+	// The linked program, or 0 after reporting the errors
+	GLuint finishProgramLoad(ProgramLoad& load)
+	{
+		trace::Scope scope("Link shader program", load.name());
+		if(load.shaders.empty())
+		{
+			reflectProgram(load.program);
+			return load.program;
+		}
+		bool ok = true;
+		for(size_t i = 0; i < load.shaders.size() && ok; i++)
+		{
+			int compileOk = 0;
+			glGetShaderiv(load.shaders[i], GL_COMPILE_STATUS, &compileOk);
+			if(!compileOk)
+			{
+				reportError(load, GetShaderInfoLog(load.shaders[i]), load.filenames[i]);
+				ok = false;
+			}
+		}
+		if(ok)
+		{
+			GLint linkOk = 0;
+			glGetProgramiv(load.program, GL_LINK_STATUS, &linkOk);
+			if(!linkOk)
+			{
+				reportError(load, GetShaderProgramInfoLog(load.program), "Linking");
+				ok = false;
+			}
+		}
+		// Attached shaders are deleted with the program
+		for(GLuint shader : load.shaders)
+		{
+			glDeleteShader(shader);
+		}
+		if(!ok)
+		{
+			glDeleteProgram(load.program);
+			return 0;
+		}
+		if(!load.allow_errors)
+			CHECK_GL_ERROR();
+		reflectProgram(load.program);
+		if(programBinariesSupported())
+		{
+			writeProgramCache(load.cache_path, load.source_hash, load.program);
+		}
+		return load.program;
+	}
+} // namespace
+
+GLuint loadShaderProgram(const std::string& vertexShader,
+                         const std::string& fragmentShader,
+                         bool allow_errors,
+                         const std::string& defines)
+{
+	ProgramLoad load = startProgramLoad({ GL_VERTEX_SHADER, GL_FRAGMENT_SHADER },
+	                                    { vertexShader, fragmentShader }, allow_errors, defines);
+	return finishProgramLoad(load);
+}
+
+GLuint loadTessellationShaderProgram(const std::string& vertexShader,
+                                     const std::string& tessControlShader,
+                                     const std::string& tessEvaluationShader,
+                                     const std::string& fragmentShader,
+                                     bool allow_errors,
+                                     const std::string& defines)
+{
+	ProgramLoad load = startProgramLoad(
+	    { GL_VERTEX_SHADER, GL_TESS_CONTROL_SHADER, GL_TESS_EVALUATION_SHADER, GL_FRAGMENT_SHADER },
+	    { vertexShader, tessControlShader, tessEvaluationShader, fragmentShader }, allow_errors, defines);
+	return finishProgramLoad(load);
+}
+
+void loadShaderProgramAsync(const std::string& vertexShader,
+                            const std::string& fragmentShader,
+                            const std::function<void(GLuint)>& done,
+                            bool allow_errors,
+                            const std::string& defines)
+{
+	program_loads.push_back(startProgramLoad({ GL_VERTEX_SHADER, GL_FRAGMENT_SHADER },
+	                                         { vertexShader, fragmentShader }, allow_errors, defines));
+	program_loads.back().done = done;
+}
 
-	if(!linkShaderProgram(shaderProgram, allow_errors))
-		return 0;
+void loadTessellationShaderProgramAsync(const std::string& vertexShader,
+                                        const std::string& tessControlShader,
+                                        const std::string& tessEvaluationShader,
+                                        const std::string& fragmentShader,
+                                        const std::function<void(GLuint)>& done,
+                                        bool allow_errors,
+                                        const std::string& defines)
+{
+	program_loads.push_back(startProgramLoad(
+	    { GL_VERTEX_SHADER, GL_TESS_CONTROL_SHADER, GL_TESS_EVALUATION_SHADER, GL_FRAGMENT_SHADER },
+	    { vertexShader, tessControlShader, tessEvaluationShader, fragmentShader }, allow_errors, defines));
+	program_loads.back().done = done;
+}
 
-	return shaderProgram;
+void updateShaderPrograms()
+{
+	// Taken out first, since `done` may load more programs
+	std::vector<ProgramLoad> ready;
+	for(size_t i = 0; i < program_loads.size();)
+	{
+		if(program_loads[i].ready())
+		{
+			ready.push_back(program_loads[i]);
+			program_loads.erase(program_loads.begin() + i);
+		}
+		else
+		{
+			i++;
+		}
+	}
+	for(ProgramLoad& load : ready)
+	{
+		load.done(finishProgramLoad(load));
+	}
+}
+
+void finishShaderPrograms()
+{
+	while(!program_loads.empty())
+	{
+		std::vector<ProgramLoad> loads;
+		loads.swap(program_loads);
+		for(ProgramLoad& load : loads)
+		{
+			load.done(finishProgramLoad(load));
+		}
+	}
+}
+
+int pendingShaderPrograms()
+{
+	return int(program_loads.size());
 }
 
 
@@ -597,6 +951,7 @@ bool linkShaderProgram(GLuint shaderProgram, bool allow_errors)
 		}
 		return false;
 	}
+	reflectProgram(shaderProgram);
 	return true;
 }
 
@@ -724,7 +1079,7 @@ void debugDrawArrow(const glm::mat4& viewMat, const glm::mat4& projMat, glm::vec
 
 	GLint shader;
 	glGetIntegerv(GL_CURRENT_PROGRAM, &shader);
-	labhelper::setUniformSlow(shader, "modelViewProjectionMatrix", projMat * viewMat * modelMat);
+	labhelper::setUniform(shader, "modelViewProjectionMatrix", projMat * viewMat * modelMat);
 
 	glBindVertexArray(vao);
 	glDrawArrays(GL_LINES, 0, nverts);
@@ -821,7 +1176,7 @@ void debugDrawDisc()
 	glBindVertexArray(0);
 }
 
-void saveScreenshot()
+std::string saveScreenshot()
 {
 	std::vector<uint8_t> img;
 
@@ -832,26 +1187,24 @@ void saveScreenshot()
 	SDL_GL_GetDrawableSize(g_window, &lwidth, &lheight);
 
 	const int n_channels = 3;
-	img.resize(lwidth * lheight * n_channels);
+	const int row = lwidth * n_channels;
+	img.resize(row * lheight);
 
+	// Rows are tightly packed, also when they are not a multiple of 4 bytes
+	GLint alignment;
+	glGetIntegerv(GL_PACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
 	glReadPixels(0, 0, lwidth, lheight, GL_RGB, GL_UNSIGNED_BYTE, img.data());
-
-	for(int r = 0; r < lheight / 2; ++r)
-	{
-		int a = r * lwidth * n_channels;
-		int b = (lheight - 1 - r) * lwidth * n_channels;
-		for(int c = 0; c < lwidth * n_channels; ++c)
-		{
-			std::swap(img[a + c], img[b + c]);
-		}
-	}
+	glPixelStorei(GL_PACK_ALIGNMENT, alignment);
 
 
 	std::time_t tt = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
 	std::stringstream fname;
 	fname << std::put_time(std::localtime(&tt), "%Y-%m-%d_%H-%M-%S") << ".png";
 
-	stbi_write_png(fname.str().c_str(), lwidth, lheight, n_channels, img.data(), 0);
+	// GL reads the rows bottom up, a negative stride flips them
+	stbi_write_png(fname.str().c_str(), lwidth, lheight, n_channels, &img[row * (lheight - 1)], -row);
+	return fname.str();
 }
 
 void drawFullScreenQuad()
@@ -1069,6 +1422,16 @@ namespace file
 		}
 	}
 
+	bool replace(const std::string& from, const std::string& to)
+	{
+#ifdef WIN32
+		// rename() fails on Windows if the target exists
+		return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return rename(from.c_str(), to.c_str()) == 0;
+#endif
+	}
+
 } // namespace file
 
 } // namespace labhelper
@@ -7,11 +7,17 @@
 
 #include <string>
 #include <cassert>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 #include <SDL.h>
 #undef main
 #include <GL/glew.h>
 
+#include "uniforms.h"
+
 // Sometimes it exists, sometimes not...
 #ifndef M_PI
 #define M_PI 3.14159265358979323846f
@@ -113,17 +119,58 @@ GLuint loadCubeMap(const char* facePosX,
 std::string GetShaderInfoLog(GLuint obj);
 
 ///////////////////////////////////////////////////////////////////////////
-/// Loads and compiles a fragment and vertex shader. Then creates a shader program
-/// and attaches the shaders. Does NOT link the program, this is done with  linkShaderProgram()
-/// The reason for this is that before linking we need to bind attribute locations, using
-/// glBindAttribLocation and fragment data lications, using glBindFragDataLocation.
+/// Loads and compiles a fragment and vertex shader, and links them into a shader program,
+/// which is then reflected like by linkShaderProgram(). Returns 0 if anything fails.
+/// The defines, such as "#define NAME\n", are inserted after the #version line of both shaders.
+/// The linked program is saved as a program binary, which is loaded instead of compiling
+/// the next time, as long as the sources and the driver are the same.
 ///////////////////////////////////////////////////////////////////////////
 GLuint loadShaderProgram(const std::string& vertexShader,
                          const std::string& fragmentShader,
-                         bool allow_errors = false);
+                         bool allow_errors = false,
+                         const std::string& defines = "");
+
+///////////////////////////////////////////////////////////////////////////
+/// Like loadShaderProgram(), but returns before the program is compiled. Drivers with
+/// GL_KHR_parallel_shader_compile compile it on threads of their own meanwhile. `done` is
+/// called with the program, or 0, by the first updateShaderPrograms() after it is linked,
+/// or by finishShaderPrograms().
+///////////////////////////////////////////////////////////////////////////
+void loadShaderProgramAsync(const std::string& vertexShader,
+                            const std::string& fragmentShader,
+                            const std::function<void(GLuint)>& done,
+                            bool allow_errors = false,
+                            const std::string& defines = "");
+
+///////////////////////////////////////////////////////////////////////////
+/// Like loadShaderProgram() and loadShaderProgramAsync(), with tessellation control and
+/// evaluation shaders between the vertex and fragment shaders. Needs OpenGL 4.0.
+///////////////////////////////////////////////////////////////////////////
+GLuint loadTessellationShaderProgram(const std::string& vertexShader,
+                                     const std::string& tessControlShader,
+                                     const std::string& tessEvaluationShader,
+                                     const std::string& fragmentShader,
+                                     bool allow_errors = false,
+                                     const std::string& defines = "");
+void loadTessellationShaderProgramAsync(const std::string& vertexShader,
+                                        const std::string& tessControlShader,
+                                        const std::string& tessEvaluationShader,
+                                        const std::string& fragmentShader,
+                                        const std::function<void(GLuint)>& done,
+                                        bool allow_errors = false,
+                                        const std::string& defines = "");
+
+///////////////////////////////////////////////////////////////////////////
+/// Call once per frame to hand out the programs that are linked. finishShaderPrograms()
+/// waits for all of them.
+///////////////////////////////////////////////////////////////////////////
+void updateShaderPrograms();
+void finishShaderPrograms();
+int pendingShaderPrograms();
 
 ///////////////////////////////////////////////////////////////////////////
 /// Call to link a shader program prevoiusly loaded using loadShaderProgram.
+/// Also finds its uniforms and binds its uniform blocks, see reflectProgram().
 ///////////////////////////////////////////////////////////////////////////
 bool linkShaderProgram(GLuint shaderProgram, bool allow_errors = false);
 
@@ -152,7 +199,7 @@ GLuint createAddIndexBuffer(GLuint vertexArrayObject,
 ///////////////////////////////////////////////////////////////////////////
 /// Helper to set uniform variables in shaders, labeled SLOW because they find the location from string each time.
 /// In OpenGL (and similarly in other APIs) it is much more efficient (in terms of CPU time) to keep the uniform
-/// location, and use that. Or even better, use uniform buffers!
+/// location, and use that. Or even better, use uniform buffers! See setUniform() and UniformBuffer.
 /// However, in the simple tutorial samples, performance is not an issue.
 /// Overloaded to set many types.
 ///////////////////////////////////////////////////////////////////////////
@@ -188,9 +235,11 @@ void debugDrawDisc();
 
 
 ///////////////////////////////////////////////////////////////////////////
-/// Takes the image in the default framebuffer and stores it in a file
+/// Takes the image in the default framebuffer and stores it in a file.
+/// Returns the name of the file. Waits for the GPU and the encoding, see
+/// labhelper::capture for screenshots that do not.
 ///////////////////////////////////////////////////////////////////////////
-void saveScreenshot();
+std::string saveScreenshot();
 
 ///////////////////////////////////////////////////////////////////////////
 /// Generates random, uniformly distributed floating point
@@ -233,6 +282,33 @@ inline size_t array_length(const _T (&arr)[_Sz])
 	return _Sz;
 }
 
+///////////////////////////////////////////////////////////////////////////
+/// Call body(begin, end) for contiguous ranges of [0, count), one range
+/// per hardware thread but no smaller than `grain` items
+///////////////////////////////////////////////////////////////////////////
+template<typename Function>
+void parallelFor(size_t count, size_t grain, const Function& body)
+{
+	size_t number_of_threads = std::max(1u, std::thread::hardware_concurrency());
+	number_of_threads = std::min(number_of_threads, std::max<size_t>(1, count / grain));
+	if(number_of_threads == 1)
+	{
+		body(size_t(0), count);
+		return;
+	}
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < number_of_threads; t++)
+	{
+		size_t begin = count * t / number_of_threads;
+		size_t end = count * (t + 1) / number_of_threads;
+		threads.push_back(std::thread([&body, begin, end]() { body(begin, end); }));
+	}
+	for(auto& thread : threads)
+	{
+		thread.join();
+	}
+}
+
 
 namespace file
 {
@@ -241,5 +317,8 @@ namespace file
 	std::string file_stem(const std::string& file_name);
 	std::string file_extension(const std::string& file_name);
 	std::string change_extension(const std::string& file_name, const std::string& ext);
+	// Move from over to, replacing it in one step, so that there is always
+	// either the old or the new file at to
+	bool replace(const std::string& from, const std::string& to);
 } // namespace file
 } // namespace labhelper
@@ -0,0 +1,680 @@
+#include "mesh_optimization.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <numeric>
+#include <queue>
+#include <unordered_map>
+
+namespace labhelper
+{
+namespace
+{
+	// Clusters may have at most this many times the cache misses per
+	// triangle of the Tipsify order, even though each starts cold
+	const float cluster_cache_tolerance = 1.05f;
+	const uint32_t no_vertex = UINT32_MAX;
+	// A collapse may not turn the normal of a triangle further than this,
+	// as the cosine of the angle between the normal before and after
+	const float min_normal_cosine = 0.2f;
+	// Each simplified level must have at most this fraction of the
+	// triangles of the level before, or it is not worth keeping
+	const float max_level_triangle_ratio = 0.8f;
+
+	///////////////////////////////////////////////////////////////////////
+	// The triangles using each vertex, triangles[offsets[v]] onwards
+	///////////////////////////////////////////////////////////////////////
+	struct Adjacency
+	{
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> triangles;
+	};
+
+	void buildAdjacency(const std::vector<uint32_t>& indices, size_t number_of_vertices, Adjacency& adjacency)
+	{
+		adjacency.offsets.assign(number_of_vertices + 1, 0);
+		for(uint32_t index : indices)
+		{
+			adjacency.offsets[index + 1]++;
+		}
+		for(size_t v = 0; v < number_of_vertices; v++)
+		{
+			adjacency.offsets[v + 1] += adjacency.offsets[v];
+		}
+		std::vector<uint32_t> next(adjacency.offsets.begin(), adjacency.offsets.end() - 1);
+		adjacency.triangles.resize(indices.size());
+		for(size_t i = 0; i < indices.size(); i++)
+		{
+			adjacency.triangles[next[indices[i]]++] = uint32_t(i / 3);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// A FIFO cache simulated with time stamps: a vertex is in the cache if
+	// fewer than vertex_cache_size vertices have entered since it did
+	///////////////////////////////////////////////////////////////////////
+	class VertexCache
+	{
+	public:
+		explicit VertexCache(size_t number_of_vertices)
+		    : m_time_stamps(number_of_vertices, 0)
+		    , m_time(vertex_cache_size + 1)
+		{
+		}
+		// Time since the vertex entered the cache
+		size_t age(uint32_t v) const
+		{
+			return m_time - m_time_stamps[v];
+		}
+		// Returns true on a cache miss
+		bool use(uint32_t v)
+		{
+			if(age(v) <= vertex_cache_size)
+			{
+				return false;
+			}
+			m_time_stamps[v] = m_time++;
+			return true;
+		}
+		void flush()
+		{
+			m_time += vertex_cache_size + 1;
+		}
+
+	private:
+		std::vector<size_t> m_time_stamps;
+		size_t m_time;
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// The sum of squared distances to a set of planes, weighted by the
+	// areas of the triangles they come from
+	///////////////////////////////////////////////////////////////////////
+	struct Quadric
+	{
+		double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+		double weight = 0;
+
+		// The plane dot(normal, p) + d = 0, with a unit normal
+		void addPlane(const glm::dvec3& normal, double d, double area)
+		{
+			a2 += area * normal.x * normal.x;
+			ab += area * normal.x * normal.y;
+			ac += area * normal.x * normal.z;
+			ad += area * normal.x * d;
+			b2 += area * normal.y * normal.y;
+			bc += area * normal.y * normal.z;
+			bd += area * normal.y * d;
+			c2 += area * normal.z * normal.z;
+			cd += area * normal.z * d;
+			d2 += area * d * d;
+			weight += area;
+		}
+		Quadric& operator+=(const Quadric& q)
+		{
+			a2 += q.a2, ab += q.ab, ac += q.ac, ad += q.ad, b2 += q.b2;
+			bc += q.bc, bd += q.bd, c2 += q.c2, cd += q.cd, d2 += q.d2;
+			weight += q.weight;
+			return *this;
+		}
+		// Mean squared distance from p to the planes
+		double error(const glm::vec3& p) const
+		{
+			if(weight <= 0.0)
+			{
+				return 0.0;
+			}
+			const double x = p.x, y = p.y, z = p.z;
+			double e = a2 * x * x + b2 * y * y + c2 * z * z + 2.0 * (ab * x * y + ac * x * z + bc * y * z)
+			           + 2.0 * (ad * x + bd * y + cd * z) + d2;
+			return std::max(e, 0.0) / weight;
+		}
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// Moving vertex `from` onto vertex `to`. The versions are those of the
+	// two vertices when the cost was computed, a collapse is out of date
+	// once either of them has changed.
+	///////////////////////////////////////////////////////////////////////
+	struct Collapse
+	{
+		double cost;
+		uint32_t from, to;
+		uint32_t from_version, to_version;
+		bool operator>(const Collapse& other) const
+		{
+			return cost > other.cost;
+		}
+	};
+} // namespace
+
+std::vector<uint32_t> optimizeVertexCache(std::vector<uint32_t>& indices, size_t number_of_vertices)
+{
+	const size_t number_of_triangles = indices.size() / 3;
+	Adjacency adjacency;
+	buildAdjacency(indices, number_of_vertices, adjacency);
+
+	///////////////////////////////////////////////////////////////////////
+	// Tipsify. Emit all remaining triangles around a fanning vertex, then
+	// continue with the vertex used by those triangles that is closest to
+	// being evicted but will still be cached after its own triangles are
+	// emitted. When there is none, go back to the last vertex used that
+	// still has triangles left (a dead end), or to the next such vertex in
+	// index order.
+	///////////////////////////////////////////////////////////////////////
+	std::vector<uint32_t> live(number_of_vertices);
+	for(size_t v = 0; v < number_of_vertices; v++)
+	{
+		live[v] = adjacency.offsets[v + 1] - adjacency.offsets[v];
+	}
+	std::vector<bool> emitted(number_of_triangles, false);
+	std::vector<uint32_t> dead_ends;
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> output;
+	output.reserve(indices.size());
+	VertexCache cache(number_of_vertices);
+	size_t cursor = 0;
+	uint32_t fanning = number_of_vertices > 0 ? 0 : no_vertex;
+	while(fanning != no_vertex)
+	{
+		candidates.clear();
+		for(uint32_t a = adjacency.offsets[fanning]; a < adjacency.offsets[fanning + 1]; a++)
+		{
+			uint32_t t = adjacency.triangles[a];
+			if(emitted[t])
+			{
+				continue;
+			}
+			emitted[t] = true;
+			for(int c = 0; c < 3; c++)
+			{
+				uint32_t v = indices[t * 3 + c];
+				output.push_back(v);
+				dead_ends.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				cache.use(v);
+			}
+		}
+
+		fanning = no_vertex;
+		size_t best_priority = 0;
+		for(uint32_t v : candidates)
+		{
+			if(live[v] > 0 && cache.age(v) + 2 * live[v] <= vertex_cache_size && cache.age(v) > best_priority)
+			{
+				best_priority = cache.age(v);
+				fanning = v;
+			}
+		}
+		while(fanning == no_vertex && !dead_ends.empty())
+		{
+			uint32_t v = dead_ends.back();
+			dead_ends.pop_back();
+			if(live[v] > 0)
+			{
+				fanning = v;
+			}
+		}
+		while(fanning == no_vertex && cursor < number_of_vertices)
+		{
+			if(live[cursor] > 0)
+			{
+				fanning = uint32_t(cursor);
+			}
+			cursor++;
+		}
+	}
+	indices.swap(output);
+
+	///////////////////////////////////////////////////////////////////////
+	// Cut the triangles into clusters. A cluster may be drawn after any
+	// other, so each starts with a cold cache. A cluster is closed as soon
+	// as its cache miss ratio is close enough to that of the whole mesh.
+	///////////////////////////////////////////////////////////////////////
+	const float acmr = averageCacheMissRatio(indices.data(), indices.size(), number_of_vertices);
+	std::vector<uint32_t> clusters;
+	VertexCache cluster_cache(number_of_vertices);
+	size_t misses = 0;
+	size_t triangles_in_cluster = 0;
+	for(size_t t = 0; t < number_of_triangles; t++)
+	{
+		if(triangles_in_cluster == 0)
+		{
+			clusters.push_back(uint32_t(t));
+			cluster_cache.flush();
+			misses = 0;
+		}
+		for(int c = 0; c < 3; c++)
+		{
+			misses += cluster_cache.use(indices[t * 3 + c]) ? 1 : 0;
+		}
+		triangles_in_cluster++;
+		if(float(misses) <= cluster_cache_tolerance * acmr * float(triangles_in_cluster))
+		{
+			triangles_in_cluster = 0;
+		}
+	}
+	return clusters;
+}
+
+void optimizeOverdraw(std::vector<uint32_t>& indices,
+                      const std::vector<uint32_t>& clusters,
+                      const glm::vec3* positions)
+{
+	const size_t number_of_triangles = indices.size() / 3;
+	const size_t number_of_clusters = clusters.size();
+	auto clusterEnd = [&](size_t c) {
+		return c + 1 < number_of_clusters ? size_t(clusters[c + 1]) : number_of_triangles;
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// Area weighted centroid and normal of each cluster, and of the mesh
+	///////////////////////////////////////////////////////////////////////
+	std::vector<glm::vec3> centroids(number_of_clusters, glm::vec3(0.0f));
+	std::vector<glm::vec3> normals(number_of_clusters, glm::vec3(0.0f));
+	std::vector<float> areas(number_of_clusters, 0.0f);
+	glm::vec3 mesh_centroid(0.0f);
+	float mesh_area = 0.0f;
+	for(size_t c = 0; c < number_of_clusters; c++)
+	{
+		for(size_t t = clusters[c]; t < clusterEnd(c); t++)
+		{
+			const glm::vec3& p0 = positions[indices[t * 3 + 0]];
+			const glm::vec3& p1 = positions[indices[t * 3 + 1]];
+			const glm::vec3& p2 = positions[indices[t * 3 + 2]];
+			glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+			float area = glm::length(normal);
+			centroids[c] += area * (p0 + p1 + p2) / 3.0f;
+			normals[c] += normal;
+			areas[c] += area;
+		}
+		mesh_centroid += centroids[c];
+		mesh_area += areas[c];
+	}
+	if(mesh_area > 0.0f)
+	{
+		mesh_centroid /= mesh_area;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Clusters far out along their own normal are likely to occlude the
+	// rest of the mesh, draw those first
+	///////////////////////////////////////////////////////////////////////
+	std::vector<float> scores(number_of_clusters, 0.0f);
+	for(size_t c = 0; c < number_of_clusters; c++)
+	{
+		float normal_length = glm::length(normals[c]);
+		if(areas[c] > 0.0f && normal_length > 0.0f)
+		{
+			scores[c] = glm::dot(centroids[c] / areas[c] - mesh_centroid, normals[c] / normal_length);
+		}
+	}
+	std::vector<uint32_t> order(number_of_clusters);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(),
+	                 [&](uint32_t a, uint32_t b) { return scores[a] > scores[b]; });
+
+	std::vector<uint32_t> output;
+	output.reserve(indices.size());
+	for(uint32_t c : order)
+	{
+		output.insert(output.end(), indices.begin() + clusters[c] * 3, indices.begin() + clusterEnd(c) * 3);
+	}
+	indices.swap(output);
+}
+
+void optimizeVertexFetch(std::vector<uint32_t>& indices,
+                         size_t number_of_vertices,
+                         std::vector<uint32_t>& remap)
+{
+	remap.assign(number_of_vertices, no_vertex);
+	uint32_t next_vertex = 0;
+	for(uint32_t& index : indices)
+	{
+		if(remap[index] == no_vertex)
+		{
+			remap[index] = next_vertex++;
+		}
+		index = remap[index];
+	}
+}
+
+float averageCacheMissRatio(const uint32_t* indices, size_t number_of_indices, size_t number_of_vertices)
+{
+	if(number_of_indices < 3)
+	{
+		return 0.0f;
+	}
+	VertexCache cache(number_of_vertices);
+	size_t misses = 0;
+	for(size_t i = 0; i < number_of_indices; i++)
+	{
+		misses += cache.use(indices[i]) ? 1 : 0;
+	}
+	return float(misses) / float(number_of_indices / 3);
+}
+
+std::vector<SimplifiedMesh> simplifyMesh(const std::vector<uint32_t>& original_indices,
+                                         const glm::vec3* positions,
+                                         size_t number_of_vertices,
+                                         const std::vector<size_t>& target_triangles)
+{
+	std::vector<uint32_t> indices = original_indices;
+	const size_t number_of_triangles = indices.size() / 3;
+	auto nextInTriangle = [](size_t i) { return i - i % 3 + (i + 1) % 3; };
+
+	///////////////////////////////////////////////////////////////////////
+	// Vertices with the same position are copies of one vertex of the
+	// surface, which the first of them in position order stands for. The
+	// copies of surface vertex s are order[first_copy[s]] up to, but not
+	// including, order[end_copy[s]].
+	///////////////////////////////////////////////////////////////////////
+	std::vector<uint32_t> order(number_of_vertices);
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		const glm::vec3& pa = positions[a];
+		const glm::vec3& pb = positions[b];
+		if(pa.x != pb.x)
+			return pa.x < pb.x;
+		if(pa.y != pb.y)
+			return pa.y < pb.y;
+		return pa.z < pb.z;
+	});
+	std::vector<uint32_t> surface_vertex(number_of_vertices);
+	std::vector<uint32_t> first_copy(number_of_vertices, 0), end_copy(number_of_vertices, 0);
+	for(size_t i = 0; i < number_of_vertices;)
+	{
+		size_t j = i + 1;
+		while(j < number_of_vertices && positions[order[j]] == positions[order[i]])
+		{
+			j++;
+		}
+		for(size_t k = i; k < j; k++)
+		{
+			surface_vertex[order[k]] = order[i];
+		}
+		first_copy[order[i]] = uint32_t(i);
+		end_copy[order[i]] = uint32_t(j);
+		i = j;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// An edge of the surface that does not have exactly two triangles is
+	// on a border, or not manifold, and its vertices are locked. An edge
+	// with two triangles that use different copies of its vertices is on
+	// a seam.
+	///////////////////////////////////////////////////////////////////////
+	auto edgeKey = [](uint32_t a, uint32_t b) { return uint64_t(std::min(a, b)) << 32 | std::max(a, b); };
+	std::unordered_map<uint64_t, uint32_t> surface_edges, edges;
+	surface_edges.reserve(indices.size());
+	edges.reserve(indices.size());
+	for(size_t i = 0; i < indices.size(); i++)
+	{
+		const uint32_t a = indices[i];
+		const uint32_t b = indices[nextInTriangle(i)];
+		surface_edges[edgeKey(surface_vertex[a], surface_vertex[b])]++;
+		edges[edgeKey(a, b)]++;
+	}
+	std::vector<bool> locked(number_of_vertices, false);
+	for(size_t i = 0; i < indices.size(); i++)
+	{
+		const uint32_t a = surface_vertex[indices[i]];
+		const uint32_t b = surface_vertex[indices[nextInTriangle(i)]];
+		if(surface_edges[edgeKey(a, b)] != 2)
+		{
+			locked[a] = true;
+			locked[b] = true;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// The planes of the triangles around each surface vertex. Seams also
+	// get planes through their edges, across the triangle, so that the
+	// copies of their vertices stay on the seam.
+	///////////////////////////////////////////////////////////////////////
+	std::vector<Quadric> quadrics(number_of_vertices);
+	std::vector<std::vector<uint32_t>> vertex_triangles(number_of_vertices);
+	for(size_t t = 0; t < number_of_triangles; t++)
+	{
+		const uint32_t* triangle = &indices[t * 3];
+		for(int c = 0; c < 3; c++)
+		{
+			vertex_triangles[triangle[c]].push_back(uint32_t(t));
+		}
+		const glm::dvec3 p[3] = { glm::dvec3(positions[triangle[0]]), glm::dvec3(positions[triangle[1]]),
+			                      glm::dvec3(positions[triangle[2]]) };
+		glm::dvec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+		const double length = glm::length(normal);
+		if(length == 0.0)
+		{
+			continue;
+		}
+		normal /= length;
+		Quadric plane;
+		plane.addPlane(normal, -glm::dot(normal, p[0]), 0.5 * length);
+		for(int c = 0; c < 3; c++)
+		{
+			quadrics[surface_vertex[triangle[c]]] += plane;
+		}
+		for(int c = 0; c < 3; c++)
+		{
+			const uint32_t a = triangle[c];
+			const uint32_t b = triangle[(c + 1) % 3];
+			const uint64_t surface_edge = edgeKey(surface_vertex[a], surface_vertex[b]);
+			if(edges[edgeKey(a, b)] != 1 || surface_edges[surface_edge] != 2)
+			{
+				continue;
+			}
+			const glm::dvec3 edge = p[(c + 1) % 3] - p[c];
+			const glm::dvec3 edge_normal = glm::normalize(glm::cross(edge, normal));
+			Quadric seam;
+			seam.addPlane(edge_normal, -glm::dot(edge_normal, p[c]), glm::dot(edge, edge));
+			quadrics[surface_vertex[a]] += seam;
+			quadrics[surface_vertex[b]] += seam;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// All possible collapses, cheapest first. A collapse moves every copy
+	// of a surface vertex to the position of a neighbour.
+	///////////////////////////////////////////////////////////////////////
+	std::vector<uint32_t> versions(number_of_vertices, 0);
+	std::vector<bool> collapsed(number_of_vertices, false);
+	std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> collapses;
+	auto addCollapse = [&](uint32_t from, uint32_t to) {
+		const uint32_t surface_from = surface_vertex[from];
+		const uint32_t surface_to = surface_vertex[to];
+		if(locked[surface_from] || surface_from == surface_to)
+		{
+			return;
+		}
+		Quadric quadric = quadrics[surface_from];
+		quadric += quadrics[surface_to];
+		collapses.push({ quadric.error(positions[to]), surface_from, surface_to, versions[surface_from],
+		                 versions[surface_to] });
+	};
+	for(size_t i = 0; i < indices.size(); i++)
+	{
+		const uint32_t a = indices[i];
+		const uint32_t b = indices[nextInTriangle(i)];
+		addCollapse(a, b);
+		addCollapse(b, a);
+	}
+
+	// Each copy of `from` must move onto a copy of `to` that it shares an
+	// edge with. Otherwise the copies are on a seam that does not follow
+	// the edge, or a corner of one, and moving them would tear the seam.
+	std::vector<bool> removed(number_of_triangles, false);
+	std::vector<std::pair<uint32_t, uint32_t>> moves;
+	auto findMoves = [&](uint32_t surface_from, uint32_t surface_to) {
+		moves.clear();
+		for(uint32_t i = first_copy[surface_from]; i < end_copy[surface_from]; i++)
+		{
+			const uint32_t from = order[i];
+			uint32_t to = no_vertex;
+			bool used = false;
+			for(uint32_t t : vertex_triangles[from])
+			{
+				for(int c = 0; c < 3 && !removed[t]; c++)
+				{
+					to = surface_vertex[indices[t * 3 + c]] == surface_to ? indices[t * 3 + c] : to;
+					used = true;
+				}
+			}
+			if(to == no_vertex && used)
+			{
+				return false;
+			}
+			moves.push_back({ from, to });
+		}
+		return true;
+	};
+
+	// Whether moving `from` onto `to` flips, or nearly flips, a triangle
+	// that remains. Triangles that end up with two copies of the same
+	// vertex are degenerate and count as flipped.
+	auto flips = [&](uint32_t from, uint32_t to) {
+		for(uint32_t t : vertex_triangles[from])
+		{
+			const uint32_t* triangle = &indices[t * 3];
+			if(removed[t] || triangle[0] == to || triangle[1] == to || triangle[2] == to)
+			{
+				continue;
+			}
+			glm::vec3 before[3], after[3];
+			for(int c = 0; c < 3; c++)
+			{
+				before[c] = positions[triangle[c]];
+				after[c] = triangle[c] == from ? positions[to] : before[c];
+			}
+			glm::vec3 normal_before = glm::cross(before[1] - before[0], before[2] - before[0]);
+			glm::vec3 normal_after = glm::cross(after[1] - after[0], after[2] - after[0]);
+			float length_before = glm::length(normal_before);
+			if(length_before > 0.0f
+			   && glm::dot(normal_before, normal_after)
+			          <= min_normal_cosine * length_before * glm::length(normal_after))
+			{
+				return true;
+			}
+		}
+		return false;
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// Collapse the cheapest valid edge until each target is reached. The
+	// error of a level is that of the most expensive collapse so far.
+	///////////////////////////////////////////////////////////////////////
+	std::vector<SimplifiedMesh> levels;
+	std::vector<uint32_t> neighbours;
+	size_t remaining_triangles = number_of_triangles;
+	double max_error = 0.0;
+	for(size_t target : target_triangles)
+	{
+		while(remaining_triangles > target && !collapses.empty())
+		{
+			const Collapse collapse = collapses.top();
+			collapses.pop();
+			const uint32_t surface_from = collapse.from;
+			const uint32_t surface_to = collapse.to;
+			const bool out_of_date = collapse.from_version != versions[surface_from]
+			                         || collapse.to_version != versions[surface_to];
+			if(collapsed[surface_from] || collapsed[surface_to] || out_of_date
+			   || !findMoves(surface_from, surface_to))
+			{
+				continue;
+			}
+			bool valid = true;
+			for(const auto& move : moves)
+			{
+				valid = valid && (move.second == no_vertex || !flips(move.first, move.second));
+			}
+			if(!valid)
+			{
+				continue;
+			}
+
+			neighbours.clear();
+			for(const auto& move : moves)
+			{
+				const uint32_t from = move.first;
+				const uint32_t to = move.second;
+				for(uint32_t t : vertex_triangles[from])
+				{
+					uint32_t* triangle = &indices[t * 3];
+					if(removed[t])
+					{
+						continue;
+					}
+					if(triangle[0] == to || triangle[1] == to || triangle[2] == to)
+					{
+						removed[t] = true;
+						remaining_triangles--;
+						continue;
+					}
+					for(int c = 0; c < 3; c++)
+					{
+						triangle[c] = triangle[c] == from ? to : triangle[c];
+					}
+					vertex_triangles[to].push_back(t);
+				}
+				std::vector<uint32_t>().swap(vertex_triangles[from]);
+				if(to == no_vertex)
+				{
+					continue;
+				}
+				std::vector<uint32_t>& to_triangles = vertex_triangles[to];
+				to_triangles.erase(std::remove_if(to_triangles.begin(), to_triangles.end(),
+				                                  [&](uint32_t t) { return removed[t]; }),
+				                   to_triangles.end());
+				for(uint32_t t : to_triangles)
+				{
+					for(int c = 0; c < 3; c++)
+					{
+						if(indices[t * 3 + c] != to)
+							neighbours.push_back(indices[t * 3 + c]);
+					}
+				}
+			}
+			quadrics[surface_to] += quadrics[surface_from];
+			collapsed[surface_from] = true;
+			versions[surface_from]++;
+			versions[surface_to]++;
+			max_error = std::max(max_error, collapse.cost);
+
+			// The collapses from and onto the moved vertex now cost more
+			std::sort(neighbours.begin(), neighbours.end());
+			neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+			const uint32_t to = moves.front().second != no_vertex ? moves.front().second : surface_to;
+			for(uint32_t neighbour : neighbours)
+			{
+				addCollapse(neighbour, to);
+				addCollapse(to, neighbour);
+			}
+		}
+
+		const size_t previous_triangles =
+		    levels.empty() ? number_of_triangles : levels.back().indices.size() / 3;
+		if(float(remaining_triangles) > max_level_triangle_ratio * float(previous_triangles))
+		{
+			break;
+		}
+		SimplifiedMesh level;
+		level.indices.reserve(remaining_triangles * 3);
+		for(size_t t = 0; t < number_of_triangles; t++)
+		{
+			if(!removed[t])
+			{
+				level.indices.insert(level.indices.end(), &indices[t * 3], &indices[t * 3] + 3);
+			}
+		}
+		level.error = float(std::sqrt(max_error));
+		levels.push_back(level);
+		if(remaining_triangles > target)
+		{
+			break;
+		}
+	}
+	return levels;
+}
+} // namespace labhelper
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// Triangle and vertex order of indexed meshes.
+//
+// optimizeVertexCache() and optimizeOverdraw() implement "Fast Triangle
+// Reordering for Vertex Locality and Reduced Overdraw" (Sander, Nehab and
+// Barczak, SIGGRAPH 2007). Tipsify orders the triangles so that vertices
+// are still in the post-transform cache when they are used again. The
+// triangles are then cut into clusters, which are sorted so that those
+// most likely to occlude the rest of the mesh are drawn first.
+//
+// simplifyMesh() implements "Surface Simplification Using Quadric Error
+// Metrics" (Garland and Heckbert, SIGGRAPH 1997), for levels of detail.
+///////////////////////////////////////////////////////////////////////////////
+namespace labhelper
+{
+// Size of the FIFO post-transform cache the meshes are optimized for
+const size_t vertex_cache_size = 16;
+
+///////////////////////////////////////////////////////////////////////////
+/// Reorder the triangles for the post-transform vertex cache. Returns the
+/// first triangle of each cluster: a run of triangles that can be drawn in
+/// any order relative to the other clusters without costing more than a
+/// few percent in cache misses.
+///////////////////////////////////////////////////////////////////////////
+std::vector<uint32_t> optimizeVertexCache(std::vector<uint32_t>& indices, size_t number_of_vertices);
+
+///////////////////////////////////////////////////////////////////////////
+/// Sort the clusters found by optimizeVertexCache() so that clusters on
+/// the outside of the mesh, facing out, are drawn first
+///////////////////////////////////////////////////////////////////////////
+void optimizeOverdraw(std::vector<uint32_t>& indices,
+                      const std::vector<uint32_t>& clusters,
+                      const glm::vec3* positions);
+
+///////////////////////////////////////////////////////////////////////////
+/// Renumber the vertices in the order they are first used, so that they
+/// are fetched from memory in order. remap[old index] is set to the new
+/// index, or to UINT32_MAX for vertices that are not used.
+///////////////////////////////////////////////////////////////////////////
+void optimizeVertexFetch(std::vector<uint32_t>& indices,
+                         size_t number_of_vertices,
+                         std::vector<uint32_t>& remap);
+
+///////////////////////////////////////////////////////////////////////////
+/// Vertex shader invocations per triangle (ACMR) with a FIFO cache of
+/// vertex_cache_size vertices. 3 without any reuse, 0.5 at best.
+///////////////////////////////////////////////////////////////////////////
+float averageCacheMissRatio(const uint32_t* indices, size_t number_of_indices, size_t number_of_vertices);
+
+struct SimplifiedMesh
+{
+	std::vector<uint32_t> indices;
+	// Root mean square distance from the removed vertices to the planes of
+	// the original triangles around them, in the units of the positions
+	float error;
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// Simplify a mesh to each of the decreasing target triangle counts in
+/// turn, by collapsing vertices onto a neighbour. The levels only use the
+/// vertices of the mesh. Vertices on borders are never removed. Vertices
+/// on seams, where vertices share a position but not their other
+/// attributes, are only collapsed along the seam. Stops early, with fewer
+/// levels, when no more vertices can be removed without flipping
+/// triangles.
+///////////////////////////////////////////////////////////////////////////
+std::vector<SimplifiedMesh> simplifyMesh(const std::vector<uint32_t>& indices,
+                                         const glm::vec3* positions,
+                                         size_t number_of_vertices,
+                                         const std::vector<size_t>& target_triangles);
+} // namespace labhelper
@@ -0,0 +1,328 @@
+#include "profiler.h"
+#include "trace.h"
+#include <GL/glew.h>
+#include <imgui.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+
+namespace labhelper
+{
+namespace profiler
+{
+	namespace
+	{
+		typedef std::chrono::steady_clock Clock;
+
+		struct Record
+		{
+			const char* name;
+			int depth;
+			Clock::time_point cpu_begin, cpu_end;
+			// Indices into Frame::queries, or -1 if only timed on the CPU
+			int query_begin, query_end;
+		};
+
+		struct Frame
+		{
+			std::vector<Record> records;
+			// Reused, and added to when a frame has more zones than before
+			std::vector<GLuint> queries;
+			size_t used_queries = 0;
+			// Whether the results have yet to be read
+			bool pending = false;
+		};
+
+		struct History
+		{
+			std::string name;
+			int depth;
+			bool gpu;
+			// Ring buffers of times in milliseconds
+			std::vector<float> cpu, gpu_times;
+			size_t next = 0;
+		};
+
+		Frame frames[frames_in_flight];
+		uint64_t frame_number = 0;
+		// Records of the current frame that have not ended
+		std::vector<size_t> open_records;
+		bool in_frame = false;
+		std::vector<History> histories;
+		std::unordered_map<std::string, size_t> history_indices;
+		uint64_t dropped_frames = 0;
+
+		bool timerQueriesSupported()
+		{
+			return GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+		}
+
+		Frame& currentFrame()
+		{
+			return frames[frame_number % frames_in_flight];
+		}
+
+		int timestamp(Frame& frame)
+		{
+			if(frame.used_queries == frame.queries.size())
+			{
+				GLuint query;
+				glGenQueries(1, &query);
+				frame.queries.push_back(query);
+			}
+			glQueryCounter(frame.queries[frame.used_queries], GL_TIMESTAMP);
+			return int(frame.used_queries++);
+		}
+
+		float milliseconds(Clock::duration duration)
+		{
+			return std::chrono::duration<float, std::milli>(duration).count();
+		}
+
+		// Add the times of a frame to the histories, or drop them if the
+		// GPU is not done with the frame yet
+		void collect(Frame& frame)
+		{
+			frame.pending = false;
+			if(frame.used_queries > 0)
+			{
+				// Queries finish in order, so the last one is enough
+				GLint available = 0;
+				GLuint last = frame.queries[frame.used_queries - 1];
+				glGetQueryObjectiv(last, GL_QUERY_RESULT_AVAILABLE, &available);
+				if(!available)
+				{
+					dropped_frames++;
+					return;
+				}
+			}
+
+			// Zones that run more than once in a frame add up
+			struct Sample
+			{
+				float cpu = 0.0f;
+				float gpu = 0.0f;
+			};
+			std::vector<Sample> samples(histories.size());
+			std::vector<bool> ran(histories.size(), false);
+			for(const Record& record : frame.records)
+			{
+				auto it = history_indices.find(record.name);
+				size_t index;
+				if(it == history_indices.end())
+				{
+					index = histories.size();
+					history_indices[record.name] = index;
+					History history;
+					history.name = record.name;
+					history.depth = record.depth;
+					history.gpu = record.query_begin >= 0;
+					histories.push_back(history);
+					samples.emplace_back();
+					ran.push_back(false);
+				}
+				else
+				{
+					index = it->second;
+				}
+				ran[index] = true;
+				samples[index].cpu += milliseconds(record.cpu_end - record.cpu_begin);
+				if(record.query_begin >= 0)
+				{
+					GLuint64 begin = 0, end = 0;
+					glGetQueryObjectui64v(frame.queries[record.query_begin], GL_QUERY_RESULT, &begin);
+					glGetQueryObjectui64v(frame.queries[record.query_end], GL_QUERY_RESULT, &end);
+					samples[index].gpu += float(double(end - begin) * 1e-6);
+				}
+			}
+
+			for(size_t i = 0; i < histories.size(); i++)
+			{
+				if(!ran[i])
+				{
+					continue;
+				}
+				History& history = histories[i];
+				if(history.cpu.size() < size_t(history_length))
+				{
+					history.cpu.push_back(samples[i].cpu);
+					history.gpu_times.push_back(samples[i].gpu);
+				}
+				else
+				{
+					history.cpu[history.next] = samples[i].cpu;
+					history.gpu_times[history.next] = samples[i].gpu;
+				}
+				history.next = (history.next + 1) % history_length;
+			}
+		}
+
+		float average(const std::vector<float>& times)
+		{
+			float sum = 0.0f;
+			for(float time : times)
+			{
+				sum += time;
+			}
+			return times.empty() ? 0.0f : sum / float(times.size());
+		}
+
+		float percentile(std::vector<float> times, float fraction)
+		{
+			if(times.empty())
+			{
+				return 0.0f;
+			}
+			auto nth = times.begin() + size_t(fraction * float(times.size() - 1) + 0.5f);
+			std::nth_element(times.begin(), nth, times.end());
+			return *nth;
+		}
+	} // namespace
+
+	void beginFrame()
+	{
+		if(in_frame)
+		{
+			endFrame();
+		}
+		Frame& frame = currentFrame();
+		if(frame.pending)
+		{
+			collect(frame);
+		}
+		frame.records.clear();
+		frame.used_queries = 0;
+		in_frame = true;
+		beginZone("Frame");
+	}
+
+	void endFrame()
+	{
+		if(!in_frame)
+		{
+			return;
+		}
+		if(open_records.size() != 1)
+		{
+			std::cout << "Profiler: " << open_records.size() - 1 << " zones were not ended in frame "
+			          << frame_number << std::endl;
+		}
+		while(!open_records.empty())
+		{
+			endZone();
+		}
+		currentFrame().pending = true;
+		in_frame = false;
+		frame_number++;
+	}
+
+	void beginZone(const char* name, bool gpu)
+	{
+		if(!in_frame)
+		{
+			return;
+		}
+		Frame& frame = currentFrame();
+		Record record;
+		record.name = name;
+		record.depth = int(open_records.size());
+		record.query_begin = gpu && timerQueriesSupported() ? timestamp(frame) : -1;
+		record.query_end = -1;
+		record.cpu_begin = Clock::now();
+		trace::begin(name);
+		open_records.push_back(frame.records.size());
+		frame.records.push_back(record);
+	}
+
+	void endZone()
+	{
+		if(!in_frame || open_records.empty())
+		{
+			return;
+		}
+		Frame& frame = currentFrame();
+		Record& record = frame.records[open_records.back()];
+		open_records.pop_back();
+		record.cpu_end = Clock::now();
+		trace::end();
+		if(record.query_begin >= 0)
+		{
+			record.query_end = timestamp(frame);
+		}
+	}
+
+	std::vector<ZoneStatistics> statistics()
+	{
+		std::vector<ZoneStatistics> result;
+		for(const History& history : histories)
+		{
+			ZoneStatistics zone;
+			zone.name = history.name;
+			zone.depth = history.depth;
+			zone.gpu = history.gpu;
+			zone.cpu_average = average(history.cpu);
+			zone.cpu_95th = percentile(history.cpu, 0.95f);
+			zone.gpu_average = average(history.gpu_times);
+			zone.gpu_median = percentile(history.gpu_times, 0.5f);
+			zone.gpu_95th = percentile(history.gpu_times, 0.95f);
+			result.push_back(zone);
+		}
+		return result;
+	}
+
+	void gui()
+	{
+		if(!ImGui::CollapsingHeader("Profiler"))
+		{
+			return;
+		}
+		if(!timerQueriesSupported())
+		{
+			ImGui::Text("No timer queries, GPU times are not available");
+		}
+		ImGui::Text("Milliseconds over the last %d frames, %d frames dropped", history_length,
+		            int(dropped_frames));
+		ImGui::Columns(6, "profiler");
+		for(const char* heading : { "Zone", "CPU", "CPU 95%", "GPU", "GPU median", "GPU 95%" })
+		{
+			ImGui::Text("%s", heading);
+			ImGui::NextColumn();
+		}
+		ImGui::Separator();
+		for(const ZoneStatistics& zone : statistics())
+		{
+			ImGui::Text("%*s%s", 2 * zone.depth, "", zone.name.c_str());
+			ImGui::NextColumn();
+			ImGui::Text("%.2f", zone.cpu_average);
+			ImGui::NextColumn();
+			ImGui::Text("%.2f", zone.cpu_95th);
+			ImGui::NextColumn();
+			for(float time : { zone.gpu_average, zone.gpu_median, zone.gpu_95th })
+			{
+				if(zone.gpu)
+				{
+					ImGui::Text("%.2f", time);
+				}
+				ImGui::NextColumn();
+			}
+		}
+		ImGui::Columns(1);
+	}
+
+	void shutDown()
+	{
+		for(Frame& frame : frames)
+		{
+			if(!frame.queries.empty())
+			{
+				glDeleteQueries(GLsizei(frame.queries.size()), frame.queries.data());
+			}
+			frame = Frame();
+		}
+		open_records.clear();
+		in_frame = false;
+	}
+} // namespace profiler
+} // namespace labhelper
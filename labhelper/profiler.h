@@ -0,0 +1,91 @@
+#pragma once
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// CPU and GPU timing of the parts of a frame.
+//
+// A zone is timed on the CPU with a steady clock, and on the GPU with a
+// GL_TIMESTAMP query at each end. Timestamps rather than GL_TIME_ELAPSED
+// queries are used, since the latter cannot be nested. Query results are
+// read frames_in_flight frames later, when the GPU should be done with
+// them, and a frame whose results are not ready by then is dropped rather
+// than waited for, so the profiler never stalls the pipeline.
+//
+// Zones are identified by name, and may be nested. Each frame is itself a
+// zone, "Frame", that the others are nested in. The times of a zone that
+// runs more than once in a frame are added up. Zones are also events in
+// labhelper::trace, when it is recording.
+//
+// Only for the thread with the GL context.
+///////////////////////////////////////////////////////////////////////////////
+namespace labhelper
+{
+namespace profiler
+{
+	// Frames that results are read after, and frames that statistics are
+	// kept for
+	const int frames_in_flight = 4;
+	const int history_length = 128;
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Call at the start and at the end of each frame, before the buffers
+	/// are swapped
+	///////////////////////////////////////////////////////////////////////////
+	void beginFrame();
+	void endFrame();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Time what is done between beginZone() and the matching endZone().
+	/// Zones without `gpu` are only timed on the CPU. The name is kept
+	/// until the results are read, so it should be a string literal.
+	///////////////////////////////////////////////////////////////////////////
+	void beginZone(const char* name, bool gpu = true);
+	void endZone();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// A zone for the rest of the enclosing scope
+	///////////////////////////////////////////////////////////////////////////
+	class Zone
+	{
+	public:
+		explicit Zone(const char* name, bool gpu = true)
+		{
+			beginZone(name, gpu);
+		}
+		~Zone()
+		{
+			endZone();
+		}
+		Zone(const Zone&) = delete;
+		Zone& operator=(const Zone&) = delete;
+	};
+
+	struct ZoneStatistics
+	{
+		std::string name;
+		// Number of zones it is nested in
+		int depth;
+		// In milliseconds, over the last history_length frames it ran in
+		float cpu_average, cpu_95th;
+		float gpu_average, gpu_median, gpu_95th;
+		// False for zones only timed on the CPU, and without timer queries
+		bool gpu;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// All zones so far, in the order they first began
+	///////////////////////////////////////////////////////////////////////////
+	std::vector<ZoneStatistics> statistics();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Show the statistics in the current ImGui window
+	///////////////////////////////////////////////////////////////////////////
+	void gui();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Delete the queries
+	///////////////////////////////////////////////////////////////////////////
+	void shutDown();
+} // namespace profiler
+} // namespace labhelper
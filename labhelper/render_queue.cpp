@@ -0,0 +1,302 @@
+#include "render_queue.h"
+#include "uniforms.h"
+#include <algorithm>
+#include <cstring>
+
+namespace labhelper
+{
+namespace
+{
+	const int pass_shift = 60;
+	const int program_shift = 48;
+	const int textures_shift = 36;
+	const int material_shift = 24;
+	const uint32_t max_number = (1 << 12) - 1;
+
+	// As glMultiDrawElementsIndirect() reads it
+	struct DrawCommand
+	{
+		GLuint count;
+		GLuint instance_count;
+		GLuint first_index;
+		GLint base_vertex;
+		GLuint base_instance;
+	};
+
+	// Non-negative floats compare as their bits do. The top 24 bits below
+	// the sign keep the 8 exponent bits and the top 16 of the mantissa.
+	uint64_t depthKey(float depth)
+	{
+		depth = std::max(depth, 0.0f);
+		uint32_t bits;
+		memcpy(&bits, &depth, sizeof(bits));
+		return (bits >> 7) & 0xffffff;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Least significant digit radix sort on the keys, a byte at a time.
+	// Stable, so that equal keys are drawn in the order they were added.
+	// Bytes that are the same in all keys are skipped, which with few
+	// programs and materials is most of them.
+	///////////////////////////////////////////////////////////////////////
+	template<typename T>
+	void radixSort(std::vector<T>& keys, std::vector<T>& scratch)
+	{
+		scratch.resize(keys.size());
+		for(int shift = 0; shift < 64; shift += 8)
+		{
+			size_t offsets[256] = {};
+			for(const T& key : keys)
+			{
+				offsets[(key.key >> shift) & 0xff]++;
+			}
+			if(offsets[(keys[0].key >> shift) & 0xff] == keys.size())
+			{
+				continue;
+			}
+			size_t offset = 0;
+			for(size_t& count : offsets)
+			{
+				size_t next = offset + count;
+				count = offset;
+				offset = next;
+			}
+			for(const T& key : keys)
+			{
+				scratch[offsets[(key.key >> shift) & 0xff]++] = key;
+			}
+			keys.swap(scratch);
+		}
+	}
+} // namespace
+
+uint32_t RenderQueue::number(std::unordered_map<uint64_t, uint32_t>& numbers, uint64_t key)
+{
+	auto it = numbers.find(key);
+	if(it != numbers.end())
+	{
+		return it->second;
+	}
+	uint32_t n = uint32_t(std::min(numbers.size(), size_t(max_number)));
+	numbers[key] = n;
+	return n;
+}
+
+void RenderQueue::add(const Model* model,
+                      GLuint program,
+                      const glm::mat4& modelViewMatrix,
+                      const glm::mat4& projectionMatrix,
+                      const void* object_uniforms,
+                      size_t object_uniforms_size,
+                      uint8_t pass,
+                      bool submitMaterials)
+{
+	m_draws.clear();
+	selectMeshes(model, modelViewMatrix, projectionMatrix, m_draws);
+	if(m_draws.empty())
+	{
+		return;
+	}
+
+	if(m_object_alignment == 0)
+	{
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &m_object_alignment);
+		m_object_alignment = std::max(m_object_alignment, 1);
+	}
+	size_t offset = m_object_uniforms.size();
+	offset = (offset + m_object_alignment - 1) / m_object_alignment * m_object_alignment;
+	m_object_uniforms.resize(offset + object_uniforms_size);
+	memcpy(&m_object_uniforms[offset], object_uniforms, object_uniforms_size);
+	m_object_offsets.push_back(offset);
+	m_object_sizes.push_back(object_uniforms_size);
+
+	Item item;
+	item.model = model;
+	item.program = program;
+	item.source = materialSource(model, program, submitMaterials);
+	item.object = uint32_t(m_object_offsets.size() - 1);
+	const uint64_t model_number = number(m_models, uint64_t(uintptr_t(model)));
+	const uint64_t program_key = uint64_t(number(m_programs, program)) << program_shift;
+	for(const MeshDraw& draw : m_draws)
+	{
+		const Mesh& mesh = model->m_meshes[draw.mesh];
+		item.material_idx = mesh.m_material_idx;
+		item.base_vertex = mesh.m_base_vertex;
+		item.start_index = draw.start_index;
+		item.number_of_indices = draw.number_of_indices;
+
+		item.textures = materialTexturesKey(model, mesh.m_material_idx, item.source);
+
+		SortKey key;
+		key.key = uint64_t(pass & 0xf) << pass_shift | program_key;
+		key.key |= uint64_t(number(m_textures, item.textures)) << textures_shift;
+		if(item.source == materials_from_storage || item.source == no_materials)
+		{
+			// Materials cost nothing to change, but the object does, and
+			// the meshes of an object can share a multi-draw
+			key.key |= uint64_t(std::min(item.object, max_number)) << material_shift;
+		}
+		else
+		{
+			uint64_t material = model_number << 32 | mesh.m_material_idx;
+			key.key |= uint64_t(number(m_materials, material)) << material_shift;
+		}
+		glm::vec4 center = modelViewMatrix * glm::vec4(mesh.m_bounding_sphere_center, 1.0f);
+		key.key |= depthKey(-center.z);
+		key.item = uint32_t(m_items.size());
+		m_keys.push_back(key);
+		m_items.push_back(item);
+	}
+}
+
+void RenderQueue::submit()
+{
+	if(!m_keys.empty())
+	{
+		radixSort(m_keys, m_sort_scratch);
+
+		if(m_object_uniforms_bo == 0)
+		{
+			glGenBuffers(1, &m_object_uniforms_bo);
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, m_object_uniforms_bo);
+		glBufferData(GL_UNIFORM_BUFFER, m_object_uniforms.size(), m_object_uniforms.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+		GLuint current_program = 0;
+		const Model* current_model = nullptr;
+		uint32_t current_object = UINT32_MAX;
+		uint32_t current_material = UINT32_MAX;
+		uint64_t current_textures = UINT64_MAX;
+		for(size_t i = 0; i < m_keys.size();)
+		{
+			const Item& item = m_items[m_keys[i].item];
+			const bool new_program = item.program != current_program;
+			if(new_program)
+			{
+				current_program = item.program;
+				glUseProgram(current_program);
+				render_statistics.program_changes++;
+				// Material uniforms belong to the program
+				current_material = UINT32_MAX;
+			}
+			const bool new_model = item.model != current_model;
+			if(new_model)
+			{
+				current_model = item.model;
+				glBindVertexArray(current_model->m_vaob);
+				render_statistics.vertex_array_binds++;
+				current_material = UINT32_MAX;
+			}
+			if(new_program || new_model)
+			{
+				bindMaterials(item.model, item.program, item.source);
+			}
+			if(item.object != current_object)
+			{
+				current_object = item.object;
+				glBindBufferRange(GL_UNIFORM_BUFFER, object_uniforms_binding, m_object_uniforms_bo,
+				                  GLintptr(m_object_offsets[current_object]),
+				                  GLsizeiptr(m_object_sizes[current_object]));
+			}
+			if(item.source != no_materials && item.material_idx != current_material)
+			{
+				current_material = item.material_idx;
+				if(item.textures != current_textures)
+				{
+					current_textures = item.textures;
+					bindMaterialTextures(item.model, item.material_idx, item.source);
+				}
+				bindMaterial(item.model, item.material_idx, item.program, item.source);
+			}
+
+			// As in render(), draws that read their materials from the storage
+			// block only need the same textures to share a multi-draw
+			size_t end = i + 1;
+			if(multi_draw_settings.enabled && item.model->m_draw_commands_bo != 0
+			   && (item.source == materials_from_storage || item.source == no_materials))
+			{
+				while(end < m_keys.size() && sharesMultiDraw(item, m_items[m_keys[end].item]))
+				{
+					end++;
+				}
+			}
+			if(end - i > 1)
+			{
+				multiDraw(i, end);
+				i = end;
+				continue;
+			}
+			i = end;
+
+			void* indices = (void*)(item.start_index * sizeof(uint32_t));
+			if(item.source == materials_from_storage)
+			{
+				// The base instance is the index of the material, as in render()
+				glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, GLsizei(item.number_of_indices),
+				                                              GL_UNSIGNED_INT, indices, 1,
+				                                              GLint(item.base_vertex), item.material_idx);
+			}
+			else
+			{
+				glDrawElementsBaseVertex(GL_TRIANGLES, GLsizei(item.number_of_indices), GL_UNSIGNED_INT,
+				                         indices, GLint(item.base_vertex));
+			}
+			render_statistics.draw_calls++;
+		}
+		glBindVertexArray(0);
+		glUseProgram(0);
+	}
+
+	m_items.clear();
+	m_keys.clear();
+	m_programs.clear();
+	m_textures.clear();
+	m_materials.clear();
+	m_models.clear();
+	m_object_uniforms.clear();
+	m_object_offsets.clear();
+	m_object_sizes.clear();
+}
+
+bool RenderQueue::sharesMultiDraw(const Item& a, const Item& b)
+{
+	return a.program == b.program && a.model == b.model && a.source == b.source && a.object == b.object
+	       && a.textures == b.textures;
+}
+
+void RenderQueue::multiDraw(size_t begin, size_t end)
+{
+	static std::vector<DrawCommand> commands;
+	commands.clear();
+	for(size_t i = begin; i < end; i++)
+	{
+		const Item& item = m_items[m_keys[i].item];
+		DrawCommand command;
+		command.count = item.number_of_indices;
+		command.instance_count = 1;
+		command.first_index = item.start_index;
+		command.base_vertex = GLint(item.base_vertex);
+		command.base_instance = item.material_idx;
+		commands.push_back(command);
+	}
+	if(m_draw_commands_bo == 0)
+	{
+		glGenBuffers(1, &m_draw_commands_bo);
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_draw_commands_bo);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawCommand), commands.data(),
+	             GL_STREAM_DRAW);
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, GLsizei(commands.size()), 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	render_statistics.draw_calls++;
+}
+
+void RenderQueue::free()
+{
+	glDeleteBuffers(1, &m_object_uniforms_bo);
+	glDeleteBuffers(1, &m_draw_commands_bo);
+	m_object_uniforms_bo = 0;
+	m_draw_commands_bo = 0;
+}
+} // namespace labhelper
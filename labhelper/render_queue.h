@@ -0,0 +1,114 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include "Model.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Sorted drawing of the meshes of many models.
+//
+// render() draws the meshes of one model in the order they are in the
+// model, and models in the order it is called, so the same program,
+// textures and materials may be set again and again. A RenderQueue collects
+// the meshes in view, with a 64 bit key each, sorts them by key with a radix
+// sort and draws them in order, skipping the state that is already set.
+// From the most significant bits:
+//
+//   pass       4 bits  passes are drawn in order
+//   program   12 bits
+//   textures  12 bits  the textures of the material, see materialTexturesKey()
+//   material  12 bits  or the object, when the material is looked up in the
+//                      Materials storage block by the draw
+//   depth     24 bits  front to back, to reject hidden fragments early
+//
+// Programs, textures, materials and objects are numbered in the order they
+// are first added, from 0 each frame. Past 4095 they share the last number,
+// which still draws everything but sorts those draws less well.
+//
+// The meshes of each add() are drawn with the ObjectUniforms block given
+// to it. The blocks are copied to one uniform buffer, and a range of it is
+// bound to object_uniforms_binding for each draw. Runs of meshes that only
+// differ in material are drawn with one multi-draw when render() would.
+///////////////////////////////////////////////////////////////////////////////
+namespace labhelper
+{
+class RenderQueue
+{
+public:
+	///////////////////////////////////////////////////////////////////////
+	/// Add the meshes that render(model, modelViewMatrix, projectionMatrix,
+	/// submitMaterials) would draw, to be drawn with the program
+	///////////////////////////////////////////////////////////////////////
+	void add(const Model* model,
+	         GLuint program,
+	         const glm::mat4& modelViewMatrix,
+	         const glm::mat4& projectionMatrix,
+	         const void* object_uniforms,
+	         size_t object_uniforms_size,
+	         uint8_t pass = 0,
+	         bool submitMaterials = true);
+	template<typename T>
+	void add(const Model* model,
+	         GLuint program,
+	         const glm::mat4& modelViewMatrix,
+	         const glm::mat4& projectionMatrix,
+	         const T& object_uniforms,
+	         uint8_t pass = 0,
+	         bool submitMaterials = true)
+	{
+		add(model, program, modelViewMatrix, projectionMatrix, &object_uniforms, sizeof(T), pass,
+		    submitMaterials);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	/// Sort and draw what was added since the last submit(), and empty the
+	/// queue. Program 0 is current afterwards.
+	///////////////////////////////////////////////////////////////////////
+	void submit();
+	void free();
+
+private:
+	struct Item
+	{
+		const Model* model;
+		GLuint program;
+		MaterialSource source;
+		uint32_t object;
+		uint32_t material_idx;
+		uint32_t base_vertex;
+		uint32_t start_index;
+		uint32_t number_of_indices;
+		// See materialTexturesKey()
+		uint64_t textures;
+	};
+	struct SortKey
+	{
+		uint64_t key;
+		uint32_t item;
+	};
+	// Number of the key, or of the last key if there are too many
+	static uint32_t number(std::unordered_map<uint64_t, uint32_t>& numbers, uint64_t key);
+	static bool sharesMultiDraw(const Item& a, const Item& b);
+	// Draw the items of m_keys[begin, end) with one glMultiDrawElementsIndirect()
+	void multiDraw(size_t begin, size_t end);
+
+	std::vector<Item> m_items;
+	std::vector<SortKey> m_keys;
+	std::vector<SortKey> m_sort_scratch;
+	std::vector<MeshDraw> m_draws;
+	std::unordered_map<uint64_t, uint32_t> m_programs;
+	std::unordered_map<uint64_t, uint32_t> m_textures;
+	std::unordered_map<uint64_t, uint32_t> m_materials;
+	std::unordered_map<uint64_t, uint32_t> m_models;
+	// The ObjectUniforms blocks, and where each one starts
+	std::vector<uint8_t> m_object_uniforms;
+	std::vector<size_t> m_object_offsets;
+	std::vector<size_t> m_object_sizes;
+	GLint m_object_alignment = 0;
+	GLuint m_object_uniforms_bo = 0;
+	GLuint m_draw_commands_bo = 0;
+};
+} // namespace labhelper
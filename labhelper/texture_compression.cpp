@@ -0,0 +1,296 @@
+#include "texture_compression.h"
+#include "labhelper.h"
+#include <GL/glew.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#define STB_DXT_IMPLEMENTATION
+#define STB_DXT_STATIC
+// The default in this version of stb_dxt.h drops the arguments
+#define STBD_MEMSET memset
+#include <stb_dxt.h>
+
+namespace labhelper
+{
+namespace
+{
+	///////////////////////////////////////////////////////////////////////
+	// DDS file layout, see "Programming Guide for DDS" in the DirectX
+	// documentation. BC4 and BC5 use the ATI1 and ATI2 codes, which are
+	// understood by more tools than the DX10 header extension.
+	///////////////////////////////////////////////////////////////////////
+	const uint32_t dds_magic = 0x20534444; // "DDS "
+	const uint32_t DDSD_CAPS = 0x1;
+	const uint32_t DDSD_HEIGHT = 0x2;
+	const uint32_t DDSD_WIDTH = 0x4;
+	const uint32_t DDSD_PIXELFORMAT = 0x1000;
+	const uint32_t DDSD_MIPMAPCOUNT = 0x20000;
+	const uint32_t DDSD_LINEARSIZE = 0x80000;
+	const uint32_t DDPF_FOURCC = 0x4;
+	const uint32_t DDSCAPS_COMPLEX = 0x8;
+	const uint32_t DDSCAPS_TEXTURE = 0x1000;
+	const uint32_t DDSCAPS_MIPMAP = 0x400000;
+	// Marks the source image stamp in the reserved part of the header
+	const uint32_t stamp_tag = 0x5854484c; // "LHTX"
+
+	struct DDSPixelFormat
+	{
+		uint32_t size, flags, four_cc, rgb_bit_count, r_mask, g_mask, b_mask, a_mask;
+	};
+
+	struct DDSHeader
+	{
+		uint32_t size, flags, height, width, pitch_or_linear_size, depth, mipmap_count;
+		uint32_t reserved1[11];
+		DDSPixelFormat pixel_format;
+		uint32_t caps, caps2, caps3, caps4, reserved2;
+	};
+	static_assert(sizeof(DDSHeader) == 124, "DDS header must be 124 bytes");
+
+	uint32_t fourCC(const char* code)
+	{
+		return uint32_t(code[0]) | uint32_t(code[1]) << 8 | uint32_t(code[2]) << 16 | uint32_t(code[3]) << 24;
+	}
+
+	struct BlockFormat
+	{
+		uint32_t internal_format;
+		const char* four_cc;
+		size_t block_size;
+	};
+
+	// Indexed by the number of components - 1
+	const BlockFormat block_formats[] = {
+		{ GL_COMPRESSED_RED_RGTC1, "ATI1", 8 },
+		{ GL_COMPRESSED_RG_RGTC2, "ATI2", 16 },
+		{ GL_COMPRESSED_RGB_S3TC_DXT1_EXT, "DXT1", 8 },
+		{ GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, "DXT5", 16 },
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// Sizes and offsets of all levels down to 1x1. Returns the total size.
+	///////////////////////////////////////////////////////////////////////
+	size_t computeLevels(int width,
+	                     int height,
+	                     size_t block_size,
+	                     std::vector<CompressedImage::Level>& levels)
+	{
+		levels.clear();
+		size_t offset = 0;
+		for(;;)
+		{
+			size_t size = size_t((width + 3) / 4) * size_t((height + 3) / 4) * block_size;
+			levels.push_back({ width, height, offset, size });
+			offset += size;
+			if(width == 1 && height == 1)
+			{
+				return offset;
+			}
+			width = std::max(1, width / 2);
+			height = std::max(1, height / 2);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Average 2x2 pixels. Odd sizes repeat the last row or column.
+	///////////////////////////////////////////////////////////////////////
+	void downsample(const uint8_t* source,
+	                int source_width,
+	                int source_height,
+	                int components,
+	                uint8_t* destination,
+	                int width,
+	                int height)
+	{
+		const size_t source_stride = size_t(source_width) * components;
+		parallelFor(size_t(height), 64, [&](size_t begin, size_t end) {
+			for(int y = int(begin); y < int(end); y++)
+			{
+				const uint8_t* row0 = source + std::min(2 * y, source_height - 1) * source_stride;
+				const uint8_t* row1 = source + std::min(2 * y + 1, source_height - 1) * source_stride;
+				for(int x = 0; x < width; x++)
+				{
+					int x0 = std::min(2 * x, source_width - 1) * components;
+					int x1 = std::min(2 * x + 1, source_width - 1) * components;
+					for(int c = 0; c < components; c++)
+					{
+						int sum = row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c];
+						destination[(size_t(y) * width + x) * components + c] = uint8_t((sum + 2) / 4);
+					}
+				}
+			}
+		});
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Compress one level, a few rows of blocks per thread
+	///////////////////////////////////////////////////////////////////////
+	void compressLevel(const uint8_t* pixels, int width, int height, int components, uint8_t* blocks)
+	{
+		const size_t block_size = block_formats[components - 1].block_size;
+		const int blocks_x = (width + 3) / 4;
+		const int blocks_y = (height + 3) / 4;
+		// stb_dxt takes RGBA for BC1 and BC3, R for BC4 and RG for BC5
+		const int block_components = components >= 3 ? 4 : components;
+		parallelFor(size_t(blocks_y), 4, [&](size_t begin, size_t end) {
+			uint8_t block[16 * 4];
+			for(int by = int(begin); by < int(end); by++)
+			{
+				for(int bx = 0; bx < blocks_x; bx++)
+				{
+					for(int i = 0; i < 16; i++)
+					{
+						// Blocks that hang over the edge repeat the edge pixels
+						int x = std::min(bx * 4 + i % 4, width - 1);
+						int y = std::min(by * 4 + i / 4, height - 1);
+						const uint8_t* pixel = pixels + (size_t(y) * width + x) * components;
+						uint8_t* texel = block + i * block_components;
+						for(int c = 0; c < components; c++)
+						{
+							texel[c] = pixel[c];
+						}
+						if(components == 3)
+						{
+							texel[3] = 255;
+						}
+					}
+					uint8_t* destination = blocks + (size_t(by) * blocks_x + bx) * block_size;
+					if(components == 1)
+						stb_compress_bc4_block(destination, block);
+					else if(components == 2)
+						stb_compress_bc5_block(destination, block);
+					else
+						stb_compress_dxt_block(destination, block, components == 4, STB_DXT_HIGHQUAL);
+				}
+			}
+		});
+	}
+} // namespace
+
+bool compressionSupported()
+{
+	// BC4 and BC5 (RGTC) are core since OpenGL 3.0, BC1 and BC3 (S3TC) are
+	// an extension that some drivers leave out
+	return GLEW_EXT_texture_compression_s3tc != GL_FALSE;
+}
+
+void compressImage(const uint8_t* pixels, int width, int height, int components, CompressedImage& image)
+{
+	const BlockFormat& format = block_formats[components - 1];
+	image.internal_format = format.internal_format;
+	image.blocks.resize(computeLevels(width, height, format.block_size, image.levels));
+
+	std::vector<uint8_t> level_pixels, next_level_pixels;
+	const uint8_t* source = pixels;
+	for(size_t i = 0; i < image.levels.size(); i++)
+	{
+		const CompressedImage::Level& level = image.levels[i];
+		if(i > 0)
+		{
+			const CompressedImage::Level& previous = image.levels[i - 1];
+			next_level_pixels.resize(size_t(level.width) * level.height * components);
+			downsample(source, previous.width, previous.height, components, next_level_pixels.data(),
+			           level.width, level.height);
+			level_pixels.swap(next_level_pixels);
+			source = level_pixels.data();
+		}
+		compressLevel(source, level.width, level.height, components, &image.blocks[level.offset]);
+	}
+}
+
+bool writeDDS(const std::string& filename,
+              const CompressedImage& image,
+              int64_t source_size,
+              int64_t source_modified)
+{
+	const BlockFormat* format = nullptr;
+	for(const BlockFormat& f : block_formats)
+	{
+		if(f.internal_format == image.internal_format)
+			format = &f;
+	}
+	if(format == nullptr || image.levels.empty())
+	{
+		return false;
+	}
+
+	DDSHeader header = {};
+	header.size = sizeof(DDSHeader);
+	header.flags =
+	    DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE;
+	header.width = uint32_t(image.levels[0].width);
+	header.height = uint32_t(image.levels[0].height);
+	header.pitch_or_linear_size = uint32_t(image.levels[0].size);
+	header.mipmap_count = uint32_t(image.levels.size());
+	header.reserved1[0] = stamp_tag;
+	header.reserved1[1] = uint32_t(uint64_t(source_size));
+	header.reserved1[2] = uint32_t(uint64_t(source_size) >> 32);
+	header.reserved1[3] = uint32_t(uint64_t(source_modified));
+	header.reserved1[4] = uint32_t(uint64_t(source_modified) >> 32);
+	header.pixel_format.size = sizeof(DDSPixelFormat);
+	header.pixel_format.flags = DDPF_FOURCC;
+	header.pixel_format.four_cc = fourCC(format->four_cc);
+	header.caps = DDSCAPS_COMPLEX | DDSCAPS_TEXTURE | DDSCAPS_MIPMAP;
+
+	// Write to a temporary file and rename it, so that a program loading the
+	// same texture never sees half a file
+	const std::string tmp_filename = filename + ".tmp";
+	{
+		std::ofstream f(tmp_filename, std::ios::binary);
+		f.write(reinterpret_cast<const char*>(&dds_magic), sizeof(dds_magic));
+		f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		f.write(reinterpret_cast<const char*>(image.blocks.data()), image.blocks.size());
+		if(!f.good())
+		{
+			std::cout << "Could not write " << filename << ".\n";
+			f.close();
+			remove(tmp_filename.c_str());
+			return false;
+		}
+	}
+	return file::replace(tmp_filename, filename);
+}
+
+bool readDDS(const std::string& filename,
+             int64_t source_size,
+             int64_t source_modified,
+             CompressedImage& image)
+{
+	std::ifstream f(filename, std::ios::binary);
+	uint32_t magic;
+	DDSHeader header;
+	if(!f.read(reinterpret_cast<char*>(&magic), sizeof(magic))
+	   || !f.read(reinterpret_cast<char*>(&header), sizeof(header)) || magic != dds_magic
+	   || header.size != sizeof(DDSHeader) || header.reserved1[0] != stamp_tag)
+	{
+		return false;
+	}
+	if(header.reserved1[1] != uint32_t(uint64_t(source_size))
+	   || header.reserved1[2] != uint32_t(uint64_t(source_size) >> 32)
+	   || header.reserved1[3] != uint32_t(uint64_t(source_modified))
+	   || header.reserved1[4] != uint32_t(uint64_t(source_modified) >> 32))
+	{
+		return false;
+	}
+
+	const BlockFormat* format = nullptr;
+	for(const BlockFormat& f : block_formats)
+	{
+		if(fourCC(f.four_cc) == header.pixel_format.four_cc)
+			format = &f;
+	}
+	if(format == nullptr || header.width == 0 || header.height == 0)
+	{
+		return false;
+	}
+	image.internal_format = format->internal_format;
+	size_t size = computeLevels(int(header.width), int(header.height), format->block_size, image.levels);
+	image.blocks.resize(size);
+	if(image.levels.size() != header.mipmap_count)
+	{
+		return false;
+	}
+	return bool(f.read(reinterpret_cast<char*>(image.blocks.data()), image.blocks.size()));
+}
+} // namespace labhelper
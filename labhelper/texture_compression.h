@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Block compressed textures.
+//
+// Images are compressed to BC1 (RGB), BC3 (RGBA), BC4 (R) or BC5 (RG)
+// with a complete chain of mipmaps, computed offline with a box filter.
+// That takes a quarter to an eighth of the memory and bandwidth of the
+// uncompressed image. Compressed images are stored as DDS files so they
+// only have to be computed once.
+///////////////////////////////////////////////////////////////////////////////
+namespace labhelper
+{
+struct CompressedImage
+{
+	struct Level
+	{
+		int width, height;
+		size_t offset, size;
+	};
+	// GL_COMPRESSED_* format of the blocks
+	uint32_t internal_format = 0;
+	std::vector<Level> levels;
+	std::vector<uint8_t> blocks;
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// Whether the GL context can sample all formats compressImage() produces
+///////////////////////////////////////////////////////////////////////////
+bool compressionSupported();
+
+///////////////////////////////////////////////////////////////////////////
+/// Compress an image with 1 to 4 components of 8 bits and all its mipmaps,
+/// on all cores
+///////////////////////////////////////////////////////////////////////////
+void compressImage(const uint8_t* pixels, int width, int height, int components, CompressedImage& image);
+
+///////////////////////////////////////////////////////////////////////////
+/// Write the image as a DDS file. The size and modification time of the
+/// image it was compressed from are stored in the reserved part of the
+/// header, see readDDS().
+///////////////////////////////////////////////////////////////////////////
+bool writeDDS(const std::string& filename,
+              const CompressedImage& image,
+              int64_t source_size,
+              int64_t source_modified);
+
+///////////////////////////////////////////////////////////////////////////
+/// Read a DDS file written by writeDDS(). Fails if it was compressed from
+/// an image of another size or modification time.
+///////////////////////////////////////////////////////////////////////////
+bool readDDS(const std::string& filename,
+             int64_t source_size,
+             int64_t source_modified,
+             CompressedImage& image);
+} // namespace labhelper
@@ -0,0 +1,184 @@
+#include "trace.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace labhelper
+{
+namespace trace
+{
+	namespace
+	{
+		typedef std::chrono::steady_clock Clock;
+
+		struct Event
+		{
+			// Null for the end of an event
+			const char* name;
+			std::string detail;
+			Clock::time_point time;
+		};
+
+		struct ThreadBuffer
+		{
+			// Only held for long by write()
+			std::mutex mutex;
+			int id;
+			std::string name;
+			std::vector<Event> events;
+		};
+
+		std::atomic<bool> is_recording(false);
+		std::mutex buffers_mutex;
+		// Kept after their threads exit, until the trace is written
+		std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+		Clock::time_point start_time = Clock::now();
+
+		ThreadBuffer& threadBuffer()
+		{
+			thread_local std::shared_ptr<ThreadBuffer> buffer;
+			if(!buffer)
+			{
+				buffer = std::make_shared<ThreadBuffer>();
+				std::lock_guard<std::mutex> lock(buffers_mutex);
+				buffer->id = int(buffers.size()) + 1;
+				buffers.push_back(buffer);
+			}
+			return *buffer;
+		}
+
+		void record(const char* name, const std::string& detail)
+		{
+			ThreadBuffer& buffer = threadBuffer();
+			Clock::time_point time = Clock::now();
+			std::lock_guard<std::mutex> lock(buffer.mutex);
+			buffer.events.push_back({ name, detail, time });
+		}
+
+		void writeString(std::ostream& out, const std::string& string)
+		{
+			out << '"';
+			for(char c : string)
+			{
+				if(c == '"' || c == '\\')
+				{
+					out << '\\' << c;
+				}
+				else if((unsigned char)c < 0x20)
+				{
+					char escaped[8];
+					snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+					out << escaped;
+				}
+				else
+				{
+					out << c;
+				}
+			}
+			out << '"';
+		}
+	} // namespace
+
+	void start()
+	{
+		if(!is_recording)
+		{
+			start_time = Clock::now();
+			is_recording = true;
+		}
+	}
+
+	bool recording()
+	{
+		return is_recording;
+	}
+
+	void begin(const char* name)
+	{
+		if(is_recording)
+		{
+			record(name, std::string());
+		}
+	}
+
+	void begin(const char* name, const std::string& detail)
+	{
+		if(is_recording)
+		{
+			record(name, detail);
+		}
+	}
+
+	void end()
+	{
+		if(is_recording)
+		{
+			record(nullptr, std::string());
+		}
+	}
+
+	void setThreadName(const std::string& name)
+	{
+		ThreadBuffer& buffer = threadBuffer();
+		std::lock_guard<std::mutex> lock(buffer.mutex);
+		buffer.name = name;
+	}
+
+	bool write(const std::string& filename)
+	{
+		is_recording = false;
+		std::ofstream out(filename);
+		if(!out)
+		{
+			std::cout << "Failed to write trace to " << filename << std::endl;
+			return false;
+		}
+		out << "{\"traceEvents\":[\n";
+		bool first = true;
+		std::lock_guard<std::mutex> buffers_lock(buffers_mutex);
+		for(const std::shared_ptr<ThreadBuffer>& buffer : buffers)
+		{
+			std::lock_guard<std::mutex> lock(buffer->mutex);
+			std::string thread_name = buffer->name;
+			if(thread_name.empty())
+			{
+				thread_name = "Thread " + std::to_string(buffer->id);
+			}
+			out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+			    << buffer->id << ",\"args\":{\"name\":";
+			writeString(out, thread_name);
+			out << "}}";
+			first = false;
+			for(const Event& event : buffer->events)
+			{
+				std::chrono::duration<double, std::micro> microseconds = event.time - start_time;
+				char time[32];
+				snprintf(time, sizeof(time), "%.3f", microseconds.count());
+				out << ",\n{\"ph\":\"" << (event.name ? 'B' : 'E') << "\",\"pid\":1,\"tid\":" << buffer->id
+				    << ",\"ts\":" << time;
+				if(event.name != nullptr)
+				{
+					out << ",\"name\":";
+					writeString(out, event.name);
+					if(!event.detail.empty())
+					{
+						out << ",\"args\":{\"detail\":";
+						writeString(out, event.detail);
+						out << "}";
+					}
+				}
+				out << "}";
+			}
+			buffer->events.clear();
+		}
+		out << "\n]}\n";
+		std::cout << "Wrote trace to " << filename << std::endl;
+		return bool(out);
+	}
+} // namespace trace
+} // namespace labhelper
@@ -0,0 +1,70 @@
+#pragma once
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+// A timeline of what each thread does, for chrome://tracing or Perfetto
+// (ui.perfetto.dev).
+//
+// Events are kept in a buffer per thread, so threads only wait for each
+// other when a thread records its first event and when the trace is
+// written. Nothing is recorded, and begin() and end() return right away,
+// unless the trace is started. Events are kept until write(), so a long
+// trace takes a lot of memory.
+//
+// Loading, decoding and uploading of models and textures are traced by
+// labhelper, as are the zones of labhelper::profiler.
+///////////////////////////////////////////////////////////////////////////////
+namespace labhelper
+{
+namespace trace
+{
+	///////////////////////////////////////////////////////////////////////////
+	/// Start recording events
+	///////////////////////////////////////////////////////////////////////////
+	void start();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Stop recording, write the events in the Chrome trace event format
+	/// (JSON) and forget them. Returns false if the file cannot be written.
+	///////////////////////////////////////////////////////////////////////////
+	bool write(const std::string& filename);
+
+	bool recording();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// An event from begin() to the next end() on the same thread. The name
+	/// should be a string literal, the detail, such as a file name, is
+	/// shown with the event.
+	///////////////////////////////////////////////////////////////////////////
+	void begin(const char* name);
+	void begin(const char* name, const std::string& detail);
+	void end();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Name the calling thread in the trace
+	///////////////////////////////////////////////////////////////////////////
+	void setThreadName(const std::string& name);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// An event for the rest of the enclosing scope
+	///////////////////////////////////////////////////////////////////////////
+	class Scope
+	{
+	public:
+		explicit Scope(const char* name)
+		{
+			begin(name);
+		}
+		Scope(const char* name, const std::string& detail)
+		{
+			begin(name, detail);
+		}
+		~Scope()
+		{
+			end();
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+} // namespace trace
+} // namespace labhelper
@@ -0,0 +1,211 @@
+#include "uniforms.h"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace labhelper
+{
+namespace
+{
+	struct ProgramUniforms
+	{
+		// Sorted by name, so they can be found without making strings
+		std::vector<std::pair<std::string, GLint>> locations;
+		std::vector<std::string> blocks;
+		std::vector<std::string> storage_blocks;
+	};
+	std::unordered_map<GLuint, ProgramUniforms> programs;
+
+	const ProgramUniforms* findProgram(GLuint program)
+	{
+		if(program == 0)
+		{
+			return nullptr;
+		}
+		auto it = programs.find(program);
+		if(it == programs.end())
+		{
+			reflectProgram(program);
+			it = programs.find(program);
+		}
+		return &it->second;
+	}
+
+	bool nameLess(const std::pair<std::string, GLint>& uniform, const char* name)
+	{
+		return strcmp(uniform.first.c_str(), name) < 0;
+	}
+} // namespace
+
+void reflectProgram(GLuint program)
+{
+	ProgramUniforms& uniforms = programs[program];
+	uniforms = ProgramUniforms();
+
+	GLint count = 0, max_length = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+	std::vector<char> name(std::max(max_length, 1));
+	for(GLint i = 0; i < count; i++)
+	{
+		GLint size;
+		GLenum type;
+		glGetActiveUniform(program, GLuint(i), GLsizei(name.size()), nullptr, &size, &type, name.data());
+		// Uniforms in blocks have no location
+		GLint location = glGetUniformLocation(program, name.data());
+		if(location == -1)
+		{
+			continue;
+		}
+		// Arrays are listed by their first element
+		std::string uniform = name.data();
+		if(uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0)
+		{
+			uniform.resize(uniform.size() - 3);
+		}
+		uniforms.locations.emplace_back(uniform, location);
+	}
+	std::sort(uniforms.locations.begin(), uniforms.locations.end());
+
+	static const struct
+	{
+		const char* name;
+		UniformBlockBinding binding;
+	} bindings[] = { { "FrameUniforms", frame_uniforms_binding },
+		             { "MaterialUniforms", material_uniforms_binding },
+		             { "ObjectUniforms", object_uniforms_binding } };
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &max_length);
+	name.resize(std::max(max_length, 1));
+	for(GLint i = 0; i < count; i++)
+	{
+		glGetActiveUniformBlockName(program, GLuint(i), GLsizei(name.size()), nullptr, name.data());
+		uniforms.blocks.push_back(name.data());
+		for(const auto& block : bindings)
+		{
+			if(uniforms.blocks.back() == block.name)
+			{
+				glUniformBlockBinding(program, GLuint(i), block.binding);
+			}
+		}
+	}
+
+	if(!GLEW_VERSION_4_3 && !(GLEW_ARB_program_interface_query && GLEW_ARB_shader_storage_buffer_object))
+	{
+		return;
+	}
+	glGetProgramInterfaceiv(program, GL_SHADER_STORAGE_BLOCK, GL_ACTIVE_RESOURCES, &count);
+	glGetProgramInterfaceiv(program, GL_SHADER_STORAGE_BLOCK, GL_MAX_NAME_LENGTH, &max_length);
+	name.resize(std::max(max_length, 1));
+	for(GLint i = 0; i < count; i++)
+	{
+		glGetProgramResourceName(program, GL_SHADER_STORAGE_BLOCK, GLuint(i), GLsizei(name.size()), nullptr,
+		                         name.data());
+		uniforms.storage_blocks.push_back(name.data());
+		if(uniforms.storage_blocks.back() == "Materials")
+		{
+			glShaderStorageBlockBinding(program, GLuint(i), materials_storage_binding);
+		}
+	}
+}
+
+GLint getUniformLocation(GLuint program, const char* name)
+{
+	const ProgramUniforms* uniforms = findProgram(program);
+	if(uniforms == nullptr)
+	{
+		return -1;
+	}
+	auto it = std::lower_bound(uniforms->locations.begin(), uniforms->locations.end(), name, nameLess);
+	if(it == uniforms->locations.end() || it->first != name)
+	{
+		return -1;
+	}
+	return it->second;
+}
+
+bool hasUniformBlock(GLuint program, const char* name)
+{
+	const ProgramUniforms* uniforms = findProgram(program);
+	return uniforms != nullptr
+	       && std::find(uniforms->blocks.begin(), uniforms->blocks.end(), name) != uniforms->blocks.end();
+}
+
+bool hasStorageBlock(GLuint program, const char* name)
+{
+	const ProgramUniforms* uniforms = findProgram(program);
+	return uniforms != nullptr
+	       && std::find(uniforms->storage_blocks.begin(), uniforms->storage_blocks.end(), name)
+	              != uniforms->storage_blocks.end();
+}
+
+void setUniform(GLuint program, const char* name, const glm::mat4& matrix)
+{
+	GLint location = getUniformLocation(program, name);
+	if(location != -1)
+	{
+		glUniformMatrix4fv(location, 1, false, &matrix[0].x);
+	}
+}
+void setUniform(GLuint program, const char* name, const float value)
+{
+	GLint location = getUniformLocation(program, name);
+	if(location != -1)
+	{
+		glUniform1f(location, value);
+	}
+}
+void setUniform(GLuint program, const char* name, const GLint value)
+{
+	GLint location = getUniformLocation(program, name);
+	if(location != -1)
+	{
+		glUniform1i(location, value);
+	}
+}
+void setUniform(GLuint program, const char* name, const GLuint value)
+{
+	GLint location = getUniformLocation(program, name);
+	if(location != -1)
+	{
+		glUniform1ui(location, value);
+	}
+}
+void setUniform(GLuint program, const char* name, const bool value)
+{
+	GLint location = getUniformLocation(program, name);
+	if(location != -1)
+	{
+		glUniform1i(location, value ? 1 : 0);
+	}
+}
+void setUniform(GLuint program, const char* name, const glm::vec3& value)
+{
+	GLint location = getUniformLocation(program, name);
+	if(location != -1)
+	{
+		glUniform3fv(location, 1, &value.x);
+	}
+}
+
+void UniformBuffer::update(UniformBlockBinding binding, const void* data, size_t size)
+{
+	if(m_buffer == 0)
+	{
+		glGenBuffers(1, &m_buffer);
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+	glBufferData(GL_UNIFORM_BUFFER, size, data, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, m_buffer);
+}
+
+void UniformBuffer::free()
+{
+	glDeleteBuffers(1, &m_buffer);
+	m_buffer = 0;
+}
+} // namespace labhelper
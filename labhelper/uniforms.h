@@ -0,0 +1,158 @@
+#pragma once
+#include <cstddef>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// Shader parameters.
+//
+// setUniformSlow() asks GL where a uniform is every time it is set. The
+// setUniform() overloads below instead look the name up in a table of the
+// active uniforms of the program, which is made once, when it is linked.
+//
+// Parameters that many draws share are better kept in uniform buffers, so
+// that one bind replaces a call per uniform. Uniform blocks with the names
+// below are bound to fixed binding points when linkShaderProgram() links a
+// program, since GLSL 4.10 cannot give them a binding itself:
+//
+//   FrameUniforms     the camera, lights and environment, set once a frame
+//   MaterialUniforms  a material, bound by render() for each mesh
+//   ObjectUniforms    the transforms of the object being drawn
+//
+// Only the layouts of the material blocks are fixed by labhelper, the others
+// are up to the application.
+//
+// With GL 4.3, a shader storage block named Materials, with an array of
+// MaterialStorage in std430 layout, is bound to materials_storage_binding.
+// render() then draws all meshes that share textures with one call, see
+// multiDrawSupported().
+///////////////////////////////////////////////////////////////////////////////
+namespace labhelper
+{
+enum UniformBlockBinding
+{
+	frame_uniforms_binding = 0,
+	material_uniforms_binding = 1,
+	object_uniforms_binding = 2,
+};
+
+enum StorageBlockBinding
+{
+	materials_storage_binding = 0,
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// The MaterialUniforms block, in std140 layout:
+///
+///	layout(std140) uniform MaterialUniforms
+///	{
+///		vec3 material_color;
+///		float material_metalness;
+///		vec3 material_emission;
+///		float material_fresnel;
+///		float material_shininess;
+///		int has_color_texture;
+///		int has_emission_texture;
+///		int has_shininess_texture;
+///	};
+///////////////////////////////////////////////////////////////////////////
+struct MaterialUniforms
+{
+	glm::vec3 color;
+	float metalness;
+	glm::vec3 emission;
+	float fresnel;
+	float shininess;
+	GLint has_color_texture;
+	GLint has_emission_texture;
+	GLint has_shininess_texture;
+};
+static_assert(sizeof(MaterialUniforms) == 48, "MaterialUniforms must match the std140 layout");
+
+///////////////////////////////////////////////////////////////////////////
+/// An element of the Materials storage block, in std430 layout:
+///
+///	struct Material
+///	{
+///		(the members of MaterialUniforms)
+///		int color_layer;
+///		int emission_layer;
+///		uvec2 color_texture_array;
+///		uvec2 emission_texture_array;
+///	};
+///	layout(std430) readonly buffer Materials
+///	{
+///		Material materials[];
+///	};
+///
+/// The layers and handles are set with texture arrays, see
+/// MaterialTextureMode in Model.h.
+///////////////////////////////////////////////////////////////////////////
+struct MaterialStorage
+{
+	MaterialUniforms uniforms;
+	GLint color_layer;
+	GLint emission_layer;
+	GLuint64 color_texture_array;
+	GLuint64 emission_texture_array;
+	// The struct is aligned to 16 bytes
+	GLuint padding[2];
+};
+static_assert(sizeof(MaterialStorage) == 80, "MaterialStorage must match the std430 layout");
+
+///////////////////////////////////////////////////////////////////////////
+/// Find the active uniforms, uniform blocks and shader storage blocks of a
+/// linked program, and bind the blocks named above. Called by
+/// linkShaderProgram().
+///////////////////////////////////////////////////////////////////////////
+void reflectProgram(GLuint program);
+
+///////////////////////////////////////////////////////////////////////////
+/// Location of a uniform, or -1 if the program does not use it. Programs
+/// not linked by linkShaderProgram() are reflected the first time.
+///////////////////////////////////////////////////////////////////////////
+GLint getUniformLocation(GLuint program, const char* name);
+
+///////////////////////////////////////////////////////////////////////////
+/// Whether the program uses the uniform block
+///////////////////////////////////////////////////////////////////////////
+bool hasUniformBlock(GLuint program, const char* name);
+
+///////////////////////////////////////////////////////////////////////////
+/// Whether the program uses the shader storage block. Always false before
+/// GL 4.3.
+///////////////////////////////////////////////////////////////////////////
+bool hasStorageBlock(GLuint program, const char* name);
+
+///////////////////////////////////////////////////////////////////////////
+/// Set a uniform of the current program, at its cached location. Uniforms
+/// that the program does not use are ignored.
+///////////////////////////////////////////////////////////////////////////
+void setUniform(GLuint program, const char* name, const glm::mat4& matrix);
+void setUniform(GLuint program, const char* name, const float value);
+void setUniform(GLuint program, const char* name, const GLint value);
+void setUniform(GLuint program, const char* name, const GLuint value);
+void setUniform(GLuint program, const char* name, const bool value);
+void setUniform(GLuint program, const char* name, const glm::vec3& value);
+
+///////////////////////////////////////////////////////////////////////////
+/// A uniform buffer with the contents of one block. update() replaces the
+/// contents and binds the buffer to the binding point of the block. The old
+/// contents are orphaned rather than overwritten, so the buffer can be
+/// updated between draws without waiting for the draws before to finish.
+///////////////////////////////////////////////////////////////////////////
+class UniformBuffer
+{
+public:
+	void update(UniformBlockBinding binding, const void* data, size_t size);
+	template<typename T>
+	void update(UniformBlockBinding binding, const T& data)
+	{
+		update(binding, &data, sizeof(T));
+	}
+	void free();
+
+private:
+	GLuint m_buffer = 0;
+};
+} // namespace labhelper
@@ -3,10 +3,13 @@
 #include <iostream>
 #include <map>
 #include <algorithm>
+#include <chrono>
+#include <stb_image_write.h>
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
 #include "labhelper.h"
+#include "trace.h"
 
 using namespace std;
 using namespace glm;
@@ -28,8 +31,9 @@ std::vector<DiscLight> disc_lights;
 ///////////////////////////////////////////////////////////////////////////
 void restart()
 {
-	// No need to clear image,
+	// No need to clear image, but the per pixel sample counts must go
 	rendered_image.number_of_samples = 0;
+	std::fill(rendered_image.samples.begin(), rendered_image.samples.end(), 0);
 }
 
 int getSampleCount()
@@ -46,6 +50,8 @@ void resize(int w, int h)
 	rendered_image.width = w / settings.subsampling;
 	rendered_image.height = h / settings.subsampling;
 	rendered_image.data.resize(rendered_image.width * rendered_image.height);
+	rendered_image.cost.resize(rendered_image.width * rendered_image.height);
+	rendered_image.samples.resize(rendered_image.width * rendered_image.height);
 	restart();
 }
 
@@ -106,6 +112,30 @@ inline static glm::vec3 homogenize(const glm::vec4& p)
 	return glm::vec3(p * (1.f / p.w));
 }
 
+///////////////////////////////////////////////////////////////////////////
+/// Trace one path through pixel (x, y) and return the radiance
+///////////////////////////////////////////////////////////////////////////
+static vec3 tracePixel(int x, int y, const vec3& camera_pos, const mat4& inv_PV)
+{
+	Ray primaryRay;
+	primaryRay.o = camera_pos;
+	// Create a ray that starts in the camera position and points toward
+	// the current pixel on a virtual screen.
+	vec2 screenCoord = vec2(float(x) / float(rendered_image.width), float(y) / float(rendered_image.height));
+	// Calculate direction
+	vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
+	vec3 p = homogenize(inv_PV * viewCoord);
+	primaryRay.d = normalize(p - camera_pos);
+	// Intersect ray with scene
+	if(intersect(primaryRay))
+	{
+		// If it hit something, evaluate the radiance from that point
+		return Li(primaryRay);
+	}
+	// Otherwise evaluate environment
+	return Lenvironment(primaryRay.d);
+}
+
 ///////////////////////////////////////////////////////////////////////////
 /// Trace one path per pixel and accumulate the result in an image
 ///////////////////////////////////////////////////////////////////////////
@@ -118,45 +148,141 @@ void tracePaths(const glm::mat4& V, const glm::mat4& P)
 		return;
 	}
 	vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	mat4 inv_PV = inverse(P * V);
 	// Trace one path per pixel (the omp parallel stuf magically distributes the
 	// pathtracing on all cores of your CPU).
-	int num_rays = 0;
-	vector<vec4> local_image(rendered_image.width * rendered_image.height, vec4(0.0f));
+	labhelper::trace::Scope scope("Trace paths");
+#pragma omp parallel
+	{
+		// One event per thread, to see how evenly the rows are shared
+		labhelper::trace::Scope thread_scope("Trace rows");
+#pragma omp for
+		for(int y = 0; y < rendered_image.height; y++)
+		{
+			for(int x = 0; x < rendered_image.width; x++)
+			{
+				std::chrono::high_resolution_clock::time_point start_time;
+				if(settings.record_cost)
+				{
+					start_time = std::chrono::high_resolution_clock::now();
+				}
+				vec3 color = tracePixel(x, y, camera_pos, inv_PV);
+				// Accumulate the obtained radiance to the pixels color
+				const int i = y * rendered_image.width + x;
+				float n = float(rendered_image.samples[i]);
+				rendered_image.data[i] =
+				    rendered_image.data[i] * (n / (n + 1.0f)) + (1.0f / (n + 1.0f)) * color;
+				rendered_image.samples[i] += 1;
+				// Accumulate the time spent on this pixel the same way
+				if(settings.record_cost)
+				{
+					std::chrono::duration<float, std::micro> cost =
+					    std::chrono::high_resolution_clock::now() - start_time;
+					rendered_image.cost[i] =
+					    rendered_image.cost[i] * (n / (n + 1.0f)) + (1.0f / (n + 1.0f)) * cost.count();
+				}
+			}
+		}
+	}
+	rendered_image.number_of_samples += 1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Trace `samples` paths per pixel in a tile and return the sums
+///////////////////////////////////////////////////////////////////////////
+void tracePathsInTile(const mat4& V, const mat4& P, const Tile& tile, std::vector<vec3>& sums)
+{
+	vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	mat4 inv_PV = inverse(P * V);
+	const int tile_width = tile.x1 - tile.x0;
+	sums.assign(tile_width * (tile.y1 - tile.y0), vec3(0.0f));
 
-#pragma omp parallel for
-	for(int y = 0; y < rendered_image.height; y++)
+	labhelper::trace::Scope scope("Trace tile");
+#pragma omp parallel
 	{
-		for(int x = 0; x < rendered_image.width; x++)
+		labhelper::trace::Scope thread_scope("Trace rows");
+#pragma omp for
+		for(int y = tile.y0; y < tile.y1; y++)
 		{
-			vec3 color;
-			Ray primaryRay;
-			primaryRay.o = camera_pos;
-			// Create a ray that starts in the camera position and points toward
-			// the current pixel on a virtual screen.
-			vec2 screenCoord = vec2(float(x) / float(rendered_image.width),
-			                        float(y) / float(rendered_image.height));
-			// Calculate direction
-			vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
-			vec3 p = homogenize(inverse(P * V) * viewCoord);
-			primaryRay.d = normalize(p - camera_pos);
-			// Intersect ray with scene
-			if(intersect(primaryRay))
+			for(int x = tile.x0; x < tile.x1; x++)
 			{
-				// If it hit something, evaluate the radiance from that point
-				color = Li(primaryRay);
+				vec3 sum(0.0f);
+				for(int s = 0; s < tile.samples; s++)
+				{
+					sum += tracePixel(x, y, camera_pos, inv_PV);
+				}
+				sums[(y - tile.y0) * tile_width + x - tile.x0] = sum;
 			}
-			else
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Merge the sums from tracePathsInTile into the rendered image
+///////////////////////////////////////////////////////////////////////////
+void accumulateTile(const Tile& tile, const vec3* sums)
+{
+	const int tile_width = tile.x1 - tile.x0;
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			const int i = y * rendered_image.width + x;
+			const float n = float(rendered_image.samples[i]);
+			const vec3& sum = sums[(y - tile.y0) * tile_width + x - tile.x0];
+			rendered_image.data[i] = (rendered_image.data[i] * n + sum) / (n + float(tile.samples));
+			rendered_image.samples[i] += tile.samples;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// Cost heatmap helpers
+///////////////////////////////////////////////////////////////////////////
+float getMaxCost()
+{
+	float max_cost = 0.0f;
+	for(float c : rendered_image.cost)
+	{
+		max_cost = std::max(max_cost, c);
+	}
+	return max_cost;
+}
+
+vec3 heatmapColor(float t)
+{
+	// Piecewise linear blue -> cyan -> green -> yellow -> red
+	const vec3 stops[] = { vec3(0, 0, 1), vec3(0, 1, 1), vec3(0, 1, 0), vec3(1, 1, 0), vec3(1, 0, 0) };
+	t = clamp(t, 0.0f, 1.0f) * 4.0f;
+	int i = std::min(int(t), 3);
+	return mix(stops[i], stops[i + 1], t - float(i));
+}
+
+void saveCostHeatmap(const std::string& basename)
+{
+	const int w = rendered_image.width;
+	const int h = rendered_image.height;
+	const float max_cost = getMaxCost();
+	std::vector<uint8_t> img_png(w * h * 3);
+	std::vector<float> img_hdr(w * h * 3);
+	for(int y = 0; y < h; y++)
+	{
+		for(int x = 0; x < w; x++)
+		{
+			// Images are stored bottom-up, files top-down
+			int src = (h - 1 - y) * w + x;
+			int dst = y * w + x;
+			float c = rendered_image.cost[src];
+			vec3 color = heatmapColor(max_cost > 0.0f ? c / max_cost : 0.0f);
+			for(int i = 0; i < 3; i++)
 			{
-				// Otherwise evaluate environment
-				color = Lenvironment(primaryRay.d);
+				img_png[dst * 3 + i] = uint8_t(255.0f * color[i]);
+				img_hdr[dst * 3 + i] = c;
 			}
-			// Accumulate the obtained radiance to the pixels color
-			float n = float(rendered_image.number_of_samples);
-			rendered_image.data[y * rendered_image.width + x] =
-			    rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f))
-			    + (1.0f / (n + 1.0f)) * color;
 		}
 	}
-	rendered_image.number_of_samples += 1;
+	stbi_write_png((basename + "_cost.png").c_str(), w, h, 3, img_png.data(), 0);
+	stbi_write_hdr((basename + "_cost.hdr").c_str(), w, h, 3, img_hdr.data());
+	std::cout << "Saved cost heatmap " << basename << "_cost.png (max " << max_cost << " us/pixel)\n";
 }
 }; // namespace pathtracer
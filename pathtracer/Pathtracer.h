@@ -26,6 +26,8 @@ extern struct Settings
 	int subsampling;
 	int max_bounces;
 	int max_paths_per_pixel;
+	// Record the wall time spent on each pixel, for the cost heatmap
+	bool record_cost;
 };
 extern Settings settings;
 
@@ -46,10 +48,19 @@ extern struct Image
 {
 	int width, height, number_of_samples = 0;
 	std::vector<glm::vec3> data;
+	// Number of samples accumulated in each pixel
+	std::vector<int> samples;
+	// Average time (in microseconds) spent tracing each pixel. Only
+	// updated while settings.record_cost is set.
+	std::vector<float> cost;
 	float* getPtr()
 	{
 		return &data[0].x;
 	}
+	float* getCostPtr()
+	{
+		return &cost[0];
+	}
 };
 extern Image rendered_image;
 
@@ -94,4 +105,42 @@ void resize(int w, int h);
 /// Trace one path per pixel
 ///////////////////////////////////////////////////////////////////////////
 void tracePaths(const mat4& V, const mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+/// A rectangle [x0, x1) x [y0, y1) of the rendered image, and the number
+/// of paths to trace per pixel in it
+///////////////////////////////////////////////////////////////////////////
+struct Tile
+{
+	int x0, y0, x1, y1;
+	int samples;
+};
+
+///////////////////////////////////////////////////////////////////////////
+/// Trace tile.samples paths per pixel in the tile. The radiance sums are
+/// returned row by row in `sums`, and are not added to the image.
+///////////////////////////////////////////////////////////////////////////
+void tracePathsInTile(const mat4& V, const mat4& P, const Tile& tile, std::vector<vec3>& sums);
+
+///////////////////////////////////////////////////////////////////////////
+/// Merge radiance sums from tracePathsInTile into rendered_image
+///////////////////////////////////////////////////////////////////////////
+void accumulateTile(const Tile& tile, const vec3* sums);
+
+///////////////////////////////////////////////////////////////////////////
+/// The most expensive pixel in the cost buffer, in microseconds
+///////////////////////////////////////////////////////////////////////////
+float getMaxCost();
+
+///////////////////////////////////////////////////////////////////////////
+/// Map a normalized cost in [0, 1] to a false colour. Must match the
+/// colour map in copyTexture.frag.
+///////////////////////////////////////////////////////////////////////////
+vec3 heatmapColor(float t);
+
+///////////////////////////////////////////////////////////////////////////
+/// Save the cost buffer as a false colour png and as raw values in an
+/// hdr image, named <basename>_cost.png and <basename>_cost.hdr.
+///////////////////////////////////////////////////////////////////////////
+void saveCostHeatmap(const std::string& basename);
 }; // namespace pathtracer
@@ -0,0 +1,229 @@
+#include "checkpoint.h"
+#include "Pathtracer.h"
+#include "sampling.h"
+#include <labhelper.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace checkpoint
+{
+	Settings settings;
+
+	namespace
+	{
+		///////////////////////////////////////////////////////////////////////
+		// File layout: header, then the variable length fields of Snapshot
+		// in declaration order. Strings are prefixed by their length.
+		///////////////////////////////////////////////////////////////////////
+		const char magic[8] = { 'P', 'T', 'C', 'K', 'P', 'T', '0', '1' };
+		const uint32_t version = 1;
+
+		thread writer;
+		atomic<bool> writing(false);
+		chrono::steady_clock::time_point last_save = chrono::steady_clock::now();
+
+		template<typename T>
+		void write(ofstream& f, const T& value)
+		{
+			f.write(reinterpret_cast<const char*>(&value), sizeof(T));
+		}
+		void write(ofstream& f, const string& s)
+		{
+			write(f, uint32_t(s.size()));
+			f.write(s.data(), s.size());
+		}
+		// Bytes from the read position to the end of the file
+		uint64_t remaining(ifstream& f)
+		{
+			const streampos position = f.tellg();
+			f.seekg(0, ios::end);
+			const streampos end = f.tellg();
+			f.seekg(position);
+			return uint64_t(end - position);
+		}
+		template<typename T>
+		bool read(ifstream& f, T& value)
+		{
+			return bool(f.read(reinterpret_cast<char*>(&value), sizeof(T)));
+		}
+		bool read(ifstream& f, string& s)
+		{
+			uint32_t size;
+			if(!read(f, size) || size > remaining(f))
+				return false;
+			s.resize(size);
+			return bool(f.read(&s[0], size));
+		}
+
+		void writeSnapshot(const string& filename, const Snapshot& snapshot)
+		{
+			// Write to a temporary file and rename it, so that a crash while
+			// writing never leaves us without a valid checkpoint
+			const string tmp_filename = filename + ".tmp";
+			{
+				ofstream f(tmp_filename, ios::binary);
+				if(!f.is_open())
+				{
+					cout << "Could not open " << tmp_filename << " for writing.\n";
+					return;
+				}
+				f.write(magic, sizeof(magic));
+				write(f, version);
+				write(f, snapshot.scene);
+				write(f, snapshot.V);
+				write(f, snapshot.P);
+				write(f, snapshot.subsampling);
+				write(f, snapshot.width);
+				write(f, snapshot.height);
+				write(f, snapshot.number_of_samples);
+				write(f, snapshot.generator_state);
+				f.write(reinterpret_cast<const char*>(snapshot.data.data()),
+				        snapshot.data.size() * sizeof(vec3));
+				f.write(reinterpret_cast<const char*>(snapshot.samples.data()),
+				        snapshot.samples.size() * sizeof(int));
+				if(!f.good())
+				{
+					cout << "Failed to write checkpoint " << tmp_filename << ".\n";
+					return;
+				}
+			}
+			if(!labhelper::file::replace(tmp_filename, filename))
+			{
+				cout << "Failed to rename " << tmp_filename << " to " << filename << ".\n";
+				return;
+			}
+			cout << "Saved checkpoint " << filename << " (" << snapshot.number_of_samples << " samples).\n";
+		}
+	} // namespace
+
+	bool save(const string& filename, const mat4& V, const mat4& P, const string& scene)
+	{
+		if(writing)
+		{
+			return false;
+		}
+		if(writer.joinable())
+		{
+			writer.join();
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Copy everything on this thread, between two passes of tracePaths(),
+		// and leave the slow part to the writer thread.
+		///////////////////////////////////////////////////////////////////////
+		shared_ptr<Snapshot> snapshot = make_shared<Snapshot>();
+		snapshot->scene = scene;
+		snapshot->V = V;
+		snapshot->P = P;
+		snapshot->subsampling = pathtracer::settings.subsampling;
+		snapshot->width = rendered_image.width;
+		snapshot->height = rendered_image.height;
+		snapshot->number_of_samples = rendered_image.number_of_samples;
+		snapshot->generator_state = getGeneratorState();
+		snapshot->data = rendered_image.data;
+		snapshot->samples = rendered_image.samples;
+
+		writing = true;
+		last_save = chrono::steady_clock::now();
+		writer = thread([filename, snapshot]() {
+			writeSnapshot(filename, *snapshot);
+			writing = false;
+		});
+		return true;
+	}
+
+	void update(const mat4& V, const mat4& P, const string& scene)
+	{
+		if(!settings.enabled || rendered_image.number_of_samples == 0)
+		{
+			return;
+		}
+		chrono::duration<float> since_last_save = chrono::steady_clock::now() - last_save;
+		if(since_last_save.count() >= settings.interval)
+		{
+			save(settings.filename, V, P, scene);
+		}
+	}
+
+	bool load(const string& filename, Snapshot& snapshot)
+	{
+		ifstream f(filename, ios::binary);
+		if(!f.is_open())
+		{
+			cout << "Could not open checkpoint " << filename << ".\n";
+			return false;
+		}
+		char file_magic[sizeof(magic)];
+		uint32_t file_version;
+		if(!f.read(file_magic, sizeof(file_magic)) || memcmp(file_magic, magic, sizeof(magic)) != 0
+		   || !read(f, file_version) || file_version != version)
+		{
+			cout << filename << " is not a checkpoint of this version.\n";
+			return false;
+		}
+		bool ok = read(f, snapshot.scene) && read(f, snapshot.V) && read(f, snapshot.P)
+		          && read(f, snapshot.subsampling) && read(f, snapshot.width) && read(f, snapshot.height)
+		          && read(f, snapshot.number_of_samples) && read(f, snapshot.generator_state);
+		if(!ok)
+		{
+			cout << "Checkpoint " << filename << " is truncated.\n";
+			return false;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Check the size in the header against the file before allocating
+		// anything, so that a damaged header can not ask for gigabytes
+		///////////////////////////////////////////////////////////////////////
+		const uint64_t pixels = uint64_t(uint32_t(snapshot.width)) * uint32_t(snapshot.height);
+		if(snapshot.width <= 0 || snapshot.height <= 0 || snapshot.subsampling <= 0
+		   || remaining(f) != pixels * (sizeof(vec3) + sizeof(int)))
+		{
+			cout << "Checkpoint " << filename << " does not match its header.\n";
+			return false;
+		}
+		snapshot.data.resize(pixels);
+		snapshot.samples.resize(pixels);
+		return f.read(reinterpret_cast<char*>(snapshot.data.data()), pixels * sizeof(vec3))
+		       && f.read(reinterpret_cast<char*>(snapshot.samples.data()), pixels * sizeof(int));
+	}
+
+	bool restore(const Snapshot& snapshot)
+	{
+		if(snapshot.width != rendered_image.width || snapshot.height != rendered_image.height)
+		{
+			cout << "Checkpoint is " << snapshot.width << "x" << snapshot.height << " but the image is "
+			     << rendered_image.width << "x" << rendered_image.height
+			     << ", resize the window to resume it.\n";
+			return false;
+		}
+		if(!setGeneratorState(snapshot.generator_state))
+		{
+			cout << "Checkpoint has an invalid generator state.\n";
+			return false;
+		}
+		rendered_image.data = snapshot.data;
+		rendered_image.samples = snapshot.samples;
+		rendered_image.number_of_samples = snapshot.number_of_samples;
+		return true;
+	}
+
+	void shutDown()
+	{
+		if(writer.joinable())
+		{
+			writer.join();
+		}
+	}
+} // namespace checkpoint
+} // namespace pathtracer
@@ -0,0 +1,68 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Checkpoints of progressive renders.
+//
+// A checkpoint holds everything needed to continue a render where it
+// stopped: the accumulated image and per pixel sample counts, the scene
+// and camera it was rendered with, and the state of the random number
+// generators. Checkpoints are written from a background thread, so the
+// only cost on the render thread is a copy of the image.
+///////////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace checkpoint
+{
+	struct Settings
+	{
+		// Write a checkpoint every `interval` seconds
+		bool enabled = false;
+		float interval = 60.0f;
+		std::string filename = "pathtracer.checkpoint";
+	};
+	extern Settings settings;
+
+	struct Snapshot
+	{
+		std::string scene;
+		glm::mat4 V, P;
+		int subsampling;
+		int width, height, number_of_samples;
+		std::string generator_state;
+		std::vector<glm::vec3> data;
+		std::vector<int> samples;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Called once per frame, between calls to tracePaths(). Starts writing
+	/// a checkpoint in the background if it's time for one.
+	///////////////////////////////////////////////////////////////////////////
+	void update(const glm::mat4& V, const glm::mat4& P, const std::string& scene);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Start writing a checkpoint now, unless one is already being written.
+	/// Returns false if a write was already in progress.
+	///////////////////////////////////////////////////////////////////////////
+	bool save(const std::string& filename, const glm::mat4& V, const glm::mat4& P, const std::string& scene);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Read a checkpoint from disk
+	///////////////////////////////////////////////////////////////////////////
+	bool load(const std::string& filename, Snapshot& snapshot);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Replace rendered_image and the generator state with the snapshot.
+	/// The scene must already be loaded, and the image must have the
+	/// snapshot's size.
+	///////////////////////////////////////////////////////////////////////////
+	bool restore(const Snapshot& snapshot);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Wait for any checkpoint being written to finish
+	///////////////////////////////////////////////////////////////////////////
+	void shutDown();
+} // namespace checkpoint
+} // namespace pathtracer
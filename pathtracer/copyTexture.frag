@@ -5,9 +5,28 @@ precision highp float;
 
 layout(location = 0) out vec4 fragmentColor;
 layout(binding = 0) uniform sampler2D image;
+layout(binding = 1) uniform sampler2D cost_image;
+uniform bool show_heatmap = false;
+uniform float max_cost = 1.0;
 in vec2 texCoord;
 
+// Piecewise linear blue -> cyan -> green -> yellow -> red, must match
+// pathtracer::heatmapColor()
+vec3 heatmapColor(float t)
+{
+	const vec3 stops[5] = vec3[](vec3(0, 0, 1), vec3(0, 1, 1), vec3(0, 1, 0), vec3(1, 1, 0), vec3(1, 0, 0));
+	t = clamp(t, 0.0, 1.0) * 4.0;
+	int i = min(int(t), 3);
+	return mix(stops[i], stops[i + 1], t - float(i));
+}
+
 void main()
 {
+	if(show_heatmap)
+	{
+		float cost = texture(cost_image, texCoord).r;
+		fragmentColor = vec4(heatmapColor(cost / max(max_cost, 1e-6)), 1.0);
+		return;
+	}
 	fragmentColor = texture(image, texCoord);
 }
@@ -0,0 +1,748 @@
+#include "distributed.h"
+#include "Pathtracer.h"
+#include "sampling.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+typedef SOCKET socket_t;
+typedef intptr_t process_t;
+#define CLOSE_SOCKET closesocket
+#define GET_PID _getpid
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+typedef int socket_t;
+typedef pid_t process_t;
+#define INVALID_SOCKET (-1)
+#define CLOSE_SOCKET close
+#define GET_PID getpid
+#endif
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace distributed
+{
+	Settings settings;
+
+	namespace
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Wire protocol. Every message is a MessageHeader followed by `size`
+		// bytes of payload.
+		///////////////////////////////////////////////////////////////////////
+		enum MessageType : uint32_t
+		{
+			MSG_HELLO = 1,  // worker -> coordinator, no payload
+			MSG_JOB = 2,    // coordinator -> worker, scene, camera and lights
+			MSG_LEASE = 3,  // coordinator -> worker, lease id, job id and Tile
+			MSG_RESULT = 4, // worker -> coordinator, lease id, job id, Tile and sums
+		};
+
+		struct MessageHeader
+		{
+			uint32_t type;
+			uint32_t size;
+		};
+
+		const uint32_t max_message_size = 64 * 1024 * 1024;
+
+		class Writer
+		{
+		public:
+			vector<uint8_t> data;
+			template<typename T>
+			void write(const T& value)
+			{
+				const uint8_t* p = reinterpret_cast<const uint8_t*>(&value);
+				data.insert(data.end(), p, p + sizeof(T));
+			}
+			void write(const string& s)
+			{
+				write(uint32_t(s.size()));
+				data.insert(data.end(), s.begin(), s.end());
+			}
+			void write(const void* p, size_t size)
+			{
+				data.insert(data.end(), (const uint8_t*)p, (const uint8_t*)p + size);
+			}
+		};
+
+		class Reader
+		{
+		public:
+			const uint8_t* p;
+			const uint8_t* end;
+			Reader(const uint8_t* data, size_t size) : p(data), end(data + size)
+			{
+			}
+			template<typename T>
+			bool read(T& value)
+			{
+				if(size_t(end - p) < sizeof(T))
+					return false;
+				memcpy(&value, p, sizeof(T));
+				p += sizeof(T);
+				return true;
+			}
+			bool read(string& s)
+			{
+				uint32_t size;
+				if(!read(size) || size_t(end - p) < size)
+					return false;
+				s.assign((const char*)p, size);
+				p += size;
+				return true;
+			}
+		};
+
+		bool sendAll(socket_t s, const void* data, size_t size)
+		{
+			const char* p = (const char*)data;
+			while(size > 0)
+			{
+				int sent = send(s, p, int(size), 0);
+				if(sent <= 0)
+					return false;
+				p += sent;
+				size -= sent;
+			}
+			return true;
+		}
+
+		bool recvAll(socket_t s, void* data, size_t size)
+		{
+			char* p = (char*)data;
+			while(size > 0)
+			{
+				int received = recv(s, p, int(size), 0);
+				if(received <= 0)
+					return false;
+				p += received;
+				size -= received;
+			}
+			return true;
+		}
+
+		bool sendMessage(socket_t s, MessageType type, const vector<uint8_t>& payload)
+		{
+			MessageHeader header = { type, uint32_t(payload.size()) };
+			return sendAll(s, &header, sizeof(header)) && sendAll(s, payload.data(), payload.size());
+		}
+
+		void initSockets()
+		{
+#ifdef _WIN32
+			static bool initialized = false;
+			if(!initialized)
+			{
+				WSADATA wsa_data;
+				WSAStartup(MAKEWORD(2, 2), &wsa_data);
+				initialized = true;
+			}
+#endif
+		}
+
+		void setNoDelay(socket_t s)
+		{
+			int flag = 1;
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&flag, sizeof(flag));
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Everything that the workers need to know to render a tile
+		///////////////////////////////////////////////////////////////////////
+		struct Job
+		{
+			uint32_t id = 0;
+			string scene;
+			mat4 V, P;
+			int width = 0, height = 0;
+			int max_bounces = 0;
+			// Only known to the coordinator. settings.tile_size when the job
+			// started, which all tile indices of the job refer to.
+			int tile_size = 0;
+		};
+
+		void writeJob(Writer& w, const Job& job)
+		{
+			w.write(job.id);
+			w.write(job.scene);
+			w.write(job.V);
+			w.write(job.P);
+			w.write(job.width);
+			w.write(job.height);
+			w.write(job.max_bounces);
+			w.write(environment.multiplier);
+			w.write(point_light);
+			w.write(uint32_t(disc_lights.size()));
+			w.write(disc_lights.data(), disc_lights.size() * sizeof(DiscLight));
+		}
+
+		bool readJob(Reader& r, Job& job)
+		{
+			uint32_t num_disc_lights;
+			bool ok = r.read(job.id) && r.read(job.scene) && r.read(job.V) && r.read(job.P)
+			          && r.read(job.width) && r.read(job.height) && r.read(job.max_bounces)
+			          && r.read(environment.multiplier) && r.read(point_light) && r.read(num_disc_lights);
+			if(!ok)
+				return false;
+			disc_lights.resize(num_disc_lights);
+			for(auto& l : disc_lights)
+			{
+				if(!r.read(l))
+					return false;
+			}
+			return true;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Coordinator state
+		///////////////////////////////////////////////////////////////////////
+		struct Lease
+		{
+			int tile;
+			int samples;
+			int worker;
+			chrono::steady_clock::time_point issued;
+		};
+
+		struct WorkerConnection
+		{
+			socket_t socket;
+			vector<uint8_t> buffer;
+			uint32_t job_sent = 0;
+			int outstanding = 0;
+			bool alive = true;
+		};
+
+		socket_t listen_socket = INVALID_SOCKET;
+		vector<WorkerConnection> workers;
+		map<uint32_t, Lease> leases;
+		deque<int> reassigned_tiles;
+		vector<int> tile_samples;
+		// Samples of each tile on leases that have not come back yet
+		vector<int> tile_leased_samples;
+		int tiles_x = 0, tiles_y = 0;
+		int next_tile = 0;
+		uint32_t next_lease_id = 1;
+		Job job;
+		Stats stats = {};
+		// Started by spawnLocalWorkers()
+		vector<process_t> local_workers;
+
+		Tile getTile(int index, int samples)
+		{
+			Tile t;
+			t.x0 = (index % tiles_x) * job.tile_size;
+			t.y0 = (index / tiles_x) * job.tile_size;
+			t.x1 = std::min(t.x0 + job.tile_size, rendered_image.width);
+			t.y1 = std::min(t.y0 + job.tile_size, rendered_image.height);
+			t.samples = samples;
+			return t;
+		}
+
+		void startJob(const mat4& V, const mat4& P, const string& scene)
+		{
+			job.id += 1;
+			job.scene = scene;
+			job.V = V;
+			job.P = P;
+			job.width = rendered_image.width;
+			job.height = rendered_image.height;
+			job.max_bounces = pathtracer::settings.max_bounces;
+			job.tile_size = settings.tile_size;
+
+			// Results for leases of the previous job are thrown away when they arrive
+			leases.clear();
+			reassigned_tiles.clear();
+			for(auto& w : workers)
+			{
+				w.outstanding = 0;
+			}
+			tiles_x = (rendered_image.width + job.tile_size - 1) / job.tile_size;
+			tiles_y = (rendered_image.height + job.tile_size - 1) / job.tile_size;
+			tile_samples.assign(tiles_x * tiles_y, 0);
+			tile_leased_samples.assign(tiles_x * tiles_y, 0);
+			next_tile = 0;
+
+			restart();
+			// So that we can tell a restart() from outside apart from our own
+			rendered_image.number_of_samples = 1;
+		}
+
+		void dropWorker(int index)
+		{
+			WorkerConnection& w = workers[index];
+			if(!w.alive)
+				return;
+			cout << "Worker " << index << " disconnected, reassigning its leases.\n";
+			w.alive = false;
+			CLOSE_SOCKET(w.socket);
+			for(auto it = leases.begin(); it != leases.end();)
+			{
+				if(it->second.worker == index)
+				{
+					tile_leased_samples[it->second.tile] -= it->second.samples;
+					reassigned_tiles.push_back(it->second.tile);
+					stats.reassigned_leases += 1;
+					it = leases.erase(it);
+				}
+				else
+				{
+					++it;
+				}
+			}
+		}
+
+		void handleResult(int worker, Reader& r)
+		{
+			uint32_t lease_id, job_id;
+			Tile tile;
+			if(!r.read(lease_id) || !r.read(job_id) || !r.read(tile))
+			{
+				dropWorker(worker);
+				return;
+			}
+			auto it = leases.find(lease_id);
+			if(job_id != job.id || it == leases.end() || it->second.worker != worker)
+			{
+				// Stale result, from a previous job or a lease that timed out
+				return;
+			}
+			// Only ever merge the tile that was leased, whatever the worker claims
+			const Tile leased = getTile(it->second.tile, it->second.samples);
+			if(tile.x0 != leased.x0 || tile.y0 != leased.y0 || tile.x1 != leased.x1 || tile.y1 != leased.y1
+			   || tile.samples != leased.samples)
+			{
+				cout << "Worker " << worker << " returned a different tile than it was leased.\n";
+				dropWorker(worker);
+				return;
+			}
+			const size_t num_values = size_t(tile.x1 - tile.x0) * size_t(tile.y1 - tile.y0);
+			if(size_t(r.end - r.p) != num_values * sizeof(vec3))
+			{
+				dropWorker(worker);
+				return;
+			}
+			vector<vec3> sums(num_values);
+			memcpy(sums.data(), r.p, num_values * sizeof(vec3));
+			accumulateTile(tile, sums.data());
+			tile_samples[it->second.tile] += tile.samples;
+			tile_leased_samples[it->second.tile] -= tile.samples;
+			leases.erase(it);
+			workers[worker].outstanding -= 1;
+			stats.completed_leases += 1;
+		}
+
+		void receive(int index)
+		{
+			WorkerConnection& w = workers[index];
+			char chunk[64 * 1024];
+			int received = recv(w.socket, chunk, sizeof(chunk), 0);
+			if(received <= 0)
+			{
+				dropWorker(index);
+				return;
+			}
+			w.buffer.insert(w.buffer.end(), chunk, chunk + received);
+
+			// Handle all complete messages in the buffer
+			size_t offset = 0;
+			while(w.alive && w.buffer.size() - offset >= sizeof(MessageHeader))
+			{
+				MessageHeader header;
+				memcpy(&header, &w.buffer[offset], sizeof(header));
+				if(header.size > max_message_size)
+				{
+					dropWorker(index);
+					return;
+				}
+				if(w.buffer.size() - offset - sizeof(header) < header.size)
+					break;
+				Reader r(&w.buffer[offset + sizeof(header)], header.size);
+				if(header.type == MSG_RESULT)
+				{
+					handleResult(index, r);
+				}
+				offset += sizeof(header) + header.size;
+			}
+			if(w.alive)
+			{
+				w.buffer.erase(w.buffer.begin(), w.buffer.begin() + offset);
+			}
+		}
+
+		// The samples that a new lease of the tile can have, counting those
+		// on leases that are still out, so that no tile gets more than
+		// max_paths_per_pixel
+		int samplesLeft(int tile)
+		{
+			const int max_paths = pathtracer::settings.max_paths_per_pixel;
+			if(max_paths == 0)
+				return settings.samples_per_lease;
+			const int left = max_paths - tile_samples[tile] - tile_leased_samples[tile];
+			return std::max(0, std::min(left, settings.samples_per_lease));
+		}
+
+		bool pickTile(int& tile, int& samples)
+		{
+			while(!reassigned_tiles.empty())
+			{
+				tile = reassigned_tiles.front();
+				reassigned_tiles.pop_front();
+				samples = samplesLeft(tile);
+				if(samples > 0)
+					return true;
+			}
+			const int num_tiles = int(tile_samples.size());
+			for(int i = 0; i < num_tiles; i++)
+			{
+				int t = (next_tile + i) % num_tiles;
+				samples = samplesLeft(t);
+				if(samples > 0)
+				{
+					next_tile = (t + 1) % num_tiles;
+					tile = t;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void issueLeases(int index)
+		{
+			WorkerConnection& w = workers[index];
+			if(w.job_sent != job.id)
+			{
+				Writer writer;
+				writeJob(writer, job);
+				if(!sendMessage(w.socket, MSG_JOB, writer.data))
+				{
+					dropWorker(index);
+					return;
+				}
+				w.job_sent = job.id;
+			}
+			int tile_index, samples;
+			while(w.outstanding < settings.leases_per_worker && pickTile(tile_index, samples))
+			{
+				Lease lease = { tile_index, samples, index, chrono::steady_clock::now() };
+				uint32_t lease_id = next_lease_id++;
+				Writer writer;
+				writer.write(lease_id);
+				writer.write(job.id);
+				writer.write(getTile(tile_index, lease.samples));
+				if(!sendMessage(w.socket, MSG_LEASE, writer.data))
+				{
+					reassigned_tiles.push_back(tile_index);
+					dropWorker(index);
+					return;
+				}
+				leases[lease_id] = lease;
+				tile_leased_samples[tile_index] += samples;
+				w.outstanding += 1;
+			}
+		}
+	} // namespace
+
+	bool startCoordinator(int port)
+	{
+		initSockets();
+		listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+		if(listen_socket == INVALID_SOCKET)
+			return false;
+		int reuse = 1;
+		setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(uint16_t(port));
+		if(::bind(listen_socket, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_socket, 16) != 0)
+		{
+			cout << "Could not listen on port " << port << ".\n";
+			CLOSE_SOCKET(listen_socket);
+			listen_socket = INVALID_SOCKET;
+			return false;
+		}
+		cout << "Coordinator listening on port " << port << ".\n";
+		return true;
+	}
+
+	bool isCoordinator()
+	{
+		return listen_socket != INVALID_SOCKET;
+	}
+
+	void coordinate(const mat4& V, const mat4& P, const string& scene)
+	{
+		if(rendered_image.number_of_samples == 0 || V != job.V || P != job.P || scene != job.scene
+		   || rendered_image.width != job.width || rendered_image.height != job.height
+		   || pathtracer::settings.max_bounces != job.max_bounces || settings.tile_size != job.tile_size)
+		{
+			startJob(V, P, scene);
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Poll the listening socket and all workers without blocking
+		///////////////////////////////////////////////////////////////////////
+		fd_set read_set;
+		FD_ZERO(&read_set);
+		FD_SET(listen_socket, &read_set);
+		socket_t max_socket = listen_socket;
+		for(auto& w : workers)
+		{
+			if(w.alive)
+			{
+				FD_SET(w.socket, &read_set);
+				max_socket = std::max(max_socket, w.socket);
+			}
+		}
+		timeval timeout = { 0, 0 };
+		if(select(int(max_socket + 1), &read_set, nullptr, nullptr, &timeout) > 0)
+		{
+			if(FD_ISSET(listen_socket, &read_set))
+			{
+				socket_t s = accept(listen_socket, nullptr, nullptr);
+				if(s != INVALID_SOCKET)
+				{
+					setNoDelay(s);
+					WorkerConnection w;
+					w.socket = s;
+					workers.push_back(w);
+					cout << "Worker " << workers.size() - 1 << " connected.\n";
+				}
+			}
+			for(int i = 0; i < int(workers.size()); i++)
+			{
+				if(workers[i].alive && FD_ISSET(workers[i].socket, &read_set))
+				{
+					receive(i);
+				}
+			}
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Workers that sit on a lease for too long are considered dead
+		///////////////////////////////////////////////////////////////////////
+		auto now = chrono::steady_clock::now();
+		vector<int> timed_out;
+		for(auto& l : leases)
+		{
+			if(chrono::duration<float>(now - l.second.issued).count() > settings.lease_timeout)
+			{
+				timed_out.push_back(l.second.worker);
+			}
+		}
+		for(int worker : timed_out)
+		{
+			dropWorker(worker);
+		}
+
+		for(int i = 0; i < int(workers.size()); i++)
+		{
+			if(workers[i].alive)
+			{
+				issueLeases(i);
+			}
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// The image has as many samples as its least sampled tile
+		///////////////////////////////////////////////////////////////////////
+		int min_samples = tile_samples.empty() ? 0 : tile_samples[0];
+		for(int s : tile_samples)
+		{
+			min_samples = std::min(min_samples, s);
+		}
+		rendered_image.number_of_samples = min_samples + 1;
+
+		stats.workers = 0;
+		for(auto& w : workers)
+		{
+			stats.workers += w.alive ? 1 : 0;
+		}
+		stats.outstanding_leases = int(leases.size());
+	}
+
+	Stats getStats()
+	{
+		return stats;
+	}
+
+	bool spawnLocalWorkers(const string& executable, int port, int count)
+	{
+		const string address = "127.0.0.1:" + to_string(port);
+		for(int i = 0; i < count; i++)
+		{
+#ifdef _WIN32
+			process_t process = _spawnl(_P_NOWAIT, executable.c_str(), executable.c_str(), "--worker",
+			                            address.c_str(), nullptr);
+			if(process == -1)
+#else
+			process_t process = fork();
+			if(process == 0)
+			{
+				// Don't hold on to the coordinator's sockets in the worker
+				CLOSE_SOCKET(listen_socket);
+				for(auto& w : workers)
+				{
+					CLOSE_SOCKET(w.socket);
+				}
+				execlp(executable.c_str(), executable.c_str(), "--worker", address.c_str(), nullptr);
+				_exit(127);
+			}
+			if(process < 0)
+#endif
+			{
+				cout << "Could not start a worker process of " << executable << ".\n";
+				return false;
+			}
+			local_workers.push_back(process);
+		}
+		cout << "Started " << count << " local workers.\n";
+		return true;
+	}
+
+	void runWorker(const string& host, int port, const function<void(const string&)>& change_scene)
+	{
+		initSockets();
+
+		// Make sure that no two workers trace the same paths
+		seedGenerators(uint32_t(random_device()()) ^ uint32_t(GET_PID()));
+
+		///////////////////////////////////////////////////////////////////////
+		// Connect, retrying for a while in case the coordinator isn't up yet
+		///////////////////////////////////////////////////////////////////////
+		addrinfo hints = {};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* address = nullptr;
+		if(getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &address) != 0)
+		{
+			cout << "Could not resolve " << host << ".\n";
+			return;
+		}
+		socket_t s = INVALID_SOCKET;
+		for(int attempt = 0; attempt < 30 && s == INVALID_SOCKET; attempt++)
+		{
+			s = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+			if(connect(s, address->ai_addr, int(address->ai_addrlen)) != 0)
+			{
+				CLOSE_SOCKET(s);
+				s = INVALID_SOCKET;
+				this_thread::sleep_for(chrono::seconds(1));
+			}
+		}
+		freeaddrinfo(address);
+		if(s == INVALID_SOCKET)
+		{
+			cout << "Could not connect to coordinator at " << host << ":" << port << ".\n";
+			return;
+		}
+		setNoDelay(s);
+		cout << "Connected to coordinator at " << host << ":" << port << ".\n";
+		sendMessage(s, MSG_HELLO, {});
+
+		///////////////////////////////////////////////////////////////////////
+		// Render leases until the coordinator goes away
+		///////////////////////////////////////////////////////////////////////
+		Job current;
+		string current_scene;
+		vector<uint8_t> payload;
+		vector<vec3> sums;
+		MessageHeader header;
+		while(recvAll(s, &header, sizeof(header)) && header.size <= max_message_size)
+		{
+			payload.resize(header.size);
+			if(!recvAll(s, payload.data(), payload.size()))
+				break;
+			Reader r(payload.data(), payload.size());
+			if(header.type == MSG_JOB)
+			{
+				if(!readJob(r, current))
+					break;
+				if(current.scene != current_scene)
+				{
+					change_scene(current.scene);
+					current_scene = current.scene;
+				}
+				pathtracer::settings.max_bounces = current.max_bounces;
+				rendered_image.width = current.width;
+				rendered_image.height = current.height;
+			}
+			else if(header.type == MSG_LEASE)
+			{
+				uint32_t lease_id, job_id;
+				Tile tile;
+				if(!r.read(lease_id) || !r.read(job_id) || !r.read(tile))
+					break;
+				if(job_id != current.id)
+				{
+					// The coordinator always sends the job before its leases
+					continue;
+				}
+				tracePathsInTile(current.V, current.P, tile, sums);
+				Writer writer;
+				writer.write(lease_id);
+				writer.write(job_id);
+				writer.write(tile);
+				writer.write(sums.data(), sums.size() * sizeof(vec3));
+				if(!sendMessage(s, MSG_RESULT, writer.data))
+					break;
+			}
+		}
+		cout << "Connection to coordinator closed.\n";
+		CLOSE_SOCKET(s);
+	}
+
+	void shutDown()
+	{
+		for(int i = 0; i < int(workers.size()); i++)
+		{
+			if(workers[i].alive)
+			{
+				workers[i].alive = false;
+				CLOSE_SOCKET(workers[i].socket);
+			}
+		}
+		if(listen_socket != INVALID_SOCKET)
+		{
+			CLOSE_SOCKET(listen_socket);
+			listen_socket = INVALID_SOCKET;
+		}
+		// With their connections closed, the local workers exit on their own
+		for(process_t process : local_workers)
+		{
+#ifdef _WIN32
+			int status;
+			_cwait(&status, process, _WAIT_CHILD);
+#else
+			waitpid(process, nullptr, 0);
+#endif
+		}
+		local_workers.clear();
+	}
+} // namespace distributed
+} // namespace pathtracer
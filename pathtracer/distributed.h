@@ -0,0 +1,112 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <functional>
+
+///////////////////////////////////////////////////////////////////////////////
+// Distributed rendering.
+//
+// One pathtracer process is started as the coordinator, and any number of
+// worker processes connect to it over TCP:
+//
+//   pathtracer --coordinator 5555
+//   pathtracer --worker 127.0.0.1:5555     (once per worker)
+//
+// or, to start the workers on this machine along with the coordinator,
+//
+//   pathtracer --coordinator 5555 --workers 4
+//
+// The coordinator splits the image into tiles and leases a tile plus a
+// number of samples per pixel to each worker. Workers send back the
+// radiance sums for the tile, which are merged into rendered_image using
+// the per pixel sample counts. If a worker disconnects, or does not answer
+// within `lease_timeout` seconds, its leases are handed to another worker.
+//
+// Both ends are assumed to run the same build on machines of the same
+// endianness. Material edits made in the coordinator GUI are not sent to
+// the workers, they render the materials as loaded from disk. The workers do
+// not time their pixels, so the coordinator has no cost heatmap.
+//
+// To check that the workers render the same image as a single process,
+// render a view with a fixed number of paths per pixel both ways, save a
+// checkpoint of each (see checkpoint.h) and compare them. `--save` writes
+// the checkpoint and quits once the paths are done, so this runs unattended:
+//
+//   pathtracer --paths 64 --save single.checkpoint
+//   pathtracer --resume single.checkpoint --paths 64 --workers 4 --save workers.checkpoint
+//   pathtracer --compare single.checkpoint workers.checkpoint
+//
+// Resuming restores the scene and camera, and the coordinator starts its
+// own render of them from scratch. The comparison fails if any pixel went
+// unsampled or if blocks of pixels differ by more than the noise allows.
+///////////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace distributed
+{
+	struct Settings
+	{
+		// Side of the square tiles leased to workers, in pixels
+		int tile_size = 32;
+		// Paths per pixel traced for each lease
+		int samples_per_lease = 4;
+		// Leases handed out to a worker before it has returned any
+		int leases_per_worker = 2;
+		// Seconds before an unanswered lease is given to another worker
+		float lease_timeout = 30.0f;
+	};
+	extern Settings settings;
+
+	struct Stats
+	{
+		int workers;
+		int outstanding_leases;
+		int completed_leases;
+		int reassigned_leases;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Start listening for workers. Returns false if the port can't be bound.
+	///////////////////////////////////////////////////////////////////////////
+	bool startCoordinator(int port);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// True if startCoordinator() has been called successfully
+	///////////////////////////////////////////////////////////////////////////
+	bool isCoordinator();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Called once per frame on the coordinator instead of tracePaths().
+	/// Accepts new workers, merges finished tiles into rendered_image and
+	/// hands out new leases. A new render is started whenever the camera
+	/// or the scene changes, or pathtracer::restart() has been called.
+	///////////////////////////////////////////////////////////////////////////
+	void coordinate(const glm::mat4& V, const glm::mat4& P, const std::string& scene);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Statistics for the GUI
+	///////////////////////////////////////////////////////////////////////////
+	Stats getStats();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Start `count` worker processes of `executable` on this machine,
+	/// connecting to the coordinator on `port`. They exit when shutDown()
+	/// closes their connections, and shutDown() waits for them.
+	///////////////////////////////////////////////////////////////////////////
+	bool spawnLocalWorkers(const std::string& executable, int port, int count);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Connect to a coordinator and render leases until the connection is
+	/// closed. `change_scene` is called whenever the coordinator switches
+	/// to a different scene.
+	///////////////////////////////////////////////////////////////////////////
+	void runWorker(const std::string& host,
+	               int port,
+	               const std::function<void(const std::string&)>& change_scene);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Close all connections
+	///////////////////////////////////////////////////////////////////////////
+	void shutDown();
+} // namespace distributed
+} // namespace pathtracer
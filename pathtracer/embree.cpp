@@ -1,4 +1,5 @@
 #include "embree.h"
+#include "trace.h"
 #include <iostream>
 #include <map>
 
@@ -20,6 +21,7 @@ RTCScene embree_scene = nullptr;
 void buildBVH()
 {
 	cout << "Embree building BVH..." << flush;
+	labhelper::trace::Scope scope("Build BVH");
 	rtcCommit(embree_scene);
 	cout << "done.\n";
 }
@@ -86,24 +88,25 @@ void addModel(const labhelper::Model* model, const mat4& model_matrix)
 	// Material.
 	///////////////////////////////////////////////////////////////////////
 	cout << "Adding " << model->m_name << " to embree scene..." << flush;
+	labhelper::trace::Scope scope("Add model to Embree", model->m_name);
 	for(auto& mesh : model->m_meshes)
 	{
 		uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-		                                      mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
+		                                      mesh.m_number_of_indices / 3, mesh.m_number_of_vertices);
 		map_geom_ID_to_mesh[geom_ID] = &mesh;
 		map_geom_ID_to_model[geom_ID] = model;
 		// Transform and commit vertices
 		vec4* embree_vertices = (vec4*)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
 		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
 		{
-			embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+			embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_base_vertex + i], 1.0f);
 		}
 		rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
 		// Commit triangle indices
 		int* embree_tri_idxs = (int*)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		for(uint32_t i = 0; i < mesh.m_number_of_indices; i++)
 		{
-			embree_tri_idxs[i] = i;
+			embree_tri_idxs[i] = int(model->m_indices[mesh.m_start_index + i]);
 		}
 		rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
 	}
@@ -119,18 +122,22 @@ Intersection getIntersection(const Ray& r)
 	const labhelper::Mesh* mesh = map_geom_ID_to_mesh[r.geomID];
 	Intersection i;
 	i.material = &(model->m_materials[mesh->m_material_idx]);
-	vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+	const uint32_t* triangle = &model->m_indices[mesh->m_start_index + r.primID * 3];
+	const uint32_t v0 = mesh->m_base_vertex + triangle[0];
+	const uint32_t v1 = mesh->m_base_vertex + triangle[1];
+	const uint32_t v2 = mesh->m_base_vertex + triangle[2];
+	vec3 n0 = model->m_normals[v0];
+	vec3 n1 = model->m_normals[v1];
+	vec3 n2 = model->m_normals[v2];
 	float w = 1.0f - (r.u + r.v);
 	i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
 	i.geometry_normal = -normalize(r.n);
 	i.position = r.o + r.tfar * r.d;
 	i.wo = normalize(-r.d);
 
-	vec2 uv0 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec2 uv1 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec2 uv2 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+	vec2 uv0 = model->m_texture_coordinates[v0];
+	vec2 uv1 = model->m_texture_coordinates[v1];
+	vec2 uv2 = model->m_texture_coordinates[v2];
 	i.uv = w * uv0 + r.u * uv1 + r.v * uv2;
 	return i;
 }
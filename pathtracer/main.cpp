@@ -9,10 +9,13 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <Model.h>
+#include <trace.h>
 #include <string>
 #include "Pathtracer.h"
 #include "embree.h"
 #include "sampling.h"
+#include "distributed.h"
+#include "checkpoint.h"
 
 
 using namespace glm;
@@ -45,6 +48,8 @@ GLuint simpleShaderProgram;
 // GL texture to put pathtracing result into
 ///////////////////////////////////////////////////////////////////////////////
 uint32_t pathtracer_result_txt_id;
+uint32_t pathtracer_cost_txt_id;
+bool showCostHeatmap = false;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Scene
@@ -73,6 +78,16 @@ std::map<std::string, scene_t> scenes;
 std::string currentScene;
 camera_t camera;
 
+// Checkpoint to continue from, applied on the next frame
+std::string resumeFilename;
+char checkpointFilename[256] = "pathtracer.checkpoint";
+// Checkpoint to write once --paths is reached, then quit
+std::string saveFilename;
+bool renderSaved = false;
+
+// Where to write the trace when --trace is given, see labhelper/trace.h
+std::string traceFilename;
+
 int selected_model_index = 0;
 int selected_mesh_index = 0;
 int selected_material_index = 0;
@@ -172,11 +187,19 @@ void initialize()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
+	glGenTextures(1, &pathtracer_cost_txt_id);
+	glBindTexture(GL_TEXTURE_2D, pathtracer_cost_txt_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
 	///////////////////////////////////////////////////////////////////////////
 	// Initial path-tracer settings
 	///////////////////////////////////////////////////////////////////////////
 	pathtracer::settings.max_bounces = 8;
 	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+	pathtracer::settings.record_cost = false;
 #ifdef _DEBUG
 	pathtracer::settings.subsampling = 16;
 #else
@@ -232,8 +255,48 @@ void initialize()
 	//glEnable(GL_FRAMEBUFFER_SRGB);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// Load a checkpoint and switch to its scene, camera and subsampling. The
+/// image itself is restored once the pathtracer has been resized.
+///////////////////////////////////////////////////////////////////////////////
+bool prepareResume(const std::string& filename, pathtracer::checkpoint::Snapshot& snapshot)
+{
+	if(!pathtracer::checkpoint::load(filename, snapshot))
+	{
+		return false;
+	}
+	// Check before touching the scene or camera, restore() needs the same size
+	int w, h;
+	SDL_GetWindowSize(g_window, &w, &h);
+	if(w / snapshot.subsampling != snapshot.width || h / snapshot.subsampling != snapshot.height)
+	{
+		std::cout << "Checkpoint is " << snapshot.width << "x" << snapshot.height
+		          << " but the image would be " << w / snapshot.subsampling << "x"
+		          << h / snapshot.subsampling << ", resize the window to resume it.\n";
+		return false;
+	}
+	if(scenes.count(snapshot.scene) == 0)
+	{
+		std::cout << "Checkpoint scene " << snapshot.scene << " does not exist.\n";
+		return false;
+	}
+	if(snapshot.scene != currentScene)
+	{
+		changeScene(snapshot.scene);
+	}
+	mat4 inv_V = inverse(snapshot.V);
+	camera.position = vec3(inv_V[3]);
+	camera.direction = -vec3(inv_V[2]);
+	pathtracer::settings.subsampling = snapshot.subsampling;
+	return true;
+}
+
 void display(void)
 {
+	pathtracer::checkpoint::Snapshot snapshot;
+	const bool resume = !resumeFilename.empty() && prepareResume(resumeFilename, snapshot);
+	resumeFilename.clear();
+
 	{ ///////////////////////////////////////////////////////////////////////
 		// If first frame, or window resized, or subsampling changes,
 		// inform the pathtracer
@@ -245,11 +308,19 @@ void display(void)
 		{
 			pathtracer::resize(w, h);
 			windowWidth = w;
-			windowWidth = h;
+			windowHeight = h;
 			old_subsampling = pathtracer::settings.subsampling;
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Continue from a checkpoint with the same image size
+	///////////////////////////////////////////////////////////////////////////
+	if(resume)
+	{
+		pathtracer::checkpoint::restore(snapshot);
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Trace one path per pixel
 	///////////////////////////////////////////////////////////////////////////
@@ -258,7 +329,22 @@ void display(void)
 	                              float(pathtracer::rendered_image.width)
 	                                  / float(pathtracer::rendered_image.height),
 	                              0.1f, 100.0f);
-	pathtracer::tracePaths(viewMatrix, projMatrix);
+	if(pathtracer::distributed::isCoordinator())
+	{
+		pathtracer::distributed::coordinate(viewMatrix, projMatrix, currentScene);
+	}
+	else
+	{
+		pathtracer::tracePaths(viewMatrix, projMatrix);
+		pathtracer::checkpoint::update(viewMatrix, projMatrix, currentScene);
+	}
+	if(!saveFilename.empty() && pathtracer::settings.max_paths_per_pixel > 0
+	   && pathtracer::rendered_image.number_of_samples > pathtracer::settings.max_paths_per_pixel)
+	{
+		pathtracer::checkpoint::save(saveFilename, viewMatrix, projMatrix, currentScene);
+		saveFilename.clear();
+		renderSaved = true;
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Copy pathtraced image to texture for display
@@ -267,6 +353,16 @@ void display(void)
 	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width,
 	             pathtracer::rendered_image.height, 0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
+	const bool heatmap = showCostHeatmap && pathtracer::settings.record_cost;
+	if(heatmap)
+	{
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, pathtracer_cost_txt_id);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, pathtracer::rendered_image.width,
+		             pathtracer::rendered_image.height, 0, GL_RED, GL_FLOAT,
+		             pathtracer::rendered_image.getCostPtr());
+		glActiveTexture(GL_TEXTURE0);
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Render a fullscreen quad, textured with our pathtraced image.
@@ -278,6 +374,11 @@ void display(void)
 	glEnable(GL_CULL_FACE);
 	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
 	glUseProgram(shaderProgram);
+	labhelper::setUniformSlow(shaderProgram, "show_heatmap", heatmap);
+	if(heatmap)
+	{
+		labhelper::setUniformSlow(shaderProgram, "max_cost", pathtracer::getMaxCost());
+	}
 	labhelper::drawFullScreenQuad();
 
 	if(showLightSources)
@@ -335,7 +436,11 @@ bool handleEvents(void)
 		}
 		else if(event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_PRINTSCREEN)
 		{
-			labhelper::saveScreenshot();
+			std::string filename = labhelper::saveScreenshot();
+			if(pathtracer::settings.record_cost)
+			{
+				pathtracer::saveCostHeatmap(labhelper::file::change_extension(filename, ""));
+			}
 		}
 		else if(event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT
 		        && !io.WantCaptureMouse)
@@ -481,6 +586,56 @@ void gui()
 			pathtracer::restart();
 		}
 		ImGui::Text("Num. samples: %d", pathtracer::getSampleCount());
+		if(pathtracer::distributed::isCoordinator())
+		{
+			pathtracer::distributed::Stats stats = pathtracer::distributed::getStats();
+			ImGui::Text("Workers: %d", stats.workers);
+			ImGui::Text("Leases: %d outstanding, %d completed, %d reassigned", stats.outstanding_leases,
+			            stats.completed_leases, stats.reassigned_leases);
+			pathtracer::distributed::Settings& ds = pathtracer::distributed::settings;
+			ImGui::SliderInt("Tile size", &ds.tile_size, 8, 256);
+			ImGui::SliderInt("Samples per lease", &ds.samples_per_lease, 1, 64);
+		}
+		// The workers do not time their pixels, so there is no cost to show
+		else if(ImGui::Checkbox("Record pixel cost", &pathtracer::settings.record_cost))
+		{
+			pathtracer::restart();
+		}
+		if(pathtracer::settings.record_cost)
+		{
+			ImGui::Checkbox("Show cost heatmap", &showCostHeatmap);
+			ImGui::Text("Max cost: %.1f us/pixel", pathtracer::getMaxCost());
+			if(ImGui::Button("Export Heatmap"))
+			{
+				std::string filename = labhelper::saveScreenshot();
+				pathtracer::saveCostHeatmap(labhelper::file::change_extension(filename, ""));
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Checkpoints
+	///////////////////////////////////////////////////////////////////////////
+	if(ImGui::CollapsingHeader("Checkpoints", "checkpoints_ch", true, false))
+	{
+		ImGui::InputText("File", checkpointFilename, sizeof(checkpointFilename));
+		pathtracer::checkpoint::settings.filename = checkpointFilename;
+		ImGui::Checkbox("Periodic checkpoints", &pathtracer::checkpoint::settings.enabled);
+		ImGui::SliderFloat("Interval (s)", &pathtracer::checkpoint::settings.interval, 5.0f, 600.0f);
+		if(ImGui::Button("Save Checkpoint"))
+		{
+			mat4 viewMatrix = lookAt(camera.position, camera.position + camera.direction, worldUp);
+			mat4 projMatrix = perspective(radians(45.0f),
+			                              float(pathtracer::rendered_image.width)
+			                                  / float(pathtracer::rendered_image.height),
+			                              0.1f, 100.0f);
+			pathtracer::checkpoint::save(checkpointFilename, viewMatrix, projMatrix, currentScene);
+		}
+		ImGui::SameLine();
+		if(ImGui::Button("Resume Checkpoint"))
+		{
+			resumeFilename = checkpointFilename;
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -580,11 +735,176 @@ void gui()
 	ImGui::End(); // Control Panel
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// Worker for distributed rendering. Loads the scenes but never shows
+/// the window, and renders whatever the coordinator asks for.
+///////////////////////////////////////////////////////////////////////////////
+int runWorker(const std::string& address)
+{
+	size_t colon = address.find_last_of(':');
+	if(colon == std::string::npos)
+	{
+		std::cout << "Expected --worker <host>:<port>\n";
+		return 1;
+	}
+	// The models need a GL context to load their textures into
+	g_window = labhelper::init_window_SDL("Pathtracer worker", 64, 64);
+	SDL_HideWindow(g_window);
+	initialize();
+
+	pathtracer::distributed::runWorker(address.substr(0, colon), std::stoi(address.substr(colon + 1)),
+	                                   [](const std::string& scene) { changeScene(scene); });
+
+	cleanupScenes();
+	labhelper::shutDown(g_window);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Check that two checkpoints of the same view agree, such as one rendered
+/// in a single process and one rendered by workers (see distributed.h).
+/// They are independent renders, so single pixels differ by their noise,
+/// but the averages of blocks of pixels should be close, and no pixel
+/// should be left without samples, as it would by a lost or misplaced tile.
+///////////////////////////////////////////////////////////////////////////////
+int compareCheckpoints(const std::string& filename_a, const std::string& filename_b)
+{
+	pathtracer::checkpoint::Snapshot a, b;
+	if(!pathtracer::checkpoint::load(filename_a, a) || !pathtracer::checkpoint::load(filename_b, b))
+	{
+		return 1;
+	}
+	// The camera of a resumed render is rebuilt from the view matrix, so allow for rounding
+	float view_difference = 0.0f;
+	for(int i = 0; i < 4; i++)
+	{
+		for(int j = 0; j < 4; j++)
+		{
+			view_difference = std::max(view_difference, std::abs(a.V[i][j] - b.V[i][j]));
+		}
+	}
+	if(a.scene != b.scene || view_difference > 1e-4f || a.width != b.width || a.height != b.height)
+	{
+		std::cout << "The checkpoints are not of the same view.\n";
+		return 1;
+	}
+
+	int unsampled = 0;
+	for(size_t i = 0; i < a.samples.size(); i++)
+	{
+		unsampled += (a.samples[i] == 0 || b.samples[i] == 0) ? 1 : 0;
+	}
+
+	// RMS difference of the luminance of blocks, relative to their mean
+	const int block_size = 16;
+	const vec3 luminance(0.2126f, 0.7152f, 0.0722f);
+	double squared_difference = 0.0, mean = 0.0;
+	int num_blocks = 0;
+	for(int by = 0; by < a.height; by += block_size)
+	{
+		for(int bx = 0; bx < a.width; bx += block_size)
+		{
+			vec3 sum_a(0.0f), sum_b(0.0f);
+			int n = 0;
+			for(int y = by; y < std::min(by + block_size, a.height); y++)
+			{
+				for(int x = bx; x < std::min(bx + block_size, a.width); x++)
+				{
+					sum_a += a.data[y * a.width + x];
+					sum_b += b.data[y * a.width + x];
+					n += 1;
+				}
+			}
+			const float la = dot(sum_a, luminance) / float(n);
+			const float lb = dot(sum_b, luminance) / float(n);
+			squared_difference += double(la - lb) * double(la - lb);
+			mean += 0.5 * double(la + lb);
+			num_blocks += 1;
+		}
+	}
+	const double relative_error =
+	    mean > 0.0 ? std::sqrt(squared_difference / num_blocks) / (mean / num_blocks) : 0.0;
+
+	std::cout << "Samples: " << a.number_of_samples << " and " << b.number_of_samples
+	          << ", unsampled pixels: " << unsampled << ", relative block error: " << relative_error << "\n";
+	const bool match = unsampled == 0 && relative_error < 0.05;
+	std::cout << (match ? "The checkpoints match.\n" : "The checkpoints differ.\n");
+	return match ? 0 : 1;
+}
+
 int main(int argc, char* argv[])
 {
+	///////////////////////////////////////////////////////////////////////////
+	// Distributed rendering, see distributed.h
+	///////////////////////////////////////////////////////////////////////////
+	int coordinator_port = 0;
+	int local_workers = 0;
+	int max_paths_per_pixel = -1;
+	for(int i = 1; i + 1 < argc; i++)
+	{
+		if(std::string(argv[i]) == "--worker")
+		{
+			return runWorker(argv[i + 1]);
+		}
+		if(std::string(argv[i]) == "--compare" && i + 2 < argc)
+		{
+			return compareCheckpoints(argv[i + 1], argv[i + 2]);
+		}
+		if(std::string(argv[i]) == "--coordinator")
+		{
+			coordinator_port = std::stoi(argv[i + 1]);
+		}
+		if(std::string(argv[i]) == "--workers")
+		{
+			local_workers = std::stoi(argv[i + 1]);
+		}
+		if(std::string(argv[i]) == "--paths")
+		{
+			max_paths_per_pixel = std::stoi(argv[i + 1]);
+		}
+		if(std::string(argv[i]) == "--resume")
+		{
+			resumeFilename = argv[i + 1];
+		}
+		if(std::string(argv[i]) == "--save")
+		{
+			saveFilename = argv[i + 1];
+		}
+		// Record a timeline of the whole run, see labhelper/trace.h
+		if(std::string(argv[i]) == "--trace")
+		{
+			traceFilename = argv[i + 1];
+			labhelper::trace::start();
+			labhelper::trace::setThreadName("Main");
+		}
+	}
+
 	g_window = labhelper::init_window_SDL("Pathtracer", 1280, 720);
 
 	initialize();
+	if(max_paths_per_pixel >= 0)
+	{
+		pathtracer::settings.max_paths_per_pixel = max_paths_per_pixel;
+	}
+
+	if(local_workers > 0 && coordinator_port == 0)
+	{
+		coordinator_port = 5555;
+	}
+	if(coordinator_port != 0 && !pathtracer::distributed::startCoordinator(coordinator_port))
+	{
+		return 1;
+	}
+	if(coordinator_port != 0)
+	{
+		pathtracer::settings.record_cost = false;
+	}
+	if(local_workers > 0
+	   && !pathtracer::distributed::spawnLocalWorkers(argv[0], coordinator_port, local_workers))
+	{
+		pathtracer::distributed::shutDown();
+		return 1;
+	}
 
 	bool stopRendering = false;
 	auto startTime = std::chrono::system_clock::now();
@@ -604,6 +924,7 @@ int main(int argc, char* argv[])
 
 		// render to window
 		display();
+		stopRendering = stopRendering || renderSaved;
 
 		// Then render overlay GUI.
 		if(showUI)
@@ -618,9 +939,17 @@ int main(int argc, char* argv[])
 		SDL_GL_SwapWindow(g_window);
 	}
 
+	pathtracer::distributed::shutDown();
+	pathtracer::checkpoint::shutDown();
+
 	// Delete Models
 	cleanupScenes();
 
+	if(!traceFilename.empty())
+	{
+		labhelper::trace::write(traceFilename);
+	}
+
 	// Shut down everything. This includes the window and all other subsystems.
 	labhelper::shutDown(g_window);
 	return 0;
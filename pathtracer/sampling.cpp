@@ -3,6 +3,7 @@
 #include "labhelper.h"
 #include <omp.h>
 #include <iostream>
+#include <sstream>
 #include <glm/glm.hpp>
 
 using namespace glm;
@@ -19,6 +20,39 @@ float randf()
 	return float(generators[omp_get_thread_num()]() / double(generators[omp_get_thread_num()].max()));
 }
 
+void seedGenerators(uint32_t seed)
+{
+	for(uint32_t i = 0; i < sizeof(generators) / sizeof(generators[0]); i++)
+	{
+		generators[i].seed(seed + i);
+	}
+}
+
+std::string getGeneratorState()
+{
+	std::stringstream ss;
+	for(const auto& g : generators)
+	{
+		ss << g << "\n";
+	}
+	return ss.str();
+}
+
+bool setGeneratorState(const std::string& state)
+{
+	std::stringstream ss(state);
+	std::mt19937 restored[sizeof(generators) / sizeof(generators[0])];
+	for(auto& g : restored)
+	{
+		if(!(ss >> g))
+		{
+			return false;
+		}
+	}
+	std::copy(std::begin(restored), std::end(restored), std::begin(generators));
+	return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
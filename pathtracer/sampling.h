@@ -1,5 +1,6 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <string>
 
 namespace pathtracer
 {
@@ -8,6 +9,19 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////
 float randf();
 
+///////////////////////////////////////////////////////////////////////////
+// Reseed the per thread generators, e.g. so that several processes
+// rendering the same pixels do not produce the same paths
+///////////////////////////////////////////////////////////////////////////
+void seedGenerators(uint32_t seed);
+
+///////////////////////////////////////////////////////////////////////////
+// Save and restore the state of all generators, so that a render can be
+// continued with the same random sequence
+///////////////////////////////////////////////////////////////////////////
+std::string getGeneratorState();
+bool setGeneratorState(const std::string& state);
+
 ///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
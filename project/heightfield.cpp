@@ -1,40 +1,296 @@
 
 #include "heightfield.h"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 #include <stdint.h>
 #include <vector>
 #include <glm/glm.hpp>
-#include <stb_image.h>
 #include <labhelper.h>
+#include <assets.h>
+#include <frustum.h>
 
 using namespace glm;
 using std::string;
 
+HeightMap::HeightMap(int width, int height, std::vector<float> heights)
+    : m_width(width)
+    , m_height(height)
+    , m_heights(std::move(heights))
+{
+	// Level 0 from the texels at the corners of its cells, and each level
+	// above from the one below
+	const int cellsX = m_width - 1;
+	const int cellsY = m_height - 1;
+	Level level;
+	level.width = (cellsX + 1) / 2;
+	level.height = (cellsY + 1) / 2;
+	level.ranges.resize(level.width * level.height);
+	for(int y = 0; y < level.height; ++y)
+	{
+		for(int x = 0; x < level.width; ++x)
+		{
+			vec2 range(std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+			for(int ty = 2 * y; ty <= min(2 * y + 2, m_height - 1); ++ty)
+			{
+				for(int tx = 2 * x; tx <= min(2 * x + 2, m_width - 1); ++tx)
+				{
+					range = vec2(min(range.x, texel(tx, ty)), max(range.y, texel(tx, ty)));
+				}
+			}
+			level.ranges[y * level.width + x] = range;
+		}
+	}
+	m_levels.push_back(std::move(level));
+	while(m_levels.back().width > 1 || m_levels.back().height > 1)
+	{
+		const Level& below = m_levels.back();
+		Level above;
+		above.width = (below.width + 1) / 2;
+		above.height = (below.height + 1) / 2;
+		above.ranges.resize(above.width * above.height);
+		for(int y = 0; y < above.height; ++y)
+		{
+			for(int x = 0; x < above.width; ++x)
+			{
+				vec2 range = below.ranges[2 * y * below.width + 2 * x];
+				for(int child = 1; child < 4; ++child)
+				{
+					const int cx = 2 * x + child % 2;
+					const int cy = 2 * y + child / 2;
+					if(cx < below.width && cy < below.height)
+					{
+						vec2 childRange = below.ranges[cy * below.width + cx];
+						range = vec2(min(range.x, childRange.x), max(range.y, childRange.y));
+					}
+				}
+				above.ranges[y * above.width + x] = range;
+			}
+		}
+		m_levels.push_back(std::move(above));
+	}
+}
+
+float HeightMap::texel(int x, int y) const
+{
+	x = clamp(x, 0, m_width - 1);
+	y = clamp(y, 0, m_height - 1);
+	return m_heights[y * m_width + x];
+}
+
+float HeightMap::height(const vec2& texCoord) const
+{
+	vec2 position = clamp(texCoord * vec2(m_width, m_height) - 0.5f, vec2(0.0f),
+	                      vec2(m_width - 1, m_height - 1));
+	ivec2 cell = min(ivec2(floor(position)), ivec2(m_width - 2, m_height - 2));
+	vec2 f = position - vec2(cell);
+	return mix(mix(texel(cell.x, cell.y), texel(cell.x + 1, cell.y), f.x),
+	           mix(texel(cell.x, cell.y + 1), texel(cell.x + 1, cell.y + 1), f.x), f.y);
+}
+
+vec2 HeightMap::slope(const vec2& texCoord) const
+{
+	// Central differences at the texels around, like heightfield_slope.frag,
+	// filtered like the slope map
+	vec2 position = clamp(texCoord * vec2(m_width, m_height) - 0.5f, vec2(0.0f),
+	                      vec2(m_width - 1, m_height - 1));
+	ivec2 cell = min(ivec2(floor(position)), ivec2(m_width - 2, m_height - 2));
+	vec2 f = position - vec2(cell);
+	vec2 slopes[4];
+	for(int corner = 0; corner < 4; ++corner)
+	{
+		const int x = cell.x + corner % 2;
+		const int y = cell.y + corner / 2;
+		slopes[corner] = 0.5f * vec2(m_width, m_height)
+		                 * vec2(texel(x + 1, y) - texel(x - 1, y), texel(x, y + 1) - texel(x, y - 1));
+	}
+	return mix(mix(slopes[0], slopes[1], f.x), mix(slopes[2], slopes[3], f.x), f.y);
+}
+
+namespace
+{
+	// Distances at which the ray enters and leaves the box, if it does
+	bool intersectBox(const vec3& origin, const vec3& direction, const vec3& boxMin, const vec3& boxMax,
+	                  float& enter, float& leave)
+	{
+		enter = 0.0f;
+		leave = std::numeric_limits<float>::max();
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			if(direction[axis] == 0.0f)
+			{
+				if(origin[axis] < boxMin[axis] || origin[axis] > boxMax[axis])
+				{
+					return false;
+				}
+				continue;
+			}
+			float t0 = (boxMin[axis] - origin[axis]) / direction[axis];
+			float t1 = (boxMax[axis] - origin[axis]) / direction[axis];
+			enter = max(enter, min(t0, t1));
+			leave = min(leave, max(t0, t1));
+		}
+		return enter <= leave;
+	}
+
+	bool intersectTriangle(const vec3& origin, const vec3& direction, const vec3& a, const vec3& b,
+	                       const vec3& c, float& distance)
+	{
+		vec3 edge1 = b - a;
+		vec3 edge2 = c - a;
+		vec3 p = cross(direction, edge2);
+		float determinant = dot(edge1, p);
+		if(abs(determinant) < 1e-12f)
+		{
+			return false;
+		}
+		vec3 toOrigin = origin - a;
+		float u = dot(toOrigin, p) / determinant;
+		vec3 q = cross(toOrigin, edge1);
+		float v = dot(direction, q) / determinant;
+		if(u < 0.0f || v < 0.0f || u + v > 1.0f)
+		{
+			return false;
+		}
+		distance = dot(edge2, q) / determinant;
+		return distance >= 0.0f;
+	}
+} // namespace
+
+bool HeightMap::intersectCell(const vec3& origin, const vec3& direction, float heightScale, int x, int y,
+                              float& distance) const
+{
+	// The same two triangles as the grids of HeightField
+	vec3 p00(x, texel(x, y) * heightScale, y);
+	vec3 p10(x + 1, texel(x + 1, y) * heightScale, y);
+	vec3 p01(x, texel(x, y + 1) * heightScale, y + 1);
+	vec3 p11(x + 1, texel(x + 1, y + 1) * heightScale, y + 1);
+	float a, b;
+	bool hitA = intersectTriangle(origin, direction, p00, p11, p10, a);
+	bool hitB = intersectTriangle(origin, direction, p00, p01, p11, b);
+	if(!hitA && !hitB)
+	{
+		return false;
+	}
+	distance = hitA && hitB ? min(a, b) : (hitA ? a : b);
+	return true;
+}
+
+bool HeightMap::intersect(const vec3& origin, const vec3& direction, float heightScale, float& distance) const
+{
+	struct Node
+	{
+		int level;
+		int x;
+		int y;
+		float enter;
+	};
+	const int cellsX = m_width - 1;
+	const int cellsY = m_height - 1;
+	// The cells and heights of a block, as a box
+	auto blockBox = [&](int level, int x, int y, vec3& boxMin, vec3& boxMax) {
+		const int size = 2 << level;
+		const vec2 range = m_levels[level].ranges[y * m_levels[level].width + x];
+		boxMin = vec3(x * size, range.x * heightScale, y * size);
+		boxMax = vec3(min((x + 1) * size, cellsX), range.y * heightScale, min((y + 1) * size, cellsY));
+	};
+
+	distance = std::numeric_limits<float>::max();
+	std::vector<Node> stack;
+	stack.reserve(4 * m_levels.size());
+	vec3 boxMin, boxMax;
+	float enter, leave;
+	blockBox(int(m_levels.size()) - 1, 0, 0, boxMin, boxMax);
+	if(intersectBox(origin, direction, boxMin, boxMax, enter, leave))
+	{
+		stack.push_back({ int(m_levels.size()) - 1, 0, 0, enter });
+	}
+	while(!stack.empty())
+	{
+		Node node = stack.back();
+		stack.pop_back();
+		if(node.enter >= distance)
+		{
+			continue;
+		}
+		if(node.level == 0)
+		{
+			for(int cell = 0; cell < 4; ++cell)
+			{
+				const int x = 2 * node.x + cell % 2;
+				const int y = 2 * node.y + cell / 2;
+				float hit;
+				if(x < cellsX && y < cellsY && intersectCell(origin, direction, heightScale, x, y, hit))
+				{
+					distance = min(distance, hit);
+				}
+			}
+			continue;
+		}
+		// The children the ray passes through, nearest on top of the stack
+		const Level& below = m_levels[node.level - 1];
+		Node children[4];
+		int count = 0;
+		for(int child = 0; child < 4; ++child)
+		{
+			const int x = 2 * node.x + child % 2;
+			const int y = 2 * node.y + child / 2;
+			if(x < below.width && y < below.height)
+			{
+				blockBox(node.level - 1, x, y, boxMin, boxMax);
+				if(intersectBox(origin, direction, boxMin, boxMax, enter, leave) && enter < distance)
+				{
+					children[count++] = { node.level - 1, x, y, enter };
+				}
+			}
+		}
+		std::sort(children, children + count, [](const Node& a, const Node& b) { return a.enter > b.enter; });
+		stack.insert(stack.end(), children, children + count);
+	}
+	return distance != std::numeric_limits<float>::max();
+}
+
 HeightField::HeightField(void)
-    : m_meshResolution(0)
+    : m_mode(chunked_lod)
+    , m_meshResolution(0)
     , m_texid_hf(UINT32_MAX)
     , m_texid_diffuse(UINT32_MAX)
     , m_texid_shininess(UINT32_MAX)
+    , m_texid_slope(UINT32_MAX)
+    , m_slopeFbo(UINT32_MAX)
+    , m_slopeMapWidth(0)
+    , m_slopeMapHeight(0)
     , m_vao(UINT32_MAX)
     , m_positionBuffer(UINT32_MAX)
     , m_uvBuffer(UINT32_MAX)
     , m_indexBuffer(UINT32_MAX)
     , m_numIndices(0)
+    , m_chunkResolution(64)
+    , m_lodLevels(7)
+    , m_lodDistance(4.0f)
+    , m_morphRatio(0.3f)
+    , m_triangleBudget(2000000)
+    , m_finestLevel(0)
+    , m_chunkTriangles(0)
+    , m_chunkVao(UINT32_MAX)
+    , m_chunkMeshResolution(0)
+    , m_chunkPositionBuffer(UINT32_MAX)
+    , m_chunkIndexBuffer(UINT32_MAX)
+    , m_chunkInstanceBuffer(UINT32_MAX)
+    , m_patchResolution(64)
+    , m_pixelsPerEdge(8.0f)
+    , m_curvatureWeight(1.0f)
+    , m_patchVao(UINT32_MAX)
+    , m_patchMeshResolution(0)
+    , m_patchPositionBuffer(UINT32_MAX)
+    , m_patchIndexBuffer(UINT32_MAX)
+    , m_gridVao(UINT32_MAX)
 {
 }
 
 void HeightField::loadPlainTexture(GLuint* texid, const std::string& path)
 {
-	int width, height, components;
-	stbi_set_flip_vertically_on_load(true);
-	float* data = stbi_loadf(path.c_str(), &width, &height, &components, 1);
-	if(data == nullptr)
-	{
-		std::cout << "Failed to load image: " << path << ".\n";
-		return;
-	}
-
 	if(*texid == UINT32_MAX)
 	{
 		glGenTextures(1, texid);
@@ -44,12 +300,10 @@ void HeightField::loadPlainTexture(GLuint* texid, const std::string& path)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT,
-	             data); // just one component (float)
-	stbi_image_free(data);
-
-	std::cout << "Successfully loaded heigh field texture: " << path << ".\n";
+	// just one component (float), decoded and uploaded in the background
+	labhelper::assets::loadTexture(*texid, path, 1, true, false);
 }
 
 void HeightField::loadHeightField(const std::string& path)
@@ -58,6 +312,48 @@ void HeightField::loadHeightField(const std::string& path)
 	CHECK_GL_ERROR();
 }
 
+bool HeightField::deleteLoadedTexture(GLuint* texid)
+{
+	if(*texid == UINT32_MAX)
+	{
+		return true;
+	}
+	// Until it is loaded, it is the one texel placeholder
+	GLint width;
+	glBindTexture(GL_TEXTURE_2D, *texid);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	if(width < 2)
+	{
+		return false;
+	}
+	glDeleteTextures(1, texid);
+	*texid = UINT32_MAX;
+	return true;
+}
+
+bool HeightField::unloadHeightField()
+{
+	if(m_texid_hf == UINT32_MAX)
+	{
+		return true;
+	}
+	if(!deleteLoadedTexture(&m_texid_hf))
+	{
+		return false;
+	}
+	if(m_texid_slope != UINT32_MAX)
+	{
+		glDeleteTextures(1, &m_texid_slope);
+		glDeleteFramebuffers(1, &m_slopeFbo);
+		m_texid_slope = m_slopeFbo = UINT32_MAX;
+	}
+	m_slopeMapWidth = m_slopeMapHeight = 0;
+	std::lock_guard<std::mutex> lock(m_heightMapMutex);
+	m_heightMap.reset();
+	return true;
+}
+
 void HeightField::loadShininess(const std::string& path)
 {
 	loadPlainTexture(&m_texid_shininess, path);
@@ -66,15 +362,6 @@ void HeightField::loadShininess(const std::string& path)
 
 void HeightField::loadDiffuseTexture(const std::string& diffusePath)
 {
-	int width, height, components;
-	stbi_set_flip_vertically_on_load(true);
-	uint8_t* data = stbi_load(diffusePath.c_str(), &width, &height, &components, 3);
-	if(data == nullptr)
-	{
-		std::cout << "Failed to load image: " << diffusePath << ".\n";
-		return;
-	}
-
 	if(m_texid_diffuse == UINT32_MAX)
 	{
 		glGenTextures(1, &m_texid_diffuse);
@@ -85,14 +372,149 @@ void HeightField::loadDiffuseTexture(const std::string& diffusePath)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	labhelper::assets::loadTexture(m_texid_diffuse, diffusePath, 3, false, true); // plain RGB
+
+	CHECK_GL_ERROR();
+}
+
+bool HeightField::unloadDiffuseTexture()
+{
+	return deleteLoadedTexture(&m_texid_diffuse);
+}
+
+void HeightField::updateSlopeMap(GLuint program)
+{
+	if(m_texid_hf == UINT32_MAX || program == 0)
+	{
+		return;
+	}
+	// The height field is a one texel placeholder until it is loaded, see
+	// assets::loadTexture()
+	GLint width, height;
+	glBindTexture(GL_TEXTURE_2D, m_texid_hf);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+	if(width == m_slopeMapWidth && height == m_slopeMapHeight)
+	{
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return;
+	}
+	m_slopeMapWidth = width;
+	m_slopeMapHeight = height;
+
+	if(m_texid_slope == UINT32_MAX)
+	{
+		glGenTextures(1, &m_texid_slope);
+		glGenFramebuffers(1, &m_slopeFbo);
+	}
+	glBindTexture(GL_TEXTURE_2D, m_texid_slope);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, width, height, 0, GL_RG, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_slopeFbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_texid_slope, 0);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data); // plain RGB
-	glGenerateMipmap(GL_TEXTURE_2D);
+	glViewport(0, 0, width, height);
+	glUseProgram(program);
+	labhelper::setUniform(program, "heightField", 1);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, m_texid_hf);
+	labhelper::drawFullScreenQuad();
 
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glUseProgram(0);
 	CHECK_GL_ERROR();
-	std::cout << "Successfully loaded diffuse texture: " << diffusePath << ".\n";
 }
 
+void HeightField::updateHeightMap()
+{
+	if(m_texid_hf == UINT32_MAX)
+	{
+		return;
+	}
+	GLint width, height;
+	glBindTexture(GL_TEXTURE_2D, m_texid_hf);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+	std::shared_ptr<const HeightMap> current = heightMap();
+	// Keeps the last height map while a new one is loading
+	if(width < 2 || height < 2 || (current && current->m_width == width && current->m_height == height))
+	{
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return;
+	}
+
+	std::vector<float> heights(size_t(width) * height);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, heights.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+	CHECK_GL_ERROR();
+
+	std::shared_ptr<const HeightMap> map = std::make_shared<HeightMap>(width, height, std::move(heights));
+	std::lock_guard<std::mutex> lock(m_heightMapMutex);
+	m_heightMap = map;
+}
+
+std::shared_ptr<const HeightMap> HeightField::heightMap() const
+{
+	std::lock_guard<std::mutex> lock(m_heightMapMutex);
+	return m_heightMap;
+}
+
+bool HeightField::heightAt(const vec2& position, float heightScale, float& height) const
+{
+	std::shared_ptr<const HeightMap> map = heightMap();
+	if(!map || any(greaterThan(abs(position), vec2(1.0f))))
+	{
+		return false;
+	}
+	height = map->height(position * 0.5f + 0.5f) * heightScale;
+	return true;
+}
+
+bool HeightField::heightsAt(const vec2* positions, size_t count, float heightScale, float* heights,
+                            vec3* normals) const
+{
+	std::shared_ptr<const HeightMap> map = heightMap();
+	if(!map)
+	{
+		return false;
+	}
+	for(size_t i = 0; i < count; ++i)
+	{
+		vec2 texCoord = positions[i] * 0.5f + 0.5f;
+		heights[i] = map->height(texCoord) * heightScale;
+		if(normals != nullptr)
+		{
+			// Like heightfield.vert
+			vec2 slope = map->slope(texCoord);
+			float fudge = 0.01f;
+			normals[i] = normalize(vec3(fudge - heightScale * slope.x, 1.0f, fudge - heightScale * slope.y));
+		}
+	}
+	return true;
+}
+
+bool HeightField::intersectRay(const vec3& origin, const vec3& direction, float heightScale,
+                               float& distance) const
+{
+	std::shared_ptr<const HeightMap> map = heightMap();
+	if(!map)
+	{
+		return false;
+	}
+	// Into texels in x and z, which keeps distances along the ray
+	vec3 texels(0.5f * map->m_width, 1.0f, 0.5f * map->m_height);
+	vec3 texelOrigin = origin * texels + vec3(0.5f * map->m_width - 0.5f, 0.0f, 0.5f * map->m_height - 0.5f);
+	return map->intersect(texelOrigin, direction * texels, heightScale, distance);
+}
 
 void HeightField::generateMesh(int tesselation)
 {
@@ -160,8 +582,17 @@ void HeightField::generateMesh(int tesselation)
 	}
 	m_numIndices = indexData.size();
 
-	// Push everything to the GPU.
-	glGenVertexArrays(1, &m_vao);
+	// Push everything to the GPU, replacing the buffers of the last mesh.
+	if(m_vao == UINT32_MAX)
+	{
+		glGenVertexArrays(1, &m_vao);
+	}
+	else
+	{
+		glDeleteBuffers(1, &m_indexBuffer);
+		glDeleteBuffers(1, &m_positionBuffer);
+		glDeleteBuffers(1, &m_uvBuffer);
+	}
 	glBindVertexArray(m_vao);
 	CHECK_GL_ERROR();
 
@@ -189,4 +620,295 @@ void HeightField::submitTriangles(void)
 	CHECK_GL_ERROR();
 	glBindVertexArray(0);
 	CHECK_GL_ERROR();
-}
\ No newline at end of file
+}
+void HeightField::submitGrid(int tesselation)
+{
+	// Vertex arrays without attributes are still needed to draw
+	if(m_gridVao == UINT32_MAX)
+	{
+		glGenVertexArrays(1, &m_gridVao);
+	}
+	// One strip of 2(N + 1) vertices per row of quads, laid out by
+	// heightfield.vert from the vertex and instance IDs
+	glBindVertexArray(m_gridVao);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 2 * (tesselation + 1), tesselation);
+	glBindVertexArray(0);
+	CHECK_GL_ERROR();
+}
+
+void HeightField::generateChunkMesh(int resolution)
+{
+	// A grid from 0 to 1 in x and z, with the same triangles as generateMesh(),
+	// but with the indices of each quadrant after each other, so that
+	// quadrants can be drawn on their own.
+	const int n = resolution;
+	std::vector<vec2> posData;
+	posData.reserve((n + 1) * (n + 1));
+	for(int y = 0; y <= n; ++y)
+	{
+		for(int x = 0; x <= n; ++x)
+		{
+			posData.emplace_back(x / (float)n, y / (float)n);
+		}
+	}
+
+	// 16 bit indices are enough for chunks of up to 254 quads per side
+	std::vector<uint16_t> indexData;
+	indexData.reserve(n * n * 2 * 3);
+	const int half = n / 2;
+	for(int quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		const int x0 = (quadrant % 2) * half;
+		const int y0 = (quadrant / 2) * half;
+		for(int y = y0; y < y0 + half; ++y)
+		{
+			for(int x = x0; x < x0 + half; ++x)
+			{
+				const int v = y * (n + 1) + x;
+				// Triangle A.
+				indexData.push_back(v);
+				indexData.push_back(v + n + 2);
+				indexData.push_back(v + 1);
+				// Triangle B.
+				indexData.push_back(v);
+				indexData.push_back(v + n + 1);
+				indexData.push_back(v + n + 2);
+			}
+		}
+	}
+
+	m_chunkMeshResolution = resolution;
+	if(m_chunkVao == UINT32_MAX)
+	{
+		glGenVertexArrays(1, &m_chunkVao);
+		glGenBuffers(1, &m_chunkInstanceBuffer);
+	}
+	else
+	{
+		glDeleteBuffers(1, &m_chunkIndexBuffer);
+		glDeleteBuffers(1, &m_chunkPositionBuffer);
+	}
+	m_chunkIndexBuffer = labhelper::createAddIndexBuffer(m_chunkVao, indexData.data(),
+	                                                     indexData.size() * sizeof(uint16_t));
+	m_chunkPositionBuffer =
+	    labhelper::createAddAttribBuffer(m_chunkVao, posData.data(), posData.size() * sizeof(vec2),
+	                                     /*attributeIndex=*/0, /*attribueSize=*/2, GL_FLOAT);
+
+	// Offset, size and level of each chunk, pointed at its quadrant by submitChunks()
+	glBindVertexArray(m_chunkVao);
+	glBindBuffer(GL_ARRAY_BUFFER, m_chunkInstanceBuffer);
+	glEnableVertexAttribArray(3);
+	glVertexAttribDivisor(3, 1);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	CHECK_GL_ERROR();
+}
+
+bool HeightField::chunkInRange(const vec2& offset, float size, int level) const
+{
+	vec3 boxMin(offset.x, 0.0f, offset.y);
+	vec3 boxMax(offset.x + size, m_selectionHeight, offset.y + size);
+	vec3 closest = clamp(m_selectionCamera, boxMin, boxMax);
+	return length(closest - m_selectionCamera) <= m_lodRanges[level];
+}
+
+void HeightField::addChunk(const vec2& offset, float size, int level, int quadrant)
+{
+	m_chunks[quadrant].push_back(vec4(offset, size, float(level)));
+}
+
+bool HeightField::selectChunk(const labhelper::Frustum& frustum, const vec2& offset, float size, int level)
+{
+	if(!chunkInRange(offset, size, level))
+	{
+		return false;
+	}
+	if(!frustum.intersectsBox(vec3(offset.x, 0.0f, offset.y),
+	                          vec3(offset.x + size, m_selectionHeight, offset.y + size)))
+	{
+		// Nothing to draw, for this chunk or its parent
+		return true;
+	}
+	if(level == m_finestLevel || !chunkInRange(offset, size, level - 1))
+	{
+		for(int quadrant = 0; quadrant < 4; ++quadrant)
+		{
+			addChunk(offset, size, level, quadrant);
+		}
+		return true;
+	}
+	// The parts the children cannot draw, since they are out of range,
+	// are drawn at this level
+	const float half = size / 2.0f;
+	for(int quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		vec2 child = offset + half * vec2(quadrant % 2, quadrant / 2);
+		if(!selectChunk(frustum, child, half, level - 1))
+		{
+			addChunk(offset, size, level, quadrant);
+		}
+	}
+	return true;
+}
+
+void HeightField::selectChunks(const vec3& cameraPosition, const mat4& modelViewProjection, float heightScale)
+{
+	// Even, for the quadrants, and small enough for 16 bit indices
+	m_chunkResolution = clamp(m_chunkResolution / 2 * 2, 2, 254);
+	if(m_chunkVao == UINT32_MAX || m_chunkResolution != m_chunkMeshResolution)
+	{
+		generateChunkMesh(m_chunkResolution);
+	}
+	m_selectionCamera = cameraPosition;
+	m_selectionHeight = heightScale;
+	labhelper::Frustum frustum(modelViewProjection);
+
+	// The smallest chunks are drawn to m_lodDistance of their own size, and
+	// each level twice as far as the one below. The whole terrain is always
+	// within range of the top level.
+	m_lodLevels = clamp(m_lodLevels, 1, 16);
+	const float leafSize = 2.0f / float(1 << (m_lodLevels - 1));
+	m_lodRanges.resize(m_lodLevels);
+	for(int level = 0; level < m_lodLevels; ++level)
+	{
+		m_lodRanges[level] = m_lodDistance * leafSize * float(1 << level);
+	}
+	m_lodRanges.back() = std::numeric_limits<float>::max();
+
+	const int trianglesPerQuadrant = m_chunkResolution * m_chunkResolution / 2;
+	for(m_finestLevel = 0;; ++m_finestLevel)
+	{
+		int quadrants = 0;
+		for(auto& chunks : m_chunks)
+		{
+			chunks.clear();
+		}
+		selectChunk(frustum, vec2(-1.0f), 2.0f, m_lodLevels - 1);
+		for(const auto& chunks : m_chunks)
+		{
+			quadrants += int(chunks.size());
+		}
+		m_chunkTriangles = quadrants * trianglesPerQuadrant;
+		if(m_chunkTriangles <= m_triangleBudget || m_finestLevel == m_lodLevels - 1)
+		{
+			break;
+		}
+	}
+}
+
+void HeightField::submitChunks(GLuint program)
+{
+	if(m_chunkVao == UINT32_MAX)
+	{
+		return;
+	}
+
+	// Morph from (x) to (y), in the last m_morphRatio of the range of each level
+	std::vector<vec2> morphRanges(m_lodLevels);
+	for(int level = 0; level < m_lodLevels - 1; ++level)
+	{
+		float lodNear = level > 0 ? m_lodRanges[level - 1] : 0.0f;
+		float lodFar = m_lodRanges[level];
+		morphRanges[level] = vec2(lodFar - (lodFar - lodNear) * m_morphRatio, lodFar);
+	}
+	// The top level has nothing to morph into
+	morphRanges.back() = vec2(1e30f, 2e30f);
+	glUniform2fv(labhelper::getUniformLocation(program, "morphRanges"), GLsizei(morphRanges.size()),
+	             &morphRanges[0].x);
+	labhelper::setUniform(program, "chunkResolution", m_chunkResolution);
+
+	std::vector<vec4> instances;
+	for(const auto& chunks : m_chunks)
+	{
+		instances.insert(instances.end(), chunks.begin(), chunks.end());
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, m_chunkInstanceBuffer);
+	glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(vec4), instances.data(), GL_STREAM_DRAW);
+
+	glBindVertexArray(m_chunkVao);
+	const int indicesPerQuadrant = m_chunkResolution * m_chunkResolution * 6 / 4;
+	size_t first = 0;
+	for(int quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		const size_t count = m_chunks[quadrant].size();
+		if(count > 0)
+		{
+			glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 0, (const void*)(first * sizeof(vec4)));
+			glDrawElementsInstanced(GL_TRIANGLES, indicesPerQuadrant, GL_UNSIGNED_SHORT,
+			                        (const void*)(quadrant * indicesPerQuadrant * sizeof(uint16_t)),
+			                        GLsizei(count));
+		}
+		first += count;
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	CHECK_GL_ERROR();
+}
+
+void HeightField::generatePatches(int resolution)
+{
+	// The corners of the patches, from -1 to 1 in x and z like generateMesh()
+	const int n = resolution;
+	std::vector<vec2> posData;
+	posData.reserve((n + 1) * (n + 1));
+	for(int y = 0; y <= n; ++y)
+	{
+		for(int x = 0; x <= n; ++x)
+		{
+			posData.emplace_back(-1.0 + 2.0 * x / (float)n, -1.0 + 2.0 * y / (float)n);
+		}
+	}
+
+	// Four corners per patch, in the order heightfield.tesc expects:
+	// (0, 0), (1, 0), (1, 1) and (0, 1) in x and z
+	std::vector<int> indexData;
+	indexData.reserve(n * n * 4);
+	for(int y = 0; y < n; ++y)
+	{
+		for(int x = 0; x < n; ++x)
+		{
+			const int v = y * (n + 1) + x;
+			indexData.push_back(v);
+			indexData.push_back(v + 1);
+			indexData.push_back(v + n + 2);
+			indexData.push_back(v + n + 1);
+		}
+	}
+
+	m_patchMeshResolution = resolution;
+	if(m_patchVao == UINT32_MAX)
+	{
+		glGenVertexArrays(1, &m_patchVao);
+	}
+	else
+	{
+		glDeleteBuffers(1, &m_patchIndexBuffer);
+		glDeleteBuffers(1, &m_patchPositionBuffer);
+	}
+	m_patchIndexBuffer =
+	    labhelper::createAddIndexBuffer(m_patchVao, indexData.data(), indexData.size() * sizeof(int));
+	m_patchPositionBuffer =
+	    labhelper::createAddAttribBuffer(m_patchVao, posData.data(), posData.size() * sizeof(vec2),
+	                                     /*attributeIndex=*/0, /*attribueSize=*/2, GL_FLOAT);
+	CHECK_GL_ERROR();
+}
+
+void HeightField::submitPatches(GLuint program, const mat4& projection, int viewportHeight)
+{
+	m_patchResolution = clamp(m_patchResolution, 1, 256);
+	if(m_patchVao == UINT32_MAX || m_patchResolution != m_patchMeshResolution)
+	{
+		generatePatches(m_patchResolution);
+	}
+
+	// Pixels per unit of length at unit distance from the camera
+	labhelper::setUniform(program, "projectionScale", 0.5f * projection[1][1] * float(viewportHeight));
+	labhelper::setUniform(program, "pixelsPerEdge", max(m_pixelsPerEdge, 1.0f));
+	labhelper::setUniform(program, "curvatureWeight", m_curvatureWeight);
+
+	glBindVertexArray(m_patchVao);
+	glPatchParameteri(GL_PATCH_VERTICES, 4);
+	glDrawElements(GL_PATCHES, m_patchResolution * m_patchResolution * 4, GL_UNSIGNED_INT, nullptr);
+	glBindVertexArray(0);
+	CHECK_GL_ERROR();
+}
@@ -1,15 +1,91 @@
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 #include <GL/glew.h>
+#include <glm/glm.hpp>
+
+namespace labhelper
+{
+class Frustum;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A CPU copy of the height field, for queries against the terrain. Heights
+// are in 0 to 1, at texel centers, and are filtered bilinearly like the
+// texture is. Over them is a hierarchy of the minimum and maximum heights
+// of square blocks of texels, with blocks of 2x2 texel cells at level 0,
+// which lets a ray skip all blocks it passes over or under, so that it
+// only tests the cells near where it hits.
+//
+// Never changes once built, so any number of threads can query it.
+///////////////////////////////////////////////////////////////////////////////
+class HeightMap
+{
+public:
+	HeightMap(int width, int height, std::vector<float> heights);
+
+	int m_width;
+	int m_height;
+	std::vector<float> m_heights;
+	// Minimum and maximum height per block of 2^(level + 1) cells per side
+	struct Level
+	{
+		int width;
+		int height;
+		std::vector<glm::vec2> ranges;
+	};
+	std::vector<Level> m_levels;
+
+	// At a texture coordinate, clamped to the edge like the texture
+	float height(const glm::vec2& texCoord) const;
+	// Derivative of the height per unit of texture coordinate, like the slope map
+	glm::vec2 slope(const glm::vec2& texCoord) const;
+	///////////////////////////////////////////////////////////////////////////
+	// The first hit of the ray with the cells of the height field, in a
+	// space where x and z are texels (0 at the first texel center) and y is
+	// the height times heightScale. Returns the distance along the ray in
+	// units of the length of the direction.
+	///////////////////////////////////////////////////////////////////////////
+	bool intersect(const glm::vec3& origin, const glm::vec3& direction, float heightScale,
+	               float& distance) const;
+
+private:
+	float texel(int x, int y) const;
+	bool intersectCell(const glm::vec3& origin, const glm::vec3& direction, float heightScale, int x,
+	                   int y, float& distance) const;
+};
 
 class HeightField
 {
 public:
+	enum Mode
+	{
+		// One grid of m_meshResolution quads per side, see generateMesh()
+		uniform_grid,
+		// Chunks of a quadtree, see selectChunks()
+		chunked_lod,
+		// Patches tessellated on the GPU, see submitPatches()
+		tessellated,
+		// Like uniform_grid, but without buffers, see submitGrid()
+		procedural_grid
+	};
+	Mode m_mode;
+
 	// Triangles edges per quad side
 	int m_meshResolution;
 	// Textures.
 	GLuint m_texid_hf;
 	GLuint m_texid_diffuse;
 	GLuint m_texid_shininess;
+	// Slope of the height field, per unit of texture coordinate, which the
+	// shaders read instead of sampling the heights around each vertex. It
+	// does not depend on the height scale, and is only redrawn when the
+	// height field changes, see updateSlopeMap().
+	GLuint m_texid_slope;
+	GLuint m_slopeFbo;
+	int m_slopeMapWidth;
+	int m_slopeMapHeight;
 	// Our VAO and its buffers.
 	GLuint m_vao;
 	GLuint m_positionBuffer;
@@ -17,13 +93,142 @@ public:
 	GLuint m_indexBuffer;
 	GLuint m_numIndices;
 
+	///////////////////////////////////////////////////////////////////////////
+	// Chunked LOD (CDLOD, Strugar 2009)
+	//
+	// The terrain is a quadtree of square chunks, from the whole terrain at
+	// level m_lodLevels - 1 down to the smallest chunks at level 0. Chunks
+	// of all levels are drawn with the same grid of m_chunkResolution quads
+	// per side, so each level has half the density of the one below it.
+	// Level i is drawn out to m_lodRanges[i] from the camera, and in the
+	// last m_morphRatio of that range its vertices morph into the grid of
+	// level i + 1, so that levels meet without cracks or popping.
+	//
+	// All selected chunks are drawn with one instanced draw per quadrant.
+	// A chunk whose children are only partly selected is drawn with the
+	// quadrants they leave out.
+	///////////////////////////////////////////////////////////////////////////
+	int m_chunkResolution;
+	int m_lodLevels;
+	// Distance to which the smallest chunks are drawn, in chunks of that size
+	float m_lodDistance;
+	float m_morphRatio;
+	// Levels below m_finestLevel are left out until the selected chunks
+	// have at most this many triangles
+	int m_triangleBudget;
+	int m_finestLevel;
+	// Distances in the model space of the terrain, per level
+	std::vector<float> m_lodRanges;
+	// Offset (x, z), size and level of the selected chunks, per quadrant
+	std::vector<glm::vec4> m_chunks[4];
+	int m_chunkTriangles;
+	GLuint m_chunkVao;
+	int m_chunkMeshResolution;
+	GLuint m_chunkPositionBuffer;
+	GLuint m_chunkIndexBuffer;
+	GLuint m_chunkInstanceBuffer;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Hardware tessellation
+	//
+	// The terrain is a grid of m_patchResolution quad patches per side, which
+	// the tessellation control shader divides so that triangle edges are
+	// about m_pixelsPerEdge long on screen, and more where the height field
+	// bends, by m_curvatureWeight. Each edge level depends only on the edge,
+	// so that neighbouring patches agree and there are no cracks. Patches
+	// outside the view are culled there too.
+	///////////////////////////////////////////////////////////////////////////
+	int m_patchResolution;
+	float m_pixelsPerEdge;
+	float m_curvatureWeight;
+	GLuint m_patchVao;
+	int m_patchMeshResolution;
+	GLuint m_patchPositionBuffer;
+	GLuint m_patchIndexBuffer;
+	// Empty, for submitGrid()
+	GLuint m_gridVao;
+
 	HeightField(void);
 
 	void loadPlainTexture(GLuint* texid, const std::string& path);
 	void loadHeightField(const std::string& path);
+	// Free the height field, and the slope map and HeightMap made from it,
+	// until loadHeightField() is called again. Not while it is loading,
+	// since it is loaded into the texture; returns whether it is freed.
+	bool unloadHeightField();
 	void loadShininess(const std::string& path);
 	void loadDiffuseTexture(const std::string& diffusePath);
+	// Like unloadHeightField()
+	bool unloadDiffuseTexture();
+	// Redraw the slope map with heightfield_slope.frag if the height field
+	// has changed size, which it does as it is loaded. Changes the bound
+	// framebuffer and viewport.
+	void updateSlopeMap(GLuint program);
+	// Read the height field back into a new HeightMap if it has changed
+	// size, like updateSlopeMap(). Waits for the GPU when it does.
+	void updateHeightMap();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Queries against the terrain, in its model space, see selectChunks().
+	// They return false outside the terrain, or before it is loaded. Safe
+	// to call from any thread.
+	///////////////////////////////////////////////////////////////////////////
+	bool heightAt(const glm::vec2& position, float heightScale, float& height) const;
+	// For many points at once, with the unit normals as the shaders see
+	// them. Points outside the terrain get the height and normal at its edge.
+	bool heightsAt(const glm::vec2* positions,
+	               size_t count,
+	               float heightScale,
+	               float* heights,
+	               glm::vec3* normals) const;
+	// Distance along the ray to the terrain, in units of the length of direction
+	bool intersectRay(const glm::vec3& origin,
+	                  const glm::vec3& direction,
+	                  float heightScale,
+	                  float& distance) const;
+	// The current HeightMap, or null before the height field is loaded
+	std::shared_ptr<const HeightMap> heightMap() const;
 
 	void generateMesh(int tesselation);
 	void submitTriangles(void);
+	// Draw a grid of tesselation quads per side without any buffers, with
+	// heightfield.vert built with PROCEDURAL_GRID
+	void submitGrid(int tesselation);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Select the chunks to draw, given the camera position and the
+	// model-view-projection matrix of the terrain, both in its model space,
+	// where the terrain spans -1 to 1 in x and z and 0 to heightScale in y.
+	///////////////////////////////////////////////////////////////////////////
+	void selectChunks(const glm::vec3& cameraPosition,
+	                  const glm::mat4& modelViewProjection,
+	                  float heightScale);
+	// Draw the selected chunks, with the LOD uniforms set on the program
+	void submitChunks(GLuint program);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Draw the patches, with the tessellation uniforms set on the program,
+	// given the projection matrix and the height of the viewport in pixels
+	///////////////////////////////////////////////////////////////////////////
+	void submitPatches(GLuint program, const glm::mat4& projection, int viewportHeight);
+
+private:
+	// Unless it is still loading, see unloadHeightField()
+	bool deleteLoadedTexture(GLuint* texid);
+	void generateChunkMesh(int resolution);
+	void generatePatches(int resolution);
+	// Returns false if the chunk is out of the range of its level, and
+	// should be drawn by its parent
+	bool selectChunk(const labhelper::Frustum& frustum, const glm::vec2& offset, float size, int level);
+	// Whether the chunk lies within the range of the level, or closer
+	bool chunkInRange(const glm::vec2& offset, float size, int level) const;
+	void addChunk(const glm::vec2& offset, float size, int level, int quadrant);
+
+	// Only valid during selectChunks()
+	glm::vec3 m_selectionCamera;
+	float m_selectionHeight;
+
+	// Replaced, not changed, so that queries can go on with the old one
+	std::shared_ptr<const HeightMap> m_heightMap;
+	mutable std::mutex m_heightMapMutex;
 };
@@ -2,19 +2,47 @@
 ///////////////////////////////////////////////////////////////////////////////
 // Input vertex attributes
 ///////////////////////////////////////////////////////////////////////////////
+#ifdef CHUNKED_LOD
+// From 0 to 1 over the chunk
+layout(location = 0) in vec2 gridPosition;
+// Offset (x, z), size and level of the chunk, see HeightField::selectChunks()
+layout(location = 3) in vec4 chunk;
+#elif defined(PROCEDURAL_GRID)
+// No attributes, see HeightField::submitGrid()
+#else
 layout(location = 0) in vec2 position;
 layout(location = 2) in vec2 texCoordIn;
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Input uniform variables
 ///////////////////////////////////////////////////////////////////////////////
-
-uniform mat4 normalMatrix;
-uniform mat4 modelViewMatrix;
-uniform mat4 modelViewProjectionMatrix;
+layout(std140) uniform ObjectUniforms
+{
+	mat4 modelViewProjectionMatrix;
+	mat4 modelViewMatrix;
+	mat4 normalMatrix;
+};
 uniform sampler2D heightField;
+// Height per unit of texture coordinate, see HeightField::updateSlopeMap()
+uniform sampler2D slopeMap;
 uniform int tesselation;
 uniform float scale;
+#ifdef CHUNKED_LOD
+// In the model space of the terrain
+uniform vec3 cameraPosition;
+uniform int chunkResolution;
+// Distances over which each level morphs into the next
+uniform vec2 morphRanges[16];
+#endif
+#ifdef STREAMED_TERRAIN
+// Tiles of the height field in a page cache, see TerrainTiles
+uniform sampler2DArray heightPages;
+uniform sampler2D pageTable;
+// In texels of level 0
+uniform vec2 terrainSize;
+uniform float tileSize;
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Output to fragment shader
@@ -23,23 +51,68 @@ out vec2 texCoord;
 out vec3 viewSpacePosition;
 out vec3 viewSpaceNormal;
 
+#ifdef STREAMED_TERRAIN
+// Where the finest resident tile over the texture coordinate has it
+vec3 pageCoord(vec2 coord)
+{
+	vec2 corner = clamp(coord, 0.0, 1.0) * terrainSize;
+	ivec2 entry = min(ivec2(corner / tileSize), textureSize(pageTable, 0) - 1);
+	// Layer, level and tile
+	vec4 page = texelFetch(pageTable, entry, 0);
+	// In texels of the tile, counted from the start of its border
+	vec2 local = corner / exp2(page.y) - page.zw * tileSize + 1.0;
+	return vec3(local / (tileSize + 2.0), page.x);
+}
+
+float terrainHeight(vec2 coord)
+{
+	vec3 page = pageCoord(coord);
+	return page.z < 0.0 ? 0.0 : textureLod(heightPages, page, 0.0).r;
+}
+#else
+float terrainHeight(vec2 coord)
+{
+	return textureLod(heightField, coord, 0.0).r;
+}
+#endif
+
 void main()
 {
-	float height = texture(heightField, texCoordIn).r * scale;
+#ifdef CHUNKED_LOD
+	vec2 position = chunk.xy + gridPosition * chunk.z;
+	float distanceToCamera = distance(cameraPosition,
+	                                  vec3(position.x, terrainHeight(position * 0.5 + 0.5) * scale,
+	                                       position.y));
+	vec2 range = morphRanges[int(chunk.w)];
+	float morph = clamp((distanceToCamera - range.x) / (range.y - range.x), 0.0, 1.0);
+	// Move the odd vertices onto the edges of the grid of the next level
+	vec2 odd = mod(round(gridPosition * chunkResolution), 2.0) / chunkResolution;
+	position = chunk.xy + (gridPosition - odd * morph) * chunk.z;
+	vec2 texCoordIn = position * 0.5 + 0.5;
+#elif defined(PROCEDURAL_GRID)
+	// Each instance is a strip along a row of quads, alternating between
+	// its two edges
+	vec2 gridPosition = vec2(gl_VertexID / 2, gl_InstanceID + gl_VertexID % 2) / tesselation;
+	vec2 position = gridPosition * 2.0 - 1.0;
+	vec2 texCoordIn = gridPosition;
+#endif
+	float height = terrainHeight(texCoordIn) * scale;
 	vec3 mappedPos = vec3(position.x, height, position.y);
-	
-	// Estimate normal.
-	float delta = 1.0 / tesselation;
-	float du = texture(heightField, texCoordIn + delta*vec2(-1,0)).r
-		     - texture(heightField, texCoordIn + delta*vec2(1,0)).r;
-	float dv = texture(heightField, texCoordIn + delta*vec2(0,-1)).r
-		     - texture(heightField, texCoordIn + delta*vec2(0,1)).r;
+
+#ifdef STREAMED_TERRAIN
+	// There is no slope map of the whole height field, so like heightfield_slope.frag
+	vec2 dx = vec2(1.0 / terrainSize.x, 0.0);
+	vec2 dy = vec2(0.0, 1.0 / terrainSize.y);
+	vec2 slope = 0.5 * terrainSize
+	             * vec2(terrainHeight(texCoordIn + dx) - terrainHeight(texCoordIn - dx),
+	                    terrainHeight(texCoordIn + dy) - terrainHeight(texCoordIn - dy));
+#else
+	// Normal from the precomputed slope.
+	vec2 slope = textureLod(slopeMap, texCoordIn, 0.0).rg;
+#endif
 	// Small term to avoid y-only normals that lead to ugly bands of fresnel.
 	float fudge = 0.01;
-	vec3 normalIn = normalize(vec3(
-		fudge + scale * du / (delta * 2),
-		1.0,
-		fudge + scale * dv / (delta * 2)));
+	vec3 normalIn = normalize(vec3(fudge - scale * slope.x, 1.0, fudge - scale * slope.y));
 
 	gl_Position = modelViewProjectionMatrix * vec4(mappedPos, 1.0);
 	texCoord = texCoordIn;
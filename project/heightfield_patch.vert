@@ -0,0 +1,24 @@
+#version 410
+///////////////////////////////////////////////////////////////////////////////
+// Input vertex attributes
+///////////////////////////////////////////////////////////////////////////////
+// A corner of a patch, see HeightField::generatePatches()
+layout(location = 0) in vec2 position;
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+uniform sampler2D heightField;
+uniform float scale;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output to tessellation control shader
+///////////////////////////////////////////////////////////////////////////////
+// In the model space of the terrain
+out vec3 cornerPosition;
+
+void main()
+{
+	float height = textureLod(heightField, position * 0.5 + 0.5, 0.0).r * scale;
+	cornerPosition = vec3(position.x, height, position.y);
+}
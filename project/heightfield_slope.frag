@@ -0,0 +1,29 @@
+#version 410
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+uniform sampler2D heightField;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output slope, see HeightField::updateSlopeMap()
+///////////////////////////////////////////////////////////////////////////////
+layout(location = 0) out vec2 slope;
+
+float heightAt(ivec2 texel)
+{
+	return texelFetch(heightField, clamp(texel, ivec2(0), textureSize(heightField, 0) - 1), 0).r;
+}
+
+void main()
+{
+	// One fragment per texel of the height field
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	float dx = heightAt(texel + ivec2(1, 0)) - heightAt(texel - ivec2(1, 0));
+	float dy = heightAt(texel + ivec2(0, 1)) - heightAt(texel - ivec2(0, 1));
+	// Central differences, per unit of texture coordinate
+	slope = 0.5 * vec2(dx, dy) * vec2(textureSize(heightField, 0));
+}
@@ -8,7 +8,10 @@ extern "C" _declspec(dllexport) unsigned int NvOptimusEnablement = 0x00000001;
 #include <cmath>
 #include <cstdlib>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <thread>
 
 #include <labhelper.h>
 #include <imgui.h>
@@ -19,9 +22,15 @@ extern "C" _declspec(dllexport) unsigned int NvOptimusEnablement = 0x00000001;
 using namespace glm;
 
 #include <Model.h>
+#include <render_queue.h>
+#include <profiler.h>
+#include <trace.h>
+#include <assets.h>
+#include <capture.h>
 #include "hdr.h"
 #include "fbo.h"
 #include "heightfield.h"
+#include "terraintiles.h"
 
 
 using std::min;
@@ -48,6 +57,32 @@ GLuint shaderProgram;       // Shader for rendering the final image
 GLuint simpleShaderProgram; // Shader used to draw the shadow map
 GLuint backgroundProgram;
 GLuint heightFieldProgram;
+GLuint heightFieldLodProgram;
+GLuint heightFieldTessProgram;
+GLuint heightFieldGridProgram;
+GLuint heightFieldStreamProgram;
+GLuint heightFieldSlopeProgram;
+
+///////////////////////////////////////////////////////////////////////////////
+// Uniform buffers, laid out as the blocks in shading.vert and shading.frag
+///////////////////////////////////////////////////////////////////////////////
+struct FrameUniforms
+{
+	mat4 viewInverse;
+	vec3 viewSpaceLightPosition;
+	float point_light_intensity_multiplier;
+	vec3 point_light_color;
+	float environment_multiplier;
+};
+struct ObjectUniforms
+{
+	mat4 modelViewProjectionMatrix;
+	mat4 modelViewMatrix;
+	mat4 normalMatrix;
+};
+labhelper::UniformBuffer frameUniforms;
+labhelper::UniformBuffer objectUniforms;
+labhelper::UniformBuffer terrainMaterialUniforms;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
@@ -86,6 +121,10 @@ mat4 fighterModelMatrix;
 
 float shipSpeed = 50;
 
+// Draws the meshes of all models sorted by state, instead of model by model
+labhelper::RenderQueue renderQueue;
+bool useRenderQueue = true;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Height field
 ///////////////////////////////////////////////////////////////////////////////
@@ -99,34 +138,166 @@ float terrainShininess = 50.0;
 float terrainFresnel = 0.03;
 bool g_showWireframe = false;
 bool g_showNormals = false;
-
-void loadShaders(bool is_reload)
+bool keepCameraAboveGround = true;
+float minCameraHeight = 2.0f;
+const std::string terrainHeightFieldPath = "../scenes/nlsFinland/L3123F.png";
+const std::string terrainColorPath = "../scenes/nlsFinland/L3123F_downscaled.jpg";
+
+// Chunked LOD can read the terrain from tiles streamed from disk instead,
+// and then neither its height field nor its colours are loaded whole, only
+// the shininess map, which is small
+TerrainTiles terrainTiles;
+bool streamTerrain = false;
+const std::string terrainTilesPath = "../scenes/nlsFinland/L3123F.terraintiles";
+const size_t terrainTilesBudget = 64 * 1024 * 1024;
+// The tiles are cut from the images of the terrain the first time, which
+// takes a while, so on a thread of its own
+std::thread terrainTilesBuilder;
+std::atomic<bool> terrainTilesBuildDone(false);
+std::atomic<bool> terrainTilesBuilt(false);
+
+// Open the tiles, or start building them if there are none yet. Call while
+// streamTerrain is set and the tiles are not open; it is cleared if they
+// cannot be built.
+void openTerrainTiles()
 {
-	GLuint shader = labhelper::loadShaderProgram("../project/simple.vert", "../project/simple.frag",
-	                                             is_reload);
-	if(shader != 0)
+	if(terrainTilesBuilder.joinable())
+	{
+		if(terrainTilesBuildDone)
+		{
+			terrainTilesBuilder.join();
+			streamTerrain = terrainTilesBuilt && terrainTiles.open(terrainTilesPath, terrainTilesBudget);
+		}
+		return;
+	}
+	if(!terrainTiles.open(terrainTilesPath, terrainTilesBudget))
 	{
-		simpleShaderProgram = shader;
+		terrainTilesBuildDone = false;
+		terrainTilesBuilder = std::thread([] {
+			labhelper::trace::setThreadName("Terrain tile build");
+			terrainTilesBuilt =
+			    TerrainTiles::build(terrainHeightFieldPath, terrainColorPath, terrainTilesPath);
+			terrainTilesBuildDone = true;
+		});
 	}
+}
 
-	shader = labhelper::loadShaderProgram("../project/fullscreenQuad.vert", "../project/background.frag",
-	                                      is_reload);
-	if(shader != 0)
+// Whether the terrain is drawn from the tiles
+bool terrainStreamed()
+{
+	return terrain.m_mode == HeightField::chunked_lod && streamTerrain && terrainTiles.isOpen();
+}
+
+// The texture units never change, so the samplers are only set when a program is loaded
+void setSamplers()
+{
+	for(GLuint program : { backgroundProgram, shaderProgram, heightFieldProgram, heightFieldLodProgram,
+	                        heightFieldTessProgram, heightFieldGridProgram, heightFieldStreamProgram })
 	{
-		backgroundProgram = shader;
+		glUseProgram(program);
+		labhelper::setUniform(program, "environmentMap", 6);
+		labhelper::setUniform(program, "irradianceMap", 7);
+		labhelper::setUniform(program, "reflectionMap", 8);
 	}
-
-	shader = labhelper::loadShaderProgram("../project/shading.vert", "../project/shading.frag", is_reload);
-	if(shader != 0)
+	for(GLuint program : { heightFieldProgram, heightFieldLodProgram, heightFieldTessProgram,
+	                        heightFieldGridProgram, heightFieldStreamProgram })
 	{
-		shaderProgram = shader;
+		glUseProgram(program);
+		labhelper::setUniform(program, "heightField", 1);
+		labhelper::setUniform(program, "color_texture", 2);
+		labhelper::setUniform(program, "shininess_texture", 3);
+		labhelper::setUniform(program, "slopeMap", 4);
 	}
+	glUseProgram(heightFieldStreamProgram);
+	labhelper::setUniform(heightFieldStreamProgram, "heightPages", 9);
+	labhelper::setUniform(heightFieldStreamProgram, "colorPages", 10);
+	labhelper::setUniform(heightFieldStreamProgram, "pageTable", 11);
+	glUseProgram(0);
+}
 
-	shader = labhelper::loadShaderProgram("../project/heightfield.vert", "../project/shading.frag", is_reload);
-	if(shader != 0)
+// Replace the program once the new one is linked, and keep the old one if it fails
+std::function<void(GLuint)> replaceProgram(GLuint& program)
+{
+	return [&program](GLuint shader) {
+		if(shader != 0)
+		{
+			glDeleteProgram(program);
+			program = shader;
+			setSamplers();
+		}
+	};
+}
+
+// All programs are compiled at the same time. On reload they are replaced
+// as they are done, without waiting for them.
+void loadShaders(bool is_reload)
+{
+	labhelper::loadShaderProgramAsync("../project/simple.vert", "../project/simple.frag",
+	                                  replaceProgram(simpleShaderProgram), is_reload);
+	labhelper::loadShaderProgramAsync("../project/fullscreenQuad.vert", "../project/background.frag",
+	                                  replaceProgram(backgroundProgram), is_reload);
+
+	// Read the materials by the index of each draw if all meshes of a model
+	// can be drawn at once, and their textures from arrays if models have them
+	std::string defines = labhelper::multiDrawSupported() ? "#define MULTI_DRAW\n" : "";
+	if(labhelper::materialTextureMode() != labhelper::separate_textures)
 	{
-		heightFieldProgram = shader;
+		defines += "#define TEXTURE_ARRAYS\n";
 	}
+	if(labhelper::materialTextureMode() == labhelper::bindless_texture_arrays)
+	{
+		defines += "#define BINDLESS_TEXTURE_ARRAYS\n";
+	}
+	labhelper::loadShaderProgramAsync("../project/shading.vert", "../project/shading.frag",
+	                                  replaceProgram(shaderProgram), is_reload, defines);
+
+	// The terrain is shaded with per-pixel normals from its slope map
+	const std::string terrainDefines = "#define TERRAIN_SLOPE_MAP\n";
+	labhelper::loadShaderProgramAsync("../project/heightfield.vert", "../project/shading.frag",
+	                                  replaceProgram(heightFieldProgram), is_reload, terrainDefines);
+	labhelper::loadShaderProgramAsync("../project/heightfield.vert", "../project/shading.frag",
+	                                  replaceProgram(heightFieldLodProgram), is_reload,
+	                                  terrainDefines + "#define CHUNKED_LOD\n");
+	labhelper::loadShaderProgramAsync("../project/heightfield.vert", "../project/shading.frag",
+	                                  replaceProgram(heightFieldGridProgram), is_reload,
+	                                  terrainDefines + "#define PROCEDURAL_GRID\n");
+	// The streamed tiles have no slope map, so it takes its normals from the heights
+	labhelper::loadShaderProgramAsync("../project/heightfield.vert", "../project/shading.frag",
+	                                  replaceProgram(heightFieldStreamProgram), is_reload,
+	                                  "#define CHUNKED_LOD\n#define STREAMED_TERRAIN\n");
+	labhelper::loadTessellationShaderProgramAsync("../project/heightfield_patch.vert",
+	                                              "../project/heightfield.tesc",
+	                                              "../project/heightfield.tese", "../project/shading.frag",
+	                                              replaceProgram(heightFieldTessProgram), is_reload,
+	                                              terrainDefines);
+	labhelper::loadShaderProgramAsync("../project/fullscreenQuad.vert", "../project/heightfield_slope.frag",
+	                                  [](GLuint program) {
+		                                  replaceProgram(heightFieldSlopeProgram)(program);
+		                                  // Redraw the slope map with the new program
+		                                  terrain.m_slopeMapWidth = 0;
+	                                  },
+	                                  is_reload);
+	if(!is_reload)
+	{
+		labhelper::finishShaderPrograms();
+	}
+}
+
+ObjectUniforms makeObjectUniforms(const mat4& viewMatrix,
+                                  const mat4& projectionMatrix,
+                                  const mat4& modelMatrix)
+{
+	ObjectUniforms object;
+	object.modelViewMatrix = viewMatrix * modelMatrix;
+	object.modelViewProjectionMatrix = projectionMatrix * object.modelViewMatrix;
+	object.normalMatrix = inverse(transpose(object.modelViewMatrix));
+	return object;
+}
+
+void setObjectUniforms(const mat4& viewMatrix, const mat4& projectionMatrix, const mat4& modelMatrix)
+{
+	objectUniforms.update(labhelper::object_uniforms_binding,
+	                      makeObjectUniforms(viewMatrix, projectionMatrix, modelMatrix));
 }
 
 
@@ -137,16 +308,20 @@ void initialize()
 {
 	ENSURE_INITIALIZE_ONLY_ONCE();
 
+	// Before the shaders and models, which depend on it
+	labhelper::material_texture_settings.mode = labhelper::bindless_texture_arrays;
+
 	///////////////////////////////////////////////////////////////////////
 	//		Load Shaders
 	///////////////////////////////////////////////////////////////////////
 	loadShaders(false);
 
 	///////////////////////////////////////////////////////////////////////
-	// Load models and set up model matrices
+	// Load models and set up model matrices. Models and textures are loaded
+	// in the background, see labhelper::assets.
 	///////////////////////////////////////////////////////////////////////
-	fighterModel = labhelper::loadModelFromOBJ("../scenes/space-ship.obj");
-	landingpadModel = labhelper::loadModelFromOBJ("../scenes/landingpad.obj");
+	fighterModel = labhelper::assets::loadModelFromOBJ("../scenes/space-ship.obj");
+	landingpadModel = labhelper::assets::loadModelFromOBJ("../scenes/landingpad.obj");
 
 	roomModelMatrix = mat4(1.0f);
 	fighterModelMatrix = translate(15.0f * worldUp);
@@ -160,14 +335,14 @@ void initialize()
 	for(int i = 0; i < roughnesses; i++)
 		filenames.push_back("../scenes/envmaps/" + envmap_base_name + "_dl_" + std::to_string(i) + ".hdr");
 
-	environmentMap = labhelper::loadHdrTexture("../scenes/envmaps/" + envmap_base_name + ".hdr");
-	irradianceMap = labhelper::loadHdrTexture("../scenes/envmaps/" + envmap_base_name + "_irradiance.hdr");
-	reflectionMap = labhelper::loadHdrMipmapTexture(filenames);
+	environmentMap = labhelper::assets::loadHdrTexture("../scenes/envmaps/" + envmap_base_name + ".hdr");
+	irradianceMap =
+	    labhelper::assets::loadHdrTexture("../scenes/envmaps/" + envmap_base_name + "_irradiance.hdr");
+	reflectionMap = labhelper::assets::loadHdrMipmapTexture(filenames);
 
-	terrain.loadDiffuseTexture("../scenes/nlsFinland/L3123F_downscaled.jpg");
-	terrain.loadHeightField("../scenes/nlsFinland/L3123F.png");
+	// The height field and colours are loaded by display() when they are
+	// needed, which they are not while streaming
 	terrain.loadShininess("../scenes/nlsFinland/L3123F_shininess.png");
-	terrain.generateMesh(terrainResolution);
 	terrainModelMatrix = translate(-10.0f * worldUp) * scale(vec3(5000));
 
 	glEnable(GL_DEPTH_TEST); // enable Z-buffering
@@ -180,9 +355,9 @@ void debugDrawLight(const glm::mat4& viewMatrix,
 {
 	mat4 modelMatrix = glm::translate(worldSpaceLightPos);
 	glUseProgram(simpleShaderProgram);
-	labhelper::setUniformSlow(simpleShaderProgram, "modelViewProjectionMatrix",
-	                          projectionMatrix * viewMatrix * modelMatrix);
-	labhelper::setUniformSlow(simpleShaderProgram, "material_color", vec3(1, 1, 1));
+	labhelper::setUniform(simpleShaderProgram, "modelViewProjectionMatrix",
+	                      projectionMatrix * viewMatrix * modelMatrix);
+	labhelper::setUniform(simpleShaderProgram, "material_color", vec3(1, 1, 1));
 	labhelper::debugDrawSphere();
 }
 
@@ -190,10 +365,9 @@ void debugDrawLight(const glm::mat4& viewMatrix,
 void drawBackground(const mat4& viewMatrix, const mat4& projectionMatrix)
 {
 	glUseProgram(backgroundProgram);
-	labhelper::setUniformSlow(backgroundProgram, "environment_multiplier", environment_multiplier);
-	labhelper::setUniformSlow(backgroundProgram, "inv_PV", inverse(projectionMatrix * viewMatrix));
-	labhelper::setUniformSlow(backgroundProgram, "camera_pos", cameraPosition);
-	labhelper::setUniformSlow(backgroundProgram, "environmentMap", 6);
+	labhelper::setUniform(backgroundProgram, "environment_multiplier", environment_multiplier);
+	labhelper::setUniform(backgroundProgram, "inv_PV", inverse(projectionMatrix * viewMatrix));
+	labhelper::setUniform(backgroundProgram, "camera_pos", cameraPosition);
 	labhelper::drawFullScreenQuad();
 }
 
@@ -208,41 +382,26 @@ void drawScene(GLuint currentShaderProgram,
                const mat4& lightProjectionMatrix)
 {
 	glUseProgram(currentShaderProgram);
-	labhelper::setUniformSlow(currentShaderProgram, "showNormals", g_showNormals);
-
-	// Light source
-	vec4 viewSpaceLightPosition = viewMatrix * vec4(lightPosition, 1.0f);
-	labhelper::setUniformSlow(currentShaderProgram, "point_light_color", point_light_color);
-	labhelper::setUniformSlow(currentShaderProgram, "point_light_intensity_multiplier",
-	                          point_light_intensity_multiplier);
-	labhelper::setUniformSlow(currentShaderProgram, "viewSpaceLightPosition", vec3(viewSpaceLightPosition));
-	labhelper::setUniformSlow(currentShaderProgram, "viewSpaceLightDir",
-	                          normalize(vec3(viewMatrix * vec4(-lightPosition, 0.0f))));
-
-
-	// Environment
-	labhelper::setUniformSlow(currentShaderProgram, "environment_multiplier", environment_multiplier);
+	labhelper::setUniform(currentShaderProgram, "showNormals", g_showNormals);
 
-	// camera
-	labhelper::setUniformSlow(currentShaderProgram, "viewInverse", inverse(viewMatrix));
+	if(useRenderQueue)
+	{
+		renderQueue.add(landingpadModel, currentShaderProgram, viewMatrix * landingPadModelMatrix,
+		                projectionMatrix,
+		                makeObjectUniforms(viewMatrix, projectionMatrix, landingPadModelMatrix));
+		renderQueue.add(fighterModel, currentShaderProgram, viewMatrix * fighterModelMatrix, projectionMatrix,
+		                makeObjectUniforms(viewMatrix, projectionMatrix, fighterModelMatrix));
+		renderQueue.submit();
+		return;
+	}
 
 	// landing pad
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-	                          projectionMatrix * viewMatrix * landingPadModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * landingPadModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
-	                          inverse(transpose(viewMatrix * landingPadModelMatrix)));
-
-	labhelper::render(landingpadModel);
+	setObjectUniforms(viewMatrix, projectionMatrix, landingPadModelMatrix);
+	labhelper::render(landingpadModel, viewMatrix * landingPadModelMatrix, projectionMatrix);
 
 	// Fighter
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-	                          projectionMatrix * viewMatrix * fighterModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * fighterModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
-	                          inverse(transpose(viewMatrix * fighterModelMatrix)));
-
-	labhelper::render(fighterModel);
+	setObjectUniforms(viewMatrix, projectionMatrix, fighterModelMatrix);
+	labhelper::render(fighterModel, viewMatrix * fighterModelMatrix, projectionMatrix);
 }
 
 void drawTerrain(GLuint program,
@@ -259,31 +418,22 @@ void drawTerrain(GLuint program,
 	glUseProgram(program);
 
 	// Configuration
-	labhelper::setUniformSlow(program, "tesselation", terrainResolution);
-	labhelper::setUniformSlow(program, "scale", terrainScale);
-	labhelper::setUniformSlow(program, "showNormals", g_showNormals);
+	labhelper::setUniform(program, "tesselation", terrainResolution);
+	labhelper::setUniform(program, "scale", terrainScale);
+	labhelper::setUniform(program, "showNormals", g_showNormals);
 
 	// Material parameters.
 	// Both water and land are dielectrics.
-	labhelper::setUniformSlow(program, "material_metalness", 0.0f);
-	labhelper::setUniformSlow(program, "material_fresnel", terrainFresnel);
-	labhelper::setUniformSlow(program, "material_shininess", terrainShininess);
-
-	// Fragment shader parameters.
-	vec4 viewSpaceLightPosition = viewMatrix * vec4(lightPosition, 1.0f);
-	labhelper::setUniformSlow(program, "point_light_color", point_light_color);
-	labhelper::setUniformSlow(program, "point_light_intensity_multiplier", point_light_intensity_multiplier);
-	labhelper::setUniformSlow(program, "viewSpaceLightPosition", vec3(viewSpaceLightPosition));
-	labhelper::setUniformSlow(program, "viewSpaceLightDir",
-	                          normalize(vec3(viewMatrix * vec4(-lightPosition, 0.0f))));
-	labhelper::setUniformSlow(program, "environment_multiplier", environment_multiplier);
-	labhelper::setUniformSlow(program, "viewInverse", inverse(viewMatrix));
+	labhelper::MaterialUniforms material = {};
+	material.color = vec3(1.0f);
+	material.metalness = 0.0f;
+	material.fresnel = terrainFresnel;
+	material.shininess = terrainShininess;
+	material.has_color_texture = 1;
+	material.has_shininess_texture = 1;
+	terrainMaterialUniforms.update(labhelper::material_uniforms_binding, material);
 
 	// Configure textures.
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, terrain.m_texid_hf);
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, terrain.m_texid_diffuse);
 	glActiveTexture(GL_TEXTURE3);
 	glBindTexture(GL_TEXTURE_2D, terrain.m_texid_shininess);
 	glActiveTexture(GL_TEXTURE6);
@@ -292,24 +442,49 @@ void drawTerrain(GLuint program,
 	glBindTexture(GL_TEXTURE_2D, irradianceMap);
 	glActiveTexture(GL_TEXTURE8);
 	glBindTexture(GL_TEXTURE_2D, reflectionMap);
+	if(program == heightFieldStreamProgram)
+	{
+		glActiveTexture(GL_TEXTURE9);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, terrainTiles.m_heightPages);
+		glActiveTexture(GL_TEXTURE10);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, terrainTiles.m_colorPages);
+		glActiveTexture(GL_TEXTURE11);
+		glBindTexture(GL_TEXTURE_2D, terrainTiles.m_pageTable);
+		terrainTiles.setUniforms(program);
+	}
+	else
+	{
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, terrain.m_texid_hf);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, terrain.m_texid_diffuse);
+		glActiveTexture(GL_TEXTURE4);
+		glBindTexture(GL_TEXTURE_2D, terrain.m_texid_slope);
+	}
 	glActiveTexture(GL_TEXTURE0);
 
-	labhelper::setUniformSlow(program, "heightField", 1);
-	labhelper::setUniformSlow(program, "color_texture", 2);
-	labhelper::setUniformSlow(program, "shininess_texture", 3);
-	labhelper::setUniformSlow(program, "environmentMap", 6);
-	labhelper::setUniformSlow(program, "irradianceMap", 7);
-	labhelper::setUniformSlow(program, "reflectionMap", 8);
-
-	labhelper::setUniformSlow(program, "has_color_texture", 1);
-	labhelper::setUniformSlow(program, "has_shininess_texture", 1);
-
 	// Set matrices.
-	labhelper::setUniformSlow(program, "modelViewProjectionMatrix",
-	                          projectionMatrix * viewMatrix * terrainModelMatrix);
-	labhelper::setUniformSlow(program, "modelViewMatrix", viewMatrix * terrainModelMatrix);
-	labhelper::setUniformSlow(program, "normalMatrix", inverse(transpose(viewMatrix * terrainModelMatrix)));
-	terrain.submitTriangles();
+	setObjectUniforms(viewMatrix, projectionMatrix, terrainModelMatrix);
+	if(terrain.m_mode == HeightField::chunked_lod)
+	{
+		vec3 modelCameraPosition = vec3(inverse(terrainModelMatrix) * vec4(cameraPosition, 1.0f));
+		labhelper::setUniform(program, "cameraPosition", modelCameraPosition);
+		terrain.selectChunks(modelCameraPosition, projectionMatrix * viewMatrix * terrainModelMatrix,
+		                     terrainScale);
+		terrain.submitChunks(program);
+	}
+	else if(terrain.m_mode == HeightField::tessellated)
+	{
+		terrain.submitPatches(program, projectionMatrix, windowHeight);
+	}
+	else if(terrain.m_mode == HeightField::procedural_grid)
+	{
+		terrain.submitGrid(terrainResolution);
+	}
+	else
+	{
+		terrain.submitTriangles();
+	}
 
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 }
@@ -337,10 +512,43 @@ void display(void)
 	///////////////////////////////////////////////////////////////////////////
 	// Re-tesselate the terrain if we changed the resolution.
 	///////////////////////////////////////////////////////////////////////////
-	if(terrain.m_meshResolution != terrainResolution)
+	if(terrain.m_mode == HeightField::uniform_grid && terrain.m_meshResolution != terrainResolution)
 	{
+		labhelper::profiler::Zone zone("Terrain mesh", false);
 		terrain.generateMesh(terrainResolution);
 	}
+	if(streamTerrain && !terrainTiles.isOpen())
+	{
+		openTerrainTiles();
+	}
+	if(terrainStreamed())
+	{
+		labhelper::profiler::Zone zone("Terrain tiles", false);
+		terrain.unloadHeightField();
+		terrain.unloadDiffuseTexture();
+		terrainTiles.update(vec3(inverse(terrainModelMatrix) * vec4(cameraPosition, 1.0f)), terrainScale);
+	}
+	else
+	{
+		// Not loaded for streaming, but kept while the tiles are built if they were
+		const bool streaming = streamTerrain && terrain.m_mode == HeightField::chunked_lod;
+		if(terrain.m_texid_hf == UINT32_MAX && !streaming)
+		{
+			terrain.loadHeightField(terrainHeightFieldPath);
+		}
+		if(terrain.m_texid_diffuse == UINT32_MAX && !streaming)
+		{
+			terrain.loadDiffuseTexture(terrainColorPath);
+		}
+		{
+			labhelper::profiler::Zone zone("Terrain slope map");
+			terrain.updateSlopeMap(heightFieldSlopeProgram);
+		}
+		{
+			labhelper::profiler::Zone zone("Terrain height map", false);
+			terrain.updateHeightMap();
+		}
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// setup matrices
@@ -356,16 +564,24 @@ void display(void)
 	///////////////////////////////////////////////////////////////////////////
 	// Bind the environment map(s) to unused texture units
 	///////////////////////////////////////////////////////////////////////////
-	glUseProgram(shaderProgram);
 	glActiveTexture(GL_TEXTURE6);
 	glBindTexture(GL_TEXTURE_2D, environmentMap);
 	glActiveTexture(GL_TEXTURE7);
 	glBindTexture(GL_TEXTURE_2D, irradianceMap);
 	glActiveTexture(GL_TEXTURE8);
 	glBindTexture(GL_TEXTURE_2D, reflectionMap);
-	labhelper::setUniformSlowIfValid(shaderProgram, "reflectionMap", 8);
-	labhelper::setUniformSlowIfValid(shaderProgram, "environmentMap", 6);
-	labhelper::setUniformSlowIfValid(shaderProgram, "irradianceMap", 7);
+	glActiveTexture(GL_TEXTURE0);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Camera, light source and environment, for all draws this frame
+	///////////////////////////////////////////////////////////////////////////
+	FrameUniforms frame;
+	frame.viewInverse = inverse(viewMatrix);
+	frame.viewSpaceLightPosition = vec3(viewMatrix * vec4(lightPosition, 1.0f));
+	frame.point_light_intensity_multiplier = point_light_intensity_multiplier;
+	frame.point_light_color = point_light_color;
+	frame.environment_multiplier = environment_multiplier;
+	frameUniforms.update(labhelper::frame_uniforms_binding, frame);
 
 
 	///////////////////////////////////////////////////////////////////////////
@@ -376,10 +592,33 @@ void display(void)
 	glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	drawBackground(viewMatrix, projMatrix);
-	drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
-	drawTerrain(heightFieldProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
-	debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
+	{
+		labhelper::profiler::Zone zone("Background");
+		drawBackground(viewMatrix, projMatrix);
+	}
+	{
+		labhelper::profiler::Zone zone("Scene");
+		drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+	}
+	{
+		labhelper::profiler::Zone zone("Terrain");
+		// By HeightField::Mode
+		const GLuint terrainPrograms[] = { heightFieldProgram, heightFieldLodProgram, heightFieldTessProgram,
+			                               heightFieldGridProgram };
+		GLuint program = terrainPrograms[terrain.m_mode];
+		if(terrainStreamed())
+		{
+			program = heightFieldStreamProgram;
+		}
+		if(program == heightFieldStreamProgram || terrain.m_texid_hf != UINT32_MAX)
+		{
+			drawTerrain(program, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+		}
+	}
+	{
+		labhelper::profiler::Zone zone("Debug");
+		debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
+	}
 }
 
 
@@ -408,7 +647,7 @@ bool handleEvents(void)
 		}
 		else if(event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_PRINTSCREEN)
 		{
-			labhelper::saveScreenshot();
+			labhelper::capture::saveScreenshot();
 		}
 		if(event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT
 		   && (!showUI || !io.WantCaptureMouse))
@@ -482,6 +721,18 @@ bool handleEvents(void)
 	{
 		cameraPosition += cameraSpeed * deltaTime * worldUp;
 	}
+
+	vec3 modelCameraPosition = vec3(inverse(terrainModelMatrix) * vec4(cameraPosition, 1.0f));
+	const vec2 groundPosition(modelCameraPosition.x, modelCameraPosition.z);
+	float groundHeight;
+	if(keepCameraAboveGround
+	   && (terrainStreamed() ? terrainTiles.heightAt(groundPosition, terrainScale, groundHeight) :
+	                           terrain.heightAt(groundPosition, terrainScale, groundHeight)))
+	{
+		vec4 ground = terrainModelMatrix
+		              * vec4(modelCameraPosition.x, groundHeight, modelCameraPosition.z, 1.0f);
+		cameraPosition.y = std::max(cameraPosition.y, ground.y + minCameraHeight);
+	}
 	return quitEvent;
 }
 
@@ -494,17 +745,121 @@ void gui()
 	// ----------------- Set variables --------------------------
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
 	            ImGui::GetIO().Framerate);
-	ImGui::SliderInt("Tesselation", &terrainResolution, 1, 1500);
+	if(labhelper::assets::pending() > 0)
+	{
+		ImGui::Text("Loading %d assets...", labhelper::assets::pending());
+	}
+	ImGui::Text("Models: %d triangles in %d meshes, %d draw calls, %d meshes outside the view",
+	            int(labhelper::render_statistics.triangles), int(labhelper::render_statistics.meshes),
+	            int(labhelper::render_statistics.draw_calls),
+	            int(labhelper::render_statistics.culled_meshes));
+	ImGui::Text("State changes: %d programs, %d vertex arrays, %d materials, %d texture binds",
+	            int(labhelper::render_statistics.program_changes),
+	            int(labhelper::render_statistics.vertex_array_binds),
+	            int(labhelper::render_statistics.material_changes),
+	            int(labhelper::render_statistics.texture_binds));
+	ImGui::Checkbox("Render queue", &useRenderQueue);
+	if(labhelper::multiDrawSupported())
+	{
+		const char* modes[] = { "separate textures", "texture arrays", "bindless texture arrays" };
+		ImGui::Text("Material textures: %s", modes[labhelper::materialTextureMode()]);
+		ImGui::Checkbox("Multi-draw", &labhelper::multi_draw_settings.enabled);
+	}
+	ImGui::Checkbox("Levels of detail", &labhelper::lod_settings.enabled);
+	ImGui::SliderFloat("LOD error (pixels)", &labhelper::lod_settings.error_threshold, 0.1f, 16.0f, "%.1f",
+	                   2.0f);
+	int terrainMode = terrain.m_mode;
+	ImGui::Combo("Terrain", &terrainMode, "Uniform grid\0Chunked LOD\0Tessellation\0Procedural grid\0");
+	terrain.m_mode = HeightField::Mode(terrainMode);
+	if(terrain.m_mode == HeightField::uniform_grid || terrain.m_mode == HeightField::procedural_grid)
+	{
+		ImGui::SliderInt("Tesselation", &terrainResolution, 1, 1500);
+	}
+	else if(terrain.m_mode == HeightField::tessellated)
+	{
+		ImGui::SliderInt("Patches per side", &terrain.m_patchResolution, 8, 256);
+		ImGui::SliderFloat("Pixels per edge", &terrain.m_pixelsPerEdge, 2.0f, 32.0f);
+		ImGui::SliderFloat("Curvature weight", &terrain.m_curvatureWeight, 0.0f, 8.0f);
+	}
+	else
+	{
+		ImGui::SliderFloat("LOD distance (chunks)", &terrain.m_lodDistance, 3.0f, 16.0f);
+		ImGui::SliderInt("Triangle budget", &terrain.m_triangleBudget, 100000, 8000000);
+		ImGui::Text("Terrain: %d triangles, finest level %d", terrain.m_chunkTriangles,
+		            terrain.m_finestLevel);
+		ImGui::Checkbox("Stream tiles", &streamTerrain);
+		if(streamTerrain && terrainTilesBuilder.joinable())
+		{
+			ImGui::Text("Building terrain tiles...");
+		}
+		else if(streamTerrain)
+		{
+			ImGui::SliderFloat("Tile distance (tiles)", &terrainTiles.m_lodDistance, 1.5f, 8.0f);
+			ImGui::Text("Tiles: %d wanted, %d of %d resident, %d loading", terrainTiles.m_wantedTiles,
+			            terrainTiles.m_residentTiles, terrainTiles.m_pages, terrainTiles.m_pendingLoads);
+		}
+	}
 	ImGui::SliderFloat("Terrain scale", &terrainScale, 0.0f, 1.0f);
 	ImGui::SliderFloat("Terrain shininess", &terrainShininess, 0.0f, 100.0f);
 	ImGui::SliderFloat("Terrain fresnel", &terrainFresnel, 0.0f, 1.0f);
 	ImGui::Checkbox("Show wireframe", &g_showWireframe);
 	ImGui::Checkbox("Show normals", &g_showNormals);
+	ImGui::Checkbox("Keep camera above ground", &keepCameraAboveGround);
+	mat4 terrainInverse = inverse(terrainModelMatrix);
+	const vec3 rayOrigin = vec3(terrainInverse * vec4(cameraPosition, 1.0f));
+	const vec3 rayDirection = vec3(terrainInverse * vec4(cameraDirection, 0.0f));
+	float groundDistance;
+	if(terrainStreamed() ? terrainTiles.intersectRay(rayOrigin, rayDirection, terrainScale, groundDistance) :
+	                       terrain.intersectRay(rayOrigin, rayDirection, terrainScale, groundDistance))
+	{
+		// The same distance along the ray in world space, scaled by the length of its direction
+		ImGui::Text("Ground ahead at %.0f", groundDistance * length(cameraDirection));
+	}
+	if(ImGui::Button("Reload shaders"))
+	{
+		loadShaders(true);
+	}
+	if(labhelper::pendingShaderPrograms() > 0)
+	{
+		ImGui::SameLine();
+		ImGui::Text("Compiling %d programs...", labhelper::pendingShaderPrograms());
+	}
+	labhelper::profiler::gui();
+	labhelper::capture::gui();
 	// ----------------------------------------------------------
 }
 
 int main(int argc, char* argv[])
 {
+	// --trace <file> records a timeline of the whole run, see labhelper/trace.h
+	std::string traceFilename;
+	for(int i = 1; i + 1 < argc; i++)
+	{
+		if(std::string(argv[i]) == "--trace")
+		{
+			traceFilename = argv[i + 1];
+			labhelper::trace::start();
+			labhelper::trace::setThreadName("Main");
+		}
+	}
+	for(int i = 1; i < argc; i++)
+	{
+		// --build-terrain-tiles <heights> <colours> cuts the terrain tiles
+		// without a window, from images too large to load while running,
+		// such as raw files, see TerrainTiles::build()
+		if(std::string(argv[i]) == "--build-terrain-tiles" && i + 2 < argc)
+		{
+			return TerrainTiles::build(argv[i + 1], argv[i + 2], terrainTilesPath) ? 0 : 1;
+		}
+		// --stream-terrain starts with the terrain streamed from its tiles,
+		// and never loads its height field or colours whole
+		if(std::string(argv[i]) == "--stream-terrain")
+		{
+			terrain.m_mode = HeightField::chunked_lod;
+			streamTerrain = true;
+		}
+	}
+
 	g_window = labhelper::init_window_SDL("OpenGL Project");
 
 	initialize();
@@ -520,31 +875,77 @@ int main(int argc, char* argv[])
 		currentTime = timeSinceStart.count();
 		deltaTime = currentTime - previousTime;
 
+		labhelper::profiler::beginFrame();
+
 		// Inform imgui of new frame
 		ImGui_ImplSdlGL3_NewFrame(g_window);
 
 		// check events (keyboard among other)
-		stopRendering = handleEvents();
+		{
+			labhelper::profiler::Zone zone("Events", false);
+			stopRendering = handleEvents();
+		}
+
+		// upload anything that finished loading in the background
+		{
+			labhelper::profiler::Zone zone("Asset upload");
+			labhelper::assets::update();
+		}
+
+		// replace shader programs that finished compiling
+		labhelper::updateShaderPrograms();
 
 		// render to window
+		labhelper::render_statistics = labhelper::RenderStatistics();
 		display();
 
 		// Render overlay GUI.
-		if(showUI)
 		{
-			gui();
+			labhelper::profiler::Zone zone("GUI");
+			if(showUI)
+			{
+				gui();
+			}
+
+			// Render the GUI.
+			ImGui::Render();
 		}
 
-		// Render the GUI.
-		ImGui::Render();
+		// Read back the frame for screenshots and frame sequences
+		{
+			labhelper::profiler::Zone zone("Capture");
+			labhelper::capture::update();
+		}
+		labhelper::profiler::endFrame();
 
 		// Swap front and back buffer. This frame will now been displayed.
 		SDL_GL_SwapWindow(g_window);
 	}
+	// Stop loading before freeing what is being loaded into
+	labhelper::assets::shutDown();
+	labhelper::capture::shutDown();
+	terrainTiles.close();
+	if(terrainTilesBuilder.joinable())
+	{
+		terrainTilesBuilder.join();
+	}
+
 	// Free Models
 	labhelper::freeModel(fighterModel);
 	labhelper::freeModel(landingpadModel);
 
+	// Free uniform buffers
+	frameUniforms.free();
+	objectUniforms.free();
+	terrainMaterialUniforms.free();
+	renderQueue.free();
+	labhelper::profiler::shutDown();
+
+	if(!traceFilename.empty())
+	{
+		labhelper::trace::write(traceFilename);
+	}
+
 	// Shut down everything. This includes the window and all other subsystems.
 	labhelper::shutDown(g_window);
 	return 0;
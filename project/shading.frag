@@ -1,4 +1,10 @@
 #version 410
+#ifdef MULTI_DRAW
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
+#ifdef BINDLESS_TEXTURE_ARRAYS
+#extension GL_ARB_bindless_texture : require
+#endif
 
 // required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
 precision highp float;
@@ -6,32 +12,94 @@ precision highp float;
 ///////////////////////////////////////////////////////////////////////////////
 // Material
 ///////////////////////////////////////////////////////////////////////////////
-uniform vec3 material_color = vec3(1, 1, 1);
-uniform float material_metalness = 0;
-uniform float material_fresnel = 0;
-uniform float material_shininess = 0;
-uniform vec3 material_emission = vec3(0);
-
-uniform int has_color_texture = 0;
+#ifdef MULTI_DRAW
+// All materials of the model, indexed by the material of the draw
+struct Material
+{
+	vec3 color;
+	float metalness;
+	vec3 emission;
+	float fresnel;
+	float shininess;
+	int has_color_texture;
+	int has_emission_texture;
+	int has_shininess_texture;
+	// With TEXTURE_ARRAYS
+	int color_layer;
+	int emission_layer;
+	// With BINDLESS_TEXTURE_ARRAYS
+	uvec2 color_texture_array;
+	uvec2 emission_texture_array;
+};
+layout(std430) readonly buffer Materials
+{
+	Material materials[];
+};
+flat in uint materialIndex;
+
+vec3 material_color;
+float material_metalness;
+vec3 material_emission;
+float material_fresnel;
+float material_shininess;
+int has_color_texture;
+int has_emission_texture;
+int has_shininess_texture;
+int color_layer;
+int emission_layer;
+#ifdef BINDLESS_TEXTURE_ARRAYS
+sampler2DArray color_texture;
+sampler2DArray emission_texture;
+#endif
+#else
+layout(std140) uniform MaterialUniforms
+{
+	vec3 material_color;
+	float material_metalness;
+	vec3 material_emission;
+	float material_fresnel;
+	float material_shininess;
+	int has_color_texture;
+	int has_emission_texture;
+	int has_shininess_texture;
+};
+#endif
+
+#if defined(TEXTURE_ARRAYS) && !defined(BINDLESS_TEXTURE_ARRAYS)
+uniform sampler2DArray color_texture;
+uniform sampler2DArray emission_texture;
+#elif !defined(TEXTURE_ARRAYS)
 uniform sampler2D color_texture;
-uniform int has_emission_texture = 0;
 uniform sampler2D emission_texture;
-uniform int has_shininess_texture = 0;
+#endif
 uniform sampler2D shininess_texture;
 
+#ifdef TEXTURE_ARRAYS
+#define COLOR_TEXCOORD vec3(texCoord, color_layer)
+#define EMISSION_TEXCOORD vec3(texCoord, emission_layer)
+#else
+#define COLOR_TEXCOORD texCoord
+#define EMISSION_TEXCOORD texCoord
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
 ///////////////////////////////////////////////////////////////////////////////
 uniform sampler2D environmentMap;
 uniform sampler2D irradianceMap;
 uniform sampler2D reflectionMap;
-uniform float environment_multiplier;
 
 ///////////////////////////////////////////////////////////////////////////////
-// Light source
+// Camera, light source and environment
 ///////////////////////////////////////////////////////////////////////////////
-uniform vec3 point_light_color = vec3(1.0, 1.0, 1.0);
-uniform float point_light_intensity_multiplier = 50.0;
+layout(std140) uniform FrameUniforms
+{
+	mat4 viewInverse;
+	vec3 viewSpaceLightPosition;
+	float point_light_intensity_multiplier;
+	vec3 point_light_color;
+	float environment_multiplier;
+};
 
 ///////////////////////////////////////////////////////////////////////////////
 // Constants
@@ -48,9 +116,35 @@ in vec3 viewSpacePosition;
 ///////////////////////////////////////////////////////////////////////////////
 // Input uniform variables
 ///////////////////////////////////////////////////////////////////////////////
-uniform mat4 viewInverse;
-uniform vec3 viewSpaceLightPosition;
 uniform bool showNormals;
+#ifdef TERRAIN_SLOPE_MAP
+// Per-pixel normals of the terrain, see HeightField::updateSlopeMap()
+layout(std140) uniform ObjectUniforms
+{
+	mat4 modelViewProjectionMatrix;
+	mat4 modelViewMatrix;
+	mat4 normalMatrix;
+};
+uniform sampler2D slopeMap;
+uniform float scale;
+#endif
+#ifdef STREAMED_TERRAIN
+// Tiles of the colour image in a page cache, see TerrainTiles
+uniform sampler2DArray colorPages;
+uniform sampler2D pageTable;
+uniform vec2 terrainSize;
+uniform float tileSize;
+
+// Like heightfield.vert
+vec3 pageCoord(vec2 coord)
+{
+	vec2 corner = clamp(coord, 0.0, 1.0) * terrainSize;
+	ivec2 entry = min(ivec2(corner / tileSize), textureSize(pageTable, 0) - 1);
+	vec4 page = texelFetch(pageTable, entry, 0);
+	vec2 local = corner / exp2(page.y) - page.zw * tileSize + 1.0;
+	return vec3(local / (tileSize + 2.0), page.x);
+}
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Output color
@@ -130,16 +224,53 @@ vec3 calculateIndirectIllumination(vec3 wo, vec3 n, vec3 base_color, float shini
 
 void main()
 {
+#ifdef MULTI_DRAW
+	Material material = materials[materialIndex];
+	material_color = material.color;
+	material_metalness = material.metalness;
+	material_emission = material.emission;
+	material_fresnel = material.fresnel;
+	material_shininess = material.shininess;
+	has_color_texture = material.has_color_texture;
+	has_emission_texture = material.has_emission_texture;
+	has_shininess_texture = material.has_shininess_texture;
+	color_layer = material.color_layer;
+	emission_layer = material.emission_layer;
+#ifdef BINDLESS_TEXTURE_ARRAYS
+	if(has_color_texture == 1)
+	{
+		color_texture = sampler2DArray(material.color_texture_array);
+	}
+	if(has_emission_texture == 1)
+	{
+		emission_texture = sampler2DArray(material.emission_texture_array);
+	}
+#endif
+#endif
+
 	float visibility = 1.0;
 	float attenuation = 1.0;
 
 	vec3 wo = -normalize(viewSpacePosition);
+#ifdef TERRAIN_SLOPE_MAP
+	vec2 slope = texture(slopeMap, texCoord).rg;
+	// Like heightfield.vert
+	float fudge = 0.01;
+	vec3 modelSpaceNormal = vec3(fudge - scale * slope.x, 1.0, fudge - scale * slope.y);
+	vec3 n = normalize((normalMatrix * vec4(modelSpaceNormal, 0.0)).xyz);
+#else
 	vec3 n = normalize(viewSpaceNormal);
+#endif
 
 	vec3 base_color = material_color;
 	if(has_color_texture == 1)
 	{
-		base_color = base_color * texture(color_texture, texCoord).rgb;
+#ifdef STREAMED_TERRAIN
+		vec3 page = pageCoord(texCoord);
+		base_color = base_color * (page.z < 0.0 ? vec3(0.5) : texture(colorPages, page).rgb);
+#else
+		base_color = base_color * texture(color_texture, COLOR_TEXCOORD).rgb;
+#endif
 	}
 
 	float shininess = material_shininess;
@@ -159,7 +290,7 @@ void main()
 	vec3 emission_term = material_emission * material_color;
 	if(has_emission_texture == 1)
 	{
-		emission_term = texture(emission_texture, texCoord).rgb;
+		emission_term = texture(emission_texture, EMISSION_TEXCOORD).rgb;
 	}
 
 	vec3 shading = direct_illumination_term + indirect_illumination_term + emission_term;
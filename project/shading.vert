@@ -5,13 +5,20 @@
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normalIn;
 layout(location = 2) in vec2 texCoordIn;
+#ifdef MULTI_DRAW
+// The index of the material, from the base instance of the draw
+layout(location = 3) in uint materialIndexIn;
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Input uniform variables
 ///////////////////////////////////////////////////////////////////////////////
-uniform mat4 normalMatrix;
-uniform mat4 modelViewMatrix;
-uniform mat4 modelViewProjectionMatrix;
+layout(std140) uniform ObjectUniforms
+{
+	mat4 modelViewProjectionMatrix;
+	mat4 modelViewMatrix;
+	mat4 normalMatrix;
+};
 
 ///////////////////////////////////////////////////////////////////////////////
 // Output to fragment shader
@@ -19,6 +26,9 @@ uniform mat4 modelViewProjectionMatrix;
 out vec2 texCoord;
 out vec3 viewSpaceNormal;
 out vec3 viewSpacePosition;
+#ifdef MULTI_DRAW
+flat out uint materialIndex;
+#endif
 
 
 void main()
@@ -28,5 +38,8 @@ void main()
 	// viewSpaceNormal = normalIn;
 	viewSpaceNormal = (normalMatrix * vec4(normalIn, 0.0)).xyz;
 	viewSpacePosition = (modelViewMatrix * vec4(position, 1.0)).xyz;
+#ifdef MULTI_DRAW
+	materialIndex = materialIndexIn;
+#endif
 
 }
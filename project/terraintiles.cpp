@@ -0,0 +1,904 @@
+#include "terraintiles.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stb_image.h>
+#include <labhelper.h>
+#include <trace.h>
+
+using namespace glm;
+
+///////////////////////////////////////////////////////////////////////////
+// Tile file
+//
+// A header, the number of tiles per side of each level, the offset of each
+// tile from the start of the file, and then the tiles, level by level and
+// row by row. A tile is (size + 2)^2 float heights followed by as many RGB
+// colours, both in rows from the first texel.
+///////////////////////////////////////////////////////////////////////////
+namespace
+{
+	const char tiles_magic[8] = { 'L', 'H', 'T', 'I', 'L', 'E', 'S', '\0' };
+	// Bump whenever the layout changes. 2: rows from the bottom, whichever
+	// way the tiles were built.
+	const uint32_t tiles_version = 2;
+
+	struct TilesHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t tile_size;
+		uint32_t levels;
+		uint32_t padding;
+	};
+
+	///////////////////////////////////////////////////////////////////////
+	// The rows of an image, from the bottom, which is how the textures of
+	// HeightField have them, see init_window_SDL(). What stb_image reads
+	// is decoded whole, since it cannot decode part of an image. Raw files
+	// are read a row at a time, so they can be larger than memory: square,
+	// with the side taken from the size of the file, of 32 bit floats for
+	// heights (.r32) or of 8 bit RGB for colours (.rgb8), stored from the
+	// top like other images.
+	///////////////////////////////////////////////////////////////////////
+	class ImageRows
+	{
+	public:
+		int width;
+		int height;
+
+		ImageRows(void) : width(0), height(0), m_rowBytes(0), m_pixels(nullptr) {}
+		~ImageRows(void)
+		{
+			if(m_pixels != nullptr)
+			{
+				stbi_image_free(m_pixels);
+			}
+		}
+
+		// As one float per texel for heights, or three bytes for colours
+		bool open(const std::string& path, bool heights)
+		{
+			const size_t texelBytes = heights ? sizeof(float) : 3;
+			const std::string rawExtension = heights ? ".r32" : ".rgb8";
+			if(path.size() > rawExtension.size()
+			   && path.compare(path.size() - rawExtension.size(), rawExtension.size(), rawExtension) == 0)
+			{
+				m_file.open(path, std::ios::binary | std::ios::ate);
+				const uint64_t bytes = m_file ? uint64_t(m_file.tellg()) : 0;
+				width = height = int(std::sqrt(double(bytes / texelBytes)) + 0.5);
+				if(bytes == 0 || uint64_t(width) * height * texelBytes != bytes)
+				{
+					std::cout << "Not a square raw image: " << path << ".\n";
+					return false;
+				}
+			}
+			else
+			{
+				// Flipped like all textures, also when building before there
+				// is a window, or on a thread that has not set it
+				int components;
+				stbi_set_flip_vertically_on_load(true);
+				if(heights)
+				{
+					m_pixels = stbi_loadf(path.c_str(), &width, &height, &components, 1);
+				}
+				else
+				{
+					m_pixels = stbi_load(path.c_str(), &width, &height, &components, 3);
+				}
+				if(m_pixels == nullptr)
+				{
+					std::cout << "Failed to load image: " << path << ".\n";
+					return false;
+				}
+			}
+			m_rowBytes = size_t(width) * texelBytes;
+			return true;
+		}
+
+		bool read(int y, void* row)
+		{
+			if(m_pixels != nullptr)
+			{
+				memcpy(row, static_cast<const uint8_t*>(m_pixels) + size_t(y) * m_rowBytes, m_rowBytes);
+				return true;
+			}
+			m_file.seekg(std::streamoff(uint64_t(height - 1 - y) * m_rowBytes));
+			return bool(m_file.read(static_cast<char*>(row), m_rowBytes));
+		}
+
+	private:
+		size_t m_rowBytes;
+		void* m_pixels;
+		std::ifstream m_file;
+	};
+
+	// A row of a level of the mip chain while building
+	struct Row
+	{
+		std::vector<float> heights;
+		std::vector<uint8_t> colors;
+	};
+
+	Row downsample(const Row& top, const Row& bottom, int width)
+	{
+		Row half;
+		const int halfWidth = (width + 1) / 2;
+		half.heights.resize(halfWidth);
+		half.colors.resize(size_t(halfWidth) * 3);
+		for(int x = 0; x < halfWidth; ++x)
+		{
+			const int right = std::min(2 * x + 1, width - 1);
+			const Row* rows[4] = { &top, &top, &bottom, &bottom };
+			const int texels[4] = { 2 * x, right, 2 * x, right };
+			float height = 0.0f;
+			int color[3] = { 0, 0, 0 };
+			for(int i = 0; i < 4; ++i)
+			{
+				height += rows[i]->heights[texels[i]];
+				for(int c = 0; c < 3; ++c)
+				{
+					color[c] += rows[i]->colors[texels[i] * 3 + c];
+				}
+			}
+			half.heights[x] = height / 4.0f;
+			for(int c = 0; c < 3; ++c)
+			{
+				half.colors[x * 3 + c] = uint8_t((color[c] + 2) / 4);
+			}
+		}
+		return half;
+	}
+
+	int tilesPerSide(int texels, int tileSize)
+	{
+		return (texels + tileSize - 1) / tileSize;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Cuts the levels of the mip chain into tiles as their rows come in,
+	// from level 0, so that only a strip of each level is in memory: the
+	// rows of the row of tiles being cut, with their borders. Each pair of
+	// rows of a level is also a row of the level above it. The tiles are
+	// written where the table of offsets has them.
+	///////////////////////////////////////////////////////////////////////
+	class TileWriter
+	{
+	public:
+		TileWriter(std::ofstream& out, int tileSize, const std::vector<uint64_t>& offsets)
+		    : m_out(out)
+		    , m_tileSize(tileSize)
+		    , m_offsets(offsets)
+		{
+		}
+
+		void addLevel(int width, int height, int firstTile)
+		{
+			Level level;
+			level.width = width;
+			level.height = height;
+			level.tiles = ivec2(tilesPerSide(width, m_tileSize), tilesPerSide(height, m_tileSize));
+			level.firstTile = firstTile;
+			level.firstRow = 0;
+			level.rowsAdded = 0;
+			level.tileRowsWritten = 0;
+			m_levels.push_back(std::move(level));
+		}
+
+		// The rows of a level have to come in order
+		void addRow(size_t l, Row row)
+		{
+			Level& level = m_levels[l];
+			const int y = level.rowsAdded++;
+			if(l + 1 < m_levels.size())
+			{
+				// An odd row pairs with the one before it, which is always
+				// kept until the next row comes in. The last of an odd number
+				// of rows pairs with itself.
+				if(y % 2 == 1)
+				{
+					addRow(l + 1, downsample(level.rows.back(), row, level.width));
+				}
+				else if(y == level.height - 1)
+				{
+					addRow(l + 1, downsample(row, row, level.width));
+				}
+			}
+			level.rows.push_back(std::move(row));
+
+			// A row of tiles is complete with the border below it
+			while(level.tileRowsWritten < level.tiles.y
+			      && y >= std::min((level.tileRowsWritten + 1) * m_tileSize, level.height - 1))
+			{
+				writeTileRow(level, level.tileRowsWritten++);
+				// The next row of tiles starts at the border above it, if any
+				while(!level.rows.empty() && level.firstRow < level.tileRowsWritten * m_tileSize - 1)
+				{
+					level.rows.pop_front();
+					level.firstRow++;
+				}
+			}
+		}
+
+		bool complete(void) const
+		{
+			for(const Level& level : m_levels)
+			{
+				if(level.tileRowsWritten < level.tiles.y)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+	private:
+		struct Level
+		{
+			int width;
+			int height;
+			ivec2 tiles;
+			int firstTile;
+			// The rows from firstRow on
+			std::deque<Row> rows;
+			int firstRow;
+			int rowsAdded;
+			int tileRowsWritten;
+		};
+
+		void writeTileRow(const Level& level, int y)
+		{
+			const int pageSize = m_tileSize + 2;
+			std::vector<float> tileHeights(size_t(pageSize) * pageSize);
+			std::vector<uint8_t> tileColors(tileHeights.size() * 3);
+			for(int x = 0; x < level.tiles.x; ++x)
+			{
+				// With a border of one texel, clamped at the edges
+				const int x0 = x * m_tileSize - 1;
+				const int y0 = y * m_tileSize - 1;
+				for(int py = 0; py < pageSize; ++py)
+				{
+					const Row& row = level.rows[clamp(y0 + py, 0, level.height - 1) - level.firstRow];
+					for(int px = 0; px < pageSize; ++px)
+					{
+						const size_t texel = size_t(clamp(x0 + px, 0, level.width - 1));
+						const size_t i = size_t(py) * pageSize + px;
+						tileHeights[i] = row.heights[texel];
+						memcpy(&tileColors[i * 3], &row.colors[texel * 3], 3);
+					}
+				}
+				m_out.seekp(std::streamoff(m_offsets[level.firstTile + y * level.tiles.x + x]));
+				m_out.write(reinterpret_cast<const char*>(tileHeights.data()),
+				            tileHeights.size() * sizeof(float));
+				m_out.write(reinterpret_cast<const char*>(tileColors.data()), tileColors.size());
+			}
+		}
+
+		std::ofstream& m_out;
+		int m_tileSize;
+		const std::vector<uint64_t>& m_offsets;
+		std::vector<Level> m_levels;
+	};
+} // namespace
+
+TerrainTiles::TerrainTiles(void)
+    : m_tileSize(0)
+    , m_width(0)
+    , m_height(0)
+    , m_lodDistance(3.0f)
+    , m_maxUploadsPerFrame(8)
+    , m_wantedTiles(0)
+    , m_residentTiles(0)
+    , m_pendingLoads(0)
+    , m_heightPages(UINT32_MAX)
+    , m_colorPages(UINT32_MAX)
+    , m_pageTable(UINT32_MAX)
+    , m_pages(0)
+    , m_pageTableDirty(false)
+    , m_frame(0)
+    , m_heightScale(0.0f)
+    , m_stopping(false)
+{
+}
+
+TerrainTiles::~TerrainTiles(void)
+{
+	// The GL objects are left to close(), while there is a context
+	stopWorkers();
+}
+
+bool TerrainTiles::build(const std::string& heightPath,
+                         const std::string& colorPath,
+                         const std::string& tilesPath,
+                         int tileSize)
+{
+	labhelper::trace::Scope scope("Build terrain tiles", tilesPath);
+	ImageRows heights, colors;
+	if(!heights.open(heightPath, true) || !colors.open(colorPath, false))
+	{
+		return false;
+	}
+
+	// Halve until one tile covers the level
+	std::vector<ivec2> levels(1, ivec2(heights.width, heights.height));
+	while(levels.back().x > tileSize || levels.back().y > tileSize)
+	{
+		levels.push_back((levels.back() + 1) / 2);
+	}
+
+	TilesHeader header = {};
+	memcpy(header.magic, tiles_magic, sizeof(tiles_magic));
+	header.version = tiles_version;
+	header.width = uint32_t(heights.width);
+	header.height = uint32_t(heights.height);
+	header.tile_size = uint32_t(tileSize);
+	header.levels = uint32_t(levels.size());
+
+	std::vector<uint32_t> levelTiles;
+	std::vector<int> levelFirstTile;
+	size_t numberOfTiles = 0;
+	for(const ivec2& l : levels)
+	{
+		levelTiles.push_back(uint32_t(tilesPerSide(l.x, tileSize)));
+		levelTiles.push_back(uint32_t(tilesPerSide(l.y, tileSize)));
+		levelFirstTile.push_back(int(numberOfTiles));
+		numberOfTiles += size_t(levelTiles[levelTiles.size() - 2]) * levelTiles.back();
+	}
+	const int pageSize = tileSize + 2;
+	const uint64_t tileBytes = uint64_t(pageSize) * pageSize * (sizeof(float) + 3);
+	std::vector<uint64_t> offsets(numberOfTiles);
+	uint64_t offset =
+	    sizeof(header) + levelTiles.size() * sizeof(uint32_t) + offsets.size() * sizeof(uint64_t);
+	for(uint64_t& tileOffset : offsets)
+	{
+		tileOffset = offset;
+		offset += tileBytes;
+	}
+
+	// Written next to it first, so that a file that is there is complete
+	const std::string tmpPath = tilesPath + ".tmp";
+	std::ofstream out(tmpPath, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(levelTiles.data()), levelTiles.size() * sizeof(uint32_t));
+	out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+	TileWriter writer(out, tileSize, offsets);
+	for(size_t l = 0; l < levels.size(); ++l)
+	{
+		writer.addLevel(levels[l].x, levels[l].y, levelFirstTile[l]);
+	}
+
+	// The colours are resampled bilinearly onto the texels of the height
+	// field, from the two rows of the colour image around each row
+	const int width = heights.width;
+	const int height = heights.height;
+	const vec2 colorSize(colors.width, colors.height);
+	std::vector<uint8_t> colorRows[2] = { std::vector<uint8_t>(size_t(colors.width) * 3),
+		                                  std::vector<uint8_t>(size_t(colors.width) * 3) };
+	int colorRowIndices[2] = { -1, -1 };
+	bool ok = bool(out);
+	for(int y = 0; y < height && ok; ++y)
+	{
+		Row row;
+		row.heights.resize(width);
+		row.colors.resize(size_t(width) * 3);
+		ok = heights.read(y, row.heights.data());
+
+		float colorY = (float(y) + 0.5f) / float(height) * colorSize.y - 0.5f;
+		colorY = clamp(colorY, 0.0f, colorSize.y - 1.0f);
+		const int corners[2] = { int(colorY), std::min(int(colorY) + 1, colors.height - 1) };
+		const float fy = colorY - float(corners[0]);
+		if(colorRowIndices[0] != corners[0] && colorRowIndices[1] == corners[0])
+		{
+			std::swap(colorRows[0], colorRows[1]);
+			std::swap(colorRowIndices[0], colorRowIndices[1]);
+		}
+		for(int i = 0; i < 2 && ok; ++i)
+		{
+			if(colorRowIndices[i] != corners[i])
+			{
+				ok = colors.read(corners[i], colorRows[i].data());
+				colorRowIndices[i] = ok ? corners[i] : -1;
+			}
+		}
+		for(int x = 0; x < width && ok; ++x)
+		{
+			float colorX = (float(x) + 0.5f) / float(width) * colorSize.x - 0.5f;
+			colorX = clamp(colorX, 0.0f, colorSize.x - 1.0f);
+			const int cx = int(colorX);
+			const float fx = colorX - float(cx);
+			for(int c = 0; c < 3; ++c)
+			{
+				auto color = [&](int px, int r) {
+					return float(colorRows[r][size_t(std::min(px, colors.width - 1)) * 3 + c]);
+				};
+				float value =
+				    mix(mix(color(cx, 0), color(cx + 1, 0), fx), mix(color(cx, 1), color(cx + 1, 1), fx), fy);
+				row.colors[size_t(x) * 3 + c] = uint8_t(value + 0.5f);
+			}
+		}
+		if(ok)
+		{
+			writer.addRow(0, std::move(row));
+		}
+	}
+	out.close();
+	if(!ok || !out || !writer.complete() || !labhelper::file::replace(tmpPath, tilesPath))
+	{
+		std::cout << "Failed to write terrain tiles to " << tilesPath << std::endl;
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+	std::cout << "Wrote " << numberOfTiles << " terrain tiles to " << tilesPath << std::endl;
+	return true;
+}
+
+bool TerrainTiles::open(const std::string& tilesPath, size_t budgetBytes)
+{
+	close();
+	std::ifstream in(tilesPath, std::ios::binary);
+	TilesHeader header;
+	if(!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+	   || memcmp(header.magic, tiles_magic, sizeof(tiles_magic)) != 0 || header.version != tiles_version)
+	{
+		return false;
+	}
+	m_path = tilesPath;
+	m_width = int(header.width);
+	m_height = int(header.height);
+	m_tileSize = int(header.tile_size);
+	std::vector<uint32_t> levelTiles(header.levels * 2);
+	in.read(reinterpret_cast<char*>(levelTiles.data()), levelTiles.size() * sizeof(uint32_t));
+	int numberOfTiles = 0;
+	for(uint32_t l = 0; l < header.levels; ++l)
+	{
+		m_levelTiles.push_back(ivec2(levelTiles[l * 2], levelTiles[l * 2 + 1]));
+		m_levelFirstTile.push_back(numberOfTiles);
+		numberOfTiles += m_levelTiles.back().x * m_levelTiles.back().y;
+	}
+	m_tileOffsets.resize(numberOfTiles);
+	if(!in.read(reinterpret_cast<char*>(m_tileOffsets.data()), m_tileOffsets.size() * sizeof(uint64_t)))
+	{
+		close();
+		return false;
+	}
+	m_tileLayers.assign(numberOfTiles, not_resident);
+	m_tileLastWanted.assign(numberOfTiles, 0);
+
+	// The budget, for heights and colours and the copy of the heights on
+	// the CPU, decides the number of pages
+	const int pageSize = m_tileSize + 2;
+	const size_t pageBytes = size_t(pageSize) * pageSize * (2 * sizeof(float) + 4);
+	GLint maxLayers;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+	m_pages = int(std::min(std::max(budgetBytes / pageBytes, size_t(header.levels)), size_t(maxLayers)));
+	m_layerTiles.assign(m_pages, -1);
+	m_pageHeights.assign(m_pages, std::vector<float>());
+
+	glGenTextures(1, &m_heightPages);
+	glGenTextures(1, &m_colorPages);
+	glGenTextures(1, &m_pageTable);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, m_heightPages);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, pageSize, pageSize, m_pages, 0, GL_RED, GL_FLOAT, nullptr);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, m_colorPages);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, pageSize, pageSize, m_pages, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+	             nullptr);
+	const GLuint pages[] = { m_heightPages, m_colorPages };
+	for(GLuint texture : pages)
+	{
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glBindTexture(GL_TEXTURE_2D, m_pageTable);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_levelTiles[0].x, m_levelTiles[0].y, 0, GL_RGBA, GL_FLOAT,
+	             nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	updatePageTable();
+	CHECK_GL_ERROR();
+
+	// Reading is mostly waiting for the disk, a few threads are enough
+	unsigned numberOfThreads = std::min(4u, std::max(2u, std::thread::hardware_concurrency()) - 1);
+	m_stopping = false;
+	for(unsigned i = 0; i < numberOfThreads; ++i)
+	{
+		m_workers.push_back(std::thread(&TerrainTiles::workerLoop, this));
+	}
+	return true;
+}
+
+bool TerrainTiles::isOpen(void) const
+{
+	return !m_path.empty();
+}
+
+void TerrainTiles::stopWorkers(void)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+		m_jobs.clear();
+	}
+	m_jobAdded.notify_all();
+	for(auto& worker : m_workers)
+	{
+		worker.join();
+	}
+	m_workers.clear();
+	m_loaded.clear();
+}
+
+void TerrainTiles::close(void)
+{
+	stopWorkers();
+	if(m_heightPages != UINT32_MAX)
+	{
+		glDeleteTextures(1, &m_heightPages);
+		glDeleteTextures(1, &m_colorPages);
+		glDeleteTextures(1, &m_pageTable);
+		m_heightPages = m_colorPages = m_pageTable = UINT32_MAX;
+	}
+	m_path.clear();
+	m_levelTiles.clear();
+	m_levelFirstTile.clear();
+	m_tileOffsets.clear();
+	m_tileLayers.clear();
+	m_tileLastWanted.clear();
+	m_layerTiles.clear();
+	m_pageHeights.clear();
+	m_pages = 0;
+	m_wantedTiles = m_residentTiles = m_pendingLoads = 0;
+}
+
+int TerrainTiles::tileIndex(int level, int x, int y) const
+{
+	return m_levelFirstTile[level] + y * m_levelTiles[level].x + x;
+}
+
+void TerrainTiles::wantTile(int level, int x, int y)
+{
+	// The tile as a box in model space, from -1 to 1 over the height field
+	const float texels = float(m_tileSize << level);
+	const vec2 size(m_width, m_height);
+	vec2 minCorner = vec2(x, y) * texels / size * 2.0f - 1.0f;
+	vec2 maxCorner = min(vec2(x + 1, y + 1) * texels / size, vec2(1.0f)) * 2.0f - 1.0f;
+	vec3 boxMin(minCorner.x, 0.0f, minCorner.y);
+	vec3 boxMax(maxCorner.x, m_heightScale, maxCorner.y);
+	float distance = length(clamp(m_camera, boxMin, boxMax) - m_camera);
+
+	const int tile = tileIndex(level, x, y);
+	m_tileLastWanted[tile] = m_frame;
+	m_wanted.push_back({ tile, level, distance });
+	if(level == 0 || distance > m_lodDistance * texels / float(std::max(m_width, m_height)) * 2.0f)
+	{
+		return;
+	}
+	for(int child = 0; child < 4; ++child)
+	{
+		const int cx = 2 * x + child % 2;
+		const int cy = 2 * y + child / 2;
+		if(cx < m_levelTiles[level - 1].x && cy < m_levelTiles[level - 1].y)
+		{
+			wantTile(level - 1, cx, cy);
+		}
+	}
+}
+
+void TerrainTiles::readTile(int tile, LoadedTile& loaded) const
+{
+	labhelper::trace::Scope scope("Read terrain tile");
+	const size_t texels = size_t(m_tileSize + 2) * (m_tileSize + 2);
+	loaded.tile = tile;
+	loaded.heights.resize(texels);
+	loaded.colors.resize(texels * 3);
+	std::ifstream in(m_path, std::ios::binary);
+	in.seekg(std::streamoff(m_tileOffsets[tile]));
+	in.read(reinterpret_cast<char*>(loaded.heights.data()), texels * sizeof(float));
+	in.read(reinterpret_cast<char*>(loaded.colors.data()), loaded.colors.size());
+	if(!in)
+	{
+		std::cout << "Failed to read terrain tile " << tile << " from " << m_path << std::endl;
+		loaded.heights.clear();
+		loaded.colors.clear();
+	}
+}
+
+void TerrainTiles::workerLoop(void)
+{
+	labhelper::trace::setThreadName("Terrain tile worker");
+	for(;;)
+	{
+		int tile;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_jobAdded.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+			if(m_stopping)
+			{
+				return;
+			}
+			tile = m_jobs.front();
+			m_jobs.pop_front();
+		}
+		LoadedTile loaded;
+		readTile(tile, loaded);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_loaded.push_back(std::move(loaded));
+	}
+}
+
+void TerrainTiles::uploadTile(LoadedTile& loaded)
+{
+	m_tileLayers[loaded.tile] = not_resident;
+	if(loaded.heights.empty())
+	{
+		return;
+	}
+	// A free page, or the one whose tile has gone longest without being
+	// wanted, as long as that is longer than the new tile
+	int layer = -1;
+	for(int l = 0; l < m_pages; ++l)
+	{
+		const int tile = m_layerTiles[l];
+		if(tile == -1)
+		{
+			layer = l;
+			break;
+		}
+		if(m_tileLastWanted[tile] < m_tileLastWanted[loaded.tile]
+		   && (layer == -1 || m_tileLastWanted[tile] < m_tileLastWanted[m_layerTiles[layer]]))
+		{
+			layer = l;
+		}
+	}
+	if(layer == -1)
+	{
+		return;
+	}
+	if(m_layerTiles[layer] != -1)
+	{
+		m_tileLayers[m_layerTiles[layer]] = not_resident;
+	}
+	m_layerTiles[layer] = loaded.tile;
+	m_tileLayers[loaded.tile] = layer;
+
+	const int pageSize = m_tileSize + 2;
+	GLint alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, m_heightPages);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, pageSize, pageSize, 1, GL_RED, GL_FLOAT,
+	                loaded.heights.data());
+	glBindTexture(GL_TEXTURE_2D_ARRAY, m_colorPages);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, pageSize, pageSize, 1, GL_RGB, GL_UNSIGNED_BYTE,
+	                loaded.colors.data());
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+	m_pageHeights[layer] = std::move(loaded.heights);
+	m_pageTableDirty = true;
+}
+
+void TerrainTiles::updatePageTable(void)
+{
+	// The finest resident tile over each tile of level 0
+	std::vector<vec4> entries(size_t(m_levelTiles[0].x) * m_levelTiles[0].y, vec4(-1.0f, 0.0f, 0.0f, 0.0f));
+	for(int y = 0; y < m_levelTiles[0].y; ++y)
+	{
+		for(int x = 0; x < m_levelTiles[0].x; ++x)
+		{
+			for(int level = 0; level < int(m_levelTiles.size()); ++level)
+			{
+				const int layer = m_tileLayers[tileIndex(level, x >> level, y >> level)];
+				if(layer >= 0)
+				{
+					entries[size_t(y) * m_levelTiles[0].x + x] = vec4(layer, level, x >> level, y >> level);
+					break;
+				}
+			}
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, m_pageTable);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_levelTiles[0].x, m_levelTiles[0].y, GL_RGBA, GL_FLOAT,
+	                entries.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+	m_pageTableDirty = false;
+}
+
+void TerrainTiles::update(const vec3& cameraPosition, float heightScale)
+{
+	if(!isOpen())
+	{
+		return;
+	}
+	labhelper::trace::Scope scope("Update terrain tiles");
+	++m_frame;
+	m_camera = cameraPosition;
+	m_heightScale = heightScale;
+	m_wanted.clear();
+	wantTile(int(m_levelTiles.size()) - 1, 0, 0);
+	// Coarsest first, since they stand in for everything below them
+	std::sort(m_wanted.begin(), m_wanted.end(), [](const Want& a, const Want& b) {
+		return a.level != b.level ? a.level > b.level : a.distance < b.distance;
+	});
+
+	for(int i = 0; i < m_maxUploadsPerFrame; ++i)
+	{
+		LoadedTile loaded;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if(m_loaded.empty())
+			{
+				break;
+			}
+			loaded = std::move(m_loaded.front());
+			m_loaded.pop_front();
+		}
+		uploadTile(loaded);
+	}
+
+	// Only as many tiles as fit in the cache are asked for, and only a few
+	// at a time, so that the queue follows the camera
+	const int maxPendingLoads = 2 * int(m_workers.size());
+	m_pendingLoads = 0;
+	for(int state : m_tileLayers)
+	{
+		m_pendingLoads += state == loading ? 1 : 0;
+	}
+	std::vector<int> requests;
+	for(size_t i = 0; i < m_wanted.size() && int(i) < m_pages && m_pendingLoads < maxPendingLoads; ++i)
+	{
+		const int tile = m_wanted[i].tile;
+		if(m_tileLayers[tile] == not_resident)
+		{
+			m_tileLayers[tile] = loading;
+			requests.push_back(tile);
+			m_pendingLoads++;
+		}
+	}
+	if(!requests.empty())
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.insert(m_jobs.end(), requests.begin(), requests.end());
+	}
+	m_jobAdded.notify_all();
+
+	m_wantedTiles = int(m_wanted.size());
+	m_residentTiles = 0;
+	for(int tile : m_layerTiles)
+	{
+		m_residentTiles += tile != -1 ? 1 : 0;
+	}
+	if(m_pageTableDirty)
+	{
+		updatePageTable();
+	}
+}
+
+void TerrainTiles::setUniforms(GLuint program) const
+{
+	glUniform2f(labhelper::getUniformLocation(program, "terrainSize"), float(m_width), float(m_height));
+	labhelper::setUniform(program, "tileSize", float(m_tileSize));
+}
+
+bool TerrainTiles::sampleHeight(const vec2& texCoord, float& height, int& level) const
+{
+	// The finest resident tile, like the page table has it
+	const vec2 corner = clamp(texCoord, vec2(0.0f), vec2(1.0f)) * vec2(m_width, m_height);
+	const ivec2 entry = min(ivec2(corner / float(m_tileSize)), m_levelTiles[0] - 1);
+	int layer = -1;
+	for(level = 0; level < int(m_levelTiles.size()) && layer < 0; ++level)
+	{
+		layer = m_tileLayers[tileIndex(level, entry.x >> level, entry.y >> level)];
+	}
+	if(layer < 0)
+	{
+		return false;
+	}
+	--level;
+
+	// Bilinearly between texel centers, counted from the start of the border
+	const int pageSize = m_tileSize + 2;
+	const ivec2 tile = entry >> level;
+	vec2 local = corner / float(1 << level) - vec2(tile * m_tileSize) + 0.5f;
+	local = clamp(local, vec2(0.0f), vec2(float(pageSize - 1)));
+	const ivec2 texel = min(ivec2(local), ivec2(pageSize - 2));
+	const vec2 f = local - vec2(texel);
+	const float* heights = &m_pageHeights[layer][size_t(texel.y) * pageSize + texel.x];
+	height = mix(mix(heights[0], heights[1], f.x), mix(heights[pageSize], heights[pageSize + 1], f.x), f.y);
+	return true;
+}
+
+bool TerrainTiles::heightAt(const vec2& position, float heightScale, float& height) const
+{
+	int level;
+	if(!isOpen() || any(greaterThan(abs(position), vec2(1.0f)))
+	   || !sampleHeight(position * 0.5f + 0.5f, height, level))
+	{
+		return false;
+	}
+	height *= heightScale;
+	return true;
+}
+
+bool TerrainTiles::intersectRay(const vec3& origin, const vec3& direction, float heightScale,
+                                float& distance) const
+{
+	// With the top tile, some tile is resident everywhere
+	const float directionLength = length(direction);
+	if(!isOpen() || m_tileLayers.back() < 0 || directionLength == 0.0f)
+	{
+		return false;
+	}
+	// Where the ray is within the box of the terrain
+	const vec3 boxMin(-1.0f, 0.0f, -1.0f);
+	const vec3 boxMax(1.0f, heightScale, 1.0f);
+	float tNear = 0.0f;
+	float tFar = std::numeric_limits<float>::max();
+	for(int i = 0; i < 3; ++i)
+	{
+		if(direction[i] == 0.0f)
+		{
+			if(origin[i] < boxMin[i] || origin[i] > boxMax[i])
+			{
+				return false;
+			}
+			continue;
+		}
+		const float t0 = (boxMin[i] - origin[i]) / direction[i];
+		const float t1 = (boxMax[i] - origin[i]) / direction[i];
+		tNear = std::max(tNear, std::min(t0, t1));
+		tFar = std::min(tFar, std::max(t0, t1));
+	}
+	if(tNear > tFar)
+	{
+		return false;
+	}
+	// Which is under all of the terrain, even where it is at 0
+	const bool leavesThroughBottom = direction.y < 0.0f && (boxMin.y - origin.y) / direction.y <= tFar;
+
+	// There is no hierarchy over the tiles like HeightMap has, so the ray
+	// is marched in steps of half a texel of the tile under it, and the
+	// step that goes below the surface is bisected
+	auto below = [&](float t, int& level) {
+		const vec3 position = origin + t * direction;
+		float height;
+		return sampleHeight(vec2(position.x, position.z) * 0.5f + 0.5f, height, level)
+		       && position.y <= height * heightScale;
+	};
+	const float texel = 2.0f / float(std::max(m_width, m_height)) / directionLength;
+	float above = tNear;
+	for(float t = tNear;;)
+	{
+		int level;
+		if(below(t, level) || (t >= tFar && leavesThroughBottom))
+		{
+			float hit = t;
+			for(int i = 0; i < 16 && hit > tNear; ++i)
+			{
+				const float middle = 0.5f * (above + hit);
+				(below(middle, level) ? hit : above) = middle;
+			}
+			distance = hit;
+			return true;
+		}
+		if(t >= tFar)
+		{
+			break;
+		}
+		above = t;
+		t = std::min(t + 0.5f * texel * float(1 << level), tFar);
+	}
+	return false;
+}
+
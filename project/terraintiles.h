@@ -0,0 +1,161 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// Streaming of height fields too large to keep in memory
+//
+// build() cuts a height field and its colour image into a mip chain of
+// square tiles, from level 0 at full resolution up to a level that fits in
+// one tile, and writes them to a single .terraintiles file. Each tile has a
+// border of one texel from its neighbours, so that it can be filtered on
+// its own without seams. It goes through the images a strip of rows at a
+// time, so it can take images larger than memory as raw files, and it
+// does not need a GL context, so it can run on any thread, or offline.
+//
+// update() decides which tiles are wanted from the distance of the camera,
+// like the chunks of HeightField::selectChunks(), and worker threads read
+// them from the file, coarsest and nearest first. The tiles are uploaded
+// into the layers of two texture arrays, the page cache, whose size is
+// fixed by the memory budget given to open(). When it is full, the tiles
+// that have gone longest without being wanted are evicted. A page table,
+// one texel per tile of level 0, points at the finest resident tile over
+// it, which is what heightfield.vert and shading.frag sample when built
+// with STREAMED_TERRAIN. The heights of the resident tiles are also kept
+// on the CPU, for heightAt() and intersectRay(), so that nothing else of
+// the terrain has to be loaded at full resolution while streaming.
+//
+// Only for the thread with the GL context.
+///////////////////////////////////////////////////////////////////////////////
+class TerrainTiles
+{
+public:
+	// Texels per side of a tile, without its border
+	int m_tileSize;
+	// Of the height field, in texels
+	int m_width;
+	int m_height;
+	// Tiles per side, per level
+	std::vector<glm::ivec2> m_levelTiles;
+
+	// Tiles of a level are wanted out to this many of their own size from the camera
+	float m_lodDistance;
+	int m_maxUploadsPerFrame;
+
+	// Statistics of the last update()
+	int m_wantedTiles;
+	int m_residentTiles;
+	int m_pendingLoads;
+
+	// The page cache, and the page table over it (layer, level and tile
+	// per texel, or a negative layer before anything is resident)
+	GLuint m_heightPages;
+	GLuint m_colorPages;
+	GLuint m_pageTable;
+	int m_pages;
+
+	TerrainTiles(void);
+	~TerrainTiles(void);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Write the tiles of the height field and colour image to tilesPath. The
+	// colour image is resampled to the size of the height field. Either can
+	// be a raw file of rows, which is read as it is needed; other images are
+	// decoded whole by stb_image first, see ImageRows in terraintiles.cpp.
+	///////////////////////////////////////////////////////////////////////////
+	static bool build(const std::string& heightPath,
+	                  const std::string& colorPath,
+	                  const std::string& tilesPath,
+	                  int tileSize = 256);
+
+	// Create a page cache of at most budgetBytes for the tiles in the file
+	bool open(const std::string& tilesPath, size_t budgetBytes);
+	bool isOpen(void) const;
+	// Stop the workers and delete the page cache
+	void close(void);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Call once per frame with the camera in the model space of the terrain,
+	// see HeightField::selectChunks(). Uploads the tiles that have been read,
+	// and asks for the ones that are wanted now.
+	///////////////////////////////////////////////////////////////////////////
+	void update(const glm::vec3& cameraPosition, float heightScale);
+	// Set the uniforms that STREAMED_TERRAIN needs, besides the samplers
+	void setUniforms(GLuint program) const;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Queries against the resident tiles, like those of HeightField, which
+	// they stand in for while streaming: in the model space of the terrain,
+	// from the finest tile there is, filtered like heightfield.vert samples
+	// it. They return false outside the terrain, or before a tile over it is
+	// resident.
+	///////////////////////////////////////////////////////////////////////////
+	bool heightAt(const glm::vec2& position, float heightScale, float& height) const;
+	// Distance along the ray to the terrain, in units of the length of direction
+	bool intersectRay(const glm::vec3& origin,
+	                  const glm::vec3& direction,
+	                  float heightScale,
+	                  float& distance) const;
+
+private:
+	struct LoadedTile
+	{
+		int tile;
+		std::vector<float> heights;
+		std::vector<uint8_t> colors;
+	};
+
+	int tileIndex(int level, int x, int y) const;
+	// Adds the tile and, if the camera is close enough, the tiles below it
+	void wantTile(int level, int x, int y);
+	// At a texture coordinate, and the level of the tile it was read from
+	bool sampleHeight(const glm::vec2& texCoord, float& height, int& level) const;
+	void readTile(int tile, LoadedTile& loaded) const;
+	void uploadTile(LoadedTile& loaded);
+	void updatePageTable(void);
+	void workerLoop(void);
+	void stopWorkers(void);
+
+	std::string m_path;
+	// Offset of each tile in the file, level by level
+	std::vector<uint64_t> m_tileOffsets;
+	std::vector<int> m_levelFirstTile;
+	// Page cache layer of each tile, or one of the states below
+	enum
+	{
+		not_resident = -1,
+		loading = -2
+	};
+	std::vector<int> m_tileLayers;
+	std::vector<uint32_t> m_tileLastWanted;
+	std::vector<int> m_layerTiles;
+	// The heights of the tile in each page, for the queries
+	std::vector<std::vector<float>> m_pageHeights;
+	bool m_pageTableDirty;
+	uint32_t m_frame;
+
+	// Only valid during update()
+	glm::vec3 m_camera;
+	float m_heightScale;
+	struct Want
+	{
+		int tile;
+		int level;
+		float distance;
+	};
+	std::vector<Want> m_wanted;
+
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_jobAdded;
+	bool m_stopping;
+	std::deque<int> m_jobs;
+	std::deque<LoadedTile> m_loaded;
+};